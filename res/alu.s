@@ -0,0 +1,53 @@
+; ALU heavy benchmark: arithmetic, logic and shifts on registers and the zero page.
+; Runs the inner loop 256 * 64 times, prints the accumulator and halts.
+command = $40ff
+buffer = $4000
+
+count = $00         ; outer loop counter
+a_zp = $10
+b_zp = $11
+c_zp = $12
+
+    .org $8000
+
+reset:
+    LDX #$ff        ; init SP
+    TXS
+    CLD
+    LDA #64
+    STA count
+    LDA #$5a
+    STA a_zp
+    LDA #$c3
+    STA b_zp
+    LDY #0
+loop:
+    ADC #$37
+    EOR #$a5
+    ROL
+    SBC #$11
+    AND #$f7
+    ORA #$08
+    LSR
+    ASL a_zp
+    ROR b_zp
+    ADC a_zp
+    EOR b_zp
+    INC c_zp
+    ADC c_zp
+    TAX
+    INX
+    TXA
+    DEY
+    BNE loop
+    DEC count
+    BNE loop
+    STA buffer
+    LDA #$cc        ; print byte
+    STA command
+    LDA #$bb        ; stop
+    STA command
+
+    .org $fffc
+    .word reset     ; Set the Reset Vector
+    .word $0000
@@ -0,0 +1,62 @@
+; Branch heavy benchmark: branches that depend on a pseudo random sequence,
+; so they are hard to predict. Runs 256 * 64 steps of an 8 bit LFSR,
+; prints the number of negative values seen and halts.
+command = $40ff
+buffer = $4000
+
+count = $00         ; outer loop counter
+seed = $01
+negative = $02
+
+    .org $8000
+
+reset:
+    LDX #$ff        ; init SP
+    TXS
+    CLD
+    LDA #64
+    STA count
+    LDA #$01
+    STA seed
+    LDA #0
+    STA negative
+    LDX #0
+    LDY #0
+loop:
+    LDA seed        ; next LFSR value
+    ASL
+    BCC no_tap
+    EOR #$1d
+no_tap:
+    STA seed
+    BMI minus       ; bit 7
+    INX
+    JMP bit2
+minus:
+    INC negative
+bit2:
+    AND #$04
+    BEQ bit4
+    DEX
+bit4:
+    LDA seed
+    AND #$10
+    BNE high
+    CMP #$08
+    BCS high
+    INX
+high:
+    DEY
+    BNE loop
+    DEC count
+    BNE loop
+    LDA negative
+    STA buffer
+    LDA #$cc        ; print byte
+    STA command
+    LDA #$bb        ; stop
+    STA command
+
+    .org $fffc
+    .word reset     ; Set the Reset Vector
+    .word $0000
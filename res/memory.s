@@ -0,0 +1,62 @@
+; Memory heavy benchmark: copies 16 pages of ROM into RAM through indirect
+; pointers, then adds two pages together with indexed absolute accesses.
+; Repeats 32 times, prints the last sum byte and halts.
+command = $40ff
+buffer = $4000
+
+count = $00         ; outer loop counter
+src = $10           ; source pointer
+dst = $12           ; destination pointer
+
+    .org $8000
+
+reset:
+    LDX #$ff        ; init SP
+    TXS
+    CLD
+    LDA #32
+    STA count
+outer:
+    LDA #$00
+    STA src
+    STA dst
+    LDA #$80
+    STA src + 1
+    LDA #$10
+    STA dst + 1
+    LDX #16
+page:
+    LDY #0
+copy:
+    LDA (src), Y
+    STA (dst), Y
+    INY
+    BNE copy
+    INC src + 1
+    INC dst + 1
+    DEX
+    BNE page
+    LDX #0
+sum:
+    LDA $1000, X
+    CLC
+    ADC $1100, X
+    STA $2000, X
+    LDA $2000, X
+    ADC $1f00, X
+    STA $2100, Y
+    INY
+    INX
+    BNE sum
+    DEC count
+    BNE outer
+    LDA $20ff
+    STA buffer
+    LDA #$cc        ; print byte
+    STA command
+    LDA #$bb        ; stop
+    STA command
+
+    .org $fffc
+    .word reset     ; Set the Reset Vector
+    .word $0000
@@ -0,0 +1,59 @@
+; Stack heavy benchmark: recursive subroutine calls that save registers and
+; ; flags on the stack. Calls a 32 deep recursion 1024 times, prints the
+; accumulated depth count and halts.
+command = $40ff
+buffer = $4000
+
+count = $00         ; outer loop counter, 16 bit
+total = $02         ; levels visited, 16 bit
+
+    .org $8000
+
+reset:
+    LDX #$ff        ; init SP
+    TXS
+    CLD
+    LDA #0
+    STA count
+    STA total
+    STA total + 1
+    LDA #4
+    STA count + 1
+loop:
+    LDA #32
+    JSR recurse
+    DEC count
+    BNE loop
+    DEC count + 1
+    BNE loop
+    LDA total
+    STA buffer
+    LDA total + 1
+    STA buffer + 1
+    LDA #$cd        ; print word
+    STA command
+    LDA #$bb        ; stop
+    STA command
+
+; Calls itself A times, pushing the registers and flags at every level.
+recurse:
+    CMP #0
+    BEQ bottom
+    PHA
+    PHP
+    TAX
+    DEX
+    TXA
+    INC total
+    BNE no_carry
+    INC total + 1
+no_carry:
+    JSR recurse
+    PLP
+    PLA
+bottom:
+    RTS
+
+    .org $fffc
+    .word reset     ; Set the Reset Vector
+    .word $0000
@@ -0,0 +1,626 @@
+/**
+ * @file batch.c
+ * @author Mason Daub
+ * @brief Worker pool and work stealing queues of the batch runner.
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "batch.h"
+#include "cpu.h"
+#include "jit.h"
+#include "loader.h"
+#include "result.h"
+#include "snapshot.h"
+#include "terminal.h"
+#include "wide.h"
+
+/**
+ * @brief Bytes written into memory before a job starts.
+ */
+typedef struct _batch_input
+{
+    uint16_t address;
+    size_t size;
+    byte* data;
+} batch_input;
+
+/**
+ * @brief One job and, once it has run, its result.
+ */
+typedef struct _batch_job
+{
+    char* rom;                  // ROM image path
+    rom_image* image;           // The opened image, shared by every job of the ROM. NULL if it could not be read.
+    char* layout;               // Memory layout
+    uint64_t max_cycles;        // Cycle limit
+    batch_input* inputs;
+    size_t input_count;
+
+    halt_reason halt;           // Why the job stopped, HALT_ERROR if it could not run
+    const char* error;          // Why the job could not run
+    uint64_t cycles;
+    uint16_t PC;
+    byte A, X, Y, S, P;
+    char* output;               // Everything the terminal printed
+    size_t output_size;
+} batch_job;
+
+/**
+ * @brief A ROM image, opened once and loaded by every job that uses it.
+ */
+typedef struct _batch_rom
+{
+    const char* path;
+    rom_image image;
+    bool opened;
+} batch_rom;
+
+/**
+ * @brief Jobs that are taken by a worker together: a single job, or the lanes of a wide machine.
+ */
+typedef struct _batch_unit
+{
+    size_t first;               // Index of the unit's first job in the batch's order
+    int count;
+    bool wide;                  // Run the jobs as lanes of a wide machine
+} batch_unit;
+
+/**
+ * @brief A worker's units. The owner pops from the back, thieves take from the front.
+ */
+typedef struct _batch_queue
+{
+    pthread_mutex_t lock;
+    size_t* units;              // Unit indices
+    size_t head;                // First unit not yet taken
+    size_t tail;                // One past the last unit not yet taken
+} batch_queue;
+
+typedef struct _batch
+{
+    batch_job* jobs;
+    size_t job_count;
+    size_t* order;              // Job indices, grouped by unit
+    batch_unit* units;
+    size_t unit_count;
+    batch_rom* roms;            // Every distinct ROM of the manifest
+    size_t rom_count;
+    batch_queue* queues;
+    int threads;
+    bool use_jit;
+} batch;
+
+typedef struct _batch_worker
+{
+    batch* b;
+    int id;
+} batch_worker;
+
+/* Manifest */
+
+static void free_jobs(batch* b)
+{
+    for(size_t i = 0; i < b->job_count; i++)
+    {
+        batch_job* job = &b->jobs[i];
+        free(job->rom);
+        free(job->layout);
+        for(size_t k = 0; k < job->input_count; k++)
+            free(job->inputs[k].data);
+        free(job->inputs);
+        free(job->output);
+    }
+    for(size_t i = 0; i < b->rom_count; i++)
+        if(b->roms[i].opened)
+            rom_close(&b->roms[i].image);
+    free(b->roms);
+    free(b->jobs);
+    free(b->order);
+    free(b->units);
+}
+
+// Parses an 'addr:hexbytes' input. Returns 0 on success.
+static int parse_input(const char* token, batch_input* input)
+{
+    unsigned int address;
+    int length;
+    if(sscanf(token, "%4x:%n", &address, &length) != 1 || token[length] == '\0')
+        return -1;
+    const char* hex = token + length;
+    size_t digits = strlen(hex);
+    if(digits % 2 != 0 || address + digits / 2 > 0x10000)
+        return -1;
+    input->address = address;
+    input->size = digits / 2;
+    input->data = malloc(input->size);
+    for(size_t i = 0; i < input->size; i++)
+    {
+        unsigned int value;
+        if(sscanf(hex + 2 * i, "%2x", &value) != 1)
+        {
+            free(input->data);
+            return -1;
+        }
+        input->data[i] = value;
+    }
+    return 0;
+}
+
+// Reads the jobs of a manifest. Returns 0 on success, -1 if it can not be read.
+static int read_manifest(batch* b, const char* path, uint64_t max_cycles)
+{
+    FILE* file = fopen(path, "r");
+    if(file == NULL)
+        return -1;
+    size_t capacity = 0;
+    char* line = NULL;
+    size_t line_size = 0;
+    int line_number = 0;
+    while(getline(&line, &line_size, file) != -1)
+    {
+        line_number++;
+        char* save;
+        char* token = strtok_r(line, " \t\r\n", &save);
+        if(token == NULL || token[0] == '#')
+            continue;
+        if(b->job_count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            b->jobs = realloc(b->jobs, capacity * sizeof(batch_job));
+        }
+        batch_job* job = &b->jobs[b->job_count++];
+        memset(job, 0, sizeof(batch_job));
+        job->rom = strdup(token);
+        job->max_cycles = max_cycles ? max_cycles : CPU_UNLIMITED;
+        while((token = strtok_r(NULL, " \t\r\n", &save)))
+        {
+            if(strncmp(token, "cycles=", 7) == 0)
+            {
+                job->max_cycles = strtoull(token + 7, NULL, 0);
+                if(job->max_cycles == 0)
+                    job->max_cycles = CPU_UNLIMITED; // like -l 0
+            }
+            else if(strncmp(token, "layout=", 7) == 0)
+            {
+                free(job->layout);
+                job->layout = strdup(token + 7);
+            }
+            else
+            {
+                job->inputs = realloc(job->inputs, (job->input_count + 1) * sizeof(batch_input));
+                if(parse_input(token, &job->inputs[job->input_count]) != 0)
+                {
+                    // only this job fails, like a job whose ROM can not be read
+                    fprintf(stderr, "%s:%d: bad input '%s'\n", path, line_number, token);
+                    job->error = "bad input";
+                    continue;
+                }
+                job->input_count++;
+            }
+        }
+    }
+    free(line);
+    fclose(file);
+    return 0;
+}
+
+/**
+ * @brief A job in a sorted list, with the key it is sorted by.
+ */
+typedef struct _batch_key
+{
+    const void* key;
+    size_t job;
+} batch_key;
+
+static int compare_paths(const void* a, const void* b)
+{
+    const batch_key* x = a;
+    const batch_key* y = b;
+    int order = strcmp(x->key, y->key);
+    return order ? order : (x->job > y->job) - (x->job < y->job);
+}
+
+static int compare_images(const void* a, const void* b)
+{
+    const batch_key* x = a;
+    const batch_key* y = b;
+    if(x->key != y->key)
+        return (uintptr_t)x->key < (uintptr_t)y->key ? -1 : 1;
+    return (x->job > y->job) - (x->job < y->job);
+}
+
+// Opens every ROM once, before the workers start. The jobs are sorted by path,
+// so the jobs of a ROM are found without comparing every pair.
+static void open_roms(batch* b)
+{
+    b->roms = calloc(b->job_count ? b->job_count : 1, sizeof(batch_rom));
+    batch_key* sorted = malloc((b->job_count ? b->job_count : 1) * sizeof(batch_key));
+    for(size_t i = 0; i < b->job_count; i++)
+        sorted[i] = (batch_key){ b->jobs[i].rom, i };
+    qsort(sorted, b->job_count, sizeof(batch_key), compare_paths);
+    batch_rom* rom = NULL;
+    for(size_t i = 0; i < b->job_count; i++)
+    {
+        batch_job* job = &b->jobs[sorted[i].job];
+        if(rom == NULL || strcmp(rom->path, job->rom) != 0)
+        {
+            rom = &b->roms[b->rom_count++];
+            rom->path = job->rom;
+            rom->opened = rom_open(&rom->image, job->rom) == 0;
+        }
+        job->image = rom->opened ? &rom->image : NULL;
+    }
+    free(sorted);
+}
+
+// Jobs can be lanes of a wide machine if they have its fixed memory map and only differ in RAM.
+static bool wide_compatible(const batch_job* job)
+{
+    if(job->image == NULL || job->error)
+        return false;
+    if(job->layout && strcmp(job->layout, DEFAULT_LAYOUT) != 0)
+        return false;
+    for(size_t i = 0; i < job->input_count; i++)
+    {
+        if(job->inputs[i].address + job->inputs[i].size > ROM_START)
+            return false;
+    }
+    return true;
+}
+
+// Groups the jobs into units. With wide set, compatible jobs of the same ROM share a
+// wide machine, up to WIDE_LANES in manifest order. Units are ordered by their first job.
+static void plan_units(batch* b, bool wide)
+{
+    size_t size = b->job_count ? b->job_count : 1;
+    b->order = malloc(size * sizeof(size_t));
+    b->units = calloc(size, sizeof(batch_unit));
+    size_t* next = malloc(size * sizeof(size_t));   // Next job of the same unit, or SIZE_MAX
+    bool* leads = malloc(size * sizeof(bool));      // The job starts a unit
+    for(size_t i = 0; i < b->job_count; i++)
+    {
+        next[i] = SIZE_MAX;
+        leads[i] = true;
+    }
+
+    // Sorted by image, the compatible jobs of a ROM follow each other and are cut into lanes
+    if(wide)
+    {
+        batch_key* sorted = malloc(size * sizeof(batch_key));
+        size_t count = 0;
+        for(size_t i = 0; i < b->job_count; i++)
+            if(wide_compatible(&b->jobs[i]))
+                sorted[count++] = (batch_key){ b->jobs[i].image, i };
+        qsort(sorted, count, sizeof(batch_key), compare_images);
+        int lanes = 0;
+        for(size_t i = 0; i < count; i++)
+        {
+            if(i > 0 && sorted[i].key == sorted[i - 1].key && lanes < WIDE_LANES)
+            {
+                next[sorted[i - 1].job] = sorted[i].job;
+                leads[sorted[i].job] = false;
+                lanes++;
+            }
+            else
+                lanes = 1;
+        }
+        free(sorted);
+    }
+
+    size_t ordered = 0;
+    for(size_t i = 0; i < b->job_count; i++)
+    {
+        if(!leads[i])
+            continue;
+        batch_unit* unit = &b->units[b->unit_count++];
+        unit->first = ordered;
+        unit->count = 0;
+        for(size_t k = i; k != SIZE_MAX; k = next[k])
+        {
+            b->order[ordered++] = k;
+            unit->count++;
+        }
+        unit->wide = unit->count > 1;
+    }
+    free(next);
+    free(leads);
+}
+
+/* Work stealing */
+
+// Takes the next unit for a worker: its own newest unit, or else the oldest unit of another worker.
+static bool next_unit(batch* b, int id, size_t* unit)
+{
+    for(int i = 0; i < b->threads; i++)
+    {
+        int victim = (id + i) % b->threads;
+        batch_queue* q = &b->queues[victim];
+        bool found = false;
+        pthread_mutex_lock(&q->lock);
+        if(q->head != q->tail)
+        {
+            *unit = victim == id ? q->units[--q->tail] : q->units[q->head++];
+            found = true;
+        }
+        pthread_mutex_unlock(&q->lock);
+        if(found)
+            return true;
+    }
+    return false; // no unit is ever added, so every queue stays empty from here on
+}
+
+/* Running */
+
+// Jobs with the same ROM and layout start from the same state, so a worker
+// saves the machine right after setting it up and restores it for the next such job.
+static bool same_setup(const batch_job* a, const batch_job* b)
+{
+    const char* layout_a = a->layout ? a->layout : DEFAULT_LAYOUT;
+    const char* layout_b = b->layout ? b->layout : DEFAULT_LAYOUT;
+    return a->image == b->image && strcmp(layout_a, layout_b) == 0;
+}
+
+// The memory a job's input goes to. A page mapped straight from the ROM image is
+// copied into the machine's own memory and remapped there first, since the
+// image must not be written. NULL if the page is not memory.
+static byte* input_page(machine* cpu, int n)
+{
+    bus_page* page = &cpu->pages[n];
+    byte* own = cpu->memory + (n << 8);
+    if(page->memory && page->memory != own)
+    {
+        memcpy(own, page->memory, BUS_PAGE_SIZE);
+        bus_map_memory(cpu, n << 8, BUS_PAGE_SIZE, own, page->access);
+    }
+    return page->memory;
+}
+
+static void run_job(batch_job* job, machine* cpu, terminal* term, jit* engine, snapshot* start, const batch_job** loaded)
+{
+    FILE* out = open_memstream(&job->output, &job->output_size);
+    job->halt = HALT_ERROR;
+    if(*loaded == NULL || !same_setup(*loaded, job) || snapshot_restore(start, cpu) != 0)
+    {
+        *loaded = NULL;
+        machine_init(cpu);
+        if(job->image == NULL)
+            job->error = "could not read ROM";
+        else if(setup_memory_map(cpu, job->layout ? job->layout : DEFAULT_LAYOUT) != 0)
+            job->error = "bad memory layout";
+        else
+        {
+            rom_load(cpu, job->image);
+            terminal_init(term, NULL);
+            terminal_attach(cpu, term, TERMINAL_ADDRESS);
+            if(start)
+            {
+                snapshot_capture(start, cpu);
+                *loaded = job;
+            }
+        }
+    }
+    if(job->error == NULL)
+    {
+        for(size_t i = 0; i < job->input_count; i++)
+        {
+            const batch_input* input = &job->inputs[i];
+            snapshot_touch(cpu, input->address, input->size);
+            size_t address = input->address;
+            size_t end = address + input->size;
+            while(address < end)
+            {
+                // one page, or what is left of the input in it
+                size_t next = (address | 0xff) + 1;
+                if(next > end)
+                    next = end;
+                byte* memory = input_page(cpu, address >> 8);
+                if(memory)
+                    memcpy(memory + (address & 0xff), input->data + (address - input->address), next - address);
+                address = next;
+            }
+            cpu_invalidate_decoded(cpu, input->address, input->size);
+        }
+        term->out = out;
+        jit_attach(cpu, engine);
+        cpu_reset(cpu);
+        uint32_t events = cpu_run(cpu, job->max_cycles, CPU_UNLIMITED);
+        job->halt = halt_reason_of(events);
+        jit_attach(cpu, NULL);
+        term->out = NULL;
+    }
+    fclose(out);
+    job->cycles = cpu->cycles;
+    job->PC = cpu->PC;
+    job->A = cpu->regA;
+    job->X = cpu->regX;
+    job->Y = cpu->regY;
+    job->S = cpu->SP;
+    job->P = cpu_get_flags(cpu);
+}
+
+// Runs the jobs of a unit as the lanes of a wide machine.
+static void run_wide(batch* b, const batch_unit* unit, wide_machine* w)
+{
+    FILE* out[WIDE_LANES];
+    wide_init(w);
+    const size_t* jobs = &b->order[unit->first];
+    const rom_image* image = b->jobs[jobs[0]].image;
+    rom_copy(image, w->rom, ROM_START, ROM_SIZE);
+    for(int lane = 0; lane < unit->count; lane++)
+    {
+        batch_job* job = &b->jobs[jobs[lane]];
+        // segments below the ROM are loaded into every lane's RAM
+        for(int i = 0; i < image->segment_count; i++)
+        {
+            const rom_segment* segment = &image->segments[i];
+            if(segment->address < ROM_START)
+            {
+                size_t size = ROM_START - segment->address;
+                wide_poke(w, lane, segment->address, segment->data, segment->size < size ? segment->size : size);
+            }
+        }
+        for(size_t i = 0; i < job->input_count; i++)
+            wide_poke(w, lane, job->inputs[i].address, job->inputs[i].data, job->inputs[i].size);
+        out[lane] = open_memstream(&job->output, &job->output_size);
+        wide_start(w, lane, out[lane], job->max_cycles);
+    }
+    wide_run(w);
+    for(int lane = 0; lane < unit->count; lane++)
+    {
+        batch_job* job = &b->jobs[jobs[lane]];
+        fclose(out[lane]);
+        job->halt = halt_reason_of(w->events[lane]);
+        job->cycles = w->cycles[lane];
+        job->PC = w->PC[lane];
+        job->A = w->regA[lane];
+        job->X = w->regX[lane];
+        job->Y = w->regY[lane];
+        job->S = w->SP[lane];
+        job->P = w->FLAGS[lane];
+    }
+}
+
+// Fails the jobs of a unit that could not be run.
+static void fail_unit(batch* b, const batch_unit* unit, const char* error)
+{
+    for(int i = 0; i < unit->count; i++)
+    {
+        batch_job* job = &b->jobs[b->order[unit->first + i]];
+        job->halt = HALT_ERROR;
+        job->error = error;
+    }
+}
+
+static void* worker_main(void* arg)
+{
+    batch_worker* worker = arg;
+    batch* b = worker->b;
+    machine* cpu = aligned_alloc(_Alignof(machine), sizeof(machine));
+    if(cpu == NULL)
+        return NULL; // takes no units, so the other workers steal its queue
+    cpu->snapshot = NULL; // machine_init releases the snapshot it finds
+    snapshot* start = snapshot_create();
+    const batch_job* loaded = NULL;
+    wide_machine* w = NULL;
+    terminal term;
+    jit* engine = b->use_jit ? jit_create() : NULL;
+    size_t index;
+    while(next_unit(b, worker->id, &index))
+    {
+        const batch_unit* unit = &b->units[index];
+        if(unit->wide)
+        {
+            if(w == NULL)
+                w = wide_create();
+            if(w)
+            {
+                run_wide(b, unit, w);
+                continue;
+            }
+        }
+        for(int i = 0; i < unit->count; i++)
+            run_job(&b->jobs[b->order[unit->first + i]], cpu, &term, engine, start, &loaded);
+    }
+    jit_destroy(engine);
+    wide_destroy(w);
+    snapshot_destroy(start);
+    free(cpu);
+    return NULL;
+}
+
+/* Results */
+
+static void write_result(FILE* out, size_t index, const batch_job* job)
+{
+    fprintf(out, "{\"job\":%zu,\"rom\":", index);
+    result_write_string(out, job->rom, strlen(job->rom));
+    fprintf(out, ",\"halt\":\"%s\"", halt_reason_name(job->halt));
+    if(job->error)
+        fprintf(out, ",\"error\":\"%s\"", job->error);
+    fprintf(out, ",\"cycles\":%llu,\"registers\":{\"pc\":%u,\"a\":%u,\"x\":%u,\"y\":%u,\"s\":%u,\"p\":%u},\"output\":",
+        (unsigned long long)job->cycles, job->PC, job->A, job->X, job->Y, job->S, job->P);
+    result_write_string(out, job->output ? job->output : "", job->output_size);
+    fputs("}\n", out);
+}
+
+int batch_run(const char* manifest, FILE* results, const batch_options* options)
+{
+    batch b = {0};
+    b.use_jit = options->use_jit;
+    if(read_manifest(&b, manifest, options->max_cycles) != 0)
+    {
+        free_jobs(&b);
+        return -1;
+    }
+    open_roms(&b);
+    plan_units(&b, options->wide);
+    b.threads = options->threads > 0 ? options->threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(b.threads < 1)
+        b.threads = 1;
+    if((size_t)b.threads > b.unit_count)
+        b.threads = b.unit_count ? b.unit_count : 1;
+
+    // Deal the units out round robin, so every worker starts with a similar mix
+    b.queues = calloc(b.threads, sizeof(batch_queue));
+    for(int i = 0; i < b.threads; i++)
+    {
+        batch_queue* q = &b.queues[i];
+        pthread_mutex_init(&q->lock, NULL);
+        q->units = malloc((b.unit_count / b.threads + 1) * sizeof(size_t));
+        for(size_t unit = i; unit < b.unit_count; unit += b.threads)
+            q->units[q->tail++] = unit;
+    }
+
+    pthread_t* threads = malloc(b.threads * sizeof(pthread_t));
+    batch_worker* workers = malloc(b.threads * sizeof(batch_worker));
+    int started = 0;
+    for(int i = 0; i < b.threads; i++)
+    {
+        workers[i] = (batch_worker){ &b, i };
+        if(pthread_create(&threads[started], NULL, worker_main, &workers[i]) == 0)
+            started++;
+    }
+    for(int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    // The units of threads that could not be started, or could not allocate a
+    // machine, are left in their queues. They are run here, or failed.
+    size_t index;
+    for(int i = 0; i < b.threads; i++)
+    {
+        if(b.queues[i].head != b.queues[i].tail)
+        {
+            worker_main(&workers[0]);
+            break;
+        }
+    }
+    while(next_unit(&b, 0, &index))
+        fail_unit(&b, &b.units[index], "out of memory");
+
+    int failed = 0;
+    for(size_t i = 0; i < b.job_count; i++)
+    {
+        write_result(results, i, &b.jobs[i]);
+        failed += b.jobs[i].error != NULL;
+    }
+
+    for(int i = 0; i < b.threads; i++)
+    {
+        pthread_mutex_destroy(&b.queues[i].lock);
+        free(b.queues[i].units);
+    }
+    free(b.queues);
+    free(threads);
+    free(workers);
+    free_jobs(&b);
+    return failed;
+}
@@ -0,0 +1,68 @@
+/**
+ * @file batch.h
+ * @author Mason Daub
+ * @brief Runs a batch of independent ROM jobs on a pool of worker threads.
+ * 
+ * The manifest lists one job per line: a ROM image followed by optional settings.
+ * 
+ *     rom.bin [cycles=N] [layout=ram:0000-7fff,rom:8000-ffff] [addr:hexbytes]...
+ * 
+ * A cycles setting of 0, like a default limit of 0, runs the job without a
+ * limit. An 'addr:hexbytes' input writes the bytes into memory at the hex
+ * address before the CPU is reset, e.g. '0200:0a0b0c'. A job with an input
+ * that can not be parsed fails with an error, and the rest still run. Blank
+ * lines and lines starting with '#' are ignored.
+ * 
+ * Every worker owns one machine, which is reused for each of its jobs. Jobs are
+ * dealt out to per-worker queues up front. A worker takes its own jobs from the
+ * back of its queue and, once it runs out, steals from the front of the others,
+ * so a few long jobs do not leave the rest of the pool idle. The queues of
+ * workers that could not be started or could not allocate their machine are
+ * run by the others, or by the calling thread if none started. Jobs that still
+ * could not be run fail with an error.
+ * 
+ * With the wide option, jobs of the same ROM that use the default layout and
+ * only write RAM are run together as the lanes of a wide machine (see wide.h),
+ * up to WIDE_LANES at a time. Their results are the same as running them alone.
+ * 
+ * Results are written as one JSON object per line, in manifest order. Their
+ * halt field names the halt_reason the job stopped for (see result.h).
+ * 
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BATCH_DEFAULT_CYCLES 1000000000ull  // Cycle limit of a job that does not set one
+
+/**
+ * @brief Options shared by every job of a batch.
+ */
+typedef struct _batch_options
+{
+    int threads;            // Worker threads, 0 for one per online core
+    bool use_jit;           // Give every worker a JIT
+    bool wide;              // Run jobs of the same ROM in lockstep on wide machines
+    uint64_t max_cycles;    // Default cycle limit per job, 0 for none
+} batch_options;
+
+/**
+ * @brief Runs every job of a manifest and writes the results.
+ * 
+ * @param manifest Path of the manifest.
+ * @param results Where to write the results.
+ * @param options Batch options.
+ * @return The number of jobs that could not be run, or -1 if the manifest could not be read.
+ */
+int batch_run(const char* manifest, FILE* results, const batch_options* options);
+
+#endif // BATCH_H
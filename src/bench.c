@@ -0,0 +1,292 @@
+/**
+ * @file bench.c
+ * @author Mason Daub
+ * @brief Host side benchmarks of the emulator.
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "bench.h"
+#include "cpu.h"
+#include "jit.h"
+#include "loader.h"
+#include "snapshot.h"
+#include "terminal.h"
+
+#ifdef __linux__
+#define BENCH_PERF
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/**
+ * @brief One workload ROM.
+ */
+typedef struct _bench_workload
+{
+    const char* name;
+    const char* rom;            // File name in BENCH_ROM_DIR
+} bench_workload;
+
+static const bench_workload workloads[] =
+{
+    { "hello", "hello_world.bin" },
+    { "mul", "multiply.bin" },
+    { "alu", "alu.bin" },
+    { "branch", "branch.bin" },
+    { "memory", "memory.bin" },
+    { "stack", "stack.bin" },
+};
+
+/*   Host counters   */
+
+typedef enum _bench_counter
+{
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CACHE_MISSES,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_COUNT
+} bench_counter;
+
+static const char* const counter_names[COUNTER_COUNT] = { "host_cycles", "host_instructions", "cache_misses", "branch_misses" };
+
+/**
+ * @brief Host performance counters of the benchmark thread. A counter whose fd is -1 is not available.
+ */
+typedef struct _bench_counters
+{
+    int fd[COUNTER_COUNT];
+    uint64_t value[COUNTER_COUNT];  // Counts of the last timing
+} bench_counters;
+
+static void counters_open(bench_counters* counters)
+{
+#ifdef BENCH_PERF
+    static const uint64_t configs[COUNTER_COUNT] =
+    {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    for(int i = 0; i < COUNTER_COUNT; i++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;    // allowed without privileges
+        attr.exclude_hv = 1;
+        counters->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#else
+    for(int i = 0; i < COUNTER_COUNT; i++)
+        counters->fd[i] = -1;
+#endif
+}
+
+static void counters_close(bench_counters* counters)
+{
+#ifdef BENCH_PERF
+    for(int i = 0; i < COUNTER_COUNT; i++)
+        if(counters->fd[i] >= 0)
+            close(counters->fd[i]);
+#endif
+}
+
+static void counters_start(bench_counters* counters)
+{
+#ifdef BENCH_PERF
+    for(int i = 0; i < COUNTER_COUNT; i++)
+    {
+        if(counters->fd[i] >= 0)
+        {
+            ioctl(counters->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+static void counters_stop(bench_counters* counters)
+{
+#ifdef BENCH_PERF
+    for(int i = 0; i < COUNTER_COUNT; i++)
+    {
+        counters->value[i] = 0;
+        if(counters->fd[i] >= 0)
+        {
+            ioctl(counters->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+            if(read(counters->fd[i], &counters->value[i], sizeof(uint64_t)) != sizeof(uint64_t))
+                counters->value[i] = 0;
+        }
+    }
+#endif
+}
+
+/*   Running   */
+
+/**
+ * @brief The result of one workload.
+ */
+typedef struct _bench_result
+{
+    uint64_t instructions;          // Emulated instructions run
+    uint64_t cycles;                // Emulated cycles run
+    double seconds;                 // Host time of the fastest timing
+    uint64_t counters[COUNTER_COUNT];   // Host counters of the fastest timing
+} bench_result;
+
+static double now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Runs one workload. Returns NULL on success, or why it could not be run.
+static const char* run_workload(const bench_workload* workload, machine* cpu, jit* engine,
+    snapshot* start, bench_counters* counters, bench_result* result)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s%s", BENCH_ROM_DIR, workload->rom);
+    rom_image image;
+    if(rom_open(&image, path) != 0)
+        return "could not read ROM";
+
+    terminal term;
+    machine_init(cpu);
+    setup_memory_map(cpu, DEFAULT_LAYOUT);
+    rom_load(cpu, &image);
+    terminal_init(&term, NULL);
+    terminal_attach(cpu, &term, TERMINAL_ADDRESS);
+    cpu_reset(cpu);
+    snapshot_capture(start, cpu);
+
+    // The length of one run, counted a step at a time
+    const char* error = NULL;
+    uint64_t length = 0;
+    while(cpu_run(cpu, CPU_UNLIMITED, 1) == EVENT_NONE && length < BENCH_MAX_INSTRUCTIONS)
+        length++;
+    length++; // the instruction that halted
+    if(length > BENCH_MAX_INSTRUCTIONS || !(cpu->events & EVENT_HALT))
+        error = "does not halt";
+    else
+    {
+        uint64_t runs = (BENCH_INSTRUCTIONS + length - 1) / length;
+        result->instructions = runs * length;
+        result->cycles = runs * cpu->cycles;
+        result->seconds = 0;
+        jit_attach(cpu, engine);
+        for(int repeat = 0; repeat < BENCH_REPEATS; repeat++)
+        {
+            counters_start(counters);
+            double begin = now();
+            for(uint64_t i = 0; i < runs; i++)
+            {
+                snapshot_restore(start, cpu);
+                cpu_run(cpu, CPU_UNLIMITED, CPU_UNLIMITED);
+            }
+            double seconds = now() - begin;
+            counters_stop(counters);
+            if(repeat == 0 || seconds < result->seconds)
+            {
+                result->seconds = seconds;
+                memcpy(result->counters, counters->value, sizeof(result->counters));
+            }
+        }
+        jit_attach(cpu, NULL);
+    }
+    machine_init(cpu); // the snapshot can not keep pointing into the image
+    rom_close(&image);
+    return error;
+}
+
+/*   Results   */
+
+static void print_counter(const bench_counters* counters, const bench_result* result, bench_counter counter)
+{
+    if(counters->fd[counter] >= 0)
+        printf(" %12llu", (unsigned long long)result->counters[counter]);
+    else
+        printf(" %12s", "-");
+}
+
+static void write_result(FILE* out, const bench_workload* workload, bool use_jit,
+    const bench_counters* counters, const bench_result* result, const char* error)
+{
+    fprintf(out, "{\"workload\":\"%s\",\"engine\":\"%s\"", workload->name, use_jit ? "jit" : "interpreter");
+    if(error)
+    {
+        fprintf(out, ",\"error\":\"%s\"}\n", error);
+        return;
+    }
+    fprintf(out, ",\"instructions\":%llu,\"cycles\":%llu,\"seconds\":%.6f,\"mips\":%.3f,\"ns_per_instruction\":%.4f,\"mhz\":%.3f",
+        (unsigned long long)result->instructions, (unsigned long long)result->cycles, result->seconds,
+        result->instructions / result->seconds * 1e-6, result->seconds * 1e9 / result->instructions,
+        result->cycles / result->seconds * 1e-6);
+    for(int i = 0; i < COUNTER_COUNT; i++)
+    {
+        if(counters->fd[i] >= 0)
+            fprintf(out, ",\"%s\":%llu", counter_names[i], (unsigned long long)result->counters[i]);
+        else
+            fprintf(out, ",\"%s\":null", counter_names[i]);
+    }
+    fputs("}\n", out);
+}
+
+int bench_run(FILE* results, bool use_jit)
+{
+    machine* cpu = aligned_alloc(_Alignof(machine), sizeof(machine));
+    cpu->snapshot = NULL; // machine_init releases the snapshot it finds
+    snapshot* start = snapshot_create();
+    jit* engine = use_jit ? jit_create() : NULL;
+    if(use_jit && engine == NULL)
+        puts("The JIT is not supported on this host, interpreting instead.");
+    bench_counters counters;
+    counters_open(&counters);
+
+    printf("%-10s %12s %10s %10s %10s %12s %12s\n",
+        "workload", "instructions", "MIPS", "ns/insn", "MHz", "cache-miss", "branch-miss");
+    int failed = 0;
+    for(size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        const bench_workload* workload = &workloads[i];
+        bench_result result;
+        const char* error = run_workload(workload, cpu, engine, start, &counters, &result);
+        if(error)
+        {
+            printf("%-10s %s\n", workload->name, error);
+            failed++;
+        }
+        else
+        {
+            printf("%-10s %12llu %10.2f %10.3f %10.2f", workload->name, (unsigned long long)result.instructions,
+                result.instructions / result.seconds * 1e-6, result.seconds * 1e9 / result.instructions,
+                result.cycles / result.seconds * 1e-6);
+            print_counter(&counters, &result, COUNTER_CACHE_MISSES);
+            print_counter(&counters, &result, COUNTER_BRANCH_MISSES);
+            putchar('\n');
+        }
+        if(results)
+            write_result(results, workload, engine != NULL, &counters, &result, error);
+    }
+
+    counters_close(&counters);
+    jit_destroy(engine);
+    snapshot_destroy(start);
+    free(cpu);
+    return failed;
+}
@@ -0,0 +1,45 @@
+/**
+ * @file bench.h
+ * @author Mason Daub
+ * @brief Host side benchmarks of the emulator.
+ * 
+ * Runs a fixed set of workload ROMs from BENCH_ROM_DIR: the hello world copy
+ * loop, the multiply routine and synthetic ALU, branch, memory and stack heavy
+ * programs. Every workload runs until it halts, and is restarted from a snapshot
+ * until about BENCH_INSTRUCTIONS instructions have run. The number of runs is
+ * worked out from how many instructions one run takes, so every benchmark does
+ * the same amount of work each time. Each workload is timed BENCH_REPEATS times
+ * and the fastest one counts.
+ * 
+ * The results are emulated MIPS, host nanoseconds per emulated instruction and
+ * the emulated clock rate. On Linux the host's cycles, instructions, cache misses
+ * and branch misses are counted with perf_event_open, if the kernel allows it.
+ * 
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#define BENCH_ROM_DIR "res/"                    // Where the workload ROMs are, relative to the working directory
+#define BENCH_INSTRUCTIONS 50000000ull          // Instructions run per timing of a workload
+#define BENCH_REPEATS 3                         // Timings per workload, the fastest counts
+#define BENCH_MAX_INSTRUCTIONS 100000000ull     // A workload that does not halt within this many fails
+
+/**
+ * @brief Runs every benchmark and prints a table of the results.
+ * 
+ * @param results Where to write the results as one JSON object per line, or NULL.
+ * @param use_jit Run the workloads with the JIT instead of the interpreter.
+ * @return The number of workloads that could not be run.
+ */
+int bench_run(FILE* results, bool use_jit);
+
+#endif // BENCH_H
@@ -0,0 +1,122 @@
+/**
+ * @file bus.c
+ * @author Mason Daub
+ * @brief Page table management and the slow path of the address bus.
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#include <assert.h>
+#include "bus.h"
+#include "cpu.h"
+#include "jit.h"
+#include "snapshot.h"
+#include "debugger.h"
+#include "replay.h"
+
+// Recomputes the direct pointers of a page from its descriptor.
+static void update_page(machine* cpu, int n)
+{
+    const bus_page* page = &cpu->pages[n];
+    cpu->read_page[n] = (page->access & BUS_READ) && !(page->traps & BUS_TRAP_WATCH_READ) ? page->memory : NULL;
+    cpu->write_page[n] = (page->access & BUS_WRITE) && !page->traps ? page->memory : NULL;
+}
+
+// Decoded and translated code can not outlive the memory it came from, and
+// a snapshot sharing the page has to keep what was there.
+static void remap_page(machine* cpu, int n)
+{
+    if(cpu->pages[n].traps & BUS_TRAP_SNAPSHOT)
+        snapshot_page_written(cpu, n);
+    if(cpu->pages[n].traps & BUS_TRAP_CODE)
+        jit_code_written(cpu, n << 8);
+    cpu_invalidate_decoded(cpu, n << 8, BUS_PAGE_SIZE);
+    cpu->pages[n].traps = 0;
+}
+
+void bus_map_memory(machine* cpu, uint16_t start, size_t size, byte* memory, byte access)
+{
+    assert((start & 0xff) == 0 && (size & 0xff) == 0 && start + size <= 0x10000);
+    for(size_t offset = 0; offset < size; offset += BUS_PAGE_SIZE)
+    {
+        int n = (start + offset) >> 8;
+        bus_page* page = &cpu->pages[n];
+        remap_page(cpu, n);
+        page->memory = memory ? memory + offset : NULL;
+        page->read = NULL;
+        page->write = NULL;
+        page->device = NULL;
+        page->state_size = 0;
+        page->access = access;
+        update_page(cpu, n);
+    }
+}
+
+void bus_map_device(machine* cpu, uint16_t start, size_t size, bus_read_handler read, bus_write_handler write,
+    void* device, size_t state_size)
+{
+    assert((start & 0xff) == 0 && (size & 0xff) == 0 && start + size <= 0x10000);
+    for(size_t offset = 0; offset < size; offset += BUS_PAGE_SIZE)
+    {
+        int n = (start + offset) >> 8;
+        bus_page* page = &cpu->pages[n];
+        remap_page(cpu, n);
+        page->memory = NULL;
+        page->read = read;
+        page->write = write;
+        page->device = device;
+        page->state_size = state_size;
+        page->access = BUS_READ | BUS_WRITE;
+        update_page(cpu, n);
+    }
+}
+
+void bus_unmap(machine* cpu, uint16_t start, size_t size)
+{
+    bus_map_memory(cpu, start, size, NULL, 0);
+}
+
+void bus_set_traps(machine* cpu, int page, byte set, byte clear)
+{
+    cpu->pages[page].traps = (cpu->pages[page].traps | set) & ~clear;
+    update_page(cpu, page);
+}
+
+byte bus_read_slow(machine* cpu, uint16_t address)
+{
+    const bus_page* page = &cpu->pages[address >> 8];
+    byte data = 0; // unmapped
+    if(cpu->replay && page->memory == NULL)
+        data = replay_input(cpu, address);
+    else if(page->read)
+        data = page->read(cpu, address, page->device);
+    else if(page->memory && (page->access & BUS_READ))
+        data = page->memory[address & 0xff]; // a watched memory page
+    if(page->traps & BUS_TRAP_WATCH_READ)
+        debugger_access(cpu, address, data, false);
+    return data;
+}
+
+void bus_write_slow(machine* cpu, uint16_t address, byte data)
+{
+    const bus_page* page = &cpu->pages[address >> 8];
+    if(page->traps & BUS_TRAP_WATCH_WRITE)
+        debugger_access(cpu, address, data, true);
+    if(page->write)
+        page->write(cpu, address, data, page->device);
+    else if(page->memory && (page->access & BUS_WRITE))
+    {
+        // a trapped memory page
+        if(page->traps & BUS_TRAP_SNAPSHOT)
+            snapshot_page_written(cpu, address >> 8);
+        page->memory[address & 0xff] = data;
+        if(page->traps & BUS_TRAP_DECODE)
+            cpu_invalidate_decoded(cpu, address, 1);
+        if(page->traps & BUS_TRAP_CODE)
+            jit_code_written(cpu, address);
+    }
+    // writes to read-only or unmapped pages are dropped
+}
@@ -0,0 +1,148 @@
+/**
+ * @file bus.h
+ * @author Mason Daub
+ * @brief The address bus. Memory is mapped in 256 byte pages through a pair of page tables.
+ * 
+ * Every page has a read and a write entry. An entry is either a direct pointer
+ * to host memory, which makes the access a single indexed load or store, or NULL,
+ * in which case the access takes the slow path through the page's bus_page.
+ * The slow path calls the device handlers for memory mapped IO, and drops writes
+ * to read-only pages such as ROM.
+ * 
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#ifndef BUS_H
+#define BUS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t byte;
+typedef struct _machine machine;
+
+#define BUS_PAGE_SIZE 0x100
+#define BUS_PAGE_COUNT 0x100
+
+/*   Page access flags   */
+
+#define BUS_READ    0x01    // The page can be read
+#define BUS_WRITE   0x02    // The page can be written
+
+/*   Page trap flags   */
+
+#define BUS_TRAP_CODE   0x01    // The page holds translated code. Writes invalidate it.
+#define BUS_TRAP_DECODE 0x02    // The page holds predecoded instructions. Writes invalidate them.
+#define BUS_TRAP_SNAPSHOT 0x04  // The page is shared with a snapshot. The first write saves it.
+#define BUS_TRAP_WATCH_READ 0x08    // The debugger watches reads of the page. It loses its direct read pointer.
+#define BUS_TRAP_WATCH_WRITE 0x10   // The debugger watches writes to the page.
+
+/**
+ * @brief Called for reads from a memory mapped device.
+ * 
+ * @param cpu The machine doing the read.
+ * @param address The full 16 bit address.
+ * @param device The device pointer given to bus_map_device.
+ * @return The byte on the data bus.
+ */
+typedef byte (*bus_read_handler)(machine* cpu, uint16_t address, void* device);
+
+/**
+ * @brief Called for writes to a memory mapped device.
+ * 
+ * @param cpu The machine doing the write.
+ * @param address The full 16 bit address.
+ * @param data The byte on the data bus.
+ * @param device The device pointer given to bus_map_device.
+ */
+typedef void (*bus_write_handler)(machine* cpu, uint16_t address, byte data, void* device);
+
+/**
+ * @brief Everything the slow path needs to know about a page.
+ */
+typedef struct _bus_page
+{
+    byte* memory;               // Host memory backing the page, NULL for devices
+    bus_read_handler read;      // Device read handler, NULL if the page is memory
+    bus_write_handler write;    // Device write handler, NULL if the page is memory
+    void* device;               // Passed to the handlers
+    size_t state_size;          // Bytes at the start of device that snapshots save
+    byte access;                // BUS_READ and BUS_WRITE flags
+    byte traps;                 // BUS_TRAP flags. Trapped memory pages are written through the slow path.
+} bus_page;
+
+/**
+ * @brief Maps host memory into the address space.
+ * 
+ * Pages that are mapped readable (or writable) get a direct pointer in the read (or write)
+ * page table. Writes to a page that is not writable are ignored, which is how ROM is protected.
+ * The memory does not need to belong to the machine, which allows bank switching.
+ * 
+ * @param cpu The machine to map.
+ * @param start First address to map. Must be page aligned.
+ * @param size Number of bytes to map. Must be a multiple of the page size.
+ * @param memory Host memory of at least size bytes.
+ * @param access BUS_READ and/or BUS_WRITE.
+ */
+void bus_map_memory(machine* cpu, uint16_t start, size_t size, byte* memory, byte access);
+
+/**
+ * @brief Maps a device into the address space. Every access to it calls its handlers.
+ * 
+ * @param cpu The machine to map.
+ * @param start First address to map. Must be page aligned.
+ * @param size Number of bytes to map. Must be a multiple of the page size.
+ * @param read Read handler, or NULL to read as 0.
+ * @param write Write handler, or NULL to ignore writes.
+ * @param device Passed to the handlers.
+ * @param state_size Number of bytes at the start of device that hold its state,
+ * which snapshots save and restore. 0 if the device has no state to save.
+ */
+void bus_map_device(machine* cpu, uint16_t start, size_t size, bus_read_handler read, bus_write_handler write,
+    void* device, size_t state_size);
+
+/**
+ * @brief Removes a range from the address space. Reads return 0 and writes are ignored.
+ * 
+ * @param cpu The machine to unmap.
+ * @param start First address to unmap. Must be page aligned.
+ * @param size Number of bytes to unmap. Must be a multiple of the page size.
+ */
+void bus_unmap(machine* cpu, uint16_t start, size_t size);
+
+/**
+ * @brief Sets or clears trap flags on a page.
+ * A memory page with any trap set loses its direct write pointer, so the
+ * slow path sees every write to it, and BUS_TRAP_WATCH_READ also takes away
+ * its direct read pointer. Remapping a page clears its traps.
+ * 
+ * @param cpu The machine.
+ * @param page The page number (address >> 8).
+ * @param set Flags to set.
+ * @param clear Flags to clear.
+ */
+void bus_set_traps(machine* cpu, int page, byte set, byte clear);
+
+/**
+ * @brief Slow path of read_memory, for pages without a direct read pointer.
+ * 
+ * @param cpu The machine to read.
+ * @param address The address to read.
+ * @return The byte at the address.
+ */
+byte bus_read_slow(machine* cpu, uint16_t address);
+
+/**
+ * @brief Slow path of write_memory, for pages without a direct write pointer.
+ * 
+ * @param cpu The machine to write.
+ * @param address The address to write.
+ * @param data The byte to write.
+ */
+void bus_write_slow(machine* cpu, uint16_t address, byte data);
+
+#endif // BUS_H
@@ -0,0 +1,92 @@
+/**
+ * @file clock.c
+ * @author Mason Daub
+ * @brief Real time throttling of the emulation.
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#include <math.h>
+#include <errno.h>
+#include "clock.h"
+
+#define NS_PER_SEC 1000000000ll
+
+static int64_t timespec_ns(const struct timespec* t)
+{
+    return t->tv_sec * NS_PER_SEC + t->tv_nsec;
+}
+
+static int64_t elapsed_ns(const cpu_clock* clk)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec_ns(&now) - timespec_ns(&clk->start);
+}
+
+// Wall time that a cycle count should be reached at, relative to the start of the clock.
+static int64_t emulated_ns(const cpu_clock* clk, uint64_t cycles)
+{
+    uint64_t elapsed = cycles - clk->start_cycles;
+    return (elapsed / clk->frequency) * NS_PER_SEC + (elapsed % clk->frequency) * NS_PER_SEC / clk->frequency;
+}
+
+void clock_init(cpu_clock* clk, uint64_t frequency, const machine* cpu)
+{
+    *clk = (cpu_clock){0};
+    clk->frequency = frequency;
+    clk->slice_cycles = frequency == CLOCK_UNLIMITED ? CPU_UNLIMITED : frequency * CLOCK_SLICE_NS / NS_PER_SEC;
+    if(clk->slice_cycles == 0)
+        clk->slice_cycles = 1;
+    clk->start_cycles = cpu->cycles;
+    clock_gettime(CLOCK_MONOTONIC, &clk->start);
+}
+
+void clock_sync(cpu_clock* clk, uint64_t cycles)
+{
+    if(clk->frequency == CLOCK_UNLIMITED)
+        return;
+    clk->syncs++;
+    int64_t target = emulated_ns(clk, cycles);
+    int64_t now = elapsed_ns(clk);
+    if(now < target)
+    {
+        int64_t deadline_ns = timespec_ns(&clk->start) + target;
+        struct timespec deadline = { deadline_ns / NS_PER_SEC, deadline_ns % NS_PER_SEC };
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+        now = elapsed_ns(clk);
+
+        int64_t latency = now - target;
+        clk->sleeps++;
+        clk->jitter_sum += latency;
+        clk->jitter_sum_sq += (double)latency * latency;
+        if(latency > clk->max_jitter_ns)
+            clk->max_jitter_ns = latency;
+    }
+    clk->drift_ns = now - target;
+    if(clk->drift_ns > clk->max_drift_ns)
+        clk->max_drift_ns = clk->drift_ns;
+}
+
+void clock_print_stats(const cpu_clock* clk, uint64_t cycles, FILE* out)
+{
+    double seconds = elapsed_ns(clk) / (double)NS_PER_SEC;
+    double mhz = seconds > 0 ? (cycles - clk->start_cycles) / seconds / 1e6 : 0;
+    fprintf(out, "Clock: %llu cycles in %.3f s (%.3f MHz", (unsigned long long)(cycles - clk->start_cycles), seconds, mhz);
+    if(clk->frequency == CLOCK_UNLIMITED)
+    {
+        fputs(", unlimited)\n", out);
+        return;
+    }
+    fprintf(out, ", target %.3f MHz)\n", clk->frequency / 1e6);
+
+    double mean = clk->sleeps ? clk->jitter_sum / clk->sleeps : 0;
+    double variance = clk->sleeps ? clk->jitter_sum_sq / clk->sleeps - mean * mean : 0;
+    fprintf(out, "Drift: %.3f ms now, %.3f ms max. Wakeup jitter: %.1f us mean, %.1f us stddev, %.1f us max over %llu/%llu slices\n",
+        clk->drift_ns / 1e6, clk->max_drift_ns / 1e6,
+        mean / 1e3, sqrt(variance > 0 ? variance : 0) / 1e3, clk->max_jitter_ns / 1e3,
+        (unsigned long long)clk->sleeps, (unsigned long long)clk->syncs);
+}
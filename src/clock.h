@@ -0,0 +1,76 @@
+/**
+ * @file clock.h
+ * @author Mason Daub
+ * @brief Locks the emulation to a target clock rate against the host's wall clock.
+ * 
+ * The CPU is run in slices of a fixed number of cycles. After each slice
+ * clock_sync sleeps until the wall clock has caught up with the emulated time,
+ * so the host only wakes up once per slice instead of once per instruction.
+ * Sleeping uses absolute deadlines, so oversleeping in one slice is paid back
+ * by the next one instead of accumulating as drift.
+ * 
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "cpu.h"
+
+#define CLOCK_UNLIMITED 0           // Frequency that disables throttling
+#define CLOCK_SLICE_NS 1000000      // Emulated time run between syncs (1 ms)
+
+/**
+ * @brief Throttle state and timing statistics.
+ */
+typedef struct _cpu_clock
+{
+    uint64_t frequency;         // Target clock in Hz, or CLOCK_UNLIMITED
+    uint64_t slice_cycles;      // Cycles to run between calls to clock_sync
+    struct timespec start;      // Wall time when the clock was started
+    uint64_t start_cycles;      // Machine cycle count when the clock was started
+
+    uint64_t syncs;             // Number of calls to clock_sync
+    uint64_t sleeps;            // Number of syncs that had to sleep
+    int64_t drift_ns;           // Wall time minus emulated time at the last sync. Positive is behind.
+    int64_t max_drift_ns;       // Largest drift seen
+    double jitter_sum;          // Sum of wakeup latencies in ns
+    double jitter_sum_sq;       // Sum of squared wakeup latencies
+    int64_t max_jitter_ns;      // Largest wakeup latency
+} cpu_clock;
+
+/**
+ * @brief Starts a clock for a machine from its current cycle count.
+ * 
+ * @param clk The clock to initialize.
+ * @param frequency Target frequency in Hz, or CLOCK_UNLIMITED.
+ * @param cpu The machine the clock will throttle.
+ */
+void clock_init(cpu_clock* clk, uint64_t frequency, const machine* cpu);
+
+/**
+ * @brief Sleeps until the wall clock reaches the emulated time of a cycle count.
+ * Returns immediately when the emulation is behind or the clock is unlimited.
+ * 
+ * @param clk The clock.
+ * @param cycles The machine's current cycle count.
+ */
+void clock_sync(cpu_clock* clk, uint64_t cycles);
+
+/**
+ * @brief Prints the achieved clock rate, drift and wakeup jitter.
+ * 
+ * @param clk The clock.
+ * @param cycles The machine's current cycle count.
+ * @param out Where to print.
+ */
+void clock_print_stats(const cpu_clock* clk, uint64_t cycles, FILE* out);
+
+#endif // CLOCK_H
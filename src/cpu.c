@@ -11,1022 +11,830 @@
 
 
 #include <stddef.h>
-#include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 #include "cpu_utils.h"
 #include "cpu.h"
+#include "jit.h"
+#include "snapshot.h"
+#include "profiler.h"
+#include "trace.h"
+#include "replay.h"
+#include "disasm.h"
+#include "debugger.h"
+
+// Used for the small helpers that make up the opcode handlers. They are always
+// called with a constant addressing mode, so inlining them lets the compiler
+// throw away every branch that does not apply to that opcode.
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+#define OPCODE_BREAK 0x02       // Undefined opcode of the entry decode returns at a breakpoint
+#define OPERAND_BREAK 0xffff    // Its operand, which a one byte instruction never decodes to
+
+uint16_t decimal_adc[0x20000];
+uint16_t decimal_sbc[0x20000];
+static pthread_once_t decimal_once = PTHREAD_ONCE_INIT;
+
+// Follows the NMOS 6502: the digits are adjusted as they are added, even when
+// they are not valid BCD, N and V come from the sum before the high digit is
+// adjusted and Z from the binary sum. SBC sets its flags exactly as in binary mode.
+static void build_decimal_tables(void)
+{
+    for(int carry = 0; carry < 2; carry++)
+    for(int a = 0; a < 0x100; a++)
+    for(int data = 0; data < 0x100; data++)
+    {
+        int binary = a + data + carry;
+        int low = (a & 0x0f) + (data & 0x0f) + carry;
+        if(low >= 0x0a)
+            low = ((low + 0x06) & 0x0f) + 0x10;
+        int high = (a & 0xf0) + (data & 0xf0) + low;
+        byte flags = (high & 0x80 ? flag_N : 0) | (~(a ^ data) & (a ^ high) & 0x80 ? flag_V : 0)
+            | ((binary & 0xff) == 0 ? flag_Z : 0);
+        if(high >= 0xa0)
+            high += 0x60;
+        flags |= high >= 0x100 ? flag_C : 0;
+        decimal_adc[DECIMAL_INDEX(carry, a, data)] = (high & 0xff) | flags << 8;
+
+        binary = a - data - !carry;
+        low = (a & 0x0f) - (data & 0x0f) - !carry;
+        if(low < 0)
+            low = ((low - 0x06) & 0x0f) - 0x10;
+        high = (a & 0xf0) - (data & 0xf0) + low;
+        if(high < 0)
+            high -= 0x60;
+        flags = (binary & 0x80 ? flag_N : 0) | ((a ^ data) & (a ^ binary) & 0x80 ? flag_V : 0)
+            | ((binary & 0xff) == 0 ? flag_Z : 0) | (binary >= 0 ? flag_C : 0);
+        decimal_sbc[DECIMAL_INDEX(carry, a, data)] = (high & 0xff) | flags << 8;
+    }
+}
 
-/* CPU register declarations */
-
-byte cpu_SP = 0xff;
-uint16_t cpu_PC = 0;
-byte cpu_regA, cpu_regX, cpu_regY, cpu_SP, cpu_FLAGS;
-
-/* Lookup tables related to number of instruction operands */
+void cpu_decimal_init(void)
+{
+    pthread_once(&decimal_once, build_decimal_tables);
+}
 
-const int c_conv[] = {2, 1, 5, 3, 7, 6, 0, 4}; // LUT for timing array index
-const int count_full_imm[]  = {1, 1, 1, 2, 1, 1, 2, 2};
-const int count_full_a[]    = {1, 1, 0, 2, 1, 1, 2, 2};
+void machine_init(machine* cpu)
+{
+    cpu_decimal_init();
+    if(cpu->snapshot)
+        snapshot_release(cpu);
+    memset(cpu, 0, sizeof(machine));
+    S = 0xff;
+    cpu_set_flags(cpu, 0);
+    bus_map_memory(cpu, 0x0000, sizeof(cpu->memory), cpu->memory, BUS_READ | BUS_WRITE);
+}
 
 // Wait for a specified number of clock cycles
-void cpu_delay(int num_cycles)
+void cpu_delay(machine* cpu, int num_cycles)
+{
+    // time is measured in cycles, so a delay is just cycles that pass without an instruction
+    cpu->cycles += num_cycles;
+}
+void cpu_reset(machine* cpu)
+{
+    PC = read_memory_word(cpu, RST_ADDRESS);
+}
+
+void cpu_stack_push(machine* cpu, byte data)
 {
-    ;
+    if(__builtin_expect(S == 0, 0))
+        cpu_raise_event(cpu, EVENT_STACK);
+    size_t address = 0x0100 | S; // computer effective address of the stack
+    write_memory(cpu, address, data); // load data
+    S--; // decrement stack pointer
 }
-void cpu_reset()
+
+byte cpu_stack_pop(machine* cpu)
 {
-    PC = read_memory_word(RST_ADDRESS);
+    if(__builtin_expect(S == 0xff, 0))
+        cpu_raise_event(cpu, EVENT_STACK);
+    S++;
+    size_t address = 0x0100 | S;
+    return read_memory(cpu, address); // return data at original memory
 }
 
-void cpu_stack_push(byte data)
+void cpu_set_irq(machine* cpu, uint32_t source, bool asserted)
 {
-    assert(cpu_SP != 0);
-    size_t address = 0x0100 | cpu_SP; // computer effective address of the stack
-    write_memory(address, data); // load data
-    cpu_SP--; // decrement stack pointer 
+    if(cpu->replay && replay_line_change(cpu->replay))
+        return; // the replay drives the lines
+    if(asserted)
+        cpu->irq_lines |= source;
+    else
+        cpu->irq_lines &= ~source;
+    if(cpu_interrupt_pending(cpu))
+        cpu->stop_cycle = 0; // stop after this instruction, like an event
 }
 
-byte cpu_stack_pop()
+void cpu_attach_irq(machine* cpu, uint32_t source)
 {
-    assert(cpu_SP != 0xff);
-    cpu_SP++;
-    size_t address = 0x0100 | cpu_SP;
-    return read_memory(address); // return data at original memory
+    cpu->irq_sources |= source;
 }
 
-void IRQ()
+void cpu_attach_nmi(machine* cpu, uint32_t source)
 {
+    cpu->nmi_sources |= source;
+}
 
+void cpu_set_nmi(machine* cpu, uint32_t source, bool asserted)
+{
+    if(cpu->replay && replay_line_change(cpu->replay))
+        return;
+    uint32_t lines = asserted ? cpu->nmi_lines | source : cpu->nmi_lines & ~source;
+    if(lines && !cpu->nmi_lines)
+    {
+        cpu->nmi_pending = true;
+        cpu->stop_cycle = 0;
+    }
+    cpu->nmi_lines = lines;
 }
 
-byte read_address(address_mode mode, byte arg1, byte arg2)
+int cpu_interrupt(machine* cpu)
 {
-    return read_memory(get_effective_address(mode, arg1, arg2));
+    uint16_t vector;
+    if(cpu->replay)
+        replay_boundary(cpu);
+    if(cpu->nmi_pending)
+    {
+        cpu->nmi_pending = false;
+        vector = NMI_ADDRESS;
+    }
+    else if(cpu->irq_lines && !(P & flag_I))
+        vector = IRQ_ADDRESS;
+    else
+        return 0;
+    cpu_stack_push(cpu, (PC >> 8) & 0xff);
+    cpu_stack_push(cpu, PC & 0xff);
+    cpu_stack_push(cpu, cpu_get_flags(cpu) | flag_U); // B is clear, unlike BRK
+    P |= flag_I;
+    PC = read_memory_word(cpu, vector);
+    cpu->cycles += INTERRUPT_CYCLES;
+    return INTERRUPT_CYCLES;
 }
 
-size_t get_effective_address(address_mode mode, byte arg1, byte arg2)
+/* Addressing */
+
+// Computes the effective address of a memory operand. When page is set, one cycle
+// is added to cycles if indexing crossed a page boundary.
+ALWAYS_INLINE uint16_t effective_address(machine* cpu, const address_mode mode, uint16_t operand, int* cycles, const int page)
 {
-    size_t eff_address = 0;
-    const uint16_t abs_arg = (arg2 << 8) | arg1;
-    size_t address1;
+    uint16_t base, address;
     switch(mode)
     {
         case zpg:
-            eff_address = arg1;
-            break;
+        case absolute:
+            return operand;
         case ind_zpg_x:
-            eff_address = (X + arg1) & 0xff;
-            break;
+            return (operand + X) & 0xff;
         case ind_zpg_y:
-            eff_address = (Y + arg1) & 0xff;
-            break;
-        case abs:
-            eff_address = abs_arg;
-            break;
+            return (operand + Y) & 0xff;
         case ind_abs_x:
-            eff_address = (X + abs_arg)& 0xffff;
+            base = operand;
+            address = base + X;
             break;
         case ind_abs_y:
-            eff_address = (Y + abs_arg) & 0xffff;
-            break;
-        case rel:
-            eff_address = PC + *(int8_t*)(&arg1); // signed offset
-            break;
-        case indir_abs:
-            eff_address = read_memory(abs_arg);
+            base = operand;
+            address = base + Y;
             break;
         case ind_indir_x:
-            address1 = (X + arg1) & 0xff;
-            eff_address = (read_memory(address1) << 8) | read_memory(address1 + 1);
-            break;
+            base = (operand + X) & 0xff;
+            return read_memory(cpu, base) | (read_memory(cpu, (base + 1) & 0xff) << 8);
         case indir_ind_y:
-            eff_address = read_memory(arg1) + Y;
+            base = read_memory(cpu, operand) | (read_memory(cpu, (operand + 1) & 0xff) << 8);
+            address = base + Y;
             break;
+        case ind_abs:
+            // The NMOS 6502 does not carry into the high byte of the pointer.
+            return read_memory(cpu, operand) | (read_memory(cpu, (operand & 0xff00) | ((operand + 1) & 0xff)) << 8);
         default:
             return 0x0000;
     }
-    return eff_address;
+    if(page)
+        *cycles += (base ^ address) > 0xff;
+    return address;
 }
 
-int address_delay(address_mode mode, byte arg1, byte arg2)
+// Reads the value an instruction operates on. Supports immediate and accumulator modes.
+ALWAYS_INLINE byte load(machine* cpu, const address_mode mode, uint16_t operand, int* cycles, const int page)
 {
-    size_t warg = arg1 | (arg2 << 8);
-    unsigned int add;
-    switch(mode)
-    {
-        case ind_abs_x:
-            return (warg & 0xff) + cpu_regX > 0xff;
-        case ind_indir_x:
-            return (cpu_regX + (size_t) arg1) > 0xff;
-        case indir_ind_y:
-            add = read_memory(arg1);
-            add |= read_memory(arg1+1) << 8; // read the word at zpg arg1
-            return (add & 0xff) + cpu_regY > 0xff;
-        default:
-        return 0;
-    }
+    if(mode == imm)
+        return operand;
+    if(mode == reg_A)
+        return A;
+    return read_memory(cpu, effective_address(cpu, mode, operand, cycles, page));
 }
 
+// A loop to itself can only be left by an interrupt, and none can ever come
+ALWAYS_INLINE bool jammed(const machine* cpu)
+{
+    return !cpu->nmi_pending && !cpu->nmi_sources && ((P & flag_I) || !cpu->irq_sources);
+}
 
-// Returns number of clock cycles it would have taken to execute
-// Yes I could have made this using if statements and seperate functions.
-// I tried to keep branching and function calls to a minimum to minimize
-// emulator overhead.
-int cpu_do_next_op()
-{
-    #ifdef DEBUG
-    char buffer[16];
-    dissasemble(PC, buffer, 16);
-    #endif
-    byte opcode = cpu_fetch();
-    address_mode mode = (opcode & mode_mask) >> 2;
-    byte arg1, arg2;    // stores the (up to) 2 operands of the op
-    byte data;          // storing operation data
-    int intermediate;   // 9 bit result of math op
-
-    const int ADC_cycles[]  = {2, 3, 4, 4, 4, 4, 6, 5};
-    const int AND_cycles[]  = {2, 2, 3, 4, 4, 4, 6, 5};
-    const int CMP_cycles[]  = {2, 3, 4, 4, 4, 4, 6, 5};
-    const int EOR_cycles[]  = {2, 3, 4, 4, 4, 4, 6, 5};
-    const int LDA_cycles[]  = {2, 3, 4, 4, 4, 4, 6, 5};
-    const int OR_cycles[]   = {2, 2, 3, 4, 4, 4, 6, 5};
-    const int SBC_cycles[]  = {2, 3, 4, 4, 4, 4, 6, 5};
-    // Full address instructions;
-    switch(opcode & ~mode_mask)
+ALWAYS_INLINE int branch(machine* cpu, bool condition, uint16_t operand, int cycles)
+{
+    if(condition)
     {
-        case ADC:
-            get_args(count_full_imm[mode], &arg1, &arg2);
-            data = get_data_full_imm(mode, arg1, arg2);
-            intermediate = (P & flag_C) + data + A; // add carry to data + A
-            P = ((A & 0x80) != (intermediate & 0x80)) ? P | flag_V : P & ~flag_V; // set V if A.7 != res.7
-            P = (A & 0x80) | (P & 0x7f); // set neg flag to A neg
-            update_Zflag(intermediate);
-            
-            /*  TODO: BCD ADD  */
-            P = (P & ~flag_C) | (intermediate > 0xff) * flag_C; 
-            A = intermediate & 0xff;
-            return ADC_cycles[c_conv[mode]] + address_delay(mode, arg1, arg2);
-        
-        case AND:
-            get_args(count_full_imm[mode], &arg1, &arg2);
-            data = get_data_full_imm(mode, arg1, arg2);
-            A &= data;
-            accum_flags;
-            return AND_cycles[c_conv[mode]] + address_delay(mode, arg1, arg2);
-
-        case CMP:
-            get_args(count_full_imm[mode], &arg1, &arg2);
-            data = get_data_full_imm(mode, arg1, arg2);
-            intermediate = A + ~data + 1;
-            P = (intermediate & flag_N) | (P & ~flag_N); // set negative flag to bit 7 of sub
-            P = (intermediate == 0) ? P | flag_Z : P & ~flag_Z; // set zero flag
-            P = (A >= data) ? P | flag_C : P & ~flag_C; // set carry flag if A >= data
-            return CMP_cycles[c_conv[mode]];
-
-        case EOR:
-            get_args(count_full_imm[mode], &arg1, &arg2);
-            data = get_data_full_imm(mode, arg1, arg2);
-            A ^= data;
-            accum_flags;
-            return EOR_cycles[c_conv[mode]] + address_delay(mode, arg1, arg2); 
-        
-        case LDA:
-            get_args(count_full_imm[mode], &arg1, &arg2);
-            A = get_data_full_imm(mode, arg1, arg2);
-            accum_flags;
-            return LDA_cycles[c_conv[mode]] + address_delay(mode, arg1, arg2);
-            
-        case ORA:
-            get_args(count_full_imm[mode], &arg1, &arg2);
-            data = get_data_full_imm(mode, arg1, arg2);
-            A |= data;
-            accum_flags;
-            return AND_cycles[mode] + address_delay(mode, arg1, arg2);
-
-        case SBC:
-            get_args(count_full_imm[mode], &arg1, &arg2);
-            data = get_data_full_imm(mode, arg1, arg2);
-            if(P & flag_D) // TODO BCD
-            {
-                
-            }
-            else
-            {
-                intermediate = A + ~data + (P & flag_C);
-                P = (intermediate > 127 || intermediate < -128) ? P | flag_V : P & ~flag_V; // Overflow cond
-            }
-            P = (intermediate >= 0) ? P | flag_C : P & ~flag_C;
-            P = (intermediate & flag_N) | (P & ~flag_N);
-            update_Zflag(intermediate);
-            A = intermediate & 0xff;
-            return SBC_cycles[c_conv[mode]] + address_delay(mode, arg1, arg2);
+        uint16_t target = PC + (int8_t)operand;
+        cycles += 1 + ((target ^ PC) > 0xff); // add 1 C for page change
+        if(__builtin_expect((int8_t)operand == -2, 0) && jammed(cpu))
+            cpu_raise_event(cpu, EVENT_JAM); // the flags can not change in the loop
+        PC = target;
     }
-   
-    /* Fixed Address Modes */
-    uint8_t COMP_reg;
-    switch(opcode)
-    {
-        case BCC:
-            arg1 = cpu_fetch();
-            return branch_instruction(~P & flag_C, arg1);
-
-        case BCS:
-            arg1 = cpu_fetch();
-            return branch_instruction(P & flag_C, arg1);
-
-        case BEQ:
-            arg1 = cpu_fetch();
-            return branch_instruction(P & flag_Z, arg1);
-
-        case BMI:
-            arg1 = cpu_fetch();
-            return branch_instruction(P & flag_N, arg1);
-
-        case BNE:
-            arg1 = cpu_fetch();
-            return branch_instruction(~P & flag_Z, arg1);
-
-        case BPL:
-            arg1 = cpu_fetch();
-            return branch_instruction(~P & flag_N, arg1);
-            
-        case BRK:
-            PC++; // this is a bug, but we'll keep it
-            cpu_stack_push((PC >> 8) & 0xff);
-            cpu_stack_push(PC & 0xff);
-            cpu_stack_push(P | flag_B);
-            PC = read_memory_word(IRQ_ADDRESS);
-            return 7;
-
-        case BVC:
-            arg1 = cpu_fetch();
-            return branch_instruction(P & flag_C, arg1);
-
-        case BVS:
-            arg1 = cpu_fetch();
-            return branch_instruction(P & flag_C, arg1);
-
-        case CLC:
-            P &= ~flag_C;
-            return 2;
-
-        case CLD:
-            P &= ~flag_D;
-            return 2;
-
-        case CLI:
-            P &= ~flag_I;
-            return 2;
-
-        case CLV:
-            P &= ~flag_V;
-            return 2;
-
-        case DEX:
-            X--;
-            update_Zflag(X);
-            update_Nflag(X);
-            return 2;
-
-        case DEY:
-            Y--;
-            update_Zflag(Y);
-            update_Nflag(Y);
-            return 2;
-
-        case INX:
-            X++;
-            update_Zflag(X);
-            update_Nflag(X);
-            return 2;
-
-        case INY:
-            X++;
-            update_Zflag(Y);
-            update_Nflag(Y);
-            return 2;
-
-        case JSR:
-            arg1 = cpu_fetch(); arg2 = cpu_fetch();
-            PC--;
-            cpu_stack_push((PC >> 8) & 0xff);
-            cpu_stack_push(PC & 0xff);
-            PC = arg1 | (arg2 << 8);
-            return 6;
-
-        case NOP:
-            return 2;
-        case PHA:
-            cpu_stack_push(A);
-            return 3;
-            
-        case PHP:
-            cpu_stack_push(P);
-            return 3;
-
-        case PLA:
-            A = cpu_stack_pop();
-            accum_flags;
-            return 4;
-
-        case PLP:
-            P = cpu_stack_pop();
-            return 4;
-
-        case RTI:
-            P = cpu_stack_pop();
-            PC = cpu_stack_pop();
-            PC |= cpu_stack_pop() << 8;
-            return 6;
-
-        case RTS:
-            PC = cpu_stack_pop();
-            PC |= cpu_stack_pop() << 8;
-            PC++;
-            return 6;
-
-        case SEC:
-            P |= flag_C;
-            return 2;
-
-        case SED:
-            P |= flag_D;
-            return 2;
-
-        case SEI:
-            P |= flag_I;
-            return 2;
-
-        case TAX:
-            X = A;
-            update_Nflag(X);
-            update_Zflag(X);
-            return 2;
-
-        case TAY:
-            Y = A;
-            update_Nflag(Y);
-            update_Zflag(Y);
-            return 2;
-
-        case TSX:
-            X = S;
-            update_Zflag(X);
-            update_Nflag(X);
-            return 2;
-
-        case TXA:
-            A = X;
-            accum_flags;
-            return 2;
-
-        case TXS:
-            S = X;
-            update_Nflag(S);
-            update_Zflag(S);
-            return 2;
-        case TYA:
-            A = Y;
-            accum_flags;
-            return 2;
-
-        case 0x4c: // JMP abs
-            get_args(2, &arg1, &arg2);
-            PC = arg1 | (arg2 << 8);
-            return 3;
-        case 0x6c: // JMP (abs)
-            get_args(2, &arg1, &arg2);
-            intermediate = arg1 | (arg2 << 8);
-            PC = read_memory(intermediate) | (read_memory((intermediate + 1) & 0xffff) << 8);
-            return 5;
+    return cycles;
+}
 
-    }
+/* Instructions */
 
-    /* Variable Address Modes */
-    switch (opcode & ~mode_mask)
-    {
-    case ASL: // A zpg zpg,X abs abs,X
-        assert(mode == imm || mode == zpg || mode == ind_zpg_x || mode == abs || mode == ind_abs_x);
-        get_args(count_full_a[mode], &arg1, &arg2);
-        data = get_data_accum(mode, arg1, arg2);
-        P = (P & ~flag_C) | flag_C * ((data & 0x80) == 0x80); // set carry flag if bit 7 of data is set
-        data = (data << 1) & 0xfe;
-        update_Zflag(data);
-        set_data_accum(mode, arg1, arg2, data);
-        return address_delay(mode, arg1, arg2) + mode == imm ? 2 : mode == zpg ? 5 :
-        mode == ind_zpg_x ? 6 : mode == abs ? 6 : mode == ind_abs_x ? 7 : -1;
-
-    case BIT:
-        assert(mode == zpg || mode == abs);
-        get_args(mode == zpg ? 1 : 2, &arg1, &arg2);
-        data = A & read_address(mode, arg1, arg2);        
-        P = (P & ~0xc0) | (data & 0xC0);
-        update_Zflag(data);
-        return mode == zpg ? 3 : 4;
-    
-    case CPY:
-        COMP_reg = Y;
-        goto COMP;
-    case CPX:
-        COMP_reg = X;
-        COMP:
-        assert(mode == imm || mode == zpg || mode == abs);
-        get_args(count_full_imm[mode], &arg1, &arg2);
-        data = get_data_full_imm(mode, arg1, arg2);
-        intermediate = COMP_reg - data;
-        P = (P & ~flag_N) | (flag_N * ((intermediate & 0x80) == 0x80));
-        P = (P & ~flag_C) | (flag_C * (intermediate >= data));
-        P = (P & ~flag_Z) | (flag_Z * (intermediate == 0));
-        return mode == imm ? 2 : mode == zpg ? 3 : 4;
-
-    case DEC:
-        assert(mode == zpg || mode == ind_zpg_x || mode == abs || mode == ind_abs_x);
-        get_args(count_full_a[mode], &arg1, &arg2);
-        data = (read_address(mode, arg1, arg2) - 1) & 0xff;
-        update_Nflag(data);
-        update_Zflag(data);
-        set_data_accum(mode, arg1, arg2, data);
-        return address_delay(mode, arg1, arg2) + mode == zpg ? 5 : mode == ind_zpg_x ? 6 : mode == abs ? 6 : 7;
-
-    case INC:
-        assert(mode == zpg || mode == ind_zpg_x || mode == abs || mode == ind_abs_x);
-        get_args(count_full_a[mode], &arg1, &arg2);
-        data = (read_address(mode, arg1, arg2) + 1) & 0xff;
-        update_Nflag(data);
-        update_Zflag(data);
-        set_data_accum(mode, arg1, arg2, data);
-        return mode == zpg ? 5 : mode == ind_zpg_x ? 6 : mode == abs ? 6 : 7;
-
-    // JMP handeled in static addressing
-
-    case LDX:
-        assert(mode == ind_indir_x || mode == zpg || mode == abs || mode == ind_abs_x || mode == ind_zpg_x);
-        mode = mode == ind_indir_x ? imm : mode;
-        get_args(count_full_imm[mode], &arg1, & arg2);
-        mode = mode == ind_zpg_x ? ind_zpg_y : mode;
-        X = get_data_full_imm(mode, arg1, arg2);
-        update_Nflag(X);
-        update_Zflag(X);
-        return address_delay(mode, arg1, arg2) + mode == imm ? 2 : mode == zpg ? 3 : mode == ind_zpg_y ? 4 : mode == abs ? 4 : 4;
-    case LDY:
-        assert(mode == imm || mode == zpg || mode == abs || mode == ind_abs_x || mode == ind_zpg_x);
-        get_args(count_full_imm[mode], &arg1, & arg2);
-        Y = get_data_full_imm(mode, arg1, arg2);
-        update_Nflag(Y);
-        update_Zflag(Y);
-        return address_delay(mode, arg1, arg2) + mode == imm ? 2 : mode == zpg ? 3 : mode == ind_zpg_x ? 4 : mode == abs ? 4 : 4;
-    case LSR:
-        assert(mode == imm || mode == zpg || mode == abs || mode == ind_abs_x || mode == ind_zpg_x);
-        get_args(count_full_a[mode], &arg1, &arg2);
-        P &= ~(flag_N & flag_C); // clear negative and carry flags
-        data = get_data_accum(mode, arg1, arg2);
-        data = (data >> 1) & 0x7f;
-        set_data_accum(mode, arg1, arg2, data);
-        update_Zflag(data);
-        return address_delay(mode, arg1, arg2) + mode == imm ? 2 : mode == zpg ? 5 : mode == ind_zpg_x ? 6 : mode == abs ? 6 : 7;
-    case ROL:
-        assert(mode == imm || mode == zpg || mode == abs || mode == ind_abs_x || mode == ind_zpg_x);
-        get_args(count_full_a[mode], &arg1, &arg2);
-        data = get_data_accum(mode, arg1, arg2);
-        intermediate = ((data & 0x80) == 0x80) * flag_C;
-        data = (data << 1) & 0xfe;
-        data |= P & flag_C;
-        P = (P & ~flag_C) | intermediate; // set carry to bit 7 of original data
-        update_Zflag(data);
-        update_Nflag(data);
-        set_data_accum(mode, arg1, arg2, data);
-        return address_delay(mode, arg1, arg2) + mode == imm ? 2 : mode == zpg ? 5 : mode == ind_zpg_x ? 6 : mode == abs ? 6 : 7;
-    case ROR:
-        assert(mode == imm || mode == zpg || mode == abs || mode == ind_abs_x || mode == ind_zpg_x);
-        get_args(count_full_a[mode], &arg1, &arg2);
-        data = get_data_accum(mode, arg1, arg2);
-        intermediate = ((data & 0x01) == 0x01) * flag_C;
-        data = (data >> 1) & 0x7f;
-        data |= (P & flag_C != 0) * 0x80; // set bit 7 if carry bit is high
-        P = (P & ~flag_C) | intermediate; // set carry to bit 0 of original data
-        update_Zflag(data);
-        update_Nflag(data);
-        set_data_accum(mode, arg1, arg2, data);
-        return address_delay(mode, arg1, arg2) + mode == imm ? 2 : mode == zpg ? 5 : mode == ind_zpg_x ? 6 : mode == abs ? 6 : 7;
-    case STA:
-        assert(mode != imm); // Supports all modes except immediate / accum
-        get_args(count_full_imm[mode], &arg1, &arg2);
-        write_memory(get_effective_address(mode, arg1, arg2), A);
-        return address_delay(mode, arg1, arg2) + mode == zpg ? 3 : mode == ind_zpg_x ? 4 : mode == abs ? 4 : mode == ind_abs_x ? 5 : mode == ind_abs_y ? 5 : 6;
-
-    case STX:
-        assert(mode == zpg || mode == ind_zpg_x || mode == abs);
-        get_args(mode, &arg1, &arg2);
-        mode = mode == ind_zpg_x ? ind_zpg_y : mode; 
-        set_data_accum(mode, arg1, arg2, X);
-        return mode == zpg ? 3 : 4;
-
-    case STY:
-        assert(mode == zpg || mode == ind_zpg_x || mode == abs);
-        get_args(mode, &arg1, &arg2);
-        set_data_accum(mode, arg1, arg2, Y);
-        return mode == zpg ? 3 : 4;
-
-    default:
-    break;
-    }
+// Every instruction is written once against a generic addressing mode. The
+// handlers generated from opcodes.h pass the mode and cycle counts as constants.
+#define INSTRUCTION(name) ALWAYS_INLINE int exec_##name(machine* cpu, const address_mode mode, \
+    uint16_t operand, int cycles, const int page)
 
-    assert(0); // unkown instruction if the program makes it here
-    return 0;
+// Read-modify-write instructions work on either the accumulator or memory.
+#define RMW_LOAD(data, address) \
+    uint16_t address = 0; \
+    byte data; \
+    if(mode == reg_A) data = A; \
+    else data = read_memory(cpu, address = effective_address(cpu, mode, operand, &cycles, 0))
+#define RMW_STORE(data, address) \
+    if(mode == reg_A) A = data; \
+    else write_memory(cpu, address, data)
+
+ALWAYS_INLINE void add_with_carry(machine* cpu, byte data)
+{
+    int intermediate = A + data + (P & flag_C);
+    P = (P & ~flag_V) | ((~(A ^ data) & (A ^ intermediate) & 0x80) ? flag_V : 0); // set V if sign of result is wrong
+    P = (P & ~flag_C) | (intermediate > 0xff) * flag_C;
+    A = intermediate & 0xff;
+    accum_flags;
 }
 
-// Yes this does modify the program counter while it's running.
-// Yes that is stupid and dangerous.
-// It restores it before exiting, but it remains to be seen if it's untrustworthy...
-int dissasemble(uint16_t adr, char* buffer, int buffsize)
+// ADC and SBC in decimal mode, a single lookup like the binary path's few operations
+ALWAYS_INLINE void add_decimal(machine* cpu, const uint16_t* table, byte data)
 {
-    buffer[0] = 0; // set to detect if op was found;
-    char add_str[32];
-    uint16_t _PC = PC;
-    PC = adr;
-    byte opcode = cpu_fetch();;
-    address_mode mode = (opcode & mode_mask) >> 2;
-    byte arg1, arg2;
-    switch(opcode & ~mode_mask)
-    {
-        case ADC:
-            get_args(count_full_imm[mode], &arg1, &arg2);
-            address_mode_str(mode, arg1, arg2, add_str);
-            sprintf(buffer, "ADC %s", add_str);
-            break;
+    uint16_t entry = table[DECIMAL_INDEX(P & flag_C, A, data)];
+    byte flags = entry >> 8;
+    P = (P & ~(flag_V | flag_C)) | (flags & (flag_V | flag_C));
+    cpu->nz_result = (flags & flag_N) << 8 | (~flags & flag_Z);    // N and Z need not come from the same value
+    A = entry & 0xff;
+}
 
-        case AND:
-            get_args(count_full_imm[mode], &arg1, &arg2);
-            address_mode_str(mode, arg1, arg2, add_str);
-            sprintf(buffer, "AND %s", add_str);
-            break;
+// Called after clearing I, which lets an IRQ that is already asserted in.
+ALWAYS_INLINE void irq_unmasked(machine* cpu)
+{
+    if(cpu_interrupt_pending(cpu))
+        cpu->stop_cycle = 0;
+}
 
-        case CMP:
-            get_args(count_full_imm[mode], &arg1, &arg2);
-            address_mode_str(mode, arg1, arg2, add_str);
-            sprintf(buffer, "CMP %s", add_str);
-            break;
+ALWAYS_INLINE void compare(machine* cpu, byte reg, byte data)
+{
+    byte result = reg - data;
+    P = (reg >= data) ? P | flag_C : P & ~flag_C; // set carry flag if reg >= data
+    update_NZflags(cpu, result);
+}
 
-        case EOR:
-            get_args(count_full_imm[mode], &arg1, &arg2);
-            address_mode_str(mode, arg1, arg2, add_str);
-            sprintf(buffer, "EOR %s", add_str);
-            break; 
-        
-        case LDA:
-            get_args(count_full_imm[mode], &arg1, &arg2);
-            address_mode_str(mode, arg1, arg2, add_str);
-            sprintf(buffer, "LDA %s", add_str);
-            break;
+INSTRUCTION(ADC)
+{
+    byte data = load(cpu, mode, operand, &cycles, page);
+    if(P & flag_D)
+        add_decimal(cpu, decimal_adc, data);
+    else
+        add_with_carry(cpu, data);
+    return cycles;
+}
 
-        case ORA:
-            get_args(count_full_imm[mode], &arg1, &arg2);
-            address_mode_str(mode, arg1, arg2, add_str);
-            sprintf(buffer, "ORA %s", add_str);
-            break;
+INSTRUCTION(AND)
+{
+    A &= load(cpu, mode, operand, &cycles, page);
+    accum_flags;
+    return cycles;
+}
 
-        case SBC:
-            get_args(count_full_imm[mode], &arg1, &arg2);
-            address_mode_str(mode, arg1, arg2, add_str);
-            sprintf(buffer, "SBC %s", add_str);
-            break;
-    }
-   
-    /* Fixed Address Modes */
-    switch(opcode)
-    {
-        case BCC:
-            arg1 = cpu_fetch();
-            mode = rel;
-            address_mode_str(mode, arg1, arg2, add_str);
-            sprintf(buffer, "BCC %s", add_str);
-            break;
+INSTRUCTION(ASL)
+{
+    RMW_LOAD(data, address);
+    P = (P & ~flag_C) | flag_C * ((data & 0x80) == 0x80); // set carry flag if bit 7 of data is set
+    data <<= 1;
+    update_NZflags(cpu, data);
+    RMW_STORE(data, address);
+    return cycles;
+}
 
-        case BCS:
-            arg1 = cpu_fetch();
-            mode = rel;
-            address_mode_str(mode, arg1, arg2, add_str);
-            sprintf(buffer, "BCS %s", add_str);
-            break;
+INSTRUCTION(BCC) { return branch(cpu, !(P & flag_C), operand, cycles); }
+INSTRUCTION(BCS) { return branch(cpu, P & flag_C, operand, cycles); }
+INSTRUCTION(BEQ) { return branch(cpu, flag_Z_set(cpu), operand, cycles); }
+INSTRUCTION(BMI) { return branch(cpu, flag_N_set(cpu), operand, cycles); }
+INSTRUCTION(BNE) { return branch(cpu, !flag_Z_set(cpu), operand, cycles); }
+INSTRUCTION(BPL) { return branch(cpu, !flag_N_set(cpu), operand, cycles); }
+INSTRUCTION(BVC) { return branch(cpu, !(P & flag_V), operand, cycles); }
+INSTRUCTION(BVS) { return branch(cpu, P & flag_V, operand, cycles); }
 
-        case BEQ:
-            arg1 = cpu_fetch();
-            mode = rel;
-            address_mode_str(mode, arg1, arg2, add_str);
-            sprintf(buffer, "BEQ %s", add_str);
-            break;
+INSTRUCTION(BIT)
+{
+    byte data = load(cpu, mode, operand, &cycles, page);
+    P = (P & ~flag_V) | (data & flag_V);
+    cpu->nz_result = (A & data) | (data & flag_N) << 8;  // Z from A & data, N from data
+    return cycles;
+}
 
-        case BMI:
-            arg1 = cpu_fetch();
-            mode = rel;
-            address_mode_str(mode, arg1, arg2, add_str);
-            sprintf(buffer, "BMI %s", add_str);
-            break;
+INSTRUCTION(BRK)
+{
+    PC++; // BRK skips a padding byte
+    cpu_stack_push(cpu, (PC >> 8) & 0xff);
+    cpu_stack_push(cpu, PC & 0xff);
+    cpu_stack_push(cpu, cpu_get_flags(cpu) | flag_B | flag_U);
+    P |= flag_I;
+    PC = read_memory_word(cpu, IRQ_ADDRESS);
+    return cycles;
+}
 
-        case BNE:
-            arg1 = cpu_fetch();
-            mode = rel;
-            address_mode_str(mode, arg1, arg2, add_str);
-            sprintf(buffer, "BNE %s", add_str);
-            break;
+INSTRUCTION(CLC) { P &= ~flag_C; return cycles; }
+INSTRUCTION(CLD) { P &= ~flag_D; return cycles; }
+INSTRUCTION(CLI)
+{
+    P &= ~flag_I;
+    irq_unmasked(cpu);
+    return cycles;
+}
+INSTRUCTION(CLV) { P &= ~flag_V; return cycles; }
 
-        case BPL:
-            mode = rel;
-            address_mode_str(mode, arg1, arg2, add_str);
-            sprintf(buffer, "BPL %s", add_str);
-            break;
-            
-        case BRK:
-            sprintf(buffer, "BRK");
-            break;
+INSTRUCTION(CMP)
+{
+    compare(cpu, A, load(cpu, mode, operand, &cycles, page));
+    return cycles;
+}
 
-        case BVC:
-            arg1 = cpu_fetch();
-            mode = rel;
-            address_mode_str(mode, arg1, arg2, add_str);
-            sprintf(buffer, "BVC %s", add_str);
-            break;
+INSTRUCTION(CPX)
+{
+    compare(cpu, X, load(cpu, mode, operand, &cycles, page));
+    return cycles;
+}
 
-        case BVS:
-            arg1 = cpu_fetch();
-            mode = rel;
-            address_mode_str(mode, arg1, arg2, add_str);
-            sprintf(buffer, "BVS %s", add_str);
-            break;
+INSTRUCTION(CPY)
+{
+    compare(cpu, Y, load(cpu, mode, operand, &cycles, page));
+    return cycles;
+}
 
-        case CLC:
-            sprintf(buffer, "CLC");
-            break;
+INSTRUCTION(DEC)
+{
+    RMW_LOAD(data, address);
+    data--;
+    update_NZflags(cpu, data);
+    RMW_STORE(data, address);
+    return cycles;
+}
 
-        case CLD:
-            sprintf(buffer, "CLD");
-            break;
+INSTRUCTION(DEX)
+{
+    X--;
+    update_NZflags(cpu, X);
+    return cycles;
+}
 
-        case CLI:
-            sprintf(buffer, "CLI");
-            break;
+INSTRUCTION(DEY)
+{
+    Y--;
+    update_NZflags(cpu, Y);
+    return cycles;
+}
 
-        case CLV:
-            sprintf(buffer, "CLV");
-            break;
+INSTRUCTION(EOR)
+{
+    A ^= load(cpu, mode, operand, &cycles, page);
+    accum_flags;
+    return cycles;
+}
 
-        case DEX:
-            sprintf(buffer, "DEX");
-            break;
+INSTRUCTION(INC)
+{
+    RMW_LOAD(data, address);
+    data++;
+    update_NZflags(cpu, data);
+    RMW_STORE(data, address);
+    return cycles;
+}
 
-        case DEY:
-            sprintf(buffer, "DEY");
-            break;
+INSTRUCTION(INX)
+{
+    X++;
+    update_NZflags(cpu, X);
+    return cycles;
+}
 
-        case INX:
-            sprintf(buffer, "INX");
-            break;
+INSTRUCTION(INY)
+{
+    Y++;
+    update_NZflags(cpu, Y);
+    return cycles;
+}
 
-        case INY:
-            sprintf(buffer, "INY");
-            break;
+INSTRUCTION(JMP)
+{
+    if(mode == absolute && __builtin_expect(operand == (uint16_t)(PC - 3), 0) && jammed(cpu))
+        cpu_raise_event(cpu, EVENT_JAM);
+    PC = mode == absolute ? operand : effective_address(cpu, mode, operand, &cycles, 0);
+    return cycles;
+}
 
-        case JSR:
-            arg1 = cpu_fetch(); arg2 = cpu_fetch();
-            address_mode_str(abs, arg1, arg2, add_str);
-            sprintf(buffer, "JSR %s", add_str);
-            break;
+INSTRUCTION(JSR)
+{
+    PC--;
+    cpu_stack_push(cpu, (PC >> 8) & 0xff);
+    cpu_stack_push(cpu, PC & 0xff);
+    PC = operand;
+    return cycles;
+}
 
-        case NOP:
-            sprintf(buffer, "NOP");
-            break;
-        case PHA:
-            sprintf(buffer, "PHA");
-            break;
-            
-        case PHP:
-            sprintf(buffer, "PHP");
-            break;
+INSTRUCTION(LDA)
+{
+    A = load(cpu, mode, operand, &cycles, page);
+    accum_flags;
+    return cycles;
+}
 
-        case PLA:
-            sprintf(buffer, "PLA");
-            break;
+INSTRUCTION(LDX)
+{
+    X = load(cpu, mode, operand, &cycles, page);
+    update_NZflags(cpu, X);
+    return cycles;
+}
 
-        case PLP:
-            sprintf(buffer, "PLP");
-            break;
+INSTRUCTION(LDY)
+{
+    Y = load(cpu, mode, operand, &cycles, page);
+    update_NZflags(cpu, Y);
+    return cycles;
+}
 
-        case RTI:
-            sprintf(buffer, "RTI");
-            break;
+INSTRUCTION(LSR)
+{
+    RMW_LOAD(data, address);
+    P = (P & ~flag_C) | (data & flag_C); // bit 0 goes into the carry
+    data >>= 1;
+    update_NZflags(cpu, data);
+    RMW_STORE(data, address);
+    return cycles;
+}
 
-        case RTS:
-            sprintf(buffer, "RTS");
-            break;
+INSTRUCTION(NOP) { return cycles; }
 
-        case SEC:
-            sprintf(buffer, "SEC");
-            break;
+INSTRUCTION(ORA)
+{
+    A |= load(cpu, mode, operand, &cycles, page);
+    accum_flags;
+    return cycles;
+}
 
-        case SED:
-            sprintf(buffer, "SED");
-            break;
+INSTRUCTION(PHA) { cpu_stack_push(cpu, A); return cycles; }
+INSTRUCTION(PHP) { cpu_stack_push(cpu, cpu_get_flags(cpu) | flag_B | flag_U); return cycles; }
 
-        case SEI:
-            sprintf(buffer, "SEI");
-            break;
+INSTRUCTION(PLA)
+{
+    A = cpu_stack_pop(cpu);
+    accum_flags;
+    return cycles;
+}
 
-        case TAX:
-            sprintf(buffer, "TAX");
-            break;
+INSTRUCTION(PLP)
+{
+    cpu_set_flags(cpu, cpu_stack_pop(cpu) & ~(flag_B | flag_U));
+    irq_unmasked(cpu);
+    return cycles;
+}
 
-        case TAY:
-            sprintf(buffer, "TAY");
-            break;
+INSTRUCTION(ROL)
+{
+    RMW_LOAD(data, address);
+    byte carry = (data & 0x80) ? flag_C : 0;
+    data = (data << 1) | (P & flag_C);
+    P = (P & ~flag_C) | carry; // set carry to bit 7 of original data
+    update_NZflags(cpu, data);
+    RMW_STORE(data, address);
+    return cycles;
+}
 
-        case TSX:
-            sprintf(buffer, "TSX");
-            break;
+INSTRUCTION(ROR)
+{
+    RMW_LOAD(data, address);
+    byte carry = data & flag_C;
+    data = (data >> 1) | ((P & flag_C) ? 0x80 : 0); // set bit 7 if carry bit is high
+    P = (P & ~flag_C) | carry; // set carry to bit 0 of original data
+    update_NZflags(cpu, data);
+    RMW_STORE(data, address);
+    return cycles;
+}
 
-        case TXA:
-            sprintf(buffer, "TXA");
-            break;
+INSTRUCTION(RTI)
+{
+    cpu_set_flags(cpu, cpu_stack_pop(cpu) & ~(flag_B | flag_U));
+    PC = cpu_stack_pop(cpu);
+    PC |= cpu_stack_pop(cpu) << 8;
+    irq_unmasked(cpu);
+    return cycles;
+}
 
-        case TXS:
-            sprintf(buffer, "TXS");
-            break;
-        case TYA:
-            sprintf(buffer, "TYA");
-            break;
+INSTRUCTION(RTS)
+{
+    PC = cpu_stack_pop(cpu);
+    PC |= cpu_stack_pop(cpu) << 8;
+    PC++;
+    return cycles;
+}
 
-        case 0x4c: // JMP abs
-            get_args(2, &arg1, &arg2);
-            address_mode_str(abs, arg1, arg2, add_str);
-            sprintf(buffer, "JMP %s", add_str);
-            break;
-        case 0x6c: // JMP (abs)
-            get_args(2, &arg1, &arg2);
-            address_mode_str(ind_abs, arg1, arg2, add_str);
-            sprintf(buffer, "JMP %s", add_str);
-            break;
+INSTRUCTION(SBC)
+{
+    byte data = load(cpu, mode, operand, &cycles, page);
+    if(P & flag_D)
+        add_decimal(cpu, decimal_sbc, data);
+    else
+        add_with_carry(cpu, ~data);
+    return cycles;
+}
 
-    }
-    if(buffer[0] != 0) 
-    {
-        PC = _PC;
-        return 0;
-    }
-    /* Variable Address Modes */
-    switch (opcode & ~mode_mask)
-    {
-    case ASL: // A zpg zpg,X abs abs,X
-        assert(mode == imm || mode == zpg || mode == ind_zpg_x || mode == abs || mode == ind_abs_x);
-        get_args(count_full_a[mode], &arg1, &arg2);
-        mode = mode == imm ? reg_A : mode;
-        address_mode_str(mode, arg1, arg2, add_str);
-        sprintf(buffer, "ASL %s", add_str);
-        break;
-
-    case BIT:
-        assert(mode == zpg || mode == abs);
-        get_args(mode == zpg ? 1 : 2, &arg1, &arg2);
-        address_mode_str(mode, arg1, arg2, add_str);
-        sprintf(buffer, "BIT %s", add_str);
-        break;
-    
-    case CPY:
-        assert(mode == imm || mode == zpg || mode == abs);
-        get_args(count_full_imm[mode], &arg1, &arg2);
-        address_mode_str(mode, arg1, arg2, add_str);
-        sprintf(buffer, "CPY %s", add_str);
-        break;
-    case CPX:
-        assert(mode == imm || mode == zpg || mode == abs);
-        get_args(count_full_imm[mode], &arg1, &arg2);
-        address_mode_str(mode, arg1, arg2, add_str);
-        sprintf(buffer, "CPX %s", add_str);
-        break;
-
-    case DEC:
-        assert(mode == zpg || mode == ind_zpg_x || mode == abs || mode == ind_abs_x);
-        get_args(count_full_a[mode], &arg1, &arg2);
-        address_mode_str(mode, arg1, arg2, add_str);
-        sprintf(buffer, "DEC %s", add_str);
-        break;
-    case INC:
-        assert(mode == zpg || mode == ind_zpg_x || mode == abs || mode == ind_abs_x);
-        get_args(count_full_a[mode], &arg1, &arg2);
-        address_mode_str(mode, arg1, arg2, add_str);
-        sprintf(buffer, "INC %s", add_str);
-        break;
-
-    // JMP handeled in static addressing
-
-    case LDX:
-        assert(mode == ind_indir_x || mode == zpg || mode == abs || mode == ind_abs_x || mode == ind_zpg_x);
-        mode = mode == ind_indir_x ? imm : mode;
-        get_args(count_full_imm[mode], &arg1, & arg2);
-        address_mode_str(mode, arg1, arg2, add_str);
-        sprintf(buffer, "LDX %s", add_str);
-        break;
-    case LDY:
-        assert(mode == imm || mode == zpg || mode == abs || mode == ind_abs_x || mode == ind_zpg_x);
-        get_args(count_full_imm[mode], &arg1, & arg2);
-        address_mode_str(mode, arg1, arg2, add_str);
-        sprintf(buffer, "LDY %s", add_str);
-        break;
-    case LSR:
-        assert(mode == imm || mode == zpg || mode == abs || mode == ind_abs_x || mode == ind_zpg_x);
-        get_args(count_full_a[mode], &arg1, &arg2);
-        mode = mode == imm ? reg_A : mode;
-        address_mode_str(mode, arg1, arg2, add_str);
-        sprintf(buffer, "LSR %s", add_str);
-        break;
-    case ROL:
-        assert(mode == imm || mode == zpg || mode == abs || mode == ind_abs_x || mode == ind_zpg_x);
-        get_args(count_full_a[mode], &arg1, &arg2);
-        mode = mode == imm ? reg_A : mode;
-        address_mode_str(mode, arg1, arg2, add_str);
-        sprintf(buffer, "ROL %s", add_str);
-        break;
-    case ROR:
-        assert(mode == imm || mode == zpg || mode == abs || mode == ind_abs_x || mode == ind_zpg_x);
-        get_args(count_full_a[mode], &arg1, &arg2);
-        mode = mode == imm ? reg_A : mode;
-        address_mode_str(mode, arg1, arg2, add_str);
-        sprintf(buffer, "ROR %s", add_str);
-        break;
-    case STA:
-        assert(mode != imm); // Supports all modes except immediate / accum
-        get_args(count_full_imm[mode], &arg1, &arg2);
-        address_mode_str(mode, arg1, arg2, add_str);
-        sprintf(buffer, "STA %s", add_str);
-        break;
-
-    case STX:
-        assert(mode == zpg || mode == ind_zpg_x || mode == abs);
-        get_args(mode, &arg1, &arg2);
-        mode = mode == ind_zpg_x ? ind_zpg_y : mode;
-        address_mode_str(mode, arg1, arg2, add_str);
-        sprintf(buffer, "STX %s", add_str);
-        break;
-
-    case STY:
-        assert(mode == zpg || mode == ind_zpg_x || mode == abs);
-        get_args(mode, &arg1, &arg2);
-        address_mode_str(mode, arg1, arg2, add_str);
-        sprintf(buffer, "STY %s", add_str);
-        break;
-    break;
-    }
+INSTRUCTION(SEC) { P |= flag_C; return cycles; }
+INSTRUCTION(SED) { P |= flag_D; return cycles; }
+INSTRUCTION(SEI) { P |= flag_I; return cycles; }
 
-    //assert(0); // unkown instruction if the program makes it here
-    if(buffer[0] == 0)
-        sprintf(buffer, "<%02x>", opcode);
-    PC = _PC; // restore program counter;
-    return 0;
+INSTRUCTION(STA)
+{
+    write_memory(cpu, effective_address(cpu, mode, operand, &cycles, 0), A);
+    return cycles;
 }
 
-// Yes I could have used a lookup table instead, but oh well.
-int address_mode_str(address_mode mode, byte arg1, byte arg2, char* buffer)
+INSTRUCTION(STX)
 {
-    const char* format;
-    size_t arg = arg1;
-    const size_t word = arg1 | (arg2 << 8);
-    switch(mode)
-    {
-        case reg_A:
-            format = "A";
-            break;
-        case ind_indir_x:
-            arg = word;
-            format = "($%04x, X)";
-        case zpg:
-            format = "$%02x";
-            break;
-        case rel:
-            sprintf(buffer, "$%02x ; $%04x", arg1, 0xffff & (PC + (arg1 & 0x80 ? (0xff00 | arg1) : arg1)));
-            return 0;
-        case imm:
-            format = "#%02x";
-            break;
-        case abs:
-            arg = word;
-            format = "$%04x";
-            break;
-        case ind_abs:
-            arg = word;
-            format = "($%04x)";
-            break;
-        case indir_ind_y:
-            arg = word;
-            format = "($%04x), Y";
-            break;
-        case ind_zpg_x:
-            format = "$%02x, X";
-            break;
-        case ind_zpg_y:
-            format = "$%02x, Y";
-            break;
-        case ind_abs_x:
-            arg = word;
-            format = "$%04x, X";
-            break;
-        case ind_abs_y:
-            arg = word;
-            format = "$%04x, Y";
-            break;
-        case indir_abs:
-            arg = word;
-            format = "($%04x)";
-            break;
-        //case indir_zpg:
-        //    format = "($%02x)";
-        //    break;
-        default:
-            format = "<??>";
-    }
-    sprintf(buffer, format, arg);
-    return 0;
+    write_memory(cpu, effective_address(cpu, mode, operand, &cycles, 0), X);
+    return cycles;
 }
 
-int branch_instruction(uint8_t condition, uint8_t arg1)
+INSTRUCTION(STY)
 {
-    if(condition)
-    {
-        size_t rel = arg1 & 0x80 ? (arg1 | 0xff00) : arg1; // set high byte to ff if arg1 is neg
-        size_t new_PC = PC + rel;
-        int retval = (new_PC & 0xff00) == (PC & 0xff00) ? 3 : 4; // add 1 C for page change
-        PC = new_PC & 0xffff;
-        return retval;
-    }
-    return 2;
+    write_memory(cpu, effective_address(cpu, mode, operand, &cycles, 0), Y);
+    return cycles;
 }
 
-byte get_data_full_imm(address_mode mode, byte arg1, byte arg2)
+INSTRUCTION(TAX)
 {
-    return mode == imm ? arg1 : read_address(mode, arg1, arg2);
+    X = A;
+    update_NZflags(cpu, X);
+    return cycles;
 }
 
-byte get_data_accum(address_mode mode, byte arg1, byte arg2)
+INSTRUCTION(TAY)
 {
-    return mode == imm ? A : read_address(mode, arg1, arg2);
+    Y = A;
+    update_NZflags(cpu, Y);
+    return cycles;
 }
 
-void set_data_accum(address_mode mode, byte arg1, byte arg2, byte data)
+INSTRUCTION(TSX)
 {
-    if(mode == imm)
-        A = data;
-    else{
-        write_memory(get_effective_address(mode, arg1, arg2), data);
+    X = S;
+    update_NZflags(cpu, X);
+    return cycles;
+}
+
+INSTRUCTION(TXA)
+{
+    A = X;
+    accum_flags;
+    return cycles;
+}
+
+INSTRUCTION(TXS) { S = X; return cycles; }
+
+INSTRUCTION(TYA)
+{
+    A = Y;
+    accum_flags;
+    return cycles;
+}
+
+/* Opcode handlers and tables, generated from the spec table */
+
+// Handlers take the operand from the predecode cache, with the addressing mode and
+// cycle count fixed. They are inline so the threaded run loop can paste them in place.
+#define GENERATE_HANDLER(code, name, mode, cycles, page) \
+    static inline int decoded_##code(machine* cpu, uint16_t operand) \
+    { \
+        return exec_##name(cpu, mode, operand, cycles, page); \
     }
+OPCODE_TABLE(GENERATE_HANDLER)
+
+static int decoded_illegal(machine* cpu, uint16_t operand)
+{
+    if(operand == OPERAND_BREAK)
+        return 0; // decode stopped in front of a breakpoint
+    PC--; // not run, so PC stays on the opcode
+    cpu_raise_event(cpu, EVENT_ILLEGAL);
+    return 0;
 }
 
-void get_args(int count, byte* arg1, byte* arg2)
+#define DECODED_ENTRY(code, name, mode, cycles, page) [code] = decoded_##code,
+const decoded_handler decoded_table[256] =
+{
+    OPCODE_TABLE(DECODED_ENTRY)
+};
+
+static const decoded_handler op_table[256] =
+{
+    [0 ... 255] = decoded_illegal,
+    OPCODE_TABLE(DECODED_ENTRY)
+};
+
+#define INFO_ENTRY(code, name, mode, cycles, page) [code] = { #name, mode, OPERAND_COUNT(mode), cycles, page },
+const opcode_info opcode_table[256] =
 {
-    int increment = 0;
-    switch(count)
+    OPCODE_TABLE(INFO_ENTRY)
+};
+
+/* Predecode cache */
+
+// Reads a byte of an instruction. Code in memory is read directly, so instruction
+// fetches do not trigger watchpoints.
+static inline byte fetch_byte(machine* cpu, uint16_t address)
+{
+    const bus_page* page = &cpu->pages[address >> 8];
+    if(page->memory && (page->access & BUS_READ))
+        return page->memory[address & 0xff];
+    return read_memory(cpu, address);
+}
+
+// Fills in the cache entry for the instruction at PC. Instructions with a byte on
+// a device page are decoded into a scratch entry every time instead.
+static __attribute__((noinline)) decoded_insn* decode(machine* cpu, decoded_insn* insn)
+{
+    if(cpu->debugger && debugger_breaks_at(cpu->debugger, PC))
     {
-        case 2:
-        *arg1 = cpu_fetch();
-        *arg2 = cpu_fetch();
-        break;
-        case 1:
-        *arg1 = cpu_fetch();
+        // breakpoints are never cached, and stopping at one runs nothing
+        cpu_raise_event(cpu, EVENT_BREAK);
+        insn = &cpu->uncached;
+        insn->opcode = OPCODE_BREAK;
+        insn->length = 0;
+        insn->operand = OPERAND_BREAK;
+        return insn;
     }
+    byte opcode = fetch_byte(cpu, PC);
+    byte length = 1 + opcode_table[opcode].length;
+    bool cacheable = true;
+    for(int i = 0; i < length; i++)
+    {
+        const bus_page* page = &cpu->pages[(uint16_t)(PC + i) >> 8];
+        if(page->memory == NULL || !(page->access & BUS_READ))
+            cacheable = false;
+    }
+    if(!cacheable)
+        insn = &cpu->uncached;
+    insn->opcode = opcode;
+    insn->operand = 0;
+    if(length >= 2)
+        insn->operand = fetch_byte(cpu, (uint16_t)(PC + 1));
+    if(length == 3)
+        insn->operand |= fetch_byte(cpu, (uint16_t)(PC + 2)) << 8;
+    insn->length = length;
+    if(cacheable)
+    {
+        // stores to the instruction's bytes must reach cpu_invalidate_decoded
+        for(int i = 0; i < length; i++)
+        {
+            int n = (uint16_t)(PC + i) >> 8;
+            if((cpu->pages[n].access & BUS_WRITE) && !(cpu->pages[n].traps & BUS_TRAP_DECODE))
+                bus_set_traps(cpu, n, BUS_TRAP_DECODE, 0);
+        }
+    }
+    return insn;
 }
 
-byte cpu_fetch()
+// Replaces fetching the opcode and operand: the instruction at PC is looked up and
+// decoded on a miss. The caller moves PC past it.
+ALWAYS_INLINE const decoded_insn* fetch_decoded(machine* cpu)
 {
-    return read_memory(cpu_PC++);
+    decoded_insn* insn = &cpu->decoded[PC];
+    if(__builtin_expect(insn->length == 0, 0))
+        insn = decode(cpu, insn);
+    return insn;
 }
 
-void update_Zflag(byte res)
+void cpu_invalidate_decoded(machine* cpu, uint16_t address, size_t size)
 {
-    cpu_FLAGS = (P & ~flag_Z) | (res == 0) * flag_Z;
+    // instructions are up to 3 bytes long, so the two before the range can overlap it
+    for(size_t i = 0; i < size + 2; i++)
+        cpu->decoded[(uint16_t)(address - 2 + i)].length = 0;
 }
 
-void update_Nflag(byte res)
+// Returns number of clock cycles it would have taken to execute
+int cpu_do_next_op(machine* cpu)
 {
-    cpu_FLAGS = (P & ~flag_N) | ((res & 0x80) > 0) * flag_N;
+    const decoded_insn* insn = fetch_decoded(cpu);
+    PC += insn->length;
+    int cycles = op_table[insn->opcode](cpu, insn->operand);
+    cpu->cycles += cycles;
+    return cycles;
 }
 
-void update_Cflag(int res)
+void cpu_raise_event(machine* cpu, uint32_t event)
 {
-    cpu_FLAGS = (P & ~flag_C) | ((res & 0x100) > 0) * flag_C;
+    cpu->events |= event;
+    cpu->stop_cycle = 0;
 }
 
-/*
+void cpu_clear_event(machine* cpu, uint32_t event)
+{
+    cpu->events &= ~event;
+}
 
-byte to_bcd_format(byte in)
+// Runs the attached engine, or the interpreter, until the stop cycle or the budget,
+// and takes the instructions it ran off the budget.
+static uint32_t dispatch(machine* cpu, uint64_t* budget)
 {
-    int ones = in % 10;
-    int tens = in - ones;
-    return ones | (tens & 0xf << 4);
+#ifndef NO_PROFILER
+    if(cpu->profiler)
+        return profiler_run(cpu, budget);
+#endif
+#ifndef NO_TRACE
+    if(cpu->tracer)
+        return trace_run(cpu, budget);
+#endif
+    if(cpu->jit)
+        return jit_run(cpu, budget);
+
+    uint64_t remaining = *budget;
+    const decoded_insn* insn;
+#if defined(__GNUC__)
+    // Threaded dispatch: every handler ends with its own indirect jump to the next
+    // one, which gives the branch predictor one history per opcode.
+    #define LABEL_ENTRY(code, name, mode, base_cycles, page) [code] = &&L_##code,
+    static const void* const labels[256] =
+    {
+        [0 ... 255] = &&L_illegal,
+        OPCODE_TABLE(LABEL_ENTRY)
+    };
+    #define DISPATCH() \
+        if(--remaining == 0 || cpu->cycles >= cpu->stop_cycle) \
+            goto done; \
+        insn = fetch_decoded(cpu); \
+        goto *labels[insn->opcode]
+
+    insn = fetch_decoded(cpu);
+    goto *labels[insn->opcode];
+
+    // The length is a constant here, so the next lookup does not wait for the entry
+    #define LABEL_HANDLER(code, name, mode, base_cycles, page) \
+        L_##code: \
+        PC += 1 + OPERAND_COUNT(mode); \
+        cpu->cycles += decoded_##code(cpu, insn->operand); \
+        DISPATCH();
+    OPCODE_TABLE(LABEL_HANDLER)
+
+    L_illegal:
+    PC += insn->length;
+    cpu->cycles += decoded_illegal(cpu, insn->operand);
+    DISPATCH();
+
+    done:
+    #undef DISPATCH
+#else
+    do
+    {
+        insn = fetch_decoded(cpu);
+        PC += insn->length;
+        cpu->cycles += op_table[insn->opcode](cpu, insn->operand);
+    }
+    while(--remaining != 0 && cpu->cycles < cpu->stop_cycle);
+#endif
+    *budget = remaining;
+    return cpu->events;
 }
 
-unsigned int add_bcd(byte in1, byte in2)
+uint32_t cpu_run(machine* cpu, uint64_t max_cycles, uint64_t max_instructions)
 {
-    byte ones1 = in1 & 0xf;
-    byte ones2 = in2 & 0xf;
-    ones1 += ones2;
-    return in1 + in2 + (ones1 >= 10) * 6; // add 6 if the ones are larger than 1 digit
+    if(cpu->events)
+        return cpu->events;
+    if(max_cycles == 0 || max_instructions == 0)
+        return EVENT_NONE;
+    const uint64_t stop_cycle = max_cycles > UINT64_MAX - cpu->cycles ? UINT64_MAX : cpu->cycles + max_cycles;
+    uint64_t remaining = max_instructions;
+    while(true)
+    {
+        cpu_interrupt(cpu);
+        if(cpu->cycles >= stop_cycle)
+            return EVENT_NONE;
+        cpu->stop_cycle = stop_cycle;
+        uint64_t replay_stop = cpu->replay ? replay_stop_cycle(cpu->replay) : CPU_UNLIMITED;
+        if(replay_stop < stop_cycle)
+            cpu->stop_cycle = replay_stop;
+        uint32_t events = dispatch(cpu, &remaining);
+        // otherwise the engine stopped early for an interrupt or the replay
+        if(events || cpu->cycles >= stop_cycle || remaining == 0)
+            return events;
+    }
 }
 
-*/
\ No newline at end of file
+int dissasemble(machine* cpu, uint16_t adr, char* buffer, int buffsize)
+{
+    disasm_instruction(cpu, adr, buffer, buffsize > 0 ? buffsize : 0);
+    return 0;
+}
@@ -1,7 +1,8 @@
 /**
  * @file cpu.h
  * @author Mason Daub
- * @brief Exposed (public) elements of the 6502 cpu. Currently only 1 CPU instance is supported. 
+ * @brief Exposed (public) elements of the 6502 cpu. All of the CPU and memory state
+ * lives in a machine context, so any number of instances can run in one process.
  * @version 0.1
  * @date 2023-11-25
  * 
@@ -14,6 +15,8 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
+#include "bus.h"
 
 #define IRQ_ADDRESS 0xfffe
 #define RST_ADDRESS 0xfffc
@@ -21,74 +24,342 @@
 
 typedef uint8_t byte;       // redefine to byte to make writing code faster. May change.
 
-extern byte cpu_regA;       // CPU accumulator register
-extern byte cpu_regX;       // CPU X index register
-extern byte cpu_regY;       // CPU Y index register
-extern byte cpu_SP;         // CPU stack pointer register (S)
-extern byte cpu_FLAGS;      // CPU flags/status register (P)
-extern uint16_t cpu_PC;     // CPU program counter register (16 bit)
+#define CPU_UNLIMITED UINT64_MAX    // Budget value for cpu_run that never runs out
+#define INTERRUPT_CYCLES 7          // Clock cycles taken to enter an interrupt handler
+
+typedef struct _jit jit;    // Translated code cache, see jit.h
+typedef struct _snapshot snapshot;  // Saved machine state, see snapshot.h
+typedef struct _profiler profiler;  // Execution profile, see profiler.h
+typedef struct _tracer tracer;      // Execution trace recorder, see trace.h
+typedef struct _debugger debugger;  // Breakpoints and watchpoints, see debugger.h
+typedef struct _replay_log replay_log;  // Recorded device inputs, see replay.h
+
+/**
+ * @brief Events that stop cpu_run. They are bit flags and stay set until cleared.
+ * 
+ * The faults leave the machine where the program went wrong. An illegal opcode
+ * is not run, so PC stays on it. A jump or taken branch to itself is run, since
+ * nothing but an interrupt could get the program out of it. It is only a fault
+ * while no NMI is pending, no device that can assert one is attached (see
+ * cpu_attach_nmi) and either the I flag is set or no device that can assert IRQ
+ * is attached (see cpu_attach_irq). Otherwise the program is taken to wait for
+ * an interrupt, and runs on as the chip would. A push to a full or pop
+ * from an empty stack wraps S around as the chip does, and the instruction
+ * completes.
+ */
+typedef enum _cpu_event
+{
+    EVENT_NONE    = 0x00,
+    EVENT_HALT    = 0x01,   // A device requested the emulation to stop
+    EVENT_BREAK   = 0x02,   // The debugger reached a breakpoint or watchpoint
+    EVENT_ILLEGAL = 0x04,   // The opcode at PC is not a 6502 instruction
+    EVENT_JAM     = 0x08,   // The program jumped or branched to itself
+    EVENT_STACK   = 0x10,   // A push overflowed or a pop underflowed the stack
+    EVENT_FAULT   = EVENT_ILLEGAL | EVENT_JAM | EVENT_STACK,
+} cpu_event;
+
+/**
+ * @brief One entry of the predecode cache: the instruction starting at an address.
+ */
+typedef struct _decoded_insn
+{
+    byte opcode;            // Selects the handler, which fixes the addressing mode and base cycles
+    byte length;            // Instruction length in bytes, 0 if the entry is not decoded
+    uint16_t operand;       // Operand bytes, little endian
+} decoded_insn;
+
+/**
+ * @brief The complete state of one emulated machine: CPU registers, cycle counter and memory.
+ * 
+ * The registers are read and written by every instruction, so they are packed together
+ * at the start of the struct to share the first cache line with the cycle counter.
+ * The page tables of the address bus follow, then the slow path page descriptors,
+ * and the machine's own 64K of memory which the bus maps by default, and
+ * last the predecode cache, which holds each executed instruction decoded.
+ * A machine in a known state only needs a machine_init() to be reused.
+ */
+typedef struct _machine
+{
+    uint16_t PC;            // CPU program counter register (16 bit)
+    byte regA;              // CPU accumulator register
+    byte regX;              // CPU X index register
+    byte regY;              // CPU Y index register
+    byte SP;                // CPU stack pointer register (S)
+    byte FLAGS;             // CPU flags/status register (P), except N and Z, see cpu_get_flags
+    uint16_t nz_result;     // Last result N and Z are derived from
+    uint32_t events;        // Pending cpu_event flags
+    uint32_t irq_lines;     // Devices asserting IRQ, one bit each
+    uint32_t nmi_lines;     // Devices asserting NMI, one bit each
+    uint32_t irq_sources;   // Devices that can assert IRQ, one bit each
+    uint32_t nmi_sources;   // Devices that can assert NMI, one bit each
+    bool nmi_pending;       // NMI was asserted and its handler is not entered yet
+    uint64_t cycles;        // Total clock cycles executed since the last init
+    uint64_t stop_cycle;    // cpu_run stops once cycles reaches this. Zeroed when an event is raised.
+    jit* jit;               // Translated code for cpu_run, NULL to interpret
+    snapshot* snapshot;     // Snapshot sharing this machine's unwritten pages, or NULL
+    profiler* profiler;     // Profile recorded by cpu_run, NULL to run unprofiled
+    tracer* tracer;         // Trace recorded by cpu_run, NULL to run untraced
+    debugger* debugger;     // Breakpoints and watchpoints, or NULL
+    replay_log* replay;     // Device inputs being recorded or replayed, or NULL
+
+    _Alignas(64) byte* read_page[BUS_PAGE_COUNT];   // Direct read pointers, NULL takes the slow path
+    byte* write_page[BUS_PAGE_COUNT];               // Direct write pointers, NULL takes the slow path
+    bus_page pages[BUS_PAGE_COUNT];                 // Slow path description of every page
+
+    _Alignas(64) byte memory[0x10000];              // Backing memory for RAM and ROM
+
+    decoded_insn decoded[0x10000];                  // Predecode cache, indexed by address
+    decoded_insn uncached;                          // Scratch entry for code fetched from devices
+} machine;
+
+/**
+ * @brief Clears a machine's registers, memory and cycle counter.
+ * The whole address space is mapped to the machine's memory as RAM.
+ * A snapshot that shares the machine's pages takes its own copy of them first.
+ * 
+ * @param cpu The machine to initialize.
+ */
+void machine_init(machine* cpu);
+
+/**
+ * @brief Builds the status register. Instructions only record the result that
+ * sets N and Z, since most of them overwrite N and Z before anything reads them.
+ * Z is set if the low byte of nz_result is 0, and N from bit 7 of either byte,
+ * which lets BIT take N from the operand and Z from another value.
+ * 
+ * @param cpu The machine.
+ * @return The status register, as PHP pushes it but without B and U.
+ */
+static inline byte cpu_get_flags(const machine* cpu)
+{
+    uint16_t nz = cpu->nz_result;
+    return cpu->FLAGS | ((nz | nz >> 8) & 0x80) | ((nz & 0xff) == 0) << 1;
+}
+
+/**
+ * @brief Sets the whole status register.
+ * 
+ * @param cpu The machine.
+ * @param flags The new status register.
+ */
+static inline void cpu_set_flags(machine* cpu, byte flags)
+{
+    cpu->FLAGS = flags & ~0x82;                                 // all but N and Z
+    cpu->nz_result = (flags & 0x80) << 8 | (~flags & 0x02);     // a low byte of 0 only if Z is set
+}
+
+/**
+ * @brief Whether the CPU will enter an interrupt handler before its next instruction.
+ * 
+ * @param cpu The machine.
+ * @return True for a pending NMI, or an asserted IRQ while the I flag is clear.
+ */
+static inline bool cpu_interrupt_pending(const machine* cpu)
+{
+    return cpu->nmi_pending || (cpu->irq_lines && !(cpu->FLAGS & 0x04));
+}
 
 /**
  * @brief Reads the memory on the address bus.
  * 
+ * @param cpu The machine whose bus is read.
  * @param address Address to read.
  * @return returns the byte at the corresponding address.
  */
-byte read_memory(size_t address);
+static inline byte read_memory(machine* cpu, size_t address)
+{
+    address &= 0xffff;
+    const byte* page = cpu->read_page[address >> 8];
+    if(page)
+        return page[address & 0xff];
+    return bus_read_slow(cpu, address);
+}
+
+/**
+ * @brief Reads memory without calling device handlers or triggering watchpoints.
+ * 
+ * @param cpu The machine whose memory is read.
+ * @param address Address to read.
+ * @return The byte at the address, or 0 on device and unmapped pages.
+ */
+static inline byte peek_memory(const machine* cpu, uint16_t address)
+{
+    const byte* direct = cpu->read_page[address >> 8];
+    if(direct)
+        return direct[address & 0xff];
+    const bus_page* page = &cpu->pages[address >> 8];
+    return page->memory && (page->access & BUS_READ) ? page->memory[address & 0xff] : 0;
+}
 
 /**
  * @brief Reads a word from the address bus.
  * 
+ * @param cpu The machine whose bus is read.
  * @param address The address to read.
  * @return The word located at address. Little Endian.
  */
-uint16_t read_memory_word(size_t address);
+static inline uint16_t read_memory_word(machine* cpu, size_t address)
+{
+    return read_memory(cpu, address) | (read_memory(cpu, address + 1) << 8);
+}
 
 /**
  * @brief Writes data to the address bus.
  * 
+ * @param cpu The machine whose bus is written.
  * @param address 16 bit address to write to.
  * @param data Data to write.
  */
-void write_memory(size_t address, byte data);
+static inline void write_memory(machine* cpu, size_t address, byte data)
+{
+    address &= 0xffff;
+    byte* page = cpu->write_page[address >> 8];
+    if(page)
+        page[address & 0xff] = data;
+    else
+        bus_write_slow(cpu, address, data);
+}
+
+/**
+ * @brief Drops predecoded instructions that overlap an address range.
+ * Writes through the bus do this automatically. It is only needed after
+ * changing memory that is mapped on the bus directly.
+ * 
+ * @param cpu The machine.
+ * @param address First address that changed.
+ * @param size Number of bytes that changed.
+ */
+void cpu_invalidate_decoded(machine* cpu, uint16_t address, size_t size);
 
 /**
  * @brief Sets up the CPU in a reset state.
  * 
+ * @param cpu The machine to reset.
  */
-void cpu_reset();
+void cpu_reset(machine* cpu);
 
 /**
  * @brief Preform the operation at the current PC address.
  * 
+ * @param cpu The machine to step.
  * @return The number of clock cycles required to preform the operation.
  */
-int cpu_do_next_op();
+int cpu_do_next_op(machine* cpu);
+
+/**
+ * @brief Runs instructions until a budget runs out or an event is raised.
+ * 
+ * Events are checked with the cycle budget in a single comparison, since raising
+ * an event also clears the machine's stop cycle. The instruction that raised the
+ * event always completes. If a jit is attached to the machine it runs the
+ * translated code, with the same results as the interpreter. If a profiler or a
+ * tracer is attached it runs instead, stepping through cpu_do_next_op.
+ * 
+ * Interrupts are checked the same way: a device that asserts IRQ or NMI clears
+ * the stop cycle, and the handler is entered once the engine has stopped. A
+ * replay log (see replay.h) stops the engine the same way wherever the replay
+ * has to act. Either way the engine is run again until a budget is used up, and
+ * entering a handler does not count as an instruction.
+ * 
+ * @param cpu The machine to run.
+ * @param max_cycles Cycle budget, or CPU_UNLIMITED.
+ * @param max_instructions Instruction budget, or CPU_UNLIMITED.
+ * @return The pending events, or EVENT_NONE if the budget ran out.
+ */
+uint32_t cpu_run(machine* cpu, uint64_t max_cycles, uint64_t max_instructions);
+
+/**
+ * @brief Raises an event, which stops cpu_run after the current instruction.
+ * 
+ * @param cpu The machine to signal.
+ * @param event The cpu_event flag(s) to raise.
+ */
+void cpu_raise_event(machine* cpu, uint32_t event);
+
+/**
+ * @brief Clears pending events so cpu_run can continue.
+ * 
+ * @param cpu The machine to clear.
+ * @param event The cpu_event flag(s) to clear.
+ */
+void cpu_clear_event(machine* cpu, uint32_t event);
+
+/**
+ * @brief Drives a device's IRQ output. IRQ is level triggered: while any device
+ * asserts it and the I flag is clear, the CPU enters the IRQ handler before its
+ * next instruction, so a device must deassert it once the handler has served it.
+ * Devices may call this from their bus handlers, in the middle of cpu_run.
+ * 
+ * @param cpu The machine.
+ * @param source The device's bit in irq_lines.
+ * @param asserted Whether the device asserts IRQ.
+ */
+void cpu_set_irq(machine* cpu, uint32_t source, bool asserted);
+
+/**
+ * @brief Drives a device's NMI output. NMI is edge triggered: the CPU enters the
+ * NMI handler once each time the line goes from no device asserting it to any.
+ * 
+ * @param cpu The machine.
+ * @param source The device's bit in nmi_lines.
+ * @param asserted Whether the device asserts NMI.
+ */
+void cpu_set_nmi(machine* cpu, uint32_t source, bool asserted);
+
+/**
+ * @brief Tells the machine that a device can assert IRQ, so a program that
+ * loops with the I flag clear waits for it instead of jamming. A device that
+ * drives IRQ attaches itself when it is mapped, after machine_init.
+ * 
+ * @param cpu The machine.
+ * @param source The device's bit in irq_lines.
+ */
+void cpu_attach_irq(machine* cpu, uint32_t source);
+
+/**
+ * @brief Tells the machine that a device can assert NMI, so a program that
+ * loops with the I flag set waits for it instead of jamming. A device that
+ * drives NMI attaches itself when it is mapped, after machine_init.
+ * 
+ * @param cpu The machine.
+ * @param source The device's bit in nmi_lines.
+ */
+void cpu_attach_nmi(machine* cpu, uint32_t source);
+
+/**
+ * @brief Enters the handler of a pending interrupt, if there is one. NMI goes
+ * first. cpu_run does this by itself between instructions.
+ * 
+ * @param cpu The machine.
+ * @return The cycles taken, INTERRUPT_CYCLES or 0 if nothing was pending.
+ */
+int cpu_interrupt(machine* cpu);
 
 /**
  * @brief Wait a specified number of CPU clock cycles.
  * 
+ * @param cpu The machine to delay.
  * @param cycles The number of cycles to wait.
  */
-void cpu_delay(int cycles);
+void cpu_delay(machine* cpu, int cycles);
 
 /**
- * @brief Dissasembles the instruction at a specified address.
+ * @brief Dissasembles the instruction at a specified address, see disasm_instruction.
+ * Device handlers are not called, so the machine is left untouched.
  * 
+ * @param cpu The machine whose memory holds the instruction.
  * @param adr The address of the instruction to dissasemble.
  * @param buffer Buffer to write output.
  * @param buffsize size of the buffer.
  * @return 0
  */
-int dissasemble(uint16_t adr, char* buffer, int buffsize);
+int dissasemble(machine* cpu, uint16_t adr, char* buffer, int buffsize);
 
 /*
 struct _cpu_interface
 {
     //unsigned int address : 16;
     unsigned int data : 8;          // INPUT/OUTPUT
-    unsigned int IRQB : 1;          // INPUT regular interrupt request
-    unsigned int NMIB : 1;          // INPUT non-maskable interrupt
     unsigned int ready : 1;         // INPUT Disables the CPU (unless its in a write-cycle)
     unsigned int read_write : 1;    // OUTPUT read active-high, write active-low
     unsigned int overflow : 1;      // INPUT Sets the overflow flag
@@ -0,0 +1,538 @@
+/**
+ * @file debugger.c
+ * @author Mason Daub
+ * @brief Breakpoints, conditional breakpoints and memory watchpoints.
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "debugger.h"
+#include "bus.h"
+#include "cpu_utils.h"
+
+#define WATCH_TRAPS (BUS_TRAP_WATCH_READ | BUS_TRAP_WATCH_WRITE)
+
+/**
+ * @brief Instructions of a compiled condition, run on a small stack.
+ */
+typedef enum _predicate_code
+{
+    PRED_CONST,         // pushes value
+    PRED_A, PRED_X, PRED_Y, PRED_S, PRED_P, PRED_PC, PRED_HITS,
+    PRED_LOAD,          // replaces an address with the byte there
+    PRED_NOT, PRED_NEG,
+    PRED_ADD, PRED_SUB, PRED_AND, PRED_OR, PRED_XOR,
+    PRED_EQ, PRED_NE, PRED_LT, PRED_LE, PRED_GT, PRED_GE,
+    PRED_LAND, PRED_LOR,
+} predicate_code;
+
+typedef struct _predicate_op
+{
+    byte code;          // predicate_code
+    uint16_t value;     // Constant of PRED_CONST
+} predicate_op;
+
+/**
+ * @brief A breakpoint or a watchpoint.
+ */
+typedef struct _debug_stop
+{
+    bool used;
+    byte access;        // 0 for a breakpoint, BUS_READ and/or BUS_WRITE for a watchpoint
+    uint16_t start;     // The breakpoint's address, or the first address watched
+    uint16_t end;       // Last address watched
+    uint64_t hits;
+    char* condition;    // Source of the condition, NULL if there is none
+    predicate_op code[PREDICATE_MAX_OPS];
+    int length;
+} debug_stop;
+
+struct _debugger
+{
+    machine* cpu;                           // Machine the debugger is attached to, or NULL
+    byte breakpoints[0x10000 / 8];          // Bit set for every address with a breakpoint
+    int32_t skip;                           // Breakpoint address being stepped over, -1 if none
+    debug_stop stops[DEBUGGER_MAX_STOPS];
+
+    int stopped;                            // Stop that raised the last EVENT_BREAK, -1 if none
+    uint16_t watch_address;                 // The access that hit a watchpoint
+    byte watch_data;
+    bool watch_write;
+};
+
+debugger* debugger_create(void)
+{
+    debugger* d = calloc(1, sizeof(debugger));
+    if(d == NULL)
+        return NULL;
+    d->skip = -1;
+    d->stopped = -1;
+    return d;
+}
+
+void debugger_destroy(debugger* d)
+{
+    if(d == NULL)
+        return;
+    for(int i = 0; i < DEBUGGER_MAX_STOPS; i++)
+        free(d->stops[i].condition);
+    free(d);
+}
+
+// Sets the watch traps of every page from the watchpoints, or clears them all.
+static void update_traps(debugger* d, machine* cpu, bool armed)
+{
+    byte traps[BUS_PAGE_COUNT] = { 0 };
+    for(int i = 0; armed && i < DEBUGGER_MAX_STOPS; i++)
+    {
+        const debug_stop* s = &d->stops[i];
+        if(!s->used || s->access == 0)
+            continue;
+        for(int n = s->start >> 8; n <= s->end >> 8; n++)
+            traps[n] |= (s->access & BUS_READ ? BUS_TRAP_WATCH_READ : 0) | (s->access & BUS_WRITE ? BUS_TRAP_WATCH_WRITE : 0);
+    }
+    for(int n = 0; n < BUS_PAGE_COUNT; n++)
+        if((cpu->pages[n].traps & WATCH_TRAPS) != traps[n])
+            bus_set_traps(cpu, n, traps[n], WATCH_TRAPS & ~traps[n]);
+}
+
+void debugger_attach(machine* cpu, debugger* d)
+{
+    if(cpu->debugger)
+    {
+        update_traps(cpu->debugger, cpu, false);
+        cpu->debugger->cpu = NULL;
+    }
+    cpu->debugger = d;
+    if(d)
+    {
+        if(d->cpu)
+            debugger_attach(d->cpu, NULL);
+        d->cpu = cpu;
+        update_traps(d, cpu, true);
+        // breakpoints must miss the predecode cache
+        for(int i = 0; i < DEBUGGER_MAX_STOPS; i++)
+            if(d->stops[i].used && d->stops[i].access == 0)
+                cpu_invalidate_decoded(cpu, d->stops[i].start, 1);
+    }
+}
+
+/*   Conditions   */
+
+typedef struct _parser
+{
+    const char* next;
+    debug_stop* stop;
+    int depth;          // Values on the stack at this point of the program
+    bool error;
+} parser;
+
+static void emit(parser* p, predicate_code code, uint16_t value, int depth_change)
+{
+    if(p->stop->length == PREDICATE_MAX_OPS)
+    {
+        p->error = true;
+        return;
+    }
+    p->stop->code[p->stop->length++] = (predicate_op){ code, value };
+    p->depth += depth_change;
+    if(p->depth > PREDICATE_STACK)
+        p->error = true;
+}
+
+// Consumes a token if it is next.
+static bool accept(parser* p, const char* token)
+{
+    while(isspace((unsigned char)*p->next))
+        p->next++;
+    size_t length = strlen(token);
+    if(strncmp(p->next, token, length) != 0)
+        return false;
+    // '&' and '|' must not take the first half of '&&' and '||', nor '<', '>' and '!' of '<=', '>=' and '!='
+    if(length == 1 && strchr("&|<>!", token[0]) && (p->next[1] == token[0] || p->next[1] == '='))
+        return false;
+    p->next += length;
+    return true;
+}
+
+static void parse_expression(parser* p);
+
+static void parse_primary(parser* p)
+{
+    static const struct { const char* name; predicate_code code; } names[] =
+    {
+        { "a", PRED_A }, { "x", PRED_X }, { "y", PRED_Y }, { "s", PRED_S }, { "sp", PRED_S },
+        { "p", PRED_P }, { "pc", PRED_PC }, { "hits", PRED_HITS },
+    };
+    if(accept(p, "("))
+    {
+        parse_expression(p);
+        if(!accept(p, ")"))
+            p->error = true;
+        return;
+    }
+    if(accept(p, "["))
+    {
+        parse_expression(p);
+        emit(p, PRED_LOAD, 0, 0);
+        if(!accept(p, "]"))
+            p->error = true;
+        return;
+    }
+
+    bool number = accept(p, "$");
+    char word[8];
+    int length = 0;
+    while(isalnum((unsigned char)*p->next) && length < (int)sizeof(word) - 1)
+        word[length++] = tolower((unsigned char)*p->next++);
+    word[length] = '\0';
+    if(length == 0 || isalnum((unsigned char)*p->next))
+    {
+        p->error = true;
+        return;
+    }
+    for(size_t i = 0; !number && i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if(strcmp(word, names[i].name) == 0)
+        {
+            emit(p, names[i].code, 0, 1);
+            return;
+        }
+    }
+    char* end;
+    unsigned long value = strtoul(word, &end, 16);
+    if(*end != '\0' || value > 0xffff)
+        p->error = true;
+    emit(p, PRED_CONST, value, 1);
+}
+
+static void parse_unary(parser* p)
+{
+    if(accept(p, "!"))
+    {
+        parse_unary(p);
+        emit(p, PRED_NOT, 0, 0);
+    }
+    else if(accept(p, "-"))
+    {
+        parse_unary(p);
+        emit(p, PRED_NEG, 0, 0);
+    }
+    else
+        parse_primary(p);
+}
+
+// One level of left associative binary operators.
+typedef struct _binary_level
+{
+    const char* token[4];
+    predicate_code code[4];
+} binary_level;
+
+static const binary_level levels[] =
+{
+    { { "||" }, { PRED_LOR } },
+    { { "&&" }, { PRED_LAND } },
+    { { "==", "!=" }, { PRED_EQ, PRED_NE } },
+    { { "<=", ">=", "<", ">" }, { PRED_LE, PRED_GE, PRED_LT, PRED_GT } },
+    { { "&", "|", "^" }, { PRED_AND, PRED_OR, PRED_XOR } },
+    { { "+", "-" }, { PRED_ADD, PRED_SUB } },
+};
+#define LEVEL_COUNT (int)(sizeof(levels) / sizeof(levels[0]))
+
+static void parse_level(parser* p, int level)
+{
+    if(level == LEVEL_COUNT)
+    {
+        parse_unary(p);
+        return;
+    }
+    parse_level(p, level + 1);
+    bool found = true;
+    while(found && !p->error)
+    {
+        found = false;
+        for(int i = 0; i < 4 && levels[level].token[i]; i++)
+        {
+            if(accept(p, levels[level].token[i]))
+            {
+                parse_level(p, level + 1);
+                emit(p, levels[level].code[i], 0, -1);
+                found = true;
+                break;
+            }
+        }
+    }
+}
+
+static void parse_expression(parser* p)
+{
+    parse_level(p, 0);
+}
+
+// Compiles a condition into the stop. Returns false if it is not valid.
+static bool compile(debug_stop* s, const char* condition)
+{
+    parser p = { condition, s, 0, false };
+    s->length = 0;
+    parse_expression(&p);
+    while(isspace((unsigned char)*p.next))
+        p.next++;
+    return !p.error && *p.next == '\0';
+}
+
+static int32_t evaluate(const debug_stop* s, machine* cpu)
+{
+    int32_t stack[PREDICATE_STACK];
+    int top = -1;
+    for(int i = 0; i < s->length; i++)
+    {
+        const predicate_op* op = &s->code[i];
+        int32_t b = top >= 0 ? stack[top] : 0;
+        int32_t* a = top >= 1 ? &stack[top - 1] : NULL;
+        switch(op->code)
+        {
+            case PRED_CONST: stack[++top] = op->value; break;
+            case PRED_A: stack[++top] = A; break;
+            case PRED_X: stack[++top] = X; break;
+            case PRED_Y: stack[++top] = Y; break;
+            case PRED_S: stack[++top] = S; break;
+            case PRED_P: stack[++top] = cpu_get_flags(cpu); break;
+            case PRED_PC: stack[++top] = PC; break;
+            case PRED_HITS: stack[++top] = s->hits > INT32_MAX ? INT32_MAX : (int32_t)s->hits; break;
+            case PRED_LOAD: stack[top] = peek_memory(cpu, b); break;
+            case PRED_NOT: stack[top] = !b; break;
+            case PRED_NEG: stack[top] = -b; break;
+            case PRED_ADD: *a += b; top--; break;
+            case PRED_SUB: *a -= b; top--; break;
+            case PRED_AND: *a &= b; top--; break;
+            case PRED_OR: *a |= b; top--; break;
+            case PRED_XOR: *a ^= b; top--; break;
+            case PRED_EQ: *a = *a == b; top--; break;
+            case PRED_NE: *a = *a != b; top--; break;
+            case PRED_LT: *a = *a < b; top--; break;
+            case PRED_LE: *a = *a <= b; top--; break;
+            case PRED_GT: *a = *a > b; top--; break;
+            case PRED_GE: *a = *a >= b; top--; break;
+            case PRED_LAND: *a = *a && b; top--; break;
+            case PRED_LOR: *a = *a || b; top--; break;
+        }
+    }
+    return top < 0 ? 1 : stack[0]; // no condition always stops
+}
+
+/*   Stops   */
+
+static int free_stop(debugger* d)
+{
+    for(int i = 0; i < DEBUGGER_MAX_STOPS; i++)
+        if(!d->stops[i].used)
+            return i;
+    return -1;
+}
+
+int debugger_break(debugger* d, uint16_t address, const char* condition)
+{
+    // an existing breakpoint at the address is replaced
+    int i;
+    for(i = 0; i < DEBUGGER_MAX_STOPS; i++)
+        if(d->stops[i].used && d->stops[i].access == 0 && d->stops[i].start == address)
+            break;
+    if(i == DEBUGGER_MAX_STOPS && (i = free_stop(d)) < 0)
+        return -1;
+
+    debug_stop s = { true, 0, address, address, 0, NULL, { { 0 } }, 0 };
+    if(condition && !compile(&s, condition))
+        return -1;
+    if(condition && (s.condition = strdup(condition)) == NULL)
+        return -1;
+    free(d->stops[i].condition);
+    d->stops[i] = s;
+    d->breakpoints[address >> 3] |= 1 << (address & 7);
+    if(d->cpu)
+        cpu_invalidate_decoded(d->cpu, address, 1);
+    return i + 1;
+}
+
+int debugger_watch(debugger* d, uint16_t start, uint16_t end, byte access)
+{
+    int i = free_stop(d);
+    if(i < 0 || start > end || !(access & (BUS_READ | BUS_WRITE)))
+        return -1;
+    d->stops[i] = (debug_stop){ true, access & (BUS_READ | BUS_WRITE), start, end, 0, NULL, { { 0 } }, 0 };
+    if(d->cpu)
+        update_traps(d, d->cpu, true);
+    return i + 1;
+}
+
+int debugger_delete(debugger* d, int number)
+{
+    if(number < 1 || number > DEBUGGER_MAX_STOPS || !d->stops[number - 1].used)
+        return -1;
+    debug_stop* s = &d->stops[number - 1];
+    s->used = false;
+    free(s->condition);
+    s->condition = NULL;
+    if(s->access == 0)
+        d->breakpoints[s->start >> 3] &= ~(1 << (s->start & 7));
+    else if(d->cpu)
+        update_traps(d, d->cpu, true);
+    if(d->stopped == number - 1)
+        d->stopped = -1;
+    return 0;
+}
+
+bool debugger_breaks_at(const debugger* d, uint16_t address)
+{
+    return (d->breakpoints[address >> 3] & (1 << (address & 7))) && address != d->skip;
+}
+
+void debugger_access(machine* cpu, uint16_t address, byte data, bool write)
+{
+    debugger* d = cpu->debugger;
+    if(d == NULL || d->stopped >= 0)
+        return; // the first access of an instruction is reported
+    byte access = write ? BUS_WRITE : BUS_READ;
+    for(int i = 0; i < DEBUGGER_MAX_STOPS; i++)
+    {
+        debug_stop* s = &d->stops[i];
+        if(s->used && (s->access & access) && address >= s->start && address <= s->end)
+        {
+            s->hits++;
+            d->stopped = i;
+            d->watch_address = address;
+            d->watch_data = data;
+            d->watch_write = write;
+            cpu_raise_event(cpu, EVENT_BREAK);
+            return;
+        }
+    }
+}
+
+/*   Running   */
+
+uint32_t debugger_step(machine* cpu)
+{
+    debugger* d = cpu->debugger;
+    uint16_t address = PC;
+    cpu_clear_event(cpu, EVENT_BREAK | EVENT_FAULT);
+    d->stopped = -1;
+    // entering an interrupt handler is a step of its own
+    if(cpu_interrupt(cpu))
+        return cpu->events;
+    d->skip = address;
+    cpu_do_next_op(cpu);
+    d->skip = -1;
+    // the step cached the instruction the breakpoint must keep out of the cache
+    if(d->breakpoints[address >> 3] & (1 << (address & 7)))
+        cpu_invalidate_decoded(cpu, address, 1);
+    return cpu->events;
+}
+
+// Called when cpu_run stopped in front of a breakpoint. Returns whether its condition holds.
+static bool breakpoint_holds(debugger* d, machine* cpu)
+{
+    for(int i = 0; i < DEBUGGER_MAX_STOPS; i++)
+    {
+        debug_stop* s = &d->stops[i];
+        if(s->used && s->access == 0 && s->start == PC)
+        {
+            s->hits++;
+            if(!evaluate(s, cpu))
+                return false;
+            d->stopped = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t debugger_run(machine* cpu, uint64_t max_cycles)
+{
+    debugger* d = cpu->debugger;
+    uint64_t end = max_cycles > UINT64_MAX - cpu->cycles ? UINT64_MAX : cpu->cycles + max_cycles;
+    while(cpu->cycles < end)
+    {
+        uint32_t events = cpu_run(cpu, end - cpu->cycles, CPU_UNLIMITED);
+        if(events != EVENT_BREAK || d->stopped >= 0 || breakpoint_holds(d, cpu))
+            return events;
+        // the condition does not hold, so carry on past the breakpoint
+        events = debugger_step(cpu);
+        if(events != EVENT_NONE)
+            return events;
+    }
+    return EVENT_NONE;
+}
+
+uint32_t debugger_continue(machine* cpu)
+{
+    uint32_t events = debugger_step(cpu);
+    return events != EVENT_NONE ? events : debugger_run(cpu, CPU_UNLIMITED);
+}
+
+int debugger_find(const debugger* d, uint16_t start, uint16_t end, byte access)
+{
+    for(int i = 0; i < DEBUGGER_MAX_STOPS; i++)
+    {
+        const debug_stop* s = &d->stops[i];
+        if(s->used && s->access == access && s->start == start && (access == 0 || s->end == end))
+            return i + 1;
+    }
+    return -1;
+}
+
+byte debugger_stopped_watch(const debugger* d, uint16_t* address)
+{
+    if(d->stopped < 0 || d->stops[d->stopped].access == 0)
+        return 0;
+    *address = d->watch_address;
+    return d->stops[d->stopped].access;
+}
+
+/*   Printing   */
+
+static void print_stop(const debug_stop* s, int number, FILE* out)
+{
+    if(s->access == 0)
+        fprintf(out, "%2d  break  $%04x", number, s->start);
+    else
+        fprintf(out, "%2d  watch  $%04x-$%04x %s%s", number, s->start, s->end,
+            s->access & BUS_READ ? "r" : "", s->access & BUS_WRITE ? "w" : "");
+    fprintf(out, "  hits %llu", (unsigned long long)s->hits);
+    if(s->condition)
+        fprintf(out, "  if %s", s->condition);
+    fputc('\n', out);
+}
+
+void debugger_print_stop(const debugger* d, FILE* out)
+{
+    if(d->stopped < 0)
+        return;
+    const debug_stop* s = &d->stops[d->stopped];
+    if(s->access == 0)
+        fprintf(out, "Breakpoint %d at $%04x\n", d->stopped + 1, s->start);
+    else
+        fprintf(out, "Watchpoint %d: %s $%04x %s $%02x\n", d->stopped + 1, d->watch_write ? "write" : "read",
+            d->watch_address, d->watch_write ? "<-" : "->", d->watch_data);
+}
+
+void debugger_print(const debugger* d, FILE* out)
+{
+    bool any = false;
+    for(int i = 0; i < DEBUGGER_MAX_STOPS; i++)
+    {
+        if(d->stops[i].used)
+        {
+            print_stop(&d->stops[i], i + 1, out);
+            any = true;
+        }
+    }
+    if(!any)
+        fputs("No breakpoints or watchpoints\n", out);
+}
@@ -0,0 +1,186 @@
+/**
+ * @file debugger.h
+ * @author Mason Daub
+ * @brief Breakpoints, conditional breakpoints and memory watchpoints.
+ * 
+ * Neither costs anything where it is not set. A breakpoint keeps its address
+ * out of the predecode cache, so only the decode of that one instruction looks
+ * for it, and stopping there runs nothing. Watchpoints set traps on the pages
+ * they cover, so accesses to those pages take the bus slow path and every other
+ * page keeps its direct pointers. Instruction fetches do not trigger watchpoints.
+ * cpu_run stops with EVENT_BREAK in front of a breakpoint, or after the
+ * instruction that touched a watched address.
+ * 
+ * A breakpoint can have a condition, which is compiled once when it is set into
+ * a short postfix program, and only evaluated when the breakpoint is reached:
+ * 
+ *     A == 0 && [0200] != ff
+ *     hits >= 10 || (P & 01)
+ * 
+ * Numbers are hex, with an optional '$'. A, X, Y, S, P and PC are the registers,
+ * hits counts how often the breakpoint has been reached including this time,
+ * and [address] reads a byte without side effects. The operators are those of C,
+ * ! - + & | ^ == != < <= > >= && ||, except that & | and ^ bind tighter than the
+ * comparisons, so flags can be tested with P & 01 == 01.
+ * 
+ * The JIT does not see breakpoints, so it should not be attached while debugging.
+ * 
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#ifndef DEBUGGER_H
+#define DEBUGGER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+
+#define DEBUGGER_MAX_STOPS 32           // Breakpoints and watchpoints together
+#define PREDICATE_MAX_OPS 32            // Longest compiled condition
+#define PREDICATE_STACK 16              // Deepest nesting of a condition
+
+/**
+ * @brief Allocates a debugger without any breakpoints or watchpoints.
+ * 
+ * @return The debugger, or NULL if it could not be allocated.
+ */
+debugger* debugger_create(void);
+
+/**
+ * @brief Frees a debugger. It must not be attached to a machine.
+ * 
+ * @param d The debugger to free, or NULL.
+ */
+void debugger_destroy(debugger* d);
+
+/**
+ * @brief Attaches a debugger to a machine, arming its breakpoints and watchpoints there.
+ * 
+ * @param cpu The machine.
+ * @param d The debugger, or NULL to detach the current one.
+ */
+void debugger_attach(machine* cpu, debugger* d);
+
+/**
+ * @brief Sets a breakpoint, replacing any other breakpoint at the address.
+ * 
+ * @param d The debugger.
+ * @param address Address of the instruction to stop in front of.
+ * @param condition Condition to stop on, see above, or NULL to always stop.
+ * @return The breakpoint's number, or -1 if the condition does not compile or there are too many stops.
+ */
+int debugger_break(debugger* d, uint16_t address, const char* condition);
+
+/**
+ * @brief Sets a watchpoint on an address range.
+ * 
+ * @param d The debugger.
+ * @param start First address watched.
+ * @param end Last address watched.
+ * @param access BUS_READ and/or BUS_WRITE.
+ * @return The watchpoint's number, or -1 if there are too many stops.
+ */
+int debugger_watch(debugger* d, uint16_t start, uint16_t end, byte access);
+
+/**
+ * @brief Removes a breakpoint or watchpoint.
+ * 
+ * @param d The debugger.
+ * @param number The number debugger_break or debugger_watch returned.
+ * @return 0 on success, -1 if there is no such stop.
+ */
+int debugger_delete(debugger* d, int number);
+
+/**
+ * @brief Runs the machine until it reaches a breakpoint whose condition holds,
+ * touches a watched address, or raises another event. A breakpoint at the
+ * current PC is stepped over first.
+ * 
+ * @param cpu The machine to run. It must have a debugger attached.
+ * @return The pending events. EVENT_BREAK is left raised for debugger_print_stop.
+ */
+uint32_t debugger_continue(machine* cpu);
+
+/**
+ * @brief Runs the machine for a number of cycles, stopping early like debugger_continue.
+ * A breakpoint at the current PC is not stepped over, so running in slices stops
+ * at every breakpoint. EVENT_BREAK must not be pending.
+ * 
+ * @param cpu The machine to run. It must have a debugger attached.
+ * @param max_cycles Cycle budget, or CPU_UNLIMITED.
+ * @return The pending events, or EVENT_NONE if the budget ran out.
+ */
+uint32_t debugger_run(machine* cpu, uint64_t max_cycles);
+
+/**
+ * @brief Runs one instruction, ignoring a breakpoint at the current PC.
+ * Watchpoints still raise EVENT_BREAK. If an interrupt is pending, entering
+ * its handler is the step instead. Faults raised before are cleared, so the
+ * program can go on once the debugger has dealt with one.
+ * 
+ * @param cpu The machine. It must have a debugger attached.
+ * @return The pending events.
+ */
+uint32_t debugger_step(machine* cpu);
+
+/**
+ * @brief Finds a breakpoint or watchpoint.
+ * 
+ * @param d The debugger.
+ * @param start The breakpoint's address, or the first address watched.
+ * @param end The last address watched. Ignored for breakpoints.
+ * @param access 0 for a breakpoint, or the watchpoint's BUS_READ and BUS_WRITE flags.
+ * @return Its number, or -1 if there is none.
+ */
+int debugger_find(const debugger* d, uint16_t start, uint16_t end, byte access);
+
+/**
+ * @brief Tells whether a watchpoint stopped the machine, for debuggers that report it.
+ * 
+ * @param d The debugger.
+ * @param address Set to the address whose access hit the watchpoint.
+ * @return The watchpoint's BUS_READ and BUS_WRITE flags, or 0 if the last stop was not a watchpoint.
+ */
+byte debugger_stopped_watch(const debugger* d, uint16_t* address);
+
+/**
+ * @brief Prints why the machine last stopped with EVENT_BREAK.
+ * 
+ * @param d The debugger.
+ * @param out Where to print.
+ */
+void debugger_print_stop(const debugger* d, FILE* out);
+
+/**
+ * @brief Prints every breakpoint and watchpoint with its hit count.
+ * 
+ * @param d The debugger.
+ * @param out Where to print.
+ */
+void debugger_print(const debugger* d, FILE* out);
+
+/**
+ * @brief Called by decode for instructions that are not in the predecode cache.
+ * 
+ * @param d The machine's debugger.
+ * @param address Address of the instruction.
+ * @return Whether a breakpoint is set at the address and armed.
+ */
+bool debugger_breaks_at(const debugger* d, uint16_t address);
+
+/**
+ * @brief Called by the bus for accesses to pages with a watch trap.
+ * 
+ * @param cpu The machine.
+ * @param address The address accessed.
+ * @param data The byte read or written.
+ * @param write Whether the access was a write.
+ */
+void debugger_access(machine* cpu, uint16_t address, byte data, bool write);
+
+#endif // DEBUGGER_H
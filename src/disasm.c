@@ -0,0 +1,232 @@
+/**
+ * @file disasm.c
+ * @author Mason Daub
+ * @brief Table driven disassembler.
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#include <string.h>
+#include <stdbool.h>
+#include "disasm.h"
+#include "cpu_utils.h"
+
+#define OPCODE_JSR 0x20
+#define OPCODE_JMP 0x4c     // absolute, the indirect JMP's target is not known statically
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/**
+ * @brief How the operand of an addressing mode is written around its hex digits.
+ */
+typedef struct _mode_syntax
+{
+    const char* prefix;
+    const char* suffix;
+} mode_syntax;
+
+static const mode_syntax syntax[] =
+{
+    [ind_indir_x]   = { "($", ", X)" },
+    [zpg]           = { "$", "" },
+    [imm]           = { "#", "" },
+    [absolute]      = { "$", "" },
+    [indir_ind_y]   = { "($", "), Y" },
+    [ind_zpg_x]     = { "$", ", X" },
+    [ind_abs_y]     = { "$", ", Y" },
+    [ind_abs_x]     = { "$", ", X" },
+    [rel]           = { "$", "" },
+    [ind_zpg_y]     = { "$", ", Y" },
+    [ind_abs]       = { "($", ")" },
+    [reg_A]         = { "A", "" },
+    [impl]          = { "", "" },
+};
+
+/*   Output   */
+
+/**
+ * @brief Writes characters into a buffer, dropping what does not fit.
+ */
+typedef struct _writer
+{
+    char* next;
+    char* end;      // Last character of the buffer, kept for the terminator
+} writer;
+
+static inline void put_char(writer* w, char c)
+{
+    if(w->next < w->end)
+        *w->next++ = c;
+}
+
+static inline void put_string(writer* w, const char* s)
+{
+    while(*s)
+        put_char(w, *s++);
+}
+
+static inline void put_hex(writer* w, unsigned value, int digits)
+{
+    while(digits--)
+        put_char(w, hex_digits[(value >> (4 * digits)) & 0xf]);
+}
+
+/*   Decoding   */
+
+static inline void fetch(const machine* cpu, uint16_t address, byte* bytes)
+{
+    bytes[0] = peek_memory(cpu, address);
+    bytes[1] = peek_memory(cpu, address + 1);
+    bytes[2] = peek_memory(cpu, address + 2);
+}
+
+static inline int instruction_length(const byte* bytes)
+{
+    const opcode_info* info = &opcode_table[bytes[0]];
+    return info->name ? 1 + info->length : 1;
+}
+
+// The address a branch, jump or call goes to, or -1 for any other instruction.
+static inline int32_t target_of(const byte* bytes, uint16_t address)
+{
+    const opcode_info* info = &opcode_table[bytes[0]];
+    if(info->name && info->mode == rel)
+        return (uint16_t)(address + 2 + (int8_t)bytes[1]);
+    if(bytes[0] == OPCODE_JSR || bytes[0] == OPCODE_JMP)
+        return bytes[1] | (bytes[2] << 8);
+    return -1;
+}
+
+static inline bool is_label(const byte* labels, int32_t address)
+{
+    return labels && address >= 0 && (labels[address >> 3] & (1 << (address & 7)));
+}
+
+// Writes the text of an instruction. Targets marked in labels are named instead of written as numbers.
+static int format(writer* w, const byte* bytes, uint16_t address, const byte* labels)
+{
+    const opcode_info* info = &opcode_table[bytes[0]];
+    if(info->name == NULL)
+    {
+        put_char(w, '<');
+        put_hex(w, bytes[0], 2);
+        put_char(w, '>');
+        return 1;
+    }
+    put_string(w, info->name);
+    if(info->mode == impl)
+        return 1 + info->length;
+
+    put_char(w, ' ');
+    int32_t target = target_of(bytes, address);
+    if(is_label(labels, target))
+    {
+        put_char(w, 'L');
+        put_hex(w, target, 4);
+        return 1 + info->length;
+    }
+    const mode_syntax* s = &syntax[info->mode];
+    put_string(w, s->prefix);
+    put_hex(w, info->length == 2 ? bytes[1] | (bytes[2] << 8) : bytes[1], 2 * info->length);
+    put_string(w, s->suffix);
+    if(info->mode == rel)
+    {
+        put_string(w, " ; $");
+        put_hex(w, target, 4);
+    }
+    return 1 + info->length;
+}
+
+/*   Interface   */
+
+int disasm_format(const byte* bytes, uint16_t address, char* text, size_t size)
+{
+    if(size == 0)
+        return instruction_length(bytes);
+    writer w = { text, text + size - 1 };
+    int length = format(&w, bytes, address, NULL);
+    *w.next = '\0';
+    return length;
+}
+
+int disasm_instruction(const machine* cpu, uint16_t address, char* text, size_t size)
+{
+    byte bytes[3];
+    fetch(cpu, address, bytes);
+    return disasm_format(bytes, address, text, size);
+}
+
+size_t disasm_range(const machine* cpu, uint16_t start, size_t size, int flags,
+    char* buffer, size_t buffer_size, size_t* consumed)
+{
+    byte bytes[3];
+    size_t offset = 0;
+    if(size > 0x10000)
+        size = 0x10000;
+
+    // First pass: mark the targets inside the range
+    byte label_bits[0x10000 / 8];
+    const byte* labels = NULL;
+    if(flags & DISASM_LABELS)
+    {
+        memset(label_bits, 0, sizeof(label_bits));
+        while(offset < size)
+        {
+            uint16_t address = start + offset;
+            fetch(cpu, address, bytes);
+            int32_t target = target_of(bytes, address);
+            if(target >= 0 && (uint16_t)(target - start) < size)
+                label_bits[target >> 3] |= 1 << (target & 7);
+            offset += instruction_length(bytes);
+        }
+        labels = label_bits;
+    }
+
+    // Second pass: a line at a time, as long as whole lines fit
+    size_t written = 0;
+    for(offset = 0; offset < size && buffer_size > 0; )
+    {
+        uint16_t address = start + offset;
+        fetch(cpu, address, bytes);
+        char line[2 * DISASM_LINE_SIZE];
+        writer w = { line, line + sizeof(line) - 1 };
+        if(is_label(labels, address))
+        {
+            put_char(&w, 'L');
+            put_hex(&w, address, 4);
+            put_string(&w, ":\n");
+        }
+        put_hex(&w, address, 4);
+        put_string(&w, "  ");
+        int length = instruction_length(bytes);
+        if(flags & DISASM_BYTES)
+        {
+            for(int i = 0; i < 3; i++)
+            {
+                if(i < length)
+                    put_hex(&w, bytes[i], 2);
+                else
+                    put_string(&w, "  ");
+                put_char(&w, ' ');
+            }
+            put_char(&w, ' ');
+        }
+        format(&w, bytes, address, labels);
+        put_char(&w, '\n');
+
+        size_t line_length = w.next - line;
+        if(written + line_length >= buffer_size)
+            break;
+        memcpy(buffer + written, line, line_length);
+        written += line_length;
+        offset += length;
+    }
+    if(buffer_size > 0)
+        buffer[written] = '\0';
+    if(consumed)
+        *consumed = offset < size ? offset : size;
+    return written;
+}
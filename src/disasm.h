@@ -0,0 +1,82 @@
+/**
+ * @file disasm.h
+ * @author Mason Daub
+ * @brief Table driven disassembler for single instructions and whole address ranges.
+ * 
+ * Instructions are formatted from opcode_table and a table of operand syntax per
+ * addressing mode, writing characters directly instead of going through printf.
+ * Memory is read with peek_memory, so device handlers and watchpoints are never
+ * triggered and nothing in the machine changes: bytes on device pages read as 0. With no shared state, any number of threads can disassemble
+ * at once, as long as nothing writes the memory they read.
+ * 
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#ifndef DISASM_H
+#define DISASM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define DISASM_TEXT_SIZE 24     // Buffer size that holds the text of any instruction
+#define DISASM_LINE_SIZE 48     // Longest line disasm_range writes, including the newline
+
+/**
+ * @brief Options of disasm_range.
+ */
+typedef enum _disasm_flags
+{
+    DISASM_BYTES  = 0x01,       // Show the instruction bytes after the address
+    DISASM_LABELS = 0x02,       // Label the targets of branches, jumps and calls inside the range
+} disasm_flags;
+
+/**
+ * @brief Formats one instruction, e.g. "LDA $0200, X".
+ * 
+ * @param bytes The opcode and up to 2 operand bytes. Only as many as the opcode uses are read.
+ * @param address Address of the instruction, to resolve relative branches.
+ * @param text Where to write the text. It is always terminated, and cut short if it does not fit.
+ * @param size Size of text, DISASM_TEXT_SIZE always fits.
+ * @return The length of the instruction in bytes.
+ */
+int disasm_format(const byte* bytes, uint16_t address, char* text, size_t size);
+
+/**
+ * @brief Formats the instruction at an address of a machine's memory.
+ * 
+ * @param cpu The machine, which is only read.
+ * @param address Address of the instruction.
+ * @param text Where to write the text, as for disasm_format.
+ * @param size Size of text.
+ * @return The length of the instruction in bytes.
+ */
+int disasm_instruction(const machine* cpu, uint16_t address, char* text, size_t size);
+
+/**
+ * @brief Disassembles an address range into a listing, one instruction per line:
+ * "8010  a9 05     LDA #05". With DISASM_LABELS every instruction that is the
+ * target of a branch, jump or call from inside the range gets an "L8010:" line,
+ * and those operands name the label.
+ * 
+ * Only whole lines are written. If the buffer fills up, the listing stops early
+ * and can be continued from start + *consumed, although labels are only found
+ * within the range of each call.
+ * 
+ * @param cpu The machine, which is only read.
+ * @param start First address.
+ * @param size Number of bytes of address space to disassemble.
+ * @param flags disasm_flags.
+ * @param buffer Where to write the listing. It is always terminated.
+ * @param buffer_size Size of buffer.
+ * @param consumed Set to the bytes of the range disassembled, or NULL.
+ * @return The number of characters written, not counting the terminator.
+ */
+size_t disasm_range(const machine* cpu, uint16_t start, size_t size, int flags,
+    char* buffer, size_t buffer_size, size_t* consumed);
+
+#endif // DISASM_H
@@ -0,0 +1,604 @@
+/**
+ * @file gdbstub.c
+ * @author Mason Daub
+ * @brief GDB remote serial protocol server.
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "gdbstub.h"
+#include "debugger.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define GDB_SOCKETS
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+#ifdef GDB_SOCKETS
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define GDB_INTERRUPT 0x03      // Sent by the debugger outside of a packet to stop the machine
+#define GDB_REGISTERS 6         // A, X, Y, S, P, PC
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static const char target_xml[] =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target version=\"1.0\">"
+    "<feature name=\"org.daubmos.6502\">"
+    "<reg name=\"a\" bitsize=\"8\" type=\"uint8\" regnum=\"0\"/>"
+    "<reg name=\"x\" bitsize=\"8\" type=\"uint8\"/>"
+    "<reg name=\"y\" bitsize=\"8\" type=\"uint8\"/>"
+    "<reg name=\"s\" bitsize=\"8\" type=\"uint8\"/>"
+    "<reg name=\"p\" bitsize=\"8\" type=\"uint8\"/>"
+    "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+    "</feature>"
+    "</target>";
+
+/**
+ * @brief One debugger connection.
+ */
+typedef struct _gdb_session
+{
+    machine* cpu;
+    debugger* d;
+    int fd;
+    bool ack;                                   // Packets are acknowledged until the debugger turns it off
+    bool done;                                  // The debugger detached or killed the machine
+    size_t input_start, input_end;
+    char input[4096];                           // Received but not yet parsed
+    char packet[GDB_PACKET_SIZE + 1];           // Payload of the packet being handled, terminated
+    char reply[GDB_PACKET_SIZE + 4];            // Framed reply, "$" payload "#" checksum
+} gdb_session;
+
+/*   Connection   */
+
+// Listens on a TCP port of the loopback interface, or on a Unix socket.
+static int listen_on(const char* address)
+{
+    char* end;
+    unsigned long port = strtoul(address, &end, 10);
+    int fd;
+    if(*address && *end == '\0')
+    {
+        if(port == 0 || port > 0xffff || (fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            return -1;
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        struct sockaddr_in in;
+        memset(&in, 0, sizeof(in));
+        in.sin_family = AF_INET;
+        in.sin_port = htons(port);
+        in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if(bind(fd, (struct sockaddr*)&in, sizeof(in)) != 0 || listen(fd, 1) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    struct sockaddr_un un;
+    if(strlen(address) >= sizeof(un.sun_path) || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strcpy(un.sun_path, address);
+    // replace a socket left behind by an earlier run, but nothing else
+    struct stat info;
+    if(stat(address, &info) == 0 && S_ISSOCK(info.st_mode))
+        unlink(address);
+    if(bind(fd, (struct sockaddr*)&un, sizeof(un)) != 0 || listen(fd, 1) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Returns the next byte from the debugger, or -1 once the connection is closed.
+static int receive_char(gdb_session* s)
+{
+    if(s->input_start == s->input_end)
+    {
+        ssize_t n;
+        do
+            n = recv(s->fd, s->input, sizeof(s->input), 0);
+        while(n < 0 && errno == EINTR);
+        if(n <= 0)
+            return -1;
+        s->input_start = 0;
+        s->input_end = n;
+    }
+    return (unsigned char)s->input[s->input_start++];
+}
+
+static bool send_all(gdb_session* s, const char* data, size_t size)
+{
+    while(size > 0)
+    {
+        ssize_t n = send(s->fd, data, size, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+static inline int hex_value(int c)
+{
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * @brief Waits for the next packet and acknowledges it.
+ * 
+ * @param s The session.
+ * @return The length of the payload in s->packet, or -1 once the connection is closed.
+ */
+static int receive_packet(gdb_session* s)
+{
+    while(true)
+    {
+        int c;
+        // anything in between packets is a stray acknowledgement or interrupt
+        while((c = receive_char(s)) != '$')
+            if(c < 0)
+                return -1;
+
+        int length = 0;
+        byte sum = 0;
+        while((c = receive_char(s)) != '#')
+        {
+            if(c < 0)
+                return -1;
+            if(length < GDB_PACKET_SIZE)
+                s->packet[length++] = c;
+            sum += c;
+        }
+        int high = receive_char(s), low = receive_char(s);
+        if(low < 0)
+            return -1;
+        s->packet[length] = '\0';
+        bool good = hex_value(high) >= 0 && hex_value(low) >= 0 && ((hex_value(high) << 4) | hex_value(low)) == sum;
+        if(!s->ack)
+            return length;
+        if(!send_all(s, good ? "+" : "-", 1))
+            return -1;
+        if(good)
+            return length;
+    }
+}
+
+/**
+ * @brief Sends a reply, and resends it until it is acknowledged.
+ * 
+ * @param s The session.
+ * @param payload The payload, which must not contain '$', '#', '}' or '*'.
+ * @param length Length of the payload, at most GDB_PACKET_SIZE.
+ * @return false once the connection is closed.
+ */
+static bool send_packet(gdb_session* s, const char* payload, size_t length)
+{
+    byte sum = 0;
+    s->reply[0] = '$';
+    for(size_t i = 0; i < length; i++)
+        sum += s->reply[i + 1] = payload[i];
+    s->reply[length + 1] = '#';
+    s->reply[length + 2] = hex_digits[sum >> 4];
+    s->reply[length + 3] = hex_digits[sum & 0xf];
+
+    while(send_all(s, s->reply, length + 4))
+    {
+        if(!s->ack)
+            return true;
+        int c;
+        while((c = receive_char(s)) != '+' && c != '-')
+            if(c < 0)
+                return false;
+        if(c == '+')
+            return true;
+    }
+    return false;
+}
+
+static inline bool send_string(gdb_session* s, const char* payload)
+{
+    return send_packet(s, payload, strlen(payload));
+}
+
+// Whether the debugger asked to stop the machine while it runs.
+static bool interrupted(gdb_session* s)
+{
+    struct pollfd p = { s->fd, POLLIN, 0 };
+    while(s->input_start < s->input_end || poll(&p, 1, 0) > 0)
+    {
+        int c = receive_char(s);
+        if(c < 0)
+        {
+            s->done = true;
+            return true;
+        }
+        if(c == GDB_INTERRUPT)
+            return true;
+    }
+    return false;
+}
+
+/*   Packets   */
+
+// Reads a hex number, advancing past it.
+static uint32_t parse_hex(const char** text)
+{
+    uint32_t value = 0;
+    int digit;
+    while((digit = hex_value(**text)) >= 0)
+    {
+        value = (value << 4) | digit;
+        (*text)++;
+    }
+    return value;
+}
+
+static inline char* put_hex_byte(char* out, byte value)
+{
+    *out++ = hex_digits[value >> 4];
+    *out++ = hex_digits[value & 0xf];
+    return out;
+}
+
+static char* put_register(char* out, const machine* cpu, int number)
+{
+    switch(number)
+    {
+        case 0: return put_hex_byte(out, cpu->regA);
+        case 1: return put_hex_byte(out, cpu->regX);
+        case 2: return put_hex_byte(out, cpu->regY);
+        case 3: return put_hex_byte(out, cpu->SP);
+        case 4: return put_hex_byte(out, cpu_get_flags(cpu));
+        default: return put_hex_byte(put_hex_byte(out, cpu->PC & 0xff), cpu->PC >> 8);
+    }
+}
+
+// Sets a register from its hex value, advancing past it. Returns false if the value is cut short.
+static bool parse_register(const char** text, machine* cpu, int number)
+{
+    int bytes = number == 5 ? 2 : 1;
+    uint16_t value = 0;
+    for(int i = 0; i < bytes; i++)
+    {
+        int high = hex_value((*text)[0]);
+        int low = high < 0 ? -1 : hex_value((*text)[1]);
+        if(low < 0)
+            return false;
+        value |= ((high << 4) | low) << (8 * i);
+        *text += 2;
+    }
+    switch(number)
+    {
+        case 0: cpu->regA = value; break;
+        case 1: cpu->regX = value; break;
+        case 2: cpu->regY = value; break;
+        case 3: cpu->SP = value; break;
+        case 4: cpu_set_flags(cpu, value); break;
+        default: cpu->PC = value; break;
+    }
+    return true;
+}
+
+// m address,length: the whole range in one reply, as much as fits.
+static bool read_memory_packet(gdb_session* s, const char* args)
+{
+    char payload[GDB_PACKET_SIZE];
+    uint32_t address = parse_hex(&args);
+    if(*args++ != ',')
+        return send_string(s, "E01");
+    uint32_t length = parse_hex(&args);
+    if(length > GDB_PACKET_SIZE / 2)
+        length = GDB_PACKET_SIZE / 2;
+    char* out = payload;
+    for(uint32_t i = 0; i < length; i++)
+        out = put_hex_byte(out, peek_memory(s->cpu, address + i));
+    return send_packet(s, payload, out - payload);
+}
+
+// M address,length:bytes
+static bool write_memory_packet(gdb_session* s, const char* args)
+{
+    uint32_t address = parse_hex(&args);
+    if(*args++ != ',')
+        return send_string(s, "E01");
+    uint32_t length = parse_hex(&args);
+    if(*args++ != ':' || length > strlen(args) / 2) // without overflowing 2 * length
+        return send_string(s, "E01");
+
+    // the debugger's own writes must not stop on watchpoints
+    debugger_attach(s->cpu, NULL);
+    for(uint32_t i = 0; i < length; i++, args += 2)
+        write_memory(s->cpu, (address + i) & 0xffff, (hex_value(args[0]) << 4) | hex_value(args[1]));
+    debugger_attach(s->cpu, s->d);
+    return send_string(s, "OK");
+}
+
+// Z type,address,kind and z type,address,kind
+static bool stop_packet(gdb_session* s, const char* args, bool insert)
+{
+    static const byte watch_access[] = { 0, 0, BUS_WRITE, BUS_READ, BUS_READ | BUS_WRITE };
+    uint32_t type = parse_hex(&args);
+    if(type > 4)
+        return send_string(s, "");
+    if(*args++ != ',')
+        return send_string(s, "E01");
+    uint32_t address = parse_hex(&args);
+    uint32_t kind = *args == ',' ? (args++, parse_hex(&args)) : 1;
+    if(address > 0xffff)
+        return send_string(s, "E01");
+
+    // breakpoints are kept by the debugger, memory is never patched
+    byte access = watch_access[type];
+    uint32_t end = access && kind > 1 ? address + kind - 1 : address;
+    if(end > 0xffff)
+        end = 0xffff;
+    int number = debugger_find(s->d, address, end, access);
+    if(insert && number < 0)
+        number = access ? debugger_watch(s->d, address, end, access) : debugger_break(s->d, address, NULL);
+    else if(!insert && number >= 0)
+        number = debugger_delete(s->d, number);
+    return send_string(s, number >= 0 ? "OK" : "E01");
+}
+
+// qXfer:features:read:annex:offset,length
+static bool features_packet(gdb_session* s, const char* args)
+{
+    char payload[GDB_PACKET_SIZE];
+    if(strncmp(args, "target.xml:", 11) != 0)
+        return send_string(s, "E00");
+    args += 11;
+    uint32_t offset = parse_hex(&args);
+    if(*args++ != ',')
+        return send_string(s, "E01");
+    uint32_t length = parse_hex(&args);
+    uint32_t total = sizeof(target_xml) - 1;
+    if(offset >= total)
+        return send_string(s, "l");
+    if(length > total - offset)
+        length = total - offset;
+    if(length > GDB_PACKET_SIZE - 1)
+        length = GDB_PACKET_SIZE - 1;
+    payload[0] = offset + length < total ? 'm' : 'l';
+    memcpy(payload + 1, target_xml + offset, length);
+    return send_packet(s, payload, length + 1);
+}
+
+// c [address] and s [address]: runs, then sends the stop reply.
+static bool resume_packet(gdb_session* s, const char* args, bool step)
+{
+    machine* cpu = s->cpu;
+    if(*args)
+        cpu->PC = parse_hex(&args);
+
+    bool stopped = false;
+    uint32_t events = debugger_step(cpu);
+    while(!step && events == EVENT_NONE && !(stopped = interrupted(s)))
+        events = debugger_run(cpu, GDB_SLICE_CYCLES);
+    if(s->done)
+        return false;
+
+    char payload[32];
+    uint16_t address;
+    byte access;
+    if(events & EVENT_HALT)
+    {
+        s->done = true;
+        return send_string(s, "W00");
+    }
+    if((events & EVENT_BREAK) && (access = debugger_stopped_watch(s->d, &address)))
+    {
+        const char* kind = access == BUS_WRITE ? "watch" : access == BUS_READ ? "rwatch" : "awatch";
+        snprintf(payload, sizeof(payload), "T05%s:%04x;", kind, address);
+        return send_string(s, payload);
+    }
+    if(events & EVENT_ILLEGAL)
+        return send_string(s, "S04");
+    if(events & EVENT_STACK)
+        return send_string(s, "S0b");
+    return send_string(s, stopped ? "S02" : "S05");
+}
+
+/**
+ * @brief Answers one packet.
+ * 
+ * @param s The session.
+ * @param length Length of the packet in s->packet.
+ * @return false once the connection is closed.
+ */
+static bool handle_packet(gdb_session* s, int length)
+{
+    char payload[2 * (GDB_REGISTERS + 1) + 1];
+    machine* cpu = s->cpu;
+    const char* args = s->packet + 1;
+    char* out;
+    if(length == 0)
+        return send_string(s, "");
+
+    switch(s->packet[0])
+    {
+        case '?':
+            return send_string(s, "S05");
+
+        case 'g':
+            out = payload;
+            for(int i = 0; i < GDB_REGISTERS; i++)
+                out = put_register(out, cpu, i);
+            return send_packet(s, payload, out - payload);
+
+        case 'G':
+            for(int i = 0; i < GDB_REGISTERS; i++)
+                if(!parse_register(&args, cpu, i))
+                    return send_string(s, "E01");
+            return send_string(s, "OK");
+
+        case 'p':
+        {
+            uint32_t number = parse_hex(&args);
+            if(number >= GDB_REGISTERS)
+                return send_string(s, "E01");
+            return send_packet(s, payload, put_register(payload, cpu, number) - payload);
+        }
+
+        case 'P':
+        {
+            uint32_t number = parse_hex(&args);
+            if(number >= GDB_REGISTERS || *args++ != '=' || !parse_register(&args, cpu, number))
+                return send_string(s, "E01");
+            return send_string(s, "OK");
+        }
+
+        case 'm':
+            return read_memory_packet(s, args);
+
+        case 'M':
+            return write_memory_packet(s, args);
+
+        case 'c':
+            return resume_packet(s, args, false);
+
+        case 's':
+            return resume_packet(s, args, true);
+
+        case 'Z':
+            return stop_packet(s, args, true);
+
+        case 'z':
+            return stop_packet(s, args, false);
+
+        case 'H':
+            return send_string(s, "OK");
+
+        case 'D':
+            s->done = true;
+            return send_string(s, "OK");
+
+        case 'k':
+            // there is no reply to a kill
+            s->done = true;
+            cpu_raise_event(cpu, EVENT_HALT);
+            return true;
+
+        case 'q':
+            if(strncmp(s->packet, "qSupported", 10) == 0)
+                return send_string(s, "PacketSize=4000;qXfer:features:read+;QStartNoAckMode+");
+            if(strncmp(s->packet, "qXfer:features:read:", 20) == 0)
+                return features_packet(s, s->packet + 20);
+            if(strcmp(s->packet, "qAttached") == 0)
+                return send_string(s, "1");
+            return send_string(s, "");
+
+        case 'Q':
+            if(strcmp(s->packet, "QStartNoAckMode") == 0)
+            {
+                // the OK is still acknowledged
+                bool sent = send_string(s, "OK");
+                s->ack = false;
+                return sent;
+            }
+            return send_string(s, "");
+
+        // X is left to fall back on M, and vCont on c and s
+        default:
+            return send_string(s, "");
+    }
+}
+
+/*   Interface   */
+
+int gdb_serve(machine* cpu, const char* address)
+{
+    int listener = listen_on(address);
+    if(listener < 0)
+        return -1;
+    printf("Waiting for gdb on %s...\n", address);
+    fflush(stdout);
+    int fd;
+    do
+        fd = accept(listener, NULL, NULL);
+    while(fd < 0 && errno == EINTR);
+    close(listener);
+    bool unix_socket = strspn(address, "0123456789") != strlen(address);
+    if(unix_socket)
+        unlink(address);
+    if(fd < 0)
+        return -1;
+    if(!unix_socket)
+    {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    gdb_session* s = calloc(1, sizeof(gdb_session));
+    debugger* d = debugger_create();
+    if(!s || !d)
+    {
+        free(s);
+        debugger_destroy(d);
+        close(fd);
+        return -1;
+    }
+    s->cpu = cpu;
+    s->d = d;
+    s->fd = fd;
+    s->ack = true;
+    debugger_attach(cpu, d);
+
+    puts("gdb connected");
+    int length;
+    while(!s->done && (length = receive_packet(s)) >= 0 && handle_packet(s, length))
+        ;
+    puts("gdb disconnected");
+
+    debugger_attach(cpu, NULL);
+    cpu_clear_event(cpu, EVENT_BREAK);
+    debugger_destroy(d);
+    close(fd);
+    free(s);
+    return 0;
+}
+
+#else
+
+int gdb_serve(machine* cpu, const char* address)
+{
+    (void)cpu;
+    (void)address;
+    puts("The gdb server is not supported on this host.");
+    return -1;
+}
+
+#endif
@@ -0,0 +1,47 @@
+/**
+ * @file gdbstub.h
+ * @author Mason Daub
+ * @brief GDB remote serial protocol server, so gdb and other debuggers that speak it can drive a machine.
+ * 
+ * gdb_serve waits for one debugger to connect to a local TCP port or Unix socket
+ * and serves it until it detaches, kills the program or the machine halts.
+ * Breakpoints and watchpoints are those of the debugger module, so between stops
+ * the machine runs at full speed and only takes its slow paths where something
+ * is set. While it runs, the connection is checked for an interrupt after every
+ * GDB_SLICE_CYCLES.
+ * 
+ * The registers are A, X, Y, S and P of 8 bits and PC of 16 bits, in that order
+ * and little endian, as the target description tells the debugger. Memory is
+ * read with peek_memory, so reading never calls device handlers, and an m packet
+ * is answered with its whole range at once. Writes go through the bus, so ROM
+ * stays write protected.
+ * 
+ * The machine stopping at an illegal opcode is reported as SIGILL, and a stack
+ * overflow or underflow as SIGSEGV.
+ * 
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#ifndef GDBSTUB_H
+#define GDBSTUB_H
+
+#include "cpu.h"
+
+#define GDB_PACKET_SIZE 0x4000          // Largest packet either side sends
+#define GDB_SLICE_CYCLES 1000000        // Cycles run between checks for an interrupt
+
+/**
+ * @brief Serves one debugger connection. The JIT must not be attached.
+ * 
+ * @param cpu The machine, reset and ready to run.
+ * @param address A port number to listen on 127.0.0.1, or the path of a Unix socket.
+ * @return 0 once the debugger is done, -1 if it could not be listened for.
+ * EVENT_HALT is pending if the machine halted or the debugger killed it.
+ */
+int gdb_serve(machine* cpu, const char* address);
+
+#endif // GDBSTUB_H
@@ -0,0 +1,1345 @@
+/**
+ * @file jit.c
+ * @author Mason Daub
+ * @brief Basic block translation to x86-64.
+ *
+ * Register use inside translated code:
+ *  rbx - the machine
+ *  r12 - instructions left in the budget
+ *  r13 - where to store the exit slot when leaving to the dispatcher
+ *  r14 - A
+ *  r15 - X
+ *  rbp - Y
+ *  r10 - P without N and Z, as in the machine's FLAGS
+ *  r11 - nz_result
+ *  r9  - cycles not added to the machine yet, less the base cycles of the
+ *        instructions before the current one, which are only known when translating
+ *  r8  - set once a call into C moved the stop cycle
+ *  rdi - an effective address that is only known at run time
+ *  rax, rcx, rdx, rsi - scratch. rax holds the byte read or written.
+ * The 6502 registers go back to the machine before every call into C and are
+ * loaded again after it, and whenever a block is left.
+ *
+ * The stack frame holds the stop cycle the block was entered with at [rsp], and
+ * the scratch registers, rdi and r8 while calling into C above it.
+ *
+ * @version 0.1
+ * @date 2023-11-25
+ *
+ * @copyright Copyright (c) 2023 Mason Daub
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "jit.h"
+
+// Field offsets used by the generated code. Taken before cpu_utils.h defines the register macros.
+static const size_t offset_pc = offsetof(machine, PC);
+static const size_t offset_a = offsetof(machine, regA);
+static const size_t offset_x = offsetof(machine, regX);
+static const size_t offset_y = offsetof(machine, regY);
+static const size_t offset_sp = offsetof(machine, SP);
+static const size_t offset_flags = offsetof(machine, FLAGS);
+static const size_t offset_nz = offsetof(machine, nz_result);
+static const size_t offset_cycles = offsetof(machine, cycles);
+static const size_t offset_stop_cycle = offsetof(machine, stop_cycle);
+static const size_t offset_read_page = offsetof(machine, read_page);
+static const size_t offset_write_page = offsetof(machine, write_page);
+
+#include "cpu_utils.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+/**
+ * @brief Runs translated code from a block until it leaves to the dispatcher.
+ *
+ * @param cpu The machine.
+ * @param remaining Instruction budget.
+ * @param exit_slot Set to the exit jump that left the block, or NULL if it can not be chained.
+ * @param block The block to start at.
+ * @return The instruction budget left.
+ */
+typedef uint64_t (*jit_entry)(machine* cpu, uint64_t remaining, byte** exit_slot, const byte* block);
+
+struct _jit
+{
+    byte* code;                     // Executable memory
+    size_t used;                    // Bytes of code emitted
+    size_t stubs;                   // Size of the shared stubs at the start of code
+    jit_entry enter;                // Shared stub that saves registers and jumps to a block
+    byte* exit;                     // Shared stub that leaves without an exit slot
+    byte* epilogue;                 // Shared stub that restores registers and returns
+    bool flush_pending;             // Translated code was written and must be thrown away
+    machine* cpu;                   // The machine the cache is attached to
+
+    byte* blocks[0x10000];          // Translated block starting at each address
+    byte heat[0x10000];             // Times each address was reached without a block
+    byte invalidations[BUS_PAGE_COUNT]; // Times each page's code was written
+
+    uint64_t translated;            // Blocks translated
+    uint64_t chained;               // Exit jumps patched
+    uint64_t flushes;               // Times all code was thrown away
+    uint64_t native;                // Instructions run by translated code
+    uint64_t interpreted;           // Instructions run by the interpreter
+};
+
+/* Code emission */
+
+static void emit(jit* j, const void* bytes, size_t size)
+{
+    memcpy(j->code + j->used, bytes, size);
+    j->used += size;
+}
+
+static void emit8(jit* j, byte value) { emit(j, &value, 1); }
+static void emit16(jit* j, uint16_t value) { emit(j, &value, 2); }
+static void emit32(jit* j, uint32_t value) { emit(j, &value, 4); }
+static void emit64(jit* j, uint64_t value) { emit(j, &value, 8); }
+
+// Points the rel32 field of a jump at a target.
+static void patch_rel32(byte* field, const byte* target)
+{
+    int32_t rel = (int32_t)(target - (field + 4));
+    memcpy(field, &rel, 4);
+}
+
+// Emits a jump with a 32 bit displacement and returns the displacement field.
+// op is the opcode, e.g. 0xe9 for jmp or 0x0f 0x84 for jz.
+static byte* emit_jump(jit* j, const byte* op, size_t op_size, const byte* target)
+{
+    emit(j, op, op_size);
+    byte* field = j->code + j->used;
+    emit32(j, 0);
+    if(target)
+        patch_rel32(field, target);
+    return field;
+}
+
+static const byte JMP[] = { 0xe9 };
+static const byte JZ[]  = { 0x0f, 0x84 };
+static const byte JNE[] = { 0x0f, 0x85 };
+static const byte JB[]  = { 0x0f, 0x82 };
+static const byte JAE[] = { 0x0f, 0x83 };
+
+// Host registers, numbered as in the instruction encoding
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+#define REG_A R14
+#define REG_X R15
+#define REG_Y RBP
+#define REG_P R10
+#define REG_NZ R11
+#define REG_EXTRA R9
+#define REG_STOP R8
+#define REG_ADDR RDI
+
+#define FRAME_STOP 0        // Stop cycle the block was entered with
+#define FRAME_SAVED 8       // rcx, rdx, rsi, rdi and r8 while calling into C
+#define FRAME_SIZE 56       // Keeps calls 16 byte aligned after the 6 pushes
+
+// Operand size and byte register flags of emit_rr and emit_rm
+#define OP_W 0x01           // 64 bit operand (REX.W)
+#define OP_16 0x02          // 16 bit operand (0x66 prefix)
+#define OP_BREG 0x04        // The reg field names a byte register
+#define OP_BRM 0x08         // The r/m field names a byte register
+
+// Opcodes of the r/m forms. Two byte opcodes have the 0x0f in the high byte.
+#define X86_ADD     0x01    // add r/m, r
+#define X86_OR      0x09    // or r/m, r
+#define X86_AND     0x21    // and r/m, r
+#define X86_XOR     0x31    // xor r/m, r
+#define X86_CMP     0x3b    // cmp r, r/m
+#define X86_MOVSXD  0x63    // movsxd r64, r/m32
+#define X86_TEST8   0x84    // test r/m8, r8
+#define X86_TEST    0x85    // test r/m, r
+#define X86_STORE8  0x88    // mov r/m8, r8
+#define X86_STORE   0x89    // mov r/m, r
+#define X86_LOAD    0x8b    // mov r, r/m
+#define X86_LEA     0x8d    // lea r, m
+#define X86_MOVZX8  0x0fb6  // movzx r32, r/m8
+#define X86_MOVZX16 0x0fb7  // movzx r32, r/m16
+
+// Immediate forms, the operation is in the reg field
+#define X86_ALU_IMM8  0x83  // add/or/and/sub/xor/cmp r/m, imm8
+#define X86_ALU_IMM32 0x81  // the same with imm32
+#define X86_SHIFT_IMM 0xc1  // shl/shr r/m, imm8
+#define X86_TEST8_IMM 0xf6  // test r/m8, imm8
+#define X86_INC8      0xfe  // inc/dec r/m8
+#define X86_MOV_IMM   0xc7  // mov r/m, imm32
+enum { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7 };
+enum { SHIFT_SHL = 4, SHIFT_SHR = 5 };
+
+// Emits the prefixes and opcode of an instruction with the given ModRM fields.
+static void emit_opcode(jit* j, int flags, unsigned op, int reg, int index, int base)
+{
+    if(flags & OP_16)
+        emit8(j, 0x66);
+    byte rex = (flags & OP_W ? 8 : 0) | (reg & 8) >> 1 | (index & 8) >> 2 | (base & 8) >> 3;
+    // spl, bpl, sil and dil need a REX prefix to be told apart from ah, ch, dh and bh
+    bool low_byte = ((flags & OP_BREG) && reg >= RSP && reg <= RDI)
+        || ((flags & OP_BRM) && base >= RSP && base <= RDI);
+    if(rex || low_byte)
+        emit8(j, 0x40 | rex);
+    if(op > 0xff)
+        emit8(j, op >> 8);
+    emit8(j, op);
+}
+
+// op reg, rm with both operands in registers.
+static void emit_rr(jit* j, int flags, unsigned op, int reg, int rm)
+{
+    emit_opcode(j, flags, op, reg, 0, rm);
+    emit8(j, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// op reg, [base + index * (1 << scale) + disp], index -1 for none.
+static void emit_rm(jit* j, int flags, unsigned op, int reg, int base, int index, int scale, int32_t disp)
+{
+    emit_opcode(j, flags, op, reg, index < 0 ? 0 : index, base);
+    if(index < 0 && (base & 7) != RSP)
+        emit8(j, 0x80 | (reg & 7) << 3 | (base & 7));
+    else
+    {
+        emit8(j, 0x84 | (reg & 7) << 3);
+        emit8(j, scale << 6 | ((index < 0 ? RSP : index) & 7) << 3 | (base & 7));
+    }
+    emit32(j, disp);
+}
+
+// op reg, a field of the machine.
+static void emit_field(jit* j, int flags, unsigned op, int reg, size_t offset)
+{
+    emit_rm(j, flags, op, reg, RBX, -1, 0, offset);
+}
+
+static void emit_alu_imm(jit* j, int flags, int alu, int rm, int32_t imm)
+{
+    if(imm >= -128 && imm < 128)
+    {
+        emit_rr(j, flags, X86_ALU_IMM8, alu, rm);
+        emit8(j, imm);
+    }
+    else
+    {
+        emit_rr(j, flags, X86_ALU_IMM32, alu, rm);
+        emit32(j, imm);
+    }
+}
+
+static void emit_shift(jit* j, int shift, int rm, byte count)
+{
+    emit_rr(j, 0, X86_SHIFT_IMM, shift, rm);
+    emit8(j, count);
+}
+
+// test the low byte of a register against a mask.
+static void emit_test8(jit* j, int rm, byte mask)
+{
+    emit_rr(j, OP_BRM, X86_TEST8_IMM, 0, rm);
+    emit8(j, mask);
+}
+
+// mov reg32, reg32
+static void emit_mov(jit* j, int to, int from)
+{
+    emit_rr(j, 0, X86_STORE, from, to);
+}
+
+// mov reg32, imm32
+static void emit_mov_imm(jit* j, int reg, uint32_t imm)
+{
+    emit_opcode(j, 0, 0xb8 + (reg & 7), 0, 0, reg);
+    emit32(j, imm);
+}
+
+// Calls a C function, whose address does not fit in a rel32.
+static void emit_call(jit* j, const void* function)
+{
+    static const byte CALL_RAX[] = { 0xff, 0xd0 };     // call rax
+    emit_opcode(j, OP_W, 0xb8, 0, 0, RAX);              // mov rax, imm64
+    emit64(j, (uint64_t)(uintptr_t)function);
+    emit(j, CALL_RAX, sizeof(CALL_RAX));
+}
+
+static void emit_stubs(jit* j)
+{
+    static const byte ENTER[] =
+    {
+        0x53,                       // push rbx
+        0x55,                       // push rbp
+        0x41, 0x54,                 // push r12
+        0x41, 0x55,                 // push r13
+        0x41, 0x56,                 // push r14
+        0x41, 0x57,                 // push r15
+        0x48, 0x83, 0xec, FRAME_SIZE, // sub rsp, FRAME_SIZE
+        0x48, 0x89, 0xfb,           // mov rbx, rdi
+        0x49, 0x89, 0xf4,           // mov r12, rsi
+        0x49, 0x89, 0xd5,           // mov r13, rdx
+        0xff, 0xe1,                 // jmp rcx
+    };
+    static const byte EXIT[] =
+    {
+        0x49, 0xc7, 0x45, 0x00, 0x00, 0x00, 0x00, 0x00, // mov qword [r13], 0
+    };
+    static const byte EPILOGUE[] =
+    {
+        0x4c, 0x89, 0xe0,           // mov rax, r12
+        0x48, 0x83, 0xc4, FRAME_SIZE, // add rsp, FRAME_SIZE
+        0x41, 0x5f,                 // pop r15
+        0x41, 0x5e,                 // pop r14
+        0x41, 0x5d,                 // pop r13
+        0x41, 0x5c,                 // pop r12
+        0x5d,                       // pop rbp
+        0x5b,                       // pop rbx
+        0xc3,                       // ret
+    };
+    j->used = 0;
+    j->enter = (jit_entry)(void*)j->code;
+    emit(j, ENTER, sizeof(ENTER));
+    j->exit = j->code + j->used;
+    emit(j, EXIT, sizeof(EXIT));
+    j->epilogue = j->code + j->used;
+    emit(j, EPILOGUE, sizeof(EPILOGUE));
+    j->stubs = j->used;
+}
+
+/* Translation */
+
+// One decoded instruction of a block.
+typedef struct _jit_insn
+{
+    byte opcode;
+    uint16_t operand;
+    uint16_t address;   // address of the opcode
+    uint16_t next;      // address of the following instruction
+} jit_insn;
+
+// Out of line code a block jumps to when something unusual happens.
+typedef enum _jit_stub_kind
+{
+    STUB_READ,          // The page is not plain memory: read it through the bus
+    STUB_WRITE,         // The same for a write
+    STUB_DECIMAL,       // ADC or SBC with the D flag set: run the interpreter's handler
+    STUB_STOP,          // A call moved the stop cycle: leave after the instruction
+    STUB_RETRY,         // Leave before the instruction, for the interpreter to run it
+} jit_stub_kind;
+
+typedef struct _jit_stub
+{
+    jit_stub_kind kind;
+    int insn;           // Index of the instruction in the block
+    int32_t address;    // Address accessed, -1 for the one in REG_ADDR. PC to leave with for STUB_STOP, or -1 if set.
+    byte* jump;         // rel32 field of the jump to the stub
+    byte* back;         // Where the slow paths continue
+} jit_stub;
+
+#define JIT_MAX_STUBS 5     // Most stubs of one instruction
+
+// How translated code goes on after an instruction.
+typedef enum _jit_end
+{
+    END_FALLBACK,       // Not translated, the interpreter's handler is called instead
+    END_NEXT,           // The next instruction
+    END_STATIC,         // An address known when translating, the block's target
+    END_DYNAMIC,        // The PC in the machine
+    END_DONE,           // The instruction left the block itself
+} jit_end;
+
+typedef struct _jit_block
+{
+    jit_insn insns[JIT_MAX_BLOCK];
+    int count;
+    uint32_t before[JIT_MAX_BLOCK + 1];     // Base cycles of the instructions before each one
+    uint16_t target;                        // Where END_STATIC goes
+    jit_stub stubs[JIT_MAX_BLOCK * JIT_MAX_STUBS];
+    int stub_count;
+    byte** slots;                           // Exit jumps that can be chained, see emit_exit
+    int slot_count;
+} jit_block;
+
+// Jumps to a new stub of instruction i if the flags say so.
+static jit_stub* emit_stub_jump(jit* j, jit_block* b, const byte* op, size_t op_size, jit_stub_kind kind, int i, int32_t address)
+{
+    jit_stub* s = &b->stubs[b->stub_count++];
+    s->kind = kind;
+    s->insn = i;
+    s->address = address;
+    s->jump = emit_jump(j, op, op_size, NULL);
+    s->back = NULL;
+    return s;
+}
+
+// Loads the 6502 registers into their host registers.
+static void emit_load_state(jit* j)
+{
+    emit_field(j, 0, X86_MOVZX8, REG_A, offset_a);
+    emit_field(j, 0, X86_MOVZX8, REG_X, offset_x);
+    emit_field(j, 0, X86_MOVZX8, REG_Y, offset_y);
+    emit_field(j, 0, X86_MOVZX8, REG_P, offset_flags);
+    emit_field(j, 0, X86_MOVZX16, REG_NZ, offset_nz);
+}
+
+// Writes the host registers back to the machine.
+static void emit_store_state(jit* j)
+{
+    emit_field(j, OP_BREG, X86_STORE8, REG_A, offset_a);
+    emit_field(j, OP_BREG, X86_STORE8, REG_X, offset_x);
+    emit_field(j, OP_BREG, X86_STORE8, REG_Y, offset_y);
+    emit_field(j, OP_BREG, X86_STORE8, REG_P, offset_flags);
+    emit_field(j, OP_16, X86_STORE, REG_NZ, offset_nz);
+}
+
+static void emit_store_pc(jit* j, uint16_t pc)
+{
+    emit_field(j, OP_16, X86_MOV_IMM, 0, offset_pc);
+    emit16(j, pc);
+}
+
+// Adds the cycles run so far to the machine, given the base cycles of the instructions run.
+static void emit_commit(jit* j, uint32_t base)
+{
+    emit_rm(j, OP_W, X86_LEA, RAX, REG_EXTRA, -1, 0, base);
+    emit_field(j, OP_W, X86_ADD, RAX, offset_cycles);
+}
+
+// After the machine's cycles were brought up to date with the base cycles counted.
+static void emit_counted(jit* j, uint32_t counted)
+{
+    emit_rr(j, OP_W, X86_MOV_IMM, 0, REG_EXTRA);
+    emit32(j, -counted);
+}
+
+// Leaves the block with instructions run. The machine's PC must be set.
+static void emit_leave(jit* j, int run, uint32_t base)
+{
+    emit_store_state(j);
+    emit_commit(j, base);
+    if(run > 0)
+        emit_alu_imm(j, OP_W, ALU_SUB, R12, run);
+}
+
+// The machine's state as the interpreter has it in the middle of instruction i,
+// for a call into C. The scratch registers are saved.
+static void emit_call_begin(jit* j, const jit_block* b, int i)
+{
+    static const int saved[] = { RCX, RDX, RSI, RDI, R8 };
+    emit_store_state(j);
+    emit_store_pc(j, b->insns[i].next);
+    emit_commit(j, b->before[i]);
+    for(int n = 0; n < 5; n++)
+        emit_rm(j, OP_W, X86_STORE, saved[n], RSP, -1, 0, FRAME_SAVED + 8 * n);
+}
+
+// Back from C with counted base cycles in the machine. Sets REG_STOP if the stop cycle moved.
+static void emit_call_end(jit* j, uint32_t counted)
+{
+    static const int saved[] = { RCX, RDX, RSI, RDI, R8 };
+    emit_field(j, OP_W, X86_LOAD, RCX, offset_stop_cycle);
+    emit_rm(j, OP_W, X86_CMP, RCX, RSP, -1, 0, FRAME_STOP);
+    emit_rr(j, OP_BRM, 0x0f95, 0, RCX);                            // setne cl
+    emit_rr(j, OP_BRM, X86_MOVZX8, RCX, RCX);
+    emit_rm(j, OP_W, X86_OR, RCX, RSP, -1, 0, FRAME_SAVED + 32);    // into the saved r8
+    for(int n = 0; n < 5; n++)
+        emit_rm(j, OP_W, X86_LOAD, saved[n], RSP, -1, 0, FRAME_SAVED + 8 * n);
+    emit_load_state(j);
+    emit_counted(j, counted);
+}
+
+// Calls the interpreter's handler for instruction i.
+static void emit_handler_call(jit* j, const jit_block* b, int i)
+{
+    const jit_insn* insn = &b->insns[i];
+    emit_call_begin(j, b, i);
+    emit_rr(j, OP_W, X86_STORE, RBX, RDI);
+    emit_mov_imm(j, RSI, insn->operand);
+    emit_call(j, decoded_table[insn->opcode]);
+    emit_rr(j, OP_W, X86_MOVSXD, RAX, RAX);
+    emit_field(j, OP_W, X86_ADD, RAX, offset_cycles);
+    emit_call_end(j, b->before[i + 1]);
+}
+
+static void emit_stub(jit* j, const jit_block* b, const jit_stub* s)
+{
+    const jit_insn* insn = &b->insns[s->insn];
+    patch_rel32(s->jump, j->code + j->used);
+    switch(s->kind)
+    {
+        case STUB_READ:
+        case STUB_WRITE:
+            if(s->kind == STUB_WRITE)
+                emit_mov(j, RDX, RAX);
+            emit_call_begin(j, b, s->insn);
+            if(s->address < 0)
+                emit_mov(j, RSI, REG_ADDR);
+            else
+                emit_mov_imm(j, RSI, s->address);
+            emit_rr(j, OP_W, X86_STORE, RBX, RDI);
+            emit_call(j, s->kind == STUB_READ ? (const void*)bus_read_slow : (const void*)bus_write_slow);
+            emit_call_end(j, b->before[s->insn]);
+            emit_rr(j, OP_BRM, X86_MOVZX8, RAX, RAX);
+            emit_jump(j, JMP, sizeof(JMP), s->back);
+            break;
+        case STUB_DECIMAL:
+            emit_handler_call(j, b, s->insn);
+            emit_jump(j, JMP, sizeof(JMP), s->back);
+            break;
+        case STUB_STOP:
+            if(s->address >= 0)
+                emit_store_pc(j, s->address);
+            emit_leave(j, s->insn + 1, b->before[s->insn + 1]);
+            emit_jump(j, JMP, sizeof(JMP), j->exit);
+            break;
+        case STUB_RETRY:
+            emit_store_pc(j, insn->address);
+            emit_leave(j, s->insn, b->before[s->insn]);
+            emit_jump(j, JMP, sizeof(JMP), j->exit);
+            break;
+    }
+}
+
+/* Memory */
+
+// Reads memory into eax, from a fixed address or the one in REG_ADDR.
+static void emit_read(jit* j, jit_block* b, int i, int32_t address)
+{
+    jit_stub* s;
+    if(address >= 0)
+    {
+        emit_field(j, OP_W, X86_LOAD, RCX, offset_read_page + (address >> 8) * sizeof(byte*));
+        emit_rr(j, OP_W, X86_TEST, RCX, RCX);
+        s = emit_stub_jump(j, b, JZ, sizeof(JZ), STUB_READ, i, address);
+        emit_rm(j, 0, X86_MOVZX8, RAX, RCX, -1, 0, address & 0xff);
+    }
+    else
+    {
+        emit_mov(j, RCX, REG_ADDR);
+        emit_shift(j, SHIFT_SHR, RCX, 8);
+        emit_rm(j, OP_W, X86_LOAD, RCX, RBX, RCX, 3, offset_read_page);
+        emit_rr(j, OP_W, X86_TEST, RCX, RCX);
+        s = emit_stub_jump(j, b, JZ, sizeof(JZ), STUB_READ, i, -1);
+        emit_rr(j, OP_BRM, X86_MOVZX8, RDX, REG_ADDR);
+        emit_rm(j, 0, X86_MOVZX8, RAX, RCX, RDX, 0, 0);
+    }
+    s->back = j->code + j->used;
+}
+
+// Writes al to a fixed address or the one in REG_ADDR.
+static void emit_write(jit* j, jit_block* b, int i, int32_t address)
+{
+    jit_stub* s;
+    if(address >= 0)
+    {
+        emit_field(j, OP_W, X86_LOAD, RCX, offset_write_page + (address >> 8) * sizeof(byte*));
+        emit_rr(j, OP_W, X86_TEST, RCX, RCX);
+        s = emit_stub_jump(j, b, JZ, sizeof(JZ), STUB_WRITE, i, address);
+        emit_rm(j, OP_BREG, X86_STORE8, RAX, RCX, -1, 0, address & 0xff);
+    }
+    else
+    {
+        emit_mov(j, RCX, REG_ADDR);
+        emit_shift(j, SHIFT_SHR, RCX, 8);
+        emit_rm(j, OP_W, X86_LOAD, RCX, RBX, RCX, 3, offset_write_page);
+        emit_rr(j, OP_W, X86_TEST, RCX, RCX);
+        s = emit_stub_jump(j, b, JZ, sizeof(JZ), STUB_WRITE, i, -1);
+        emit_rr(j, OP_BRM, X86_MOVZX8, RDX, REG_ADDR);
+        emit_rm(j, OP_BREG, X86_STORE8, RAX, RCX, RDX, 0, 0);
+    }
+    s->back = j->code + j->used;
+}
+
+// Computes the effective address as effective_address does. Returns it if it is
+// known when translating, or -1 if it is left in REG_ADDR. With page, esi is left
+// with the cycle a page crossing adds, to be added once the access is done.
+static int32_t emit_address(jit* j, jit_block* b, int i, address_mode mode, uint16_t operand, int page)
+{
+    int index = mode == ind_zpg_y || mode == ind_abs_y || mode == indir_ind_y ? REG_Y : REG_X;
+    switch(mode)
+    {
+        case zpg:
+        case absolute:
+            return operand;
+        case ind_zpg_x:
+        case ind_zpg_y:
+            emit_rm(j, 0, X86_LEA, REG_ADDR, index, -1, 0, operand);
+            emit_rr(j, OP_BRM, X86_MOVZX8, REG_ADDR, REG_ADDR);
+            return -1;
+        case ind_abs_x:
+        case ind_abs_y:
+            emit_rm(j, 0, X86_LEA, REG_ADDR, index, -1, 0, operand);
+            emit_rr(j, 0, X86_MOVZX16, REG_ADDR, REG_ADDR);
+            if(page)
+            {
+                emit_rm(j, 0, X86_LEA, RSI, index, -1, 0, operand & 0xff);
+                emit_shift(j, SHIFT_SHR, RSI, 8);
+            }
+            return -1;
+        case ind_indir_x:
+            emit_rm(j, 0, X86_LEA, REG_ADDR, index, -1, 0, operand);
+            emit_rr(j, OP_BRM, X86_MOVZX8, REG_ADDR, REG_ADDR);
+            emit_read(j, b, i, -1);
+            emit_mov(j, RSI, RAX);
+            emit_rm(j, 0, X86_LEA, REG_ADDR, REG_ADDR, -1, 0, 1);
+            emit_rr(j, OP_BRM, X86_MOVZX8, REG_ADDR, REG_ADDR);
+            emit_read(j, b, i, -1);
+            emit_shift(j, SHIFT_SHL, RAX, 8);
+            emit_rr(j, 0, X86_OR, RSI, RAX);
+            emit_mov(j, REG_ADDR, RAX);
+            return -1;
+        case indir_ind_y:
+            emit_read(j, b, i, operand);
+            emit_mov(j, RSI, RAX);
+            emit_read(j, b, i, (operand + 1) & 0xff);
+            emit_shift(j, SHIFT_SHL, RAX, 8);
+            emit_rr(j, 0, X86_OR, RSI, RAX);
+            emit_rm(j, 0, X86_LEA, REG_ADDR, RAX, index, 0, 0);
+            emit_rr(j, 0, X86_MOVZX16, REG_ADDR, REG_ADDR);
+            if(page)
+            {
+                emit_rr(j, OP_BRM, X86_MOVZX8, RSI, RAX);
+                emit_rr(j, 0, X86_ADD, index, RSI);
+                emit_shift(j, SHIFT_SHR, RSI, 8);
+            }
+            return -1;
+        default:
+            return 0;
+    }
+}
+
+// Leaves the value an instruction operates on in eax, as load does.
+static void emit_load(jit* j, jit_block* b, int i, address_mode mode, uint16_t operand, int page)
+{
+    if(mode == imm)
+    {
+        emit_mov_imm(j, RAX, operand);
+        return;
+    }
+    if(mode == reg_A)
+    {
+        emit_mov(j, RAX, REG_A);
+        return;
+    }
+    int32_t address = emit_address(j, b, i, mode, operand, page);
+    emit_read(j, b, i, address);
+    if(page && address < 0)
+        emit_rr(j, OP_W, X86_ADD, RSI, REG_EXTRA);
+}
+
+// Leaves before instruction i unless the stack has room for count pushes, or
+// -count pops, so the interpreter raises EVENT_STACK.
+static void emit_stack_check(jit* j, jit_block* b, int i, int count)
+{
+    emit_field(j, 0, X86_MOVZX8, RCX, offset_sp);
+    emit_alu_imm(j, 0, ALU_CMP, RCX, count > 0 ? count : 0x100 + count);
+    if(count > 0)
+        emit_stub_jump(j, b, JB, sizeof(JB), STUB_RETRY, i, 0);
+    else
+        emit_stub_jump(j, b, JAE, sizeof(JAE), STUB_RETRY, i, 0);
+}
+
+// Pushes al. The stack was checked for room.
+static void emit_push(jit* j, jit_block* b, int i)
+{
+    emit_field(j, 0, X86_MOVZX8, REG_ADDR, offset_sp);
+    emit_alu_imm(j, 0, ALU_OR, REG_ADDR, 0x100);
+    emit_write(j, b, i, -1);
+    emit_field(j, 0, X86_INC8, 1, offset_sp);   // dec byte [rbx + SP]
+}
+
+// Pops into eax. The stack was checked for something to pop.
+static void emit_pop(jit* j, jit_block* b, int i)
+{
+    emit_field(j, 0, X86_INC8, 0, offset_sp);   // inc byte [rbx + SP]
+    emit_field(j, 0, X86_MOVZX8, REG_ADDR, offset_sp);
+    emit_alu_imm(j, 0, ALU_OR, REG_ADDR, 0x100);
+    emit_read(j, b, i, -1);
+}
+
+// N and Z from a register holding a byte.
+static void emit_nz(jit* j, int reg)
+{
+    emit_mov(j, REG_NZ, reg);
+}
+
+// Sets the carry from a register holding 0 or 1.
+static void emit_set_carry(jit* j, int reg)
+{
+    emit_alu_imm(j, 0, ALU_AND, REG_P, ~flag_C);
+    emit_rr(j, 0, X86_OR, reg, REG_P);
+}
+
+/* Instructions */
+
+// Every instruction is written against a generic addressing mode, like the
+// ones in cpu.c, and emits the code for one instruction of a block. Those that
+// are left to the interpreter return END_FALLBACK before emitting anything.
+#define NATIVE(name) static jit_end native_##name(jit* j, jit_block* b, int i, \
+    const address_mode mode, uint16_t operand, const int page)
+
+#define NATIVE_FALLBACK(name) NATIVE(name) { return END_FALLBACK; }
+
+// Read-modify-write instructions work on either the accumulator or memory, with eax
+// holding the byte to modify and the result.
+#define NATIVE_RMW(name, modify) \
+    NATIVE(name) \
+    { \
+        int32_t address = 0; \
+        if(mode == reg_A) \
+            emit_mov(j, RAX, REG_A); \
+        else \
+        { \
+            address = emit_address(j, b, i, mode, operand, 0); \
+            emit_read(j, b, i, address); \
+        } \
+        modify; \
+        emit_nz(j, RAX); \
+        if(mode == reg_A) \
+            emit_mov(j, REG_A, RAX); \
+        else \
+            emit_write(j, b, i, address); \
+        return END_NEXT; \
+    }
+
+#define NATIVE_LOAD(name, reg) \
+    NATIVE(name) \
+    { \
+        emit_load(j, b, i, mode, operand, page); \
+        emit_mov(j, reg, RAX); \
+        emit_nz(j, RAX); \
+        return END_NEXT; \
+    }
+
+#define NATIVE_STORE(name, reg) \
+    NATIVE(name) \
+    { \
+        int32_t address = emit_address(j, b, i, mode, operand, 0); \
+        emit_mov(j, RAX, reg); \
+        emit_write(j, b, i, address); \
+        return END_NEXT; \
+    }
+
+#define NATIVE_LOGIC(name, op) \
+    NATIVE(name) \
+    { \
+        emit_load(j, b, i, mode, operand, page); \
+        emit_rr(j, 0, op, RAX, REG_A); \
+        emit_nz(j, REG_A); \
+        return END_NEXT; \
+    }
+
+#define NATIVE_COMPARE(name, reg) \
+    NATIVE(name) \
+    { \
+        emit_load(j, b, i, mode, operand, page); \
+        emit_compare(j, reg); \
+        return END_NEXT; \
+    }
+
+#define NATIVE_STEP(name, reg, delta) \
+    NATIVE(name) \
+    { \
+        emit_alu_imm(j, 0, ALU_ADD, reg, delta); \
+        emit_rr(j, OP_BRM, X86_MOVZX8, reg, reg); \
+        emit_nz(j, reg); \
+        return END_NEXT; \
+    }
+
+#define NATIVE_TRANSFER(name, from, to) \
+    NATIVE(name) \
+    { \
+        emit_mov(j, to, from); \
+        emit_nz(j, to); \
+        return END_NEXT; \
+    }
+
+#define NATIVE_FLAG(name, alu, flag) \
+    NATIVE(name) \
+    { \
+        emit_alu_imm(j, 0, alu, REG_P, flag); \
+        return END_NEXT; \
+    }
+
+// Taken when the flag test leaves the x86 zero flag as when_zero says.
+#define NATIVE_BRANCH(name, test, when_zero) \
+    NATIVE(name) \
+    { \
+        if((int8_t)operand == -2) \
+            return END_FALLBACK; /* the interpreter checks if it jams */ \
+        test; \
+        emit_branch(j, b, i, operand, when_zero); \
+        return END_DONE; \
+    }
+
+// ADC of eax, as add_with_carry does.
+static void emit_add(jit* j)
+{
+    emit_mov(j, RCX, REG_P);
+    emit_alu_imm(j, 0, ALU_AND, RCX, flag_C);
+    emit_rr(j, 0, X86_ADD, RAX, RCX);
+    emit_rr(j, 0, X86_ADD, REG_A, RCX);             // ecx = A + data + C
+    emit_mov(j, RDX, REG_A);
+    emit_rr(j, 0, X86_XOR, RAX, RDX);
+    emit_rr(j, 0, 0xf7, 2, RDX);                    // not edx: ~(A ^ data)
+    emit_rr(j, 0, X86_XOR, RCX, REG_A);             // A ^ result
+    emit_rr(j, 0, X86_AND, REG_A, RDX);
+    emit_alu_imm(j, 0, ALU_AND, RDX, 0x80);
+    emit_shift(j, SHIFT_SHR, RDX, 1);               // the sign is wrong: V
+    emit_alu_imm(j, 0, ALU_AND, REG_P, ~(flag_V | flag_C));
+    emit_rr(j, 0, X86_OR, RDX, REG_P);
+    emit_rr(j, OP_BRM, X86_MOVZX8, REG_A, RCX);
+    emit_shift(j, SHIFT_SHR, RCX, 8);
+    emit_rr(j, 0, X86_OR, RCX, REG_P);
+    emit_nz(j, REG_A);
+}
+
+// ADC and SBC. Decimal mode is left to the interpreter's handler.
+static jit_end emit_add_with_mode(jit* j, jit_block* b, int i, address_mode mode, uint16_t operand, int page, bool subtract)
+{
+    emit_test8(j, REG_P, flag_D);
+    jit_stub* decimal = emit_stub_jump(j, b, JNE, sizeof(JNE), STUB_DECIMAL, i, 0);
+    emit_load(j, b, i, mode, operand, page);
+    if(subtract)
+        emit_alu_imm(j, 0, ALU_XOR, RAX, 0xff);
+    emit_add(j);
+    decimal->back = j->code + j->used;
+    return END_NEXT;
+}
+
+// CMP, CPX and CPY of eax, as compare does.
+static void emit_compare(jit* j, int reg)
+{
+    emit_alu_imm(j, 0, ALU_AND, REG_P, ~flag_C);
+    emit_rr(j, 0, X86_CMP, reg, RAX);               // cmp reg, eax
+    emit_rr(j, OP_BRM, 0x0f93, 0, RCX);             // setae cl
+    emit_rr(j, OP_BRM, X86_MOVZX8, RCX, RCX);
+    emit_rr(j, 0, X86_OR, RCX, REG_P);
+    emit_mov(j, REG_NZ, reg);
+    emit_rr(j, 0, 0x29, RAX, REG_NZ);               // sub r11d, eax
+    emit_rr(j, OP_BRM, X86_MOVZX8, REG_NZ, REG_NZ);
+}
+
+// Leaves the block for the successor at pc, and lets the exit be chained.
+static void emit_exit(jit* j, jit_block* b, uint16_t pc, uint32_t base)
+{
+    emit_store_pc(j, pc);
+    emit_leave(j, b->count, base);
+    b->slots[b->slot_count++] = emit_jump(j, JMP, sizeof(JMP), NULL);
+}
+
+// A taken branch adds a cycle, and another if it lands on a different page.
+static void emit_branch(jit* j, jit_block* b, int i, uint16_t operand, bool when_zero)
+{
+    const jit_insn* insn = &b->insns[i];
+    uint16_t target = insn->next + (int8_t)operand;
+    uint32_t base = b->before[i + 1];
+    byte* taken = emit_jump(j, when_zero ? JZ : JNE, 2, NULL);
+    emit_exit(j, b, insn->next, base);
+    patch_rel32(taken, j->code + j->used);
+    emit_exit(j, b, target, base + 1 + ((target ^ insn->next) > 0xff));
+}
+
+NATIVE(ADC) { return emit_add_with_mode(j, b, i, mode, operand, page, false); }
+NATIVE(SBC) { return emit_add_with_mode(j, b, i, mode, operand, page, true); }
+NATIVE_LOGIC(AND, X86_AND)
+NATIVE_LOGIC(EOR, X86_XOR)
+NATIVE_LOGIC(ORA, X86_OR)
+
+NATIVE_RMW(ASL,
+    emit_mov(j, RCX, RAX);
+    emit_shift(j, SHIFT_SHR, RCX, 7);
+    emit_set_carry(j, RCX);
+    emit_rr(j, 0, X86_ADD, RAX, RAX);
+    emit_rr(j, OP_BRM, X86_MOVZX8, RAX, RAX))
+NATIVE_RMW(LSR,
+    emit_mov(j, RCX, RAX);
+    emit_alu_imm(j, 0, ALU_AND, RCX, flag_C);
+    emit_set_carry(j, RCX);
+    emit_shift(j, SHIFT_SHR, RAX, 1))
+NATIVE_RMW(ROL,
+    emit_mov(j, RDX, REG_P);
+    emit_alu_imm(j, 0, ALU_AND, RDX, flag_C);
+    emit_mov(j, RCX, RAX);
+    emit_shift(j, SHIFT_SHR, RCX, 7);
+    emit_set_carry(j, RCX);
+    emit_rm(j, 0, X86_LEA, RAX, RDX, RAX, 1, 0);    // lea eax, [rdx + rax * 2]
+    emit_rr(j, OP_BRM, X86_MOVZX8, RAX, RAX))
+NATIVE_RMW(ROR,
+    emit_mov(j, RDX, REG_P);
+    emit_alu_imm(j, 0, ALU_AND, RDX, flag_C);
+    emit_shift(j, SHIFT_SHL, RDX, 7);
+    emit_mov(j, RCX, RAX);
+    emit_alu_imm(j, 0, ALU_AND, RCX, flag_C);
+    emit_set_carry(j, RCX);
+    emit_shift(j, SHIFT_SHR, RAX, 1);
+    emit_rr(j, 0, X86_OR, RDX, RAX))
+NATIVE_RMW(DEC,
+    emit_alu_imm(j, 0, ALU_SUB, RAX, 1);
+    emit_rr(j, OP_BRM, X86_MOVZX8, RAX, RAX))
+NATIVE_RMW(INC,
+    emit_alu_imm(j, 0, ALU_ADD, RAX, 1);
+    emit_rr(j, OP_BRM, X86_MOVZX8, RAX, RAX))
+
+NATIVE_BRANCH(BCC, emit_test8(j, REG_P, flag_C), true)
+NATIVE_BRANCH(BCS, emit_test8(j, REG_P, flag_C), false)
+NATIVE_BRANCH(BVC, emit_test8(j, REG_P, flag_V), true)
+NATIVE_BRANCH(BVS, emit_test8(j, REG_P, flag_V), false)
+NATIVE_BRANCH(BEQ, emit_rr(j, OP_BREG | OP_BRM, X86_TEST8, REG_NZ, REG_NZ), true)
+NATIVE_BRANCH(BNE, emit_rr(j, OP_BREG | OP_BRM, X86_TEST8, REG_NZ, REG_NZ), false)
+// N is bit 7 of either byte of nz_result
+#define TEST_N \
+    emit_mov(j, RAX, REG_NZ); \
+    emit_shift(j, SHIFT_SHR, RAX, 8); \
+    emit_rr(j, 0, X86_OR, REG_NZ, RAX); \
+    emit_test8(j, RAX, flag_N)
+NATIVE_BRANCH(BMI, TEST_N, false)
+NATIVE_BRANCH(BPL, TEST_N, true)
+
+NATIVE(BIT)
+{
+    emit_load(j, b, i, mode, operand, page);
+    emit_alu_imm(j, 0, ALU_AND, REG_P, ~flag_V);
+    emit_mov(j, RCX, RAX);
+    emit_alu_imm(j, 0, ALU_AND, RCX, flag_V);
+    emit_rr(j, 0, X86_OR, RCX, REG_P);
+    emit_mov(j, RCX, RAX);
+    emit_alu_imm(j, 0, ALU_AND, RCX, flag_N);
+    emit_shift(j, SHIFT_SHL, RCX, 8);
+    emit_mov(j, REG_NZ, REG_A);
+    emit_rr(j, 0, X86_AND, RAX, REG_NZ);
+    emit_rr(j, 0, X86_OR, RCX, REG_NZ);             // Z from A & data, N from data
+    return END_NEXT;
+}
+
+NATIVE_FALLBACK(BRK)
+NATIVE_FALLBACK(CLI)        // irq_unmasked can stop the run
+NATIVE_FALLBACK(PLP)
+NATIVE_FALLBACK(RTI)
+
+NATIVE_FLAG(CLC, ALU_AND, ~flag_C)
+NATIVE_FLAG(CLD, ALU_AND, ~flag_D)
+NATIVE_FLAG(CLV, ALU_AND, ~flag_V)
+NATIVE_FLAG(SEC, ALU_OR, flag_C)
+NATIVE_FLAG(SED, ALU_OR, flag_D)
+NATIVE_FLAG(SEI, ALU_OR, flag_I)
+
+NATIVE_COMPARE(CMP, REG_A)
+NATIVE_COMPARE(CPX, REG_X)
+NATIVE_COMPARE(CPY, REG_Y)
+
+NATIVE_STEP(DEX, REG_X, -1)
+NATIVE_STEP(DEY, REG_Y, -1)
+NATIVE_STEP(INX, REG_X, 1)
+NATIVE_STEP(INY, REG_Y, 1)
+
+NATIVE(JMP)
+{
+    if(mode != absolute || operand == b->insns[i].address)
+        return END_FALLBACK; // the interpreter reads the pointer, or checks if it jams
+    b->target = operand;
+    return END_STATIC;
+}
+
+NATIVE(JSR)
+{
+    uint16_t pc = b->insns[i].next - 1;
+    emit_stack_check(j, b, i, 2);
+    emit_mov_imm(j, RAX, pc >> 8);
+    emit_push(j, b, i);
+    emit_mov_imm(j, RAX, pc & 0xff);
+    emit_push(j, b, i);
+    b->target = operand;
+    return END_STATIC;
+}
+
+NATIVE_LOAD(LDA, REG_A)
+NATIVE_LOAD(LDX, REG_X)
+NATIVE_LOAD(LDY, REG_Y)
+
+NATIVE(NOP) { return END_NEXT; }
+
+NATIVE(PHA)
+{
+    emit_stack_check(j, b, i, 1);
+    emit_mov(j, RAX, REG_A);
+    emit_push(j, b, i);
+    return END_NEXT;
+}
+
+NATIVE(PHP)
+{
+    // cpu_get_flags with B and U
+    emit_stack_check(j, b, i, 1);
+    emit_mov(j, RAX, REG_NZ);
+    emit_shift(j, SHIFT_SHR, RAX, 8);
+    emit_rr(j, 0, X86_OR, REG_NZ, RAX);
+    emit_alu_imm(j, 0, ALU_AND, RAX, flag_N);
+    emit_rr(j, OP_BREG | OP_BRM, X86_TEST8, REG_NZ, REG_NZ);
+    emit_rr(j, OP_BRM, 0x0f94, 0, RCX);             // sete cl
+    emit_rr(j, OP_BRM, X86_MOVZX8, RCX, RCX);
+    emit_rm(j, 0, X86_LEA, RAX, RAX, RCX, 1, flag_B | flag_U);  // lea eax, [rax + rcx * 2 + B | U]
+    emit_rr(j, 0, X86_OR, REG_P, RAX);
+    emit_push(j, b, i);
+    return END_NEXT;
+}
+
+NATIVE(PLA)
+{
+    emit_stack_check(j, b, i, -1);
+    emit_pop(j, b, i);
+    emit_mov(j, REG_A, RAX);
+    emit_nz(j, RAX);
+    return END_NEXT;
+}
+
+NATIVE(RTS)
+{
+    emit_stack_check(j, b, i, -2);
+    emit_pop(j, b, i);
+    emit_mov(j, RSI, RAX);
+    emit_pop(j, b, i);
+    emit_shift(j, SHIFT_SHL, RAX, 8);
+    emit_rm(j, 0, X86_LEA, RAX, RAX, RSI, 0, 1);    // lea eax, [rax + rsi + 1]
+    emit_field(j, OP_16, X86_STORE, RAX, offset_pc);
+    return END_DYNAMIC;
+}
+
+NATIVE_STORE(STA, REG_A)
+NATIVE_STORE(STX, REG_X)
+NATIVE_STORE(STY, REG_Y)
+
+NATIVE_TRANSFER(TAX, REG_A, REG_X)
+NATIVE_TRANSFER(TAY, REG_A, REG_Y)
+NATIVE_TRANSFER(TXA, REG_X, REG_A)
+NATIVE_TRANSFER(TYA, REG_Y, REG_A)
+
+NATIVE(TSX)
+{
+    emit_field(j, 0, X86_MOVZX8, REG_X, offset_sp);
+    emit_nz(j, REG_X);
+    return END_NEXT;
+}
+
+NATIVE(TXS)
+{
+    emit_field(j, OP_BREG, X86_STORE8, REG_X, offset_sp);
+    return END_NEXT;
+}
+
+typedef jit_end (*native_emitter)(jit* j, jit_block* b, int i, const address_mode mode, uint16_t operand, const int page);
+
+// The instruction's emitter with the addressing mode and page penalty fixed, like the decoded handlers
+#define NATIVE_HANDLER(code, name, mode, cycles, page) \
+    static jit_end native_##code(jit* j, jit_block* b, int i, const address_mode unused, uint16_t operand, const int no_page) \
+    { \
+        return native_##name(j, b, i, mode, operand, page); \
+    }
+OPCODE_TABLE(NATIVE_HANDLER)
+
+#define NATIVE_ENTRY(code, name, mode, cycles, page) [code] = native_##code,
+static const native_emitter native_table[256] =
+{
+    OPCODE_TABLE(NATIVE_ENTRY)
+};
+
+// Code is only translated from plain memory on pages that are not written too often.
+static bool translatable(const jit* j, const machine* cpu, uint16_t address)
+{
+    int n = address >> 8;
+    return cpu->read_page[n] != NULL && j->invalidations[n] < JIT_SMC_LIMIT;
+}
+
+static bool ends_block(const opcode_info* info)
+{
+    static const char* const enders[] = { "JMP", "JSR", "RTS", "RTI", "BRK" };
+    if(info->mode == rel)
+        return true;
+    for(size_t i = 0; i < sizeof(enders) / sizeof(enders[0]); i++)
+        if(strcmp(info->name, enders[i]) == 0)
+            return true;
+    return false;
+}
+
+static void flush(jit* j, machine* cpu)
+{
+    for(int n = 0; n < BUS_PAGE_COUNT; n++)
+        if(cpu->pages[n].traps & BUS_TRAP_CODE)
+            bus_set_traps(cpu, n, 0, BUS_TRAP_CODE);
+    memset(j->blocks, 0, sizeof(j->blocks));
+    j->used = j->stubs;
+    j->flush_pending = false;
+    j->flushes++;
+}
+
+// Worst case size of a translated instruction with its stubs, and of the block's entry and exits.
+#define INSN_CODE_SIZE 1536
+#define BLOCK_CODE_SIZE 512
+
+static byte* translate(jit* j, machine* cpu, uint16_t start)
+{
+    jit_block b;
+    byte* slots[2];
+    b.count = 0;
+    b.stub_count = 0;
+    b.slots = slots;
+    b.slot_count = 0;
+    b.before[0] = 0;
+    uint16_t pc = start;
+    bool ended = false;
+    uint32_t longest = 0; // cycles the block can take before its last instruction
+    while(b.count < JIT_MAX_BLOCK && !ended)
+    {
+        if(!translatable(j, cpu, pc))
+            break;
+        byte opcode = read_memory(cpu, pc);
+        const opcode_info* info = &opcode_table[opcode];
+        uint16_t last = pc + info->length;
+        if(info->name == NULL || !translatable(j, cpu, last))
+            break; // left to the interpreter
+        jit_insn* insn = &b.insns[b.count];
+        insn->opcode = opcode;
+        insn->operand = 0;
+        if(info->length >= 1)
+            insn->operand = read_memory(cpu, (uint16_t)(pc + 1));
+        if(info->length == 2)
+            insn->operand |= read_memory(cpu, (uint16_t)(pc + 2)) << 8;
+        insn->address = pc;
+        insn->next = last + 1;
+        ended = ends_block(info);
+        if(!ended)
+            longest += info->cycles + info->page_penalty;
+        b.before[b.count + 1] = b.before[b.count] + info->cycles;
+        b.count++;
+        pc = insn->next;
+    }
+    if(b.count == 0)
+        return NULL;
+    if(!ended)
+        longest -= opcode_table[b.insns[b.count - 1].opcode].cycles + opcode_table[b.insns[b.count - 1].opcode].page_penalty;
+
+    if(j->used + BLOCK_CODE_SIZE + b.count * INSN_CODE_SIZE > JIT_CODE_SIZE)
+        flush(j, cpu);
+    byte* block = j->code + j->used;
+
+    // Entered from the dispatcher or chained, the block only runs if it can run to
+    // its end: every instruction fits in the budget, and only the last one can
+    // reach the stop cycle. Otherwise the dispatcher interprets the next instruction.
+    emit_alu_imm(j, OP_W, ALU_CMP, R12, b.count);
+    emit_jump(j, JB, sizeof(JB), j->exit);
+    emit_field(j, OP_W, X86_LOAD, RAX, offset_cycles);
+    emit_alu_imm(j, OP_W, ALU_ADD, RAX, longest);
+    emit_field(j, OP_W, X86_CMP, RAX, offset_stop_cycle);
+    emit_jump(j, JAE, sizeof(JAE), j->exit);
+    emit_field(j, OP_W, X86_LOAD, RAX, offset_stop_cycle);
+    emit_rm(j, OP_W, X86_STORE, RAX, RSP, -1, 0, FRAME_STOP);
+    emit_load_state(j);
+    emit_rr(j, 0, X86_XOR, REG_EXTRA, REG_EXTRA);
+    emit_rr(j, 0, X86_XOR, REG_STOP, REG_STOP);
+
+    jit_end end = END_NEXT;
+    for(int i = 0; i < b.count; i++)
+    {
+        const jit_insn* insn = &b.insns[i];
+        int stubs = b.stub_count;
+        end = native_table[insn->opcode](j, &b, i, impl, insn->operand, 0);
+        if(end == END_FALLBACK)
+        {
+            emit_handler_call(j, &b, i);
+            end = ends_block(&opcode_table[insn->opcode]) ? END_DYNAMIC : END_NEXT;
+            stubs = -1;
+        }
+        // A call into C that moved the stop cycle ends the block after the instruction
+        if(b.stub_count != stubs && end != END_DONE)
+        {
+            int32_t leave_pc = stubs < 0 || end == END_DYNAMIC ? -1 : end == END_STATIC ? b.target : insn->next;
+            emit_rr(j, OP_W, X86_TEST, REG_STOP, REG_STOP);
+            emit_stub_jump(j, &b, JNE, sizeof(JNE), STUB_STOP, i, leave_pc);
+        }
+    }
+
+    // Exits to the successors known now. Each is a jump that can be patched to chain
+    // to its block. Until then it goes to a stub that reports the jump as the exit slot.
+    uint32_t base = b.before[b.count];
+    if(end == END_NEXT)
+        emit_exit(j, &b, b.insns[b.count - 1].next, base);
+    else if(end == END_STATIC)
+        emit_exit(j, &b, b.target, base);
+    else if(end == END_DYNAMIC)
+    {
+        // continue straight at the block for the PC if there is one
+        emit_leave(j, b.count, base);
+        emit_field(j, 0, X86_MOVZX16, RAX, offset_pc);
+        emit_opcode(j, OP_W, 0xb8 + RCX, 0, 0, RCX);           // mov rcx, imm64
+        emit64(j, (uint64_t)(uintptr_t)j->blocks);
+        emit_rm(j, OP_W, X86_LOAD, RAX, RCX, RAX, 3, 0);
+        emit_rr(j, OP_W, X86_TEST, RAX, RAX);
+        emit_jump(j, JZ, sizeof(JZ), j->exit);
+        emit_rr(j, 0, 0xff, 4, RAX);                          // jmp rax
+    }
+    for(int i = 0; i < b.stub_count; i++)
+        emit_stub(j, &b, &b.stubs[i]);
+    static const byte LEA_RAX[]   = { 0x48, 0x8d, 0x05 };       // lea rax, [rip + disp32]
+    static const byte STORE_R13[] = { 0x49, 0x89, 0x45, 0x00 }; // mov [r13], rax
+    for(int i = 0; i < b.slot_count; i++)
+    {
+        patch_rel32(slots[i], j->code + j->used);
+        emit(j, LEA_RAX, sizeof(LEA_RAX));
+        byte* field = j->code + j->used;
+        emit32(j, 0);
+        patch_rel32(field, slots[i]);
+        emit(j, STORE_R13, sizeof(STORE_R13));
+        emit_jump(j, JMP, sizeof(JMP), j->epilogue);
+    }
+
+    // Writes to the code must invalidate it
+    for(int i = 0; i < b.count; i++)
+    {
+        int first = b.insns[i].address >> 8;
+        int last = (uint16_t)(b.insns[i].next - 1) >> 8;
+        if(cpu->pages[first].access & BUS_WRITE)
+            bus_set_traps(cpu, first, BUS_TRAP_CODE, 0);
+        if(cpu->pages[last].access & BUS_WRITE)
+            bus_set_traps(cpu, last, BUS_TRAP_CODE, 0);
+    }
+
+    j->blocks[start] = block;
+    j->translated++;
+    return block;
+}
+
+/* Public interface */
+
+jit* jit_create(void)
+{
+    jit* j = calloc(1, sizeof(jit));
+    if(j == NULL)
+        return NULL;
+    j->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(j->code == MAP_FAILED)
+    {
+        free(j);
+        return NULL;
+    }
+    emit_stubs(j);
+    return j;
+}
+
+void jit_destroy(jit* j)
+{
+    if(j == NULL)
+        return;
+    munmap(j->code, JIT_CODE_SIZE);
+    free(j);
+}
+
+void jit_attach(machine* cpu, jit* j)
+{
+    if(cpu->jit)
+    {
+        flush(cpu->jit, cpu);
+        cpu->jit->cpu = NULL;
+    }
+    cpu->jit = j;
+    if(j)
+    {
+        if(j->cpu)
+            jit_attach(j->cpu, NULL);
+        j->cpu = cpu;
+        flush(j, cpu);
+        j->translated = j->chained = j->flushes = j->native = j->interpreted = 0;
+        memset(j->heat, 0, sizeof(j->heat));
+        memset(j->invalidations, 0, sizeof(j->invalidations));
+    }
+}
+
+uint32_t jit_run(machine* cpu, uint64_t* budget)
+{
+    jit* j = cpu->jit;
+    uint64_t remaining = *budget;
+    const uint64_t stop_cycle = cpu->stop_cycle;
+    while(true)
+    {
+        if(j->flush_pending)
+        {
+            // jit_code_written borrowed the stop cycle to end the block early.
+            // A replay may have wanted it too, so cpu_run sets it again.
+            flush(j, cpu);
+            if(!cpu->events && !cpu_interrupt_pending(cpu) && !cpu->replay)
+                cpu->stop_cycle = stop_cycle;
+        }
+        if(cpu->cycles >= cpu->stop_cycle || remaining == 0)
+            break;
+
+        byte* block = j->blocks[PC];
+        if(block == NULL && ++j->heat[PC] >= JIT_HOT)
+        {
+            j->heat[PC] = 0;
+            block = translate(j, cpu, PC);
+        }
+        uint64_t before = remaining;
+        byte* exit_slot = NULL;
+        if(block)
+        {
+            remaining = j->enter(cpu, remaining, &exit_slot, block);
+            j->native += before - remaining;
+        }
+        if(remaining == before)
+        {
+            // no block, or it could not run to its end
+            cpu_do_next_op(cpu);
+            remaining--;
+            j->interpreted++;
+            continue;
+        }
+        if(exit_slot && !j->flush_pending && j->blocks[PC])
+        {
+            patch_rel32(exit_slot, j->blocks[PC]);
+            j->chained++;
+        }
+    }
+    *budget = remaining;
+    return cpu->events;
+}
+
+void jit_code_written(machine* cpu, uint16_t address)
+{
+    jit* j = cpu->jit;
+    if(j == NULL)
+        return;
+    byte* count = &j->invalidations[address >> 8];
+    if(*count < JIT_SMC_LIMIT)
+        (*count)++;
+    j->flush_pending = true;
+    cpu->stop_cycle = 0; // leave the block after this instruction, like an event
+}
+
+void jit_flush(machine* cpu)
+{
+    if(cpu->jit)
+        flush(cpu->jit, cpu);
+}
+
+void jit_print_stats(const jit* j, FILE* out)
+{
+    int interpreted_pages = 0;
+    for(int n = 0; n < BUS_PAGE_COUNT; n++)
+        interpreted_pages += j->invalidations[n] >= JIT_SMC_LIMIT;
+    fprintf(out, "JIT: %llu blocks translated, %llu chained, %llu flushes, %d pages interpreted. "
+        "%llu instructions native, %llu interpreted\n",
+        (unsigned long long)j->translated, (unsigned long long)j->chained, (unsigned long long)j->flushes,
+        interpreted_pages, (unsigned long long)j->native, (unsigned long long)j->interpreted);
+}
+
+#else
+
+jit* jit_create(void) { return NULL; }
+void jit_destroy(jit* j) { }
+void jit_attach(machine* cpu, jit* j) { cpu->jit = NULL; }
+uint32_t jit_run(machine* cpu, uint64_t* remaining) { return cpu->events; } // never attached, so runs nothing
+void jit_code_written(machine* cpu, uint16_t address) { }
+void jit_flush(machine* cpu) { }
+void jit_print_stats(const jit* j, FILE* out) { }
+
+#endif
@@ -0,0 +1,108 @@
+/**
+ * @file jit.h
+ * @author Mason Daub
+ * @brief Translates hot basic blocks of 6502 code into x86-64 machine code.
+ * 
+ * A block starts at any address that has been run JIT_HOT times and ends after
+ * a branch, JMP, JSR, RTS, RTI or BRK. Loads, stores, ALU and flag instructions,
+ * shifts, transfers, branches, JMP, JSR, RTS and the stack instructions become
+ * inline code, with A, X, Y and P held in host registers for the whole block.
+ * Memory is accessed through the bus's direct page pointers, and only pages
+ * without one call the bus. Decimal ADC and SBC, CLI, PLP, RTI, BRK, indirect
+ * JMP and loops that may jam call the interpreter's pre-decoded handler.
+ * 
+ * A block only runs if the instruction budget covers all of it and no
+ * instruction but the last can reach the stop cycle, which is one check on entry
+ * instead of one per instruction. Otherwise the next instruction is interpreted.
+ * A call into C that moves the stop cycle, like an event or an interrupt, leaves
+ * the block after its instruction, and an instruction that would overflow the
+ * stack is left to the interpreter, so results are identical to interpreting.
+ * 
+ * Blocks are chained: when a block exits to an address that has a block, the
+ * exit jump is patched to go straight there without returning to the dispatcher.
+ * 
+ * Writable pages that hold translated code are trapped on the bus. A write to one
+ * stops the running block after the current instruction and throws away all
+ * translated code. A page that keeps being written (self modifying code, or data
+ * sharing a page with code) is only interpreted from then on. Code is never
+ * translated from device pages.
+ * 
+ * Only x86-64 hosts with mmap are supported. Elsewhere jit_create returns NULL.
+ * 
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define JIT_CODE_SIZE (4 << 20)     // Bytes of executable memory. Everything is flushed when it fills up.
+#define JIT_MAX_BLOCK 32            // Most instructions in one block
+#define JIT_HOT 16                  // Times an address is interpreted before it is translated
+#define JIT_SMC_LIMIT 4             // Invalidations of a page before it is only interpreted
+
+/**
+ * @brief Allocates an empty code cache.
+ * 
+ * @return The cache, or NULL if the host is not supported or memory could not be mapped.
+ */
+jit* jit_create(void);
+
+/**
+ * @brief Frees a code cache. It must not be attached to a machine.
+ * 
+ * @param j The cache to free.
+ */
+void jit_destroy(jit* j);
+
+/**
+ * @brief Attaches a code cache to a machine, so cpu_run uses translated code.
+ * A cache can only be attached to one machine at a time.
+ * 
+ * @param cpu The machine.
+ * @param j The cache, or NULL to detach the current one and interpret again.
+ */
+void jit_attach(machine* cpu, jit* j);
+
+/**
+ * @brief The translated code version of cpu_run's loop.
+ * Called by cpu_run after it has set the machine's stop cycle.
+ * 
+ * @param cpu The machine to run. It must have a jit attached.
+ * @param remaining Instruction budget, or CPU_UNLIMITED. Less the instructions run when it returns.
+ * @return The pending events.
+ */
+uint32_t jit_run(machine* cpu, uint64_t* remaining);
+
+/**
+ * @brief Called by the bus when a trapped code page is written or remapped.
+ * 
+ * @param cpu The machine.
+ * @param address The address written.
+ */
+void jit_code_written(machine* cpu, uint16_t address);
+
+/**
+ * @brief Throws away all translated code. Needed after writing the machine's
+ * memory directly instead of through the bus.
+ * 
+ * @param cpu The machine.
+ */
+void jit_flush(machine* cpu);
+
+/**
+ * @brief Prints how much code was translated and run.
+ * 
+ * @param j The cache.
+ * @param out Where to print.
+ */
+void jit_print_stats(const jit* j, FILE* out);
+
+#endif // JIT_H
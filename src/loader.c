@@ -0,0 +1,396 @@
+/**
+ * @file loader.c
+ * @author Mason Daub
+ * @brief Loads ROM images and sets up a machine's memory layout.
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "loader.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LOADER_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+typedef enum _rom_format
+{
+    FORMAT_RAW,
+    FORMAT_PRG,
+    FORMAT_IHEX,
+    FORMAT_SREC,
+} rom_format;
+
+static rom_format file_format(const char* filename)
+{
+    static const struct { const char* extension; rom_format format; } formats[] =
+    {
+        { ".prg", FORMAT_PRG },
+        { ".hex", FORMAT_IHEX }, { ".ihx", FORMAT_IHEX }, { ".ihex", FORMAT_IHEX },
+        { ".srec", FORMAT_SREC }, { ".s19", FORMAT_SREC }, { ".s28", FORMAT_SREC },
+        { ".s37", FORMAT_SREC }, { ".mot", FORMAT_SREC },
+    };
+    const char* extension = strrchr(filename, '.');
+    if(extension == NULL || strchr(extension, '/'))
+        return FORMAT_RAW;
+    for(size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+        if(strcasecmp(extension, formats[i].extension) == 0)
+            return formats[i].format;
+    return FORMAT_RAW;
+}
+
+/*   Reading the file   */
+
+// Maps the whole file read-only, or reads it into a buffer where mmap is not available.
+static int open_file(rom_image* image, const char* filename)
+{
+#ifdef LOADER_MMAP
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0)
+        return -1;
+    struct stat info;
+    if(fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        close(fd);
+        return -1;
+    }
+    image->file_size = info.st_size;
+    if(image->file_size)
+    {
+        void* file = mmap(NULL, image->file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(file == MAP_FAILED)
+        {
+            close(fd);
+            return -1;
+        }
+        image->file = file;
+        image->mapped = true;
+    }
+    close(fd); // the mapping keeps the file open
+    return 0;
+#else
+    FILE* file = fopen(filename, "rb");
+    if(file == NULL)
+        return -1;
+    size_t capacity = 0;
+    size_t count;
+    do
+    {
+        if(image->file_size == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 0x10000;
+            byte* buffer = realloc(image->file, capacity);
+            if(buffer == NULL)
+            {
+                fclose(file);
+                return -1;
+            }
+            image->file = buffer;
+        }
+        count = fread(image->file + image->file_size, 1, capacity - image->file_size, file);
+        image->file_size += count;
+    }
+    while(count);
+    fclose(file);
+    return 0;
+#endif
+}
+
+static int add_segment(rom_image* image, uint16_t address, const byte* data, size_t size)
+{
+    rom_segment* segments = realloc(image->segments, (image->segment_count + 1) * sizeof(rom_segment));
+    if(segments == NULL)
+        return -1;
+    image->segments = segments;
+    image->segments[image->segment_count++] = (rom_segment){ address, size, data };
+    return 0;
+}
+
+/*   Text formats   */
+
+static int hex_digit(byte c)
+{
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Decodes the hex digits of a record. Returns the number of bytes, or -1 if the
+// digits are not pairs of hex digits.
+static int record_bytes(const byte* text, size_t length, byte* record)
+{
+    if(length % 2 != 0 || length / 2 > 0x110)
+        return -1;
+    for(size_t i = 0; i < length / 2; i++)
+    {
+        int high = hex_digit(text[2 * i]);
+        int low = hex_digit(text[2 * i + 1]);
+        if(high < 0 || low < 0)
+            return -1;
+        record[i] = (high << 4) | low;
+    }
+    return length / 2;
+}
+
+// Puts the data of one record into the decoded address space.
+static int place(rom_image* image, byte* present, unsigned long address, const byte* data, int size)
+{
+    if(address + size > 0x10000)
+        return -1;
+    memcpy(image->decoded + address, data, size);
+    memset(present + address, 1, size);
+    return 0;
+}
+
+// Intel HEX: ':' count, address, type, data and checksum, all in hex. The bytes sum to 0.
+static int ihex_record(rom_image* image, byte* present, const byte* record, int size, unsigned long* base, bool* done)
+{
+    if(size < 5 || record[0] != size - 5)
+        return -1;
+    byte sum = 0;
+    for(int i = 0; i < size; i++)
+        sum += record[i];
+    if(sum != 0)
+        return -1;
+    const byte* data = record + 4;
+    int count = record[0];
+    switch(record[3])
+    {
+        case 0x00: // data
+            return place(image, present, *base + ((record[1] << 8) | record[2]), data, count);
+        case 0x01: // end of file
+            *done = true;
+            return 0;
+        case 0x02: // extended segment address
+            if(count != 2)
+                return -1;
+            *base = ((data[0] << 8) | data[1]) << 4;
+            return 0;
+        case 0x04: // extended linear address
+            if(count != 2)
+                return -1;
+            *base = (unsigned long)((data[0] << 8) | data[1]) << 16;
+            return 0;
+        case 0x03: // start addresses, which the reset vector takes care of
+        case 0x05:
+            return 0;
+    }
+    return -1;
+}
+
+// Motorola S-record: 'S', type, then count, address, data and checksum in hex.
+// The count covers everything after it, and the checksum is the complement of their sum.
+static int srec_record(rom_image* image, byte* present, char type, const byte* record, int size, bool* done)
+{
+    if(size < 3 || record[0] != size - 1)
+        return -1;
+    byte sum = 0;
+    for(int i = 0; i < size - 1; i++)
+        sum += record[i];
+    if((byte)~sum != record[size - 1])
+        return -1;
+    int address_size;
+    switch(type)
+    {
+        case '1': address_size = 2; break;
+        case '2': address_size = 3; break;
+        case '3': address_size = 4; break;
+        case '7': case '8': case '9': // termination, with a start address
+            *done = true;
+            return 0;
+        case '0': case '5': case '6': // header and record counts
+            return 0;
+        default:
+            return -1;
+    }
+    int count = size - 2 - address_size;
+    if(count < 0)
+        return -1;
+    unsigned long address = 0;
+    for(int i = 0; i < address_size; i++)
+        address = (address << 8) | record[1 + i];
+    return place(image, present, address, record + 1 + address_size, count);
+}
+
+// Decodes a text format into a 64K address space and makes a segment of every run of bytes it set.
+static int decode_text(rom_image* image, rom_format format)
+{
+    image->decoded = calloc(0x10000, 1);
+    byte* present = calloc(0x10000 + 1, 1);
+    int status = image->decoded && present ? 0 : -1;
+    unsigned long base = 0;
+    bool done = false;
+    const byte* text = image->file;
+    const byte* end = text + image->file_size;
+    byte record[0x110];
+    while(status == 0 && !done && text < end)
+    {
+        const byte* line = text;
+        const byte* eol = memchr(text, '\n', end - text);
+        text = eol ? eol + 1 : end;
+        size_t length = (eol ? eol : end) - line;
+        while(length && (line[length - 1] == '\r' || line[length - 1] == ' ' || line[length - 1] == '\t'))
+            length--;
+        if(length == 0)
+            continue;
+        if(format == FORMAT_IHEX)
+        {
+            int size = line[0] == ':' ? record_bytes(line + 1, length - 1, record) : -1;
+            status = size < 0 ? -1 : ihex_record(image, present, record, size, &base, &done);
+        }
+        else
+        {
+            int size = line[0] == 'S' && length >= 2 ? record_bytes(line + 2, length - 2, record) : -1;
+            status = size < 0 ? -1 : srec_record(image, present, line[1], record, size, &done);
+        }
+    }
+    for(long address = 0; status == 0 && address < 0x10000; address++)
+    {
+        if(!present[address])
+            continue;
+        long first = address;
+        while(present[address])
+            address++;
+        status = add_segment(image, first, image->decoded + first, address - first);
+    }
+    free(present);
+    return status;
+}
+
+/*   Images   */
+
+int rom_open(rom_image* image, const char* filename)
+{
+    memset(image, 0, sizeof(rom_image));
+    if(open_file(image, filename) != 0)
+        return -1;
+    rom_format format = file_format(filename);
+    int status = 0;
+    if(format == FORMAT_IHEX || format == FORMAT_SREC)
+        status = decode_text(image, format);
+    else if(format == FORMAT_PRG)
+    {
+        if(image->file_size < 2)
+            status = -1;
+        else
+        {
+            uint16_t address = image->file[0] | (image->file[1] << 8);
+            size_t size = image->file_size - 2;
+            if(size > 0x10000 - address)
+                size = 0x10000 - address;
+            if(size)
+                status = add_segment(image, address, image->file + 2, size);
+        }
+    }
+    else if(image->file_size)
+        status = add_segment(image, ROM_START, image->file, image->file_size < ROM_SIZE ? image->file_size : ROM_SIZE);
+    if(status != 0)
+        rom_close(image);
+    return status;
+}
+
+void rom_close(rom_image* image)
+{
+#ifdef LOADER_MMAP
+    if(image->mapped)
+        munmap(image->file, image->file_size);
+    else
+#endif
+        free(image->file);
+    free(image->decoded);
+    free(image->segments);
+    memset(image, 0, sizeof(rom_image));
+}
+
+void rom_load(machine* cpu, const rom_image* image)
+{
+    for(int i = 0; i < image->segment_count; i++)
+    {
+        const rom_segment* segment = &image->segments[i];
+        size_t address = segment->address;
+        size_t end = address + segment->size;
+        while(address < end)
+        {
+            // one page, or what is left of the segment in it
+            size_t next = (address | 0xff) + 1;
+            if(next > end)
+                next = end;
+            const byte* data = segment->data + (address - segment->address);
+            const bus_page* page = &cpu->pages[address >> 8];
+            if(next - address == BUS_PAGE_SIZE && page->access == BUS_READ && page->memory == cpu->memory + address)
+                bus_map_memory(cpu, address, BUS_PAGE_SIZE, (byte*)data, BUS_READ);
+            else
+            {
+                memcpy(cpu->memory + address, data, next - address);
+                cpu_invalidate_decoded(cpu, address, next - address);
+            }
+            address = next;
+        }
+    }
+}
+
+void rom_copy(const rom_image* image, byte* memory, uint16_t start, size_t size)
+{
+    size_t end = start + size;
+    for(int i = 0; i < image->segment_count; i++)
+    {
+        const rom_segment* segment = &image->segments[i];
+        size_t first = segment->address > start ? segment->address : start;
+        size_t last = segment->address + segment->size < end ? segment->address + segment->size : end;
+        if(first < last)
+            memcpy(memory + (first - start), segment->data + (first - segment->address), last - first);
+    }
+}
+
+int read_file(machine* cpu, const char* filename)
+{
+    rom_image image;
+    if(rom_open(&image, filename) != 0)
+        return -1;
+    rom_copy(&image, cpu->memory, 0, sizeof(cpu->memory));
+    cpu_invalidate_decoded(cpu, 0, sizeof(cpu->memory));
+    rom_close(&image);
+    return 0;
+}
+
+int setup_memory_map(machine* cpu, const char* layout)
+{
+    bus_unmap(cpu, 0x0000, 0x10000);
+    while(*layout)
+    {
+        char kind[4];
+        unsigned int start, end;
+        int length;
+        if(sscanf(layout, "%3[a-z]:%x-%x%n", kind, &start, &end, &length) != 3 || start > end || end > 0xffff)
+            return -1;
+        byte access;
+        if(strcmp(kind, "ram") == 0)
+            access = BUS_READ | BUS_WRITE;
+        else if(strcmp(kind, "rom") == 0)
+            access = BUS_READ;
+        else
+            return -1;
+        // regions are rounded out to whole pages
+        start &= 0xff00;
+        end |= 0xff;
+        bus_map_memory(cpu, start, end - start + 1, cpu->memory + start, access);
+        layout += length;
+        if(*layout == ',')
+            layout++;
+    }
+    return 0;
+}
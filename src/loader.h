@@ -0,0 +1,117 @@
+/**
+ * @file loader.h
+ * @author Mason Daub
+ * @brief Loads ROM images and sets up a machine's memory layout.
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stdbool.h>
+#include "cpu.h"
+
+#define ROM_START 0x8000                            // Where ROM images are loaded
+#define ROM_SIZE 0x8000
+#define DEFAULT_LAYOUT "ram:0000-7fff,rom:8000-ffff" // RAM (and the terminal) in the low half, ROM above
+
+/**
+ * @brief One contiguous piece of a ROM image and where it is loaded.
+ */
+typedef struct _rom_segment
+{
+    uint16_t address;       // Load address of the first byte
+    size_t size;            // Number of bytes. Segments never wrap past 0xffff.
+    const byte* data;       // The bytes, owned by the image
+} rom_segment;
+
+/**
+ * @brief A ROM image file, split into the segments it loads.
+ * 
+ * The format is picked by the file extension: .prg for PRG files, .hex, .ihx
+ * or .ihex for Intel HEX, and .srec, .s19, .s28, .s37 or .mot for S-records.
+ * Anything else is a raw binary. Raw binaries load at ROM_START and are cut off
+ * at ROM_SIZE. PRG files start with a little endian load address, as written by
+ * vasm and the Commodore tools. Intel HEX and Motorola S-record files can place any
+ * number of segments anywhere in the 64K address space.
+ * 
+ * Binary files are mapped into memory rather than read, and their segments
+ * point straight into the mapping. Text formats are decoded once into a
+ * buffer that belongs to the image.
+ */
+typedef struct _rom_image
+{
+    rom_segment* segments;
+    int segment_count;
+    byte* file;             // Contents of the file
+    size_t file_size;
+    bool mapped;            // The file is memory mapped rather than read into a buffer
+    byte* decoded;          // 64K address space decoded from a text format, or NULL
+} rom_image;
+
+/**
+ * @brief Opens a ROM image and finds its segments.
+ * 
+ * @param image The image to fill in. It is cleared first.
+ * @param filename The name of the file.
+ * @return 0 on success, -1 if the file could not be read or is malformed.
+ */
+int rom_open(rom_image* image, const char* filename);
+
+/**
+ * @brief Frees an image. No machine may still have it loaded.
+ * 
+ * @param image The image to close.
+ */
+void rom_close(rom_image* image);
+
+/**
+ * @brief Loads an image into a machine, after its memory map has been set up.
+ * 
+ * Whole pages of a segment that land on read-only memory pages (ROM in the
+ * layout) are mapped onto the bus straight from the image, without copying.
+ * The image has to stay open for as long as the machine uses them. Everything
+ * else is copied into the machine's memory, like read_file does.
+ * 
+ * @param cpu The machine to load.
+ * @param image The image.
+ */
+void rom_load(machine* cpu, const rom_image* image);
+
+/**
+ * @brief Copies the part of an image that falls into an address range.
+ * 
+ * @param image The image.
+ * @param memory Buffer of size bytes, which receives the bytes at start and up.
+ * @param start First address of the range.
+ * @param size Number of bytes in the range.
+ */
+void rom_copy(const rom_image* image, byte* memory, uint16_t start, size_t size);
+
+/**
+ * @brief Read the contents of a ROM image file into the machine's memory.
+ * 
+ * @param cpu The machine to load.
+ * @param filename The name of the file
+ * @return 0 on success, -1 if the file could not be read.
+ */
+int read_file(machine* cpu, const char* filename);
+
+/**
+ * @brief Maps the machine's memory onto the address bus.
+ * 
+ * The layout is a comma separated list of regions in the form 'kind:start-end'
+ * with hex addresses, where kind is 'ram' or 'rom'. ROM is write protected.
+ * Addresses that are not listed are left unmapped.
+ * 
+ * @param cpu The machine to map.
+ * @param layout The layout string, e.g. DEFAULT_LAYOUT.
+ * @return 0 on success, -1 if the layout could not be parsed.
+ */
+int setup_memory_map(machine* cpu, const char* layout);
+
+#endif // LOADER_H
@@ -3,7 +3,8 @@
  * @author Mason Daub
  * @brief Runs an emulation of the MOS 6502 processor. 
  * It is not cycle accurate, or even timing accurate at the moment.
- * Only one CPU instance is allowed at the moment.
+ * All of the emulated state lives in a machine context, so more than
+ * one instance can be created, although main only runs one.
  * 
  * Currently only has one IO device mapped to $4000-$40ff -- the terminal.
  * This allows the 6502 CPU to write to the terminal and request the
@@ -17,67 +18,94 @@
  */
 
 #include "cpu.h"
+#include "terminal.h"
+#include "clock.h"
+#include "jit.h"
+#include "loader.h"
+#include "batch.h"
+#include "bench.h"
+#include "profiler.h"
+#include "trace.h"
+#include "disasm.h"
+#include "debugger.h"
+#include "gdbstub.h"
+#include "result.h"
+#include "replay.h"
+#include "savestate.h"
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
-#define RAM_SIZE 0x4000
-#define IO_SIZE 0x4000
-#define ROM_SIZE 0x8000
-
 /**
- * @brief Read the contents of a file into ROM
+ * @brief Load the 'Hello World!' program into ROM
  * 
- * @param filename The name of the file
- * @return 0 on success
+ * @param cpu The machine to load.
  */
-int read_file(const char* filename);
+void load_hello_world(machine* cpu);
 
 /**
- * @brief Load the 'Hello World!' program into ROM
+ * @brief Run the CPU (and terminal) normally
  * 
+ * @param cpu The machine to run.
  */
-void load_hello_world();
+void run_mode(machine* cpu, cpu_clock* clk);
 
 /**
- * @brief Run the CPU (and terminal) normally
+ * @brief Runs the CPU to completion without printing anything but the result.
  * 
+ * @param cpu The machine, reset and ready to run.
+ * @param result Memory ranges to include in the result. The rest is filled in.
+ * @param max_cycles Cycle budget, or CPU_UNLIMITED.
+ * @param max_instructions Instruction budget, or CPU_UNLIMITED.
+ * @param results File to write the result to, or NULL for stdout.
+ * @param binary Write the binary result instead of JSON.
+ * @return The exit status, which is the halt_reason.
  */
-void run_mode();
+int headless_mode(machine* cpu, run_result* result, uint64_t max_cycles, uint64_t max_instructions,
+    const char* results, bool binary);
 
 /**
  * @brief Run the CPU in Debug Mode.
- * This allows single stepping, reading addresses and registers.
- * @todo Add breakpoints.
+ * This allows single stepping, reading addresses and registers, and running
+ * to breakpoints and watchpoints.
+ * @param cpu The machine to debug.
  */
-void debug_mode();
+void debug_mode(machine* cpu);
 
 /**
- * @brief Runs the terminal IO device.
- * Only supports printing to terminal and stopping the emulation.
- * @return true: keep running the emulation.
- * @return false: Terminate the emulation.
+ * @brief Prints a labelled disassembly of part of the loaded program.
+ * 
+ * @param cpu The machine with the program loaded.
+ * @param range The addresses to list, as "start-end" in hex, inclusive.
+ * @return The exit status.
  */
-bool run_terminal_interface();
+int list_mode(machine* cpu, const char* range);
 
 /**
- * @brief returns a pointer to the memory mapped to the address bus.
+ * @brief Runs a batch of jobs on all cores and writes their results.
  * 
- * For now there is only a single memory map defined for reads and writes.
- * Systems like the NES have a map that changes according to reads and writes.
- * Each IO device will likely want it's own read/write functions so it can
- * make changes internally on read/write.
+ * @param manifest The manifest of jobs, see batch.h.
+ * @param results File to write the results to, or NULL for stdout.
+ * @param options Batch options.
+ * @return The exit status.
+ */
+int batch_mode(const char* manifest, const char* results, const batch_options* options);
+
+/**
+ * @brief Runs the benchmarks and prints their results.
  * 
- * @param address the value of the address bus
- * @return Pointer to the mapped data.
+ * @param results File to write the results to as JSON lines, or NULL.
+ * @param use_jit Benchmark the JIT instead of the interpreter.
+ * @return The exit status.
  */
-byte* memory_map(size_t address);
+int bench_mode(const char* results, bool use_jit);
 
-byte RAM_DATA[RAM_SIZE];    // RAM 
-byte IO_MEM[IO_SIZE];       // IO memory
-byte ROM_DATA[ROM_SIZE];    // ROM
+machine emulator;           // The emulated machine run by main
+terminal term;              // The terminal attached to the emulator
+rom_image image;            // The program, which the emulator's ROM pages map
+cpu_clock clk;              // Throttles the emulator to its target clock rate
 
 
 
@@ -101,178 +129,416 @@ const char hello_world[] =
 
 int main(int argc, char* argv[])
 {
-    puts("*** 6502 EMULATOR ***");
-    
     // Load the program options
-    bool has_input = false;
+    const char* input = NULL;
+    const char* manifest = NULL;
+    const char* results = NULL;
+    const char* profile = NULL;
+    const char* trace = NULL;
+    const char* trace_text = NULL;
+    const char* listing = NULL;
+    const char* gdb = NULL;
+    const char* headless = NULL;
+    const char* record = NULL;
+    const char* replay = NULL;
+    const char* save = NULL;
+    const char* resume = NULL;
+    bool compress = false;
     bool debug = false;
+    bool bench = false;
+    const char* layout = DEFAULT_LAYOUT;
+    uint64_t frequency = CLOCK_UNLIMITED;
+    bool use_jit = false;
+    batch_options batch = { 0, false, false, BATCH_DEFAULT_CYCLES };
+    uint64_t max_instructions = CPU_UNLIMITED;
+    run_result result = { 0 };
     for(int i = 1; i < argc; i++)
     {
         const char* arg = argv[i];
         // file input
         if(strcmp(arg, "-f") == 0 && (i + 1) < argc)
         {
-            printf("Reading binary from file '%s'...\n", argv[i+1]);
-            read_file(argv[++i]);
-            has_input = true;
+            input = argv[++i];
         }
         else if(strcmp(arg, "-d") == 0)
         {
             debug = true;
         }
+        // gdb remote debugging, on a port or a Unix socket
+        else if(strcmp(arg, "-g") == 0 && (i + 1) < argc)
+        {
+            gdb = argv[++i];
+        }
+        // disassembly listing
+        else if(strcmp(arg, "-a") == 0 && (i + 1) < argc)
+        {
+            listing = argv[++i];
+        }
+        else if(strcmp(arg, "-j") == 0)
+        {
+            use_jit = true;
+        }
+        // profile, written as folded stacks
+        else if(strcmp(arg, "-p") == 0 && (i + 1) < argc)
+        {
+            profile = argv[++i];
+        }
+        // execution trace, recorded or printed
+        else if(strcmp(arg, "-x") == 0 && (i + 1) < argc)
+        {
+            trace = argv[++i];
+        }
+        else if(strcmp(arg, "-X") == 0 && (i + 1) < argc)
+        {
+            trace_text = argv[++i];
+        }
+        // device inputs, recorded or replayed
+        else if(strcmp(arg, "-r") == 0 && (i + 1) < argc)
+        {
+            record = argv[++i];
+        }
+        else if(strcmp(arg, "-R") == 0 && (i + 1) < argc)
+        {
+            replay = argv[++i];
+        }
+        // saved states, written when the run stops or resumed instead of resetting
+        else if(strcmp(arg, "-s") == 0 && (i + 1) < argc)
+        {
+            save = argv[++i];
+        }
+        else if(strcmp(arg, "-S") == 0 && (i + 1) < argc)
+        {
+            resume = argv[++i];
+        }
+        else if(strcmp(arg, "-z") == 0)
+        {
+            compress = true;
+        }
+        // memory layout
+        else if(strcmp(arg, "-m") == 0 && (i + 1) < argc)
+        {
+            layout = argv[++i];
+        }
+        // clock rate in MHz, 0 for unlimited
+        else if(strcmp(arg, "-c") == 0 && (i + 1) < argc)
+        {
+            double mhz = atof(argv[++i]);
+            frequency = mhz > 0 ? (uint64_t)(mhz * 1e6 + 0.5) : CLOCK_UNLIMITED;
+        }
+        // batch mode
+        else if(strcmp(arg, "-b") == 0 && (i + 1) < argc)
+        {
+            manifest = argv[++i];
+        }
+        else if(strcmp(arg, "-t") == 0 && (i + 1) < argc)
+        {
+            batch.threads = atoi(argv[++i]);
+        }
+        else if(strcmp(arg, "-l") == 0 && (i + 1) < argc)
+        {
+            batch.max_cycles = strtoull(argv[++i], NULL, 0);
+        }
+        else if(strcmp(arg, "-W") == 0)
+        {
+            batch.wide = true;
+        }
+        // headless run to completion, with the result as json or bin
+        else if(strcmp(arg, "-q") == 0 && (i + 1) < argc)
+        {
+            headless = argv[++i];
+        }
+        else if(strcmp(arg, "-i") == 0 && (i + 1) < argc)
+        {
+            max_instructions = strtoull(argv[++i], NULL, 0);
+        }
+        else if(strcmp(arg, "-M") == 0 && (i + 1) < argc)
+        {
+            memory_range* range = &result.ranges[result.range_count];
+            if(result.range_count == RESULT_MAX_RANGES || result_parse_range(argv[++i], range) != 0)
+            {
+                fprintf(stderr, "Bad memory range '%s'\n", argv[i]);
+                return HALT_ERROR;
+            }
+            result.range_count++;
+        }
+        // benchmarks
+        else if(strcmp(arg, "-B") == 0)
+        {
+            bench = true;
+        }
+        else if(strcmp(arg, "-o") == 0 && (i + 1) < argc)
+        {
+            results = argv[++i];
+        }
         else
         {
-            printf("Argument %d: '%s'\n", i, argv[i]);
+            fprintf(stderr, "Argument %d: '%s'\n", i, argv[i]);
         }
     }
 
-    // Load the 'Hello World!' binary if no input is specified.
-    if(!has_input)
+    if(bench)
+        return bench_mode(results, use_jit);
+
+    // Printing a trace does not run anything
+    if(trace_text)
     {
-        puts("No input binary: Loading Hello World...");
-        load_hello_world();
+        if(trace_print(trace_text, stdout) < 0)
+        {
+            fprintf(stderr, "Could not read the trace '%s'\n", trace_text);
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
     }
-    
-    write_memory(0x40ff, 0);    // init terminal by setting its command to 0
-    cpu_reset();                // reset the cpu
 
-    // Run the CPU normally
-    if(!debug)
+    // Batch mode prints nothing but the results
+    if(manifest)
     {
-        run_mode();
+        batch.use_jit = use_jit;
+        return batch_mode(manifest, results, &batch);
     }
 
-    // Start the debug (single step) mode
-    else if(debug) 
+    // Headless mode keeps stdout for the result, and fails with HALT_ERROR
+    if(headless && strcmp(headless, "json") != 0 && strcmp(headless, "bin") != 0)
+    {
+        fprintf(stderr, "Bad result format '%s', use json or bin\n", headless);
+        return HALT_ERROR;
+    }
+    FILE* info = headless ? stderr : stdout;
+    if(!headless)
+        puts("*** 6502 EMULATOR ***");
+    
+    machine_init(&emulator);
+    if(input)
     {
-        debug_mode();
+        if(!headless)
+            printf("Reading binary from file '%s'...\n", input);
+        if(rom_open(&image, input) != 0)
+        {
+            fprintf(info, "Could not read '%s'\n", input);
+            return EXIT_FAILURE;
+        }
     }
 
+    if(setup_memory_map(&emulator, layout) != 0)
+    {
+        fprintf(info, "Bad memory layout '%s'\n", layout);
+        return EXIT_FAILURE;
+    }
+    rom_load(&emulator, &image);
+    terminal_init(&term, stdout);
+    terminal_attach(&emulator, &term, TERMINAL_ADDRESS);
+
+    jit* engine = NULL;
+    if(use_jit && !(engine = jit_create()))
+        fputs("The JIT is not supported on this host, interpreting instead.\n", info);
+    jit_attach(&emulator, engine);
+
+    profiler* prof = NULL;
+    if(profile && !(prof = profiler_create()))
+        fputs("Could not allocate the profiler.\n", info);
+    profiler_attach(&emulator, prof);
+
+    tracer* recorder = NULL;
+    if(trace && !(recorder = trace_open(trace)))
+        fprintf(info, "Could not create the trace '%s'\n", trace);
+    trace_attach(&emulator, recorder);
+
+    replay_log* inputs = NULL;
+    if(replay && !(inputs = replay_open(replay)))
+        fprintf(info, "Could not read the input log '%s'\n", replay);
+    else if(record && !replay && !(inputs = replay_record(record)))
+        fprintf(info, "Could not create the input log '%s'\n", record);
 
-    return EXIT_SUCCESS;
-}
+    // Load the 'Hello World!' binary if no input is specified.
+    if(!input && !resume)
+    {
+        if(!headless)
+            puts("No input binary: Loading Hello World...");
+        load_hello_world(&emulator);
+    }
 
-int read_file(const char* filename)
-{
-    //printf("File input string: '%s'\n", filename);
-    FILE* file = fopen(filename, "r");
-    assert(file != NULL);
-    ROM_DATA[0] = fgetc(file);
-    int i = 1;
-    while(i < ROM_SIZE && (ROM_DATA[i++] = fgetc(file)) != EOF); // load contents into memory
-    fclose(file);
-    return 0;
-}
+    if(listing)
+    {
+        int status = list_mode(&emulator, listing);
+        rom_close(&image);
+        return status;
+    }
+    
+    // Resume a saved state, which maps its own memory, or reset the cpu
+    savestate* state = NULL;
+    if(resume)
+    {
+        if(!(state = savestate_open(resume)) || savestate_load(&emulator, state) != 0)
+        {
+            fprintf(info, "Could not resume the state '%s'\n", resume);
+            savestate_close(state);
+            rom_close(&image);
+            return headless ? HALT_ERROR : EXIT_FAILURE;
+        }
+    }
+    else
+        cpu_reset(&emulator);
+    replay_attach(&emulator, inputs);   // from the state the run starts in
+    int status = EXIT_SUCCESS;
 
-byte* memory_map(size_t address)
-{
-    address &= 0xffff;
-    if(address < 0x4000) // ram
+    if(headless)
     {
-        return RAM_DATA + address;
+        uint64_t max_cycles = batch.max_cycles ? batch.max_cycles : CPU_UNLIMITED;
+        status = headless_mode(&emulator, &result, max_cycles, max_instructions, results, strcmp(headless, "bin") == 0);
     }
-    else if(address < 0x8000) // IO
+
+    // Serve gdb, then keep running once it detaches
+    else if(gdb)
     {
-        return IO_MEM + address - 0x4000;
+        jit_attach(&emulator, NULL); // translated code does not stop at breakpoints
+        if(gdb_serve(&emulator, gdb) != 0)
+            printf("Could not listen for gdb on '%s'\n", gdb);
     }
-    else return ROM_DATA + address -0x8000; // ROM
-}
 
+    // Run the CPU normally, unless gdb already ran it to the end
+    if(!headless && !debug && !(emulator.events & EVENT_HALT))
+    {
+        // the program's output is written on a thread of its own, so a slow stdout does not hold it up
+        term.output = terminal_output_open(stdout);
+        clock_init(&clk, frequency, &emulator);
+        run_mode(&emulator, &clk);
+        if(terminal_output_close(term.output) != 0)
+            fputs("Could not write all of the terminal output\n", stderr);
+        term.output = NULL;
+        // statistics only for what was asked for, so a plain run prints what it did before
+        if(frequency != CLOCK_UNLIMITED)
+            clock_print_stats(&clk, emulator.cycles, stdout);
+        if(engine)
+            jit_print_stats(engine, stdout);
+    }
 
-byte read_memory(size_t address)
-{
-    return *memory_map(address);
-}
+    // Start the debug (single step) mode
+    else if(!headless && debug && !(emulator.events & EVENT_HALT))
+    {
+        jit_attach(&emulator, NULL); // translated code does not stop at breakpoints
+        debug_mode(&emulator);
+    }
 
-uint16_t read_memory_word(size_t address)
-{
-    return read_memory(address) | (read_memory(address + 1) << 8);
-}
+    if(save && savestate_write(&emulator, save, compress) != 0)
+        fprintf(info, "Could not write the state to '%s'\n", save);
 
-void write_memory(size_t address, byte data)
-{
-    *memory_map(address) = data; // currently this will still allow writing to ROM
+    if(prof)
+    {
+        profiler_print(prof, &emulator, info);
+        FILE* folded = fopen(profile, "w");
+        if(folded)
+        {
+            profiler_write_folded(prof, folded);
+            fclose(folded);
+        }
+        else
+            fprintf(info, "Could not write the profile to '%s'\n", profile);
+        profiler_attach(&emulator, NULL);
+        profiler_destroy(prof);
+    }
+    if(recorder)
+    {
+        trace_attach(&emulator, NULL);
+        if(trace_close(recorder) != 0)
+            fprintf(info, "Could not write the whole trace to '%s'\n", trace);
+    }
+    if(inputs)
+    {
+        replay_attach(&emulator, NULL);
+        if(replay_close(inputs) != 0)
+        {
+            if(replay)
+                fprintf(info, "The run diverged from the input log '%s'\n", replay);
+            else
+                fprintf(info, "Could not write the whole input log to '%s'\n", record);
+        }
+    }
+    jit_attach(&emulator, NULL);
+    jit_destroy(engine);
+    savestate_close(state);
+    rom_close(&image);
+    return status;
 }
 
-void write_memory_word(size_t address, uint16_t word)
-{
-    write_memory(address, word & 0xff); // write l
-    write_memory(address + 1, (word >> 8) & 0xff); // write h
-}
 
-void load_hello_world()
+
+void load_hello_world(machine* cpu)
 {
     int len = sizeof(hello_world)/ sizeof(char);
+    byte* rom = cpu->memory + ROM_START;
     for(int i = 0; i < len; i++)
     {
-        ROM_DATA[i] = hello_world[i];
+        rom[i] = hello_world[i];
     }
-    ROM_DATA[RST_ADDRESS-0x8000] = 0x0d;
-    ROM_DATA[RST_ADDRESS-0x8000 + 1] = 0x80;
+    rom[RST_ADDRESS-ROM_START] = 0x0d;
+    rom[RST_ADDRESS-ROM_START + 1] = 0x80;
 }
 
-void run_mode()
+void run_mode(machine* cpu, cpu_clock* clk)
 {
-    bool running = true;
-    while(running){
-        cpu_do_next_op();
-        running = run_terminal_interface();
+    // runs one slice at a time until the terminal halts it or the program faults,
+    // waiting for the wall clock to catch up after each slice. A jammed program
+    // keeps running, as it would on the chip, until it is interrupted.
+    uint32_t events;
+    while(!(events = cpu_run(cpu, clk->slice_cycles, CPU_UNLIMITED)) || events == EVENT_JAM)
+    {
+        cpu_clear_event(cpu, EVENT_JAM);
+        clock_sync(clk, cpu->cycles);
     }
+    if(term.output)
+        terminal_output_flush(term.output); // before anything else is printed
+    if(events & EVENT_FAULT)
+        printf("Stopped at $%04x: %s\n", cpu->PC, halt_reason_name(halt_reason_of(events)));
 }
 
-bool run_terminal_interface()
+int headless_mode(machine* cpu, run_result* result, uint64_t max_cycles, uint64_t max_instructions,
+    const char* results, bool binary)
 {
-    bool running = true;
-    // read the command and set it to zero.
-    byte command = read_memory(0x40ff);
-    write_memory(0x40ff, 0);
-    
-    // if terminal command is 0xaa, write contents of buffer
-    if(command == 0xaa)
+    FILE* out = results ? fopen(results, binary ? "wb" : "w") : stdout;
+    if(out == NULL)
     {
-        puts(IO_MEM);
+        fprintf(stderr, "Could not open '%s'\n", results);
+        return HALT_ERROR;
     }
-    // 6502 emulator stop command.
-    else if (command == 0xbb)
-    {
-        puts("Emulator recieved halt command...");
-        running = false;
-    }
-    // print number
-    else if (command == 0xcc)
-    {
-        printf("IO PRINT BYTE: %d\n", read_memory(0x4000));
-    }
-    // print unsigned word
-    else if (command == 0xcd)
-    {
-        int word = read_memory(0x4000) | (read_memory(0x4001) << 8);
-        printf("IO PRINT WORD: %d\n", word);
-    }
-    // signed word
-    else if (command == 0xce)
-    {
-        int16_t word = read_memory(0x4000) | (read_memory(0x4001) << 8);
-        printf("IO PRINT WORD: %d\n", word);
-    }
-    return running;
+    char* output = NULL;
+    size_t output_size = 0;
+    FILE* captured = open_memstream(&output, &output_size);
+    term.out = captured;
+    result->halt = halt_reason_of(cpu_run(cpu, max_cycles, max_instructions));
+    term.out = NULL;
+    fclose(captured);
+    result->output = output;
+    result->output_size = output_size;
+    if(binary)
+        result_write_binary(out, cpu, result);
+    else
+        result_write_json(out, cpu, result);
+    if(out != stdout)
+        fclose(out);
+    free(output);
+    return result->halt;
 }
 
-void debug_mode()
+void debug_mode(machine* cpu)
 {
     bool running = true;
-    int read_start, read_stop;
+    unsigned read_start, read_stop;
+    int number, offset;
+    char access[3];
     char buffer[256];
+    debugger* dbg = debugger_create();
+    debugger_attach(cpu, dbg);
     
     while(running)
     {
-        dissasemble(cpu_PC, buffer, sizeof(buffer) / sizeof(char));
+        dissasemble(cpu, cpu->PC, buffer, sizeof(buffer) / sizeof(char));
 
         // Print the contents of the registers and the dissasembled instruction
-        printf("\nPC: %4x A: %2x X: %2x Y: %2x P: %2x S: %2x\n", cpu_PC, cpu_regA, cpu_regX, cpu_regY, cpu_FLAGS, cpu_SP);
+        printf("\nPC: %4x A: %2x X: %2x Y: %2x P: %2x S: %2x\n", cpu->PC, cpu->regA, cpu->regX, cpu->regY, cpu_get_flags(cpu), cpu->SP);
         printf("\nCurrent Instruction: '%s'\n", buffer);
 
-        fgets(buffer, 256, stdin); // get user input
+        if(fgets(buffer, 256, stdin) == NULL) // get user input
+            break;
         for(int i = 0; i < 256; i++)
         {
             if(buffer[i] == '\n')
@@ -284,8 +550,58 @@ void debug_mode()
         // next or n (single step)
         if(strncmp(buffer, "next", 4) == 0 || strcmp(buffer, "n") == 0)
         {
-            cpu_do_next_op();
-            running = run_terminal_interface();
+            uint32_t events = debugger_step(cpu);
+            running = !(events & EVENT_HALT);
+            debugger_print_stop(dbg, stdout);
+            if(events & EVENT_FAULT)
+                printf("Stopped: %s\n", halt_reason_name(halt_reason_of(events)));
+        }
+
+        // continue or c (run to the next breakpoint or watchpoint)
+        else if(strncmp(buffer, "continue", 8) == 0 || strcmp(buffer, "c") == 0)
+        {
+            uint32_t events = debugger_continue(cpu);
+            running = !(events & EVENT_HALT);
+            debugger_print_stop(dbg, stdout);
+            if(events & EVENT_FAULT)
+                printf("Stopped: %s\n", halt_reason_name(halt_reason_of(events)));
+        }
+
+        // Set a breakpoint. Format: 'break address [if condition]' (in hex)
+        else if(sscanf(buffer, "break %x %n", &read_start, &offset) == 1)
+        {
+            const char* condition = strncmp(buffer + offset, "if ", 3) == 0 ? buffer + offset + 3 : NULL;
+            if(read_start > 0xffff || (buffer[offset] && !condition))
+                puts("Bad breakpoint: 'break address [if condition]'");
+            else if((number = debugger_break(dbg, read_start, condition)) < 0)
+                puts("Bad condition, or too many breakpoints");
+            else
+                printf("Breakpoint %d at $%04x\n", number, read_start);
+        }
+
+        // Watch a range of memory. Format: 'watch r|w|rw start[:stop]' (in hex)
+        else if(sscanf(buffer, "watch %2[rw] %x", access, &read_start) == 2)
+        {
+            if(sscanf(buffer, "watch %*s %*x:%x", &read_stop) != 1)
+                read_stop = read_start;
+            byte flags = (strchr(access, 'r') ? BUS_READ : 0) | (strchr(access, 'w') ? BUS_WRITE : 0);
+            if(read_stop > 0xffff || (number = debugger_watch(dbg, read_start, read_stop, flags)) < 0)
+                printf("Bad watchpoint (%04x:%04x)\n", read_start, read_stop);
+            else
+                printf("Watchpoint %d on (%04x:%04x)\n", number, read_start, read_stop);
+        }
+
+        // Remove a breakpoint or watchpoint by number
+        else if(sscanf(buffer, "delete %d", &number) == 1)
+        {
+            if(debugger_delete(dbg, number) != 0)
+                printf("No breakpoint or watchpoint %d\n", number);
+        }
+
+        // List the breakpoints and watchpoints
+        else if(strcmp(buffer, "info") == 0)
+        {
+            debugger_print(dbg, stdout);
         }
 
         // Read range of memory. Format: 'read start:stop' (in hex)
@@ -305,7 +621,7 @@ void debug_mode()
                     printf("(%04x): ", read_start + j * 8);
                     for(int i = 0; i <= (j == n_rows ? num_reads & 7 : 7); i++)
                     {
-                        printf("%02x ", read_memory(read_start + i + j * 8));
+                        printf("%02x ", peek_memory(cpu, read_start + i + j * 8));
                     }
                     puts("");
                 }
@@ -316,7 +632,7 @@ void debug_mode()
         // Read single byte in memory (address in hex)
         else if(sscanf(buffer, "read %x", &read_start) == 1)
         {
-            printf("(%04x): %02x\n", read_start, read_memory(read_start));
+            printf("(%04x): %02x\n", read_start, peek_memory(cpu, read_start));
         }
 
         // Terminate the emulation
@@ -325,4 +641,61 @@ void debug_mode()
             running = false;
         }
     }
-}
\ No newline at end of file
+    debugger_attach(cpu, NULL);
+    debugger_destroy(dbg);
+}
+
+int list_mode(machine* cpu, const char* range)
+{
+    unsigned start, end;
+    if(sscanf(range, "%x-%x", &start, &end) != 2 || start > end || end > 0xffff)
+    {
+        printf("Bad address range '%s'\n", range);
+        return EXIT_FAILURE;
+    }
+    char buffer[4096];
+    size_t size = end - start + 1;
+    size_t consumed;
+    while(size > 0)
+    {
+        disasm_range(cpu, start, size, DISASM_BYTES | DISASM_LABELS, buffer, sizeof(buffer), &consumed);
+        fputs(buffer, stdout);
+        start += consumed;
+        size -= consumed;
+    }
+    return EXIT_SUCCESS;
+}
+
+int batch_mode(const char* manifest, const char* results, const batch_options* options)
+{
+    FILE* out = results ? fopen(results, "w") : stdout;
+    if(out == NULL)
+    {
+        fprintf(stderr, "Could not open '%s'\n", results);
+        return EXIT_FAILURE;
+    }
+    int failed = batch_run(manifest, out, options);
+    if(out != stdout)
+        fclose(out);
+    if(failed < 0)
+        fprintf(stderr, "Could not read manifest '%s'\n", manifest);
+    else if(failed > 0)
+        fprintf(stderr, "%d jobs could not be run\n", failed);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int bench_mode(const char* results, bool use_jit)
+{
+    FILE* out = NULL;
+    if(results && (out = fopen(results, "w")) == NULL)
+    {
+        fprintf(stderr, "Could not open '%s'\n", results);
+        return EXIT_FAILURE;
+    }
+    int failed = bench_run(out, use_jit);
+    if(out)
+        fclose(out);
+    if(failed > 0)
+        fprintf(stderr, "%d benchmarks could not be run\n", failed);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
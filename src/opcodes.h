@@ -0,0 +1,212 @@
+/**
+ * @file opcodes.h
+ * @author Mason Daub
+ * @brief The instruction spec table for the 6502.
+ * 
+ * Every documented opcode is listed exactly once. The table is an X-macro:
+ * OPCODE_TABLE(OP) expands OP(code, mnemonic, mode, cycles, page) for each entry,
+ * and is used to generate the per-opcode handlers, the dispatch table, the
+ * dissasembler and the cycle tables, so they can never disagree.
+ * 
+ *  code     - the opcode byte.
+ *  mnemonic - the instruction, used to pick the handler and for dissasembly.
+ *  mode     - the addressing mode (see address_mode in cpu_utils.h).
+ *  cycles   - base number of clock cycles.
+ *  page     - 1 if crossing a page boundary while indexing costs an extra cycle.
+ *             Taken branches always cost 1 extra cycle, and another 1 on a page change.
+ * 
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#ifndef OPCODES_H
+#define OPCODES_H
+
+#define OPCODE_TABLE(OP) \
+    OP(0x69, ADC, imm,          2, 0) \
+    OP(0x65, ADC, zpg,          3, 0) \
+    OP(0x75, ADC, ind_zpg_x,    4, 0) \
+    OP(0x6d, ADC, absolute,     4, 0) \
+    OP(0x7d, ADC, ind_abs_x,    4, 1) \
+    OP(0x79, ADC, ind_abs_y,    4, 1) \
+    OP(0x61, ADC, ind_indir_x,  6, 0) \
+    OP(0x71, ADC, indir_ind_y,  5, 1) \
+    \
+    OP(0x29, AND, imm,          2, 0) \
+    OP(0x25, AND, zpg,          3, 0) \
+    OP(0x35, AND, ind_zpg_x,    4, 0) \
+    OP(0x2d, AND, absolute,     4, 0) \
+    OP(0x3d, AND, ind_abs_x,    4, 1) \
+    OP(0x39, AND, ind_abs_y,    4, 1) \
+    OP(0x21, AND, ind_indir_x,  6, 0) \
+    OP(0x31, AND, indir_ind_y,  5, 1) \
+    \
+    OP(0x0a, ASL, reg_A,        2, 0) \
+    OP(0x06, ASL, zpg,          5, 0) \
+    OP(0x16, ASL, ind_zpg_x,    6, 0) \
+    OP(0x0e, ASL, absolute,     6, 0) \
+    OP(0x1e, ASL, ind_abs_x,    7, 0) \
+    \
+    OP(0x90, BCC, rel,          2, 0) \
+    OP(0xb0, BCS, rel,          2, 0) \
+    OP(0xf0, BEQ, rel,          2, 0) \
+    OP(0x30, BMI, rel,          2, 0) \
+    OP(0xd0, BNE, rel,          2, 0) \
+    OP(0x10, BPL, rel,          2, 0) \
+    OP(0x50, BVC, rel,          2, 0) \
+    OP(0x70, BVS, rel,          2, 0) \
+    \
+    OP(0x24, BIT, zpg,          3, 0) \
+    OP(0x2c, BIT, absolute,     4, 0) \
+    \
+    OP(0x00, BRK, impl,         7, 0) \
+    \
+    OP(0x18, CLC, impl,         2, 0) \
+    OP(0xd8, CLD, impl,         2, 0) \
+    OP(0x58, CLI, impl,         2, 0) \
+    OP(0xb8, CLV, impl,         2, 0) \
+    \
+    OP(0xc9, CMP, imm,          2, 0) \
+    OP(0xc5, CMP, zpg,          3, 0) \
+    OP(0xd5, CMP, ind_zpg_x,    4, 0) \
+    OP(0xcd, CMP, absolute,     4, 0) \
+    OP(0xdd, CMP, ind_abs_x,    4, 1) \
+    OP(0xd9, CMP, ind_abs_y,    4, 1) \
+    OP(0xc1, CMP, ind_indir_x,  6, 0) \
+    OP(0xd1, CMP, indir_ind_y,  5, 1) \
+    \
+    OP(0xe0, CPX, imm,          2, 0) \
+    OP(0xe4, CPX, zpg,          3, 0) \
+    OP(0xec, CPX, absolute,     4, 0) \
+    \
+    OP(0xc0, CPY, imm,          2, 0) \
+    OP(0xc4, CPY, zpg,          3, 0) \
+    OP(0xcc, CPY, absolute,     4, 0) \
+    \
+    OP(0xc6, DEC, zpg,          5, 0) \
+    OP(0xd6, DEC, ind_zpg_x,    6, 0) \
+    OP(0xce, DEC, absolute,     6, 0) \
+    OP(0xde, DEC, ind_abs_x,    7, 0) \
+    \
+    OP(0xca, DEX, impl,         2, 0) \
+    OP(0x88, DEY, impl,         2, 0) \
+    \
+    OP(0x49, EOR, imm,          2, 0) \
+    OP(0x45, EOR, zpg,          3, 0) \
+    OP(0x55, EOR, ind_zpg_x,    4, 0) \
+    OP(0x4d, EOR, absolute,     4, 0) \
+    OP(0x5d, EOR, ind_abs_x,    4, 1) \
+    OP(0x59, EOR, ind_abs_y,    4, 1) \
+    OP(0x41, EOR, ind_indir_x,  6, 0) \
+    OP(0x51, EOR, indir_ind_y,  5, 1) \
+    \
+    OP(0xe6, INC, zpg,          5, 0) \
+    OP(0xf6, INC, ind_zpg_x,    6, 0) \
+    OP(0xee, INC, absolute,     6, 0) \
+    OP(0xfe, INC, ind_abs_x,    7, 0) \
+    \
+    OP(0xe8, INX, impl,         2, 0) \
+    OP(0xc8, INY, impl,         2, 0) \
+    \
+    OP(0x4c, JMP, absolute,     3, 0) \
+    OP(0x6c, JMP, ind_abs,      5, 0) \
+    OP(0x20, JSR, absolute,     6, 0) \
+    \
+    OP(0xa9, LDA, imm,          2, 0) \
+    OP(0xa5, LDA, zpg,          3, 0) \
+    OP(0xb5, LDA, ind_zpg_x,    4, 0) \
+    OP(0xad, LDA, absolute,     4, 0) \
+    OP(0xbd, LDA, ind_abs_x,    4, 1) \
+    OP(0xb9, LDA, ind_abs_y,    4, 1) \
+    OP(0xa1, LDA, ind_indir_x,  6, 0) \
+    OP(0xb1, LDA, indir_ind_y,  5, 1) \
+    \
+    OP(0xa2, LDX, imm,          2, 0) \
+    OP(0xa6, LDX, zpg,          3, 0) \
+    OP(0xb6, LDX, ind_zpg_y,    4, 0) \
+    OP(0xae, LDX, absolute,     4, 0) \
+    OP(0xbe, LDX, ind_abs_y,    4, 1) \
+    \
+    OP(0xa0, LDY, imm,          2, 0) \
+    OP(0xa4, LDY, zpg,          3, 0) \
+    OP(0xb4, LDY, ind_zpg_x,    4, 0) \
+    OP(0xac, LDY, absolute,     4, 0) \
+    OP(0xbc, LDY, ind_abs_x,    4, 1) \
+    \
+    OP(0x4a, LSR, reg_A,        2, 0) \
+    OP(0x46, LSR, zpg,          5, 0) \
+    OP(0x56, LSR, ind_zpg_x,    6, 0) \
+    OP(0x4e, LSR, absolute,     6, 0) \
+    OP(0x5e, LSR, ind_abs_x,    7, 0) \
+    \
+    OP(0xea, NOP, impl,         2, 0) \
+    \
+    OP(0x09, ORA, imm,          2, 0) \
+    OP(0x05, ORA, zpg,          3, 0) \
+    OP(0x15, ORA, ind_zpg_x,    4, 0) \
+    OP(0x0d, ORA, absolute,     4, 0) \
+    OP(0x1d, ORA, ind_abs_x,    4, 1) \
+    OP(0x19, ORA, ind_abs_y,    4, 1) \
+    OP(0x01, ORA, ind_indir_x,  6, 0) \
+    OP(0x11, ORA, indir_ind_y,  5, 1) \
+    \
+    OP(0x48, PHA, impl,         3, 0) \
+    OP(0x08, PHP, impl,         3, 0) \
+    OP(0x68, PLA, impl,         4, 0) \
+    OP(0x28, PLP, impl,         4, 0) \
+    \
+    OP(0x2a, ROL, reg_A,        2, 0) \
+    OP(0x26, ROL, zpg,          5, 0) \
+    OP(0x36, ROL, ind_zpg_x,    6, 0) \
+    OP(0x2e, ROL, absolute,     6, 0) \
+    OP(0x3e, ROL, ind_abs_x,    7, 0) \
+    \
+    OP(0x6a, ROR, reg_A,        2, 0) \
+    OP(0x66, ROR, zpg,          5, 0) \
+    OP(0x76, ROR, ind_zpg_x,    6, 0) \
+    OP(0x6e, ROR, absolute,     6, 0) \
+    OP(0x7e, ROR, ind_abs_x,    7, 0) \
+    \
+    OP(0x40, RTI, impl,         6, 0) \
+    OP(0x60, RTS, impl,         6, 0) \
+    \
+    OP(0xe9, SBC, imm,          2, 0) \
+    OP(0xe5, SBC, zpg,          3, 0) \
+    OP(0xf5, SBC, ind_zpg_x,    4, 0) \
+    OP(0xed, SBC, absolute,     4, 0) \
+    OP(0xfd, SBC, ind_abs_x,    4, 1) \
+    OP(0xf9, SBC, ind_abs_y,    4, 1) \
+    OP(0xe1, SBC, ind_indir_x,  6, 0) \
+    OP(0xf1, SBC, indir_ind_y,  5, 1) \
+    \
+    OP(0x38, SEC, impl,         2, 0) \
+    OP(0xf8, SED, impl,         2, 0) \
+    OP(0x78, SEI, impl,         2, 0) \
+    \
+    OP(0x85, STA, zpg,          3, 0) \
+    OP(0x95, STA, ind_zpg_x,    4, 0) \
+    OP(0x8d, STA, absolute,     4, 0) \
+    OP(0x9d, STA, ind_abs_x,    5, 0) \
+    OP(0x99, STA, ind_abs_y,    5, 0) \
+    OP(0x81, STA, ind_indir_x,  6, 0) \
+    OP(0x91, STA, indir_ind_y,  6, 0) \
+    \
+    OP(0x86, STX, zpg,          3, 0) \
+    OP(0x96, STX, ind_zpg_y,    4, 0) \
+    OP(0x8e, STX, absolute,     4, 0) \
+    \
+    OP(0x84, STY, zpg,          3, 0) \
+    OP(0x94, STY, ind_zpg_x,    4, 0) \
+    OP(0x8c, STY, absolute,     4, 0) \
+    \
+    OP(0xaa, TAX, impl,         2, 0) \
+    OP(0xa8, TAY, impl,         2, 0) \
+    OP(0xba, TSX, impl,         2, 0) \
+    OP(0x8a, TXA, impl,         2, 0) \
+    OP(0x9a, TXS, impl,         2, 0) \
+    OP(0x98, TYA, impl,         2, 0)
+
+#endif // OPCODES_H
@@ -0,0 +1,311 @@
+/**
+ * @file profiler.c
+ * @author Mason Daub
+ * @brief Execution profiler with call stack attribution.
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "profiler.h"
+#include "cpu_utils.h"
+
+// What an opcode does to the call stack
+typedef enum _profile_kind
+{
+    KIND_OTHER,
+    KIND_CALL,      // JSR and BRK enter a subroutine
+    KIND_RETURN,    // RTS and RTI leave one
+    KIND_STACK,     // TXS can throw frames away
+} profile_kind;
+
+/**
+ * @brief One distinct call stack: a subroutine and the chain of callers that led to it.
+ */
+typedef struct _profile_node
+{
+    uint16_t address;       // Entry address of the subroutine
+    int parent;             // Node of the caller, -1 for the root
+    int child;              // First callee, -1 if none
+    int sibling;            // Next callee of the parent, -1 if none
+    uint64_t cycles;        // Exclusive cycles spent with exactly this call stack
+} profile_node;
+
+/**
+ * @brief A subroutine that has been entered and not yet returned from.
+ */
+typedef struct _profile_frame
+{
+    int node;
+    uint16_t address;       // Entry address
+    byte sp;                // Stack pointer just after the call pushed its return address
+    uint64_t entry;         // Cycle count just after the call
+} profile_frame;
+
+struct _profiler
+{
+    machine* cpu;                       // Machine the profiler is attached to, or NULL
+    byte kind[256];                     // profile_kind of every opcode
+    uint64_t instructions;
+    uint64_t cycles;
+
+    uint64_t opcode_count[256];
+    uint64_t opcode_cycles[256];
+    uint64_t pc_count[0x10000];         // Executions of the instruction at every address
+    uint64_t pc_cycles[0x10000];
+
+    uint64_t calls[0x10000];            // Subroutine statistics, by entry address
+    uint64_t inclusive[0x10000];
+    uint64_t exclusive[0x10000];
+    uint32_t active[0x10000];           // Frames of the subroutine on the call stack, so recursion is counted once
+
+    profile_node* nodes;                // Node 0 is the root: code that is not in a subroutine
+    int node_count;
+    int node_capacity;
+
+    profile_frame frames[PROFILER_MAX_DEPTH];   // The call stack, frames[0] is the root
+    int depth;
+    int overflow;                       // Calls made past PROFILER_MAX_DEPTH that have not returned
+};
+
+profiler* profiler_create(void)
+{
+    profiler* p = calloc(1, sizeof(profiler));
+    if(p == NULL)
+        return NULL;
+    p->node_capacity = 64;
+    p->nodes = malloc(p->node_capacity * sizeof(profile_node));
+    if(p->nodes == NULL)
+    {
+        free(p);
+        return NULL;
+    }
+    p->nodes[0] = (profile_node){ 0, -1, -1, -1, 0 };
+    p->node_count = 1;
+    p->frames[0] = (profile_frame){ 0, 0, 0xff, 0 };
+    p->depth = 1;
+
+    for(int i = 0; i < 256; i++)
+    {
+        const char* name = opcode_table[i].name;
+        if(name == NULL)
+            continue;
+        if(strcmp(name, "JSR") == 0 || strcmp(name, "BRK") == 0)
+            p->kind[i] = KIND_CALL;
+        else if(strcmp(name, "RTS") == 0 || strcmp(name, "RTI") == 0)
+            p->kind[i] = KIND_RETURN;
+        else if(strcmp(name, "TXS") == 0)
+            p->kind[i] = KIND_STACK;
+    }
+    return p;
+}
+
+void profiler_destroy(profiler* p)
+{
+    if(p == NULL)
+        return;
+    free(p->nodes);
+    free(p);
+}
+
+void profiler_attach(machine* cpu, profiler* p)
+{
+    if(cpu->profiler)
+        cpu->profiler->cpu = NULL;
+    cpu->profiler = p;
+    if(p)
+    {
+        if(p->cpu)
+            profiler_attach(p->cpu, NULL);
+        p->cpu = cpu;
+    }
+}
+
+/*   Call stack   */
+
+// Returns the node of a call from the current node, adding it the first time.
+static int callee_node(profiler* p, int parent, uint16_t address)
+{
+    for(int n = p->nodes[parent].child; n >= 0; n = p->nodes[n].sibling)
+        if(p->nodes[n].address == address)
+            return n;
+    if(p->node_count == p->node_capacity)
+    {
+        profile_node* nodes = realloc(p->nodes, 2 * p->node_capacity * sizeof(profile_node));
+        if(nodes == NULL)
+            return parent; // out of memory, the cycles stay with the caller
+        p->nodes = nodes;
+        p->node_capacity *= 2;
+    }
+    int n = p->node_count++;
+    p->nodes[n] = (profile_node){ address, parent, -1, p->nodes[parent].child, 0 };
+    p->nodes[parent].child = n;
+    return n;
+}
+
+static void call(profiler* p, uint16_t address, byte sp, uint64_t cycles)
+{
+    if(p->depth == PROFILER_MAX_DEPTH)
+    {
+        p->overflow++;
+        return;
+    }
+    profile_frame* frame = &p->frames[p->depth++];
+    frame->node = callee_node(p, p->frames[p->depth - 2].node, address);
+    frame->address = address;
+    frame->sp = sp;
+    frame->entry = cycles;
+    p->calls[address]++;
+    p->active[address]++;
+}
+
+// Closes every frame that the stack pointer has moved above. A return first
+// closes a call made past PROFILER_MAX_DEPTH, if there is one.
+static void unwind(profiler* p, byte sp, uint64_t cycles, bool is_return)
+{
+    if(is_return && p->overflow)
+    {
+        p->overflow--;
+        return;
+    }
+    while(p->depth > 1 && p->frames[p->depth - 1].sp < sp)
+    {
+        const profile_frame* frame = &p->frames[--p->depth];
+        // a recursive subroutine's time is counted once, by its outermost frame
+        if(--p->active[frame->address] == 0)
+            p->inclusive[frame->address] += cycles - frame->entry;
+    }
+}
+
+uint32_t profiler_run(machine* cpu, uint64_t* remaining)
+{
+    profiler* p = cpu->profiler;
+    uint64_t left = *remaining;
+    do
+    {
+        uint16_t address = PC;
+        byte opcode = peek_memory(cpu, address); // without the side effects of a read
+        int cycles = cpu_do_next_op(cpu);
+
+        p->instructions++;
+        p->cycles += cycles;
+        p->opcode_count[opcode]++;
+        p->opcode_cycles[opcode] += cycles;
+        p->pc_count[address]++;
+        p->pc_cycles[address] += cycles;
+        const profile_frame* frame = &p->frames[p->depth - 1];
+        p->nodes[frame->node].cycles += cycles;
+        if(p->depth > 1)
+            p->exclusive[frame->address] += cycles;
+
+        switch(p->kind[opcode])
+        {
+            case KIND_CALL:
+                call(p, PC, S, cpu->cycles);
+                break;
+            case KIND_RETURN:
+            case KIND_STACK:
+                unwind(p, S, cpu->cycles, p->kind[opcode] == KIND_RETURN);
+                break;
+        }
+    }
+    while(--left != 0 && cpu->cycles < cpu->stop_cycle);
+    *remaining = left;
+    return cpu->events;
+}
+
+/*   Reports   */
+
+typedef struct _profile_row
+{
+    int index;
+    uint64_t key;
+} profile_row;
+
+static int compare_rows(const void* a, const void* b)
+{
+    uint64_t x = ((const profile_row*)a)->key, y = ((const profile_row*)b)->key;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Sorts the indices with a nonzero key, largest first. Returns how many there are.
+static int sort_rows(profile_row* rows, const uint64_t* keys, int count)
+{
+    int used = 0;
+    for(int i = 0; i < count; i++)
+        if(keys[i])
+            rows[used++] = (profile_row){ i, keys[i] };
+    qsort(rows, used, sizeof(profile_row), compare_rows);
+    return used;
+}
+
+static double percent(uint64_t part, uint64_t whole)
+{
+    return whole ? 100.0 * part / whole : 0;
+}
+
+void profiler_print(const profiler* p, machine* cpu, FILE* out)
+{
+    profile_row* rows = malloc(0x10000 * sizeof(profile_row));
+    if(rows == NULL)
+        return;
+    fprintf(out, "Profile: %llu instructions, %llu cycles\n",
+        (unsigned long long)p->instructions, (unsigned long long)p->cycles);
+
+    int count = sort_rows(rows, p->opcode_cycles, 256);
+    fprintf(out, "\nOpcodes by cycles:\n%12s %12s %7s  opcode\n", "count", "cycles", "%");
+    for(int i = 0; i < count && i < PROFILER_TOP; i++)
+    {
+        int opcode = rows[i].index;
+        fprintf(out, "%12llu %12llu %6.2f%%  %02x %s\n", (unsigned long long)p->opcode_count[opcode],
+            (unsigned long long)p->opcode_cycles[opcode], percent(p->opcode_cycles[opcode], p->cycles),
+            opcode, opcode_table[opcode].name ? opcode_table[opcode].name : "???");
+    }
+
+    count = sort_rows(rows, p->pc_cycles, 0x10000);
+    fprintf(out, "\nAddresses by cycles:\n%12s %12s %7s  address\n", "count", "cycles", "%");
+    for(int i = 0; i < count && i < PROFILER_TOP; i++)
+    {
+        int address = rows[i].index;
+        char buffer[32] = "";
+        if(cpu)
+            dissasemble(cpu, address, buffer, sizeof(buffer));
+        fprintf(out, "%12llu %12llu %6.2f%%  $%04x  %s\n", (unsigned long long)p->pc_count[address],
+            (unsigned long long)p->pc_cycles[address], percent(p->pc_cycles[address], p->cycles), address, buffer);
+    }
+
+    count = sort_rows(rows, p->inclusive, 0x10000);
+    fprintf(out, "\nSubroutines by inclusive cycles:\n%12s %12s %7s %12s %7s  entry\n",
+        "calls", "inclusive", "%", "exclusive", "%");
+    for(int i = 0; i < count && i < PROFILER_TOP; i++)
+    {
+        int address = rows[i].index;
+        fprintf(out, "%12llu %12llu %6.2f%% %12llu %6.2f%%  $%04x\n", (unsigned long long)p->calls[address],
+            (unsigned long long)p->inclusive[address], percent(p->inclusive[address], p->cycles),
+            (unsigned long long)p->exclusive[address], percent(p->exclusive[address], p->cycles), address);
+    }
+    fprintf(out, "%12s %12llu %6.2f%% %12llu %6.2f%%  (top level)\n", "",
+        (unsigned long long)p->cycles, 100.0, (unsigned long long)p->nodes[0].cycles, percent(p->nodes[0].cycles, p->cycles));
+    free(rows);
+}
+
+void profiler_write_folded(const profiler* p, FILE* out)
+{
+    int path[PROFILER_MAX_DEPTH];
+    for(int n = 0; n < p->node_count; n++)
+    {
+        if(p->nodes[n].cycles == 0)
+            continue;
+        int depth = 0;
+        for(int k = n; k > 0; k = p->nodes[k].parent)
+            path[depth++] = k;
+        fputs("root", out);
+        while(depth--)
+            fprintf(out, ";$%04x", p->nodes[path[depth]].address);
+        fprintf(out, " %llu\n", (unsigned long long)p->nodes[n].cycles);
+    }
+}
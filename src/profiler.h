@@ -0,0 +1,88 @@
+/**
+ * @file profiler.h
+ * @author Mason Daub
+ * @brief Counts where a machine spends its cycles: per opcode, per PC and per subroutine.
+ * 
+ * While a profiler is attached, cpu_run steps through cpu_do_next_op and adds
+ * the cycles it returns to the instruction's opcode and address. JSR and BRK
+ * open a frame for the subroutine they enter, and RTS and RTI close it, so the
+ * cycles are also attributed to subroutines: exclusive cycles are spent in the
+ * subroutine's own instructions, inclusive cycles also count everything it
+ * called. Frames are matched by the stack pointer, so code that drops return
+ * addresses or resets the stack does not leave stale frames behind.
+ * 
+ * Every distinct call stack gets its own exclusive cycle count, which is written
+ * in the folded stack format ("root;$8010;$8042 1234") that flame graph tools read.
+ * 
+ * A machine without a profiler runs exactly as before: cpu_run only checks for
+ * one once per call. Building with -DNO_PROFILER removes even that check.
+ * The profiler replaces the JIT while it is attached.
+ * 
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define PROFILER_MAX_DEPTH 256  // Deepest call stack tracked. Deeper calls count toward the deepest frame.
+#define PROFILER_TOP 10         // Rows of each table printed by profiler_print
+
+/**
+ * @brief Allocates an empty profile.
+ * 
+ * @return The profiler, or NULL if it could not be allocated.
+ */
+profiler* profiler_create(void);
+
+/**
+ * @brief Frees a profiler. It must not be attached to a machine.
+ * 
+ * @param p The profiler to free, or NULL.
+ */
+void profiler_destroy(profiler* p);
+
+/**
+ * @brief Attaches a profiler to a machine, so cpu_run records what it executes.
+ * Whatever the machine runs from then on is counted on top of the profile so far.
+ * 
+ * @param cpu The machine.
+ * @param p The profiler, or NULL to detach the current one.
+ */
+void profiler_attach(machine* cpu, profiler* p);
+
+/**
+ * @brief The profiling version of cpu_run's loop.
+ * Called by cpu_run after it has set the machine's stop cycle.
+ * 
+ * @param cpu The machine to run. It must have a profiler attached.
+ * @param remaining Instruction budget, or CPU_UNLIMITED. Less the instructions run when it returns.
+ * @return The pending events.
+ */
+uint32_t profiler_run(machine* cpu, uint64_t* remaining);
+
+/**
+ * @brief Prints the busiest opcodes, addresses and subroutines.
+ * 
+ * @param p The profiler.
+ * @param cpu Machine used to disassemble the busiest addresses, or NULL.
+ * @param out Where to print.
+ */
+void profiler_print(const profiler* p, machine* cpu, FILE* out);
+
+/**
+ * @brief Writes the cycles of every call stack in the folded stack format.
+ * 
+ * @param p The profiler.
+ * @param out Where to write.
+ */
+void profiler_write_folded(const profiler* p, FILE* out);
+
+#endif // PROFILER_H
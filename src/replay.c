@@ -0,0 +1,313 @@
+/**
+ * @file replay.c
+ * @author Mason Daub
+ * @brief Device input log writer and reader.
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "replay.h"
+
+#define ENTRY_READ  0       // A byte read from a device
+#define ENTRY_LINES 1       // The interrupt lines changed
+#define ENTRY_END   2       // Past the last entry of a replay
+
+/**
+ * @brief One entry of the log.
+ */
+typedef struct _replay_entry
+{
+    byte kind;              // ENTRY_READ, ENTRY_LINES or ENTRY_END
+    uint64_t cycle;         // Cycle the read happened or the lines changed at
+    byte data;              // The byte read
+    uint32_t irq_lines;     // The lines from the cycle on
+    uint32_t nmi_lines;
+    bool nmi_pending;
+} replay_entry;
+
+struct _replay_log
+{
+    machine* cpu;                       // Machine the log is attached to, or NULL
+    FILE* file;
+    bool recording;                     // Writing the log rather than replaying it
+    bool failed;                        // A write failed, or the replay diverged
+    bool lines_changed;                 // A device changed a line since the last boundary
+    uint64_t cycle;                     // Cycle of the last entry written or read
+    replay_entry next;                  // The replay's next entry, read ahead
+    size_t used;                        // Bytes in the buffer
+    size_t position;                    // Next byte of the buffer to read
+    byte buffer[REPLAY_BUFFER_SIZE];
+};
+
+/*   Writing   */
+
+static void flush_buffer(replay_log* r)
+{
+    if(r->used && fwrite(r->buffer, 1, r->used, r->file) != r->used)
+        r->failed = true;
+    r->used = 0;
+}
+
+static void put_byte(replay_log* r, byte value)
+{
+    if(r->used == REPLAY_BUFFER_SIZE)
+        flush_buffer(r);
+    r->buffer[r->used++] = value;
+}
+
+static void put_varint(replay_log* r, uint64_t value)
+{
+    while(value >= 0x80)
+    {
+        put_byte(r, value | 0x80);
+        value >>= 7;
+    }
+    put_byte(r, value);
+}
+
+static void put_entry(replay_log* r, const replay_entry* e)
+{
+    put_varint(r, (e->cycle - r->cycle) << 1 | e->kind);
+    r->cycle = e->cycle;
+    if(e->kind == ENTRY_READ)
+        put_byte(r, e->data);
+    else
+    {
+        put_varint(r, e->irq_lines);
+        put_varint(r, e->nmi_lines);
+        put_byte(r, e->nmi_pending);
+    }
+}
+
+/*   Reading   */
+
+// Returns the next byte of the log, or -1 at its end.
+static int get_byte(replay_log* r)
+{
+    if(r->position == r->used)
+    {
+        r->used = fread(r->buffer, 1, REPLAY_BUFFER_SIZE, r->file);
+        r->position = 0;
+        if(r->used == 0)
+            return -1;
+    }
+    return r->buffer[r->position++];
+}
+
+static bool get_varint(replay_log* r, uint64_t* value)
+{
+    *value = 0;
+    for(int shift = 0; shift < 64; shift += 7)
+    {
+        int c = get_byte(r);
+        if(c < 0)
+            return false;
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        if(!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// Reads the entry after the current one into r->next.
+static void next_entry(replay_log* r)
+{
+    replay_entry* e = &r->next;
+    uint64_t header, irq, nmi;
+    int c = get_byte(r);
+    e->kind = ENTRY_END;
+    if(c < 0)
+        return; // the end of the log
+    r->position--;
+    if(!get_varint(r, &header))
+    {
+        r->failed = true; // cut off
+        return;
+    }
+    r->cycle += header >> 1;
+    e->cycle = r->cycle;
+    if((header & 1) == ENTRY_READ)
+    {
+        if((c = get_byte(r)) < 0)
+        {
+            r->failed = true;
+            return;
+        }
+        e->data = c;
+    }
+    else
+    {
+        if(!get_varint(r, &irq) || !get_varint(r, &nmi) || (c = get_byte(r)) < 0)
+        {
+            r->failed = true;
+            return;
+        }
+        e->irq_lines = irq;
+        e->nmi_lines = nmi;
+        e->nmi_pending = c != 0;
+    }
+    e->kind = header & 1;
+}
+
+/*   Interface   */
+
+static replay_log* open_log(const char* path, bool recording)
+{
+    replay_log* r = calloc(1, sizeof(replay_log));
+    if(r == NULL)
+        return NULL;
+    r->recording = recording;
+    r->file = fopen(path, recording ? "wb" : "rb");
+    if(r->file == NULL)
+    {
+        free(r);
+        return NULL;
+    }
+    setvbuf(r->file, NULL, _IONBF, 0); // the log has its own buffer
+    return r;
+}
+
+replay_log* replay_record(const char* path)
+{
+    replay_log* r = open_log(path, true);
+    if(r == NULL)
+        return NULL;
+    uint32_t version = REPLAY_VERSION;
+    if(fwrite(REPLAY_MAGIC, 8, 1, r->file) != 1 || fwrite(&version, sizeof(version), 1, r->file) != 1)
+    {
+        fclose(r->file);
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+replay_log* replay_open(const char* path)
+{
+    replay_log* r = open_log(path, false);
+    if(r == NULL)
+        return NULL;
+    char magic[8];
+    uint32_t version;
+    if(fread(magic, 8, 1, r->file) != 1 || memcmp(magic, REPLAY_MAGIC, 8) != 0
+        || fread(&version, sizeof(version), 1, r->file) != 1 || version != REPLAY_VERSION)
+    {
+        fclose(r->file);
+        free(r);
+        return NULL;
+    }
+    next_entry(r);
+    return r;
+}
+
+int replay_close(replay_log* r)
+{
+    if(r == NULL)
+        return 0;
+    if(r->recording)
+        flush_buffer(r);
+    int result = r->failed ? -1 : 0;
+    if(fclose(r->file) != 0)
+        result = -1;
+    free(r);
+    return result;
+}
+
+void replay_attach(machine* cpu, replay_log* r)
+{
+    if(cpu->replay)
+        cpu->replay->cpu = NULL;
+    cpu->replay = r;
+    if(r)
+    {
+        if(r->cpu)
+            replay_attach(r->cpu, NULL);
+        r->cpu = cpu;
+    }
+}
+
+byte replay_input(machine* cpu, uint16_t address)
+{
+    replay_log* r = cpu->replay;
+    if(r->recording)
+    {
+        const bus_page* page = &cpu->pages[address >> 8];
+        replay_entry e = { ENTRY_READ, cpu->cycles };
+        e.data = page->read ? page->read(cpu, address, page->device) : 0;
+        put_entry(r, &e);
+        return e.data;
+    }
+    // reads the run went past without making them
+    while(r->next.kind == ENTRY_READ && r->next.cycle < cpu->cycles)
+    {
+        r->failed = true;
+        next_entry(r);
+    }
+    if(r->next.kind != ENTRY_READ || r->next.cycle != cpu->cycles)
+    {
+        r->failed = true; // a read the recording did not make here
+        return 0;
+    }
+    byte data = r->next.data;
+    next_entry(r);
+    // the engine only stops for line changes, so it is told here where the next one is
+    if(r->next.kind == ENTRY_LINES && r->next.cycle < cpu->stop_cycle)
+        cpu->stop_cycle = r->next.cycle;
+    return data;
+}
+
+bool replay_line_change(replay_log* r)
+{
+    if(!r->recording)
+        return true;
+    // logged once the instruction completes, which is where the replay applies it
+    r->lines_changed = true;
+    r->cpu->stop_cycle = 0;
+    return false;
+}
+
+void replay_boundary(machine* cpu)
+{
+    replay_log* r = cpu->replay;
+    if(r->recording)
+    {
+        if(r->lines_changed)
+        {
+            replay_entry e = { ENTRY_LINES, cpu->cycles };
+            e.irq_lines = cpu->irq_lines;
+            e.nmi_lines = cpu->nmi_lines;
+            e.nmi_pending = cpu->nmi_pending;
+            put_entry(r, &e);
+            r->lines_changed = false;
+        }
+        return;
+    }
+    while(r->next.kind != ENTRY_END && r->next.cycle <= cpu->cycles)
+    {
+        if(r->next.kind == ENTRY_LINES)
+        {
+            cpu->irq_lines = r->next.irq_lines;
+            cpu->nmi_lines = r->next.nmi_lines;
+            cpu->nmi_pending = r->next.nmi_pending;
+        }
+        else if(r->next.cycle == cpu->cycles)
+            break; // read by the instruction about to run
+        else
+            r->failed = true; // the run went past a read without making it
+        next_entry(r);
+    }
+}
+
+uint64_t replay_stop_cycle(const replay_log* r)
+{
+    // reads are answered where they happen, replay_input stops the engine for a line change after one
+    if(r->recording || r->next.kind != ENTRY_LINES)
+        return CPU_UNLIMITED;
+    return r->next.cycle;
+}
@@ -0,0 +1,119 @@
+/**
+ * @file replay.h
+ * @author Mason Daub
+ * @brief Records the inputs a machine gets from its devices, and replays them.
+ * 
+ * A recording logs every byte read from a page that is not memory, which is
+ * where device handlers answer, and every change to the interrupt lines, each
+ * tagged with the cycle it happened at. Replaying the log feeds those bytes and
+ * line changes back in the same order, without calling the read handlers or
+ * listening to the devices' interrupt outputs, so a run from the same starting
+ * state is identical even if the devices are not there. Writes still reach the
+ * devices, so a replayed terminal prints what it did before.
+ * 
+ * The log is written and read front to back through a buffer, and a replay only
+ * ever looks at its next entry. A recording stops the engine after every
+ * instruction that changes an interrupt line and logs the lines there, and a
+ * replay stops its engine at the cycle of its next line change, so the change
+ * is applied between the same two instructions. Reads are answered where they
+ * happen without stopping the engine, so IO heavy programs replay at full speed.
+ * The entry after a read is seen once the read is answered, which is where a
+ * replay learns where to stop for a line change that follows it. A read that
+ * does not match its entry's cycle, or that the run skips, marks the replay as
+ * diverged.
+ * 
+ * The log starts with REPLAY_MAGIC and a 32 bit version in host byte order. Each
+ * entry is a varint of the cycles since the previous entry, shifted left by one
+ * with the entry kind in bit 0, followed by the byte read, or by the IRQ and NMI
+ * lines as varints and a byte that is 1 if an NMI is pending.
+ * 
+ * Memory pages, including pages the debugger watches, are never logged, and a
+ * machine without a log only checks for one where it takes the bus slow path
+ * to a device and once per engine run.
+ * 
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+
+#define REPLAY_MAGIC "D6502INP"         // First 8 bytes of a log
+#define REPLAY_VERSION 1
+#define REPLAY_BUFFER_SIZE 0x10000      // Bytes of the log written or read at a time
+
+/**
+ * @brief Creates a log to record into.
+ * 
+ * @param path The file to create.
+ * @return The log, or NULL if the file could not be created.
+ */
+replay_log* replay_record(const char* path);
+
+/**
+ * @brief Opens a recorded log to replay.
+ * 
+ * @param path The log file.
+ * @return The log, or NULL if the file could not be read or is not a log.
+ */
+replay_log* replay_open(const char* path);
+
+/**
+ * @brief Writes the rest of a recording, or ends a replay, and closes the file.
+ * The log must not be attached.
+ * 
+ * @param r The log to close, or NULL.
+ * @return 0 on success, -1 if a write failed or the replay diverged from the recording.
+ */
+int replay_close(replay_log* r);
+
+/**
+ * @brief Attaches a log to a machine. Attach it to a machine in the state the
+ * recording started from before running it.
+ * 
+ * @param cpu The machine.
+ * @param r The log, or NULL to detach the current one.
+ */
+void replay_attach(machine* cpu, replay_log* r);
+
+/**
+ * @brief Called by the bus slow path for reads of pages that are not memory.
+ * 
+ * @param cpu The machine. It must have a log attached.
+ * @param address The address read.
+ * @return The byte the device returned, or the one recorded for this read.
+ */
+byte replay_input(machine* cpu, uint16_t address);
+
+/**
+ * @brief Called by cpu_set_irq and cpu_set_nmi before a device changes a line.
+ * 
+ * @param r The machine's log.
+ * @return true if the log is being replayed, which drives the lines instead of the devices.
+ */
+bool replay_line_change(replay_log* r);
+
+/**
+ * @brief Called by cpu_interrupt between instructions. A recording logs the
+ * interrupt lines if they changed, and a replay applies the changes due by now.
+ * 
+ * @param cpu The machine. It must have a log attached.
+ */
+void replay_boundary(machine* cpu);
+
+/**
+ * @brief Tells cpu_run where its engine has to stop for the replay.
+ * 
+ * @param r The machine's log.
+ * @return The cycle of the next line change, CPU_UNLIMITED if none is known yet.
+ */
+uint64_t replay_stop_cycle(const replay_log* r);
+
+#endif // REPLAY_H
@@ -0,0 +1,118 @@
+/**
+ * @file result.c
+ * @author Mason Daub
+ * @brief Halt reasons and the JSON and binary result writers.
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#include "result.h"
+
+halt_reason halt_reason_of(uint32_t events)
+{
+    if(events & EVENT_HALT)
+        return HALT_COMMAND;
+    if(events & EVENT_ILLEGAL)
+        return HALT_ILLEGAL;
+    if(events & EVENT_STACK)
+        return HALT_STACK;
+    if(events & EVENT_JAM)
+        return HALT_JAM;
+    return HALT_LIMIT;
+}
+
+const char* halt_reason_name(halt_reason reason)
+{
+    static const char* const names[] = { "halt", "error", "limit", "illegal", "jam", "stack" };
+    if((unsigned)reason >= sizeof(names) / sizeof(names[0]))
+        return "error";
+    return names[reason];
+}
+
+int result_parse_range(const char* text, memory_range* range)
+{
+    unsigned start, end;
+    if(sscanf(text, "%x-%x", &start, &end) != 2 || start > end || end > 0xffff)
+        return -1;
+    range->start = start;
+    range->end = end;
+    return 0;
+}
+
+void result_write_string(FILE* out, const char* str, size_t size)
+{
+    fputc('"', out);
+    for(size_t i = 0; i < size; i++)
+    {
+        unsigned char c = str[i];
+        if(c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if(c == '\n')
+            fputs("\\n", out);
+        else if(c < 0x20 || c >= 0x7f)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+void result_write_json(FILE* out, const machine* cpu, const run_result* result)
+{
+    static const char hex[] = "0123456789abcdef";
+    fprintf(out, "{\"halt\":\"%s\",\"status\":%d", halt_reason_name(result->halt), result->halt);
+    fprintf(out, ",\"cycles\":%llu,\"registers\":{\"pc\":%u,\"a\":%u,\"x\":%u,\"y\":%u,\"s\":%u,\"p\":%u},\"output\":",
+        (unsigned long long)cpu->cycles, cpu->PC, cpu->regA, cpu->regX, cpu->regY, cpu->SP, cpu_get_flags(cpu));
+    result_write_string(out, result->output ? result->output : "", result->output_size);
+    fputs(",\"memory\":[", out);
+    for(int i = 0; i < result->range_count; i++)
+    {
+        const memory_range* range = &result->ranges[i];
+        fprintf(out, "%s{\"start\":%u,\"data\":\"", i ? "," : "", range->start);
+        for(uint32_t address = range->start; address <= range->end; address++)
+        {
+            byte data = peek_memory(cpu, address);
+            fputc(hex[data >> 4], out);
+            fputc(hex[data & 0xf], out);
+        }
+        fputs("\"}", out);
+    }
+    fputs("]}\n", out);
+}
+
+// Writes the low bytes of a value, least significant first.
+static void put_le(FILE* out, uint64_t value, int bytes)
+{
+    for(int i = 0; i < bytes; i++)
+        fputc((value >> (8 * i)) & 0xff, out);
+}
+
+void result_write_binary(FILE* out, const machine* cpu, const run_result* result)
+{
+    fwrite("6502", 1, 4, out);
+    put_le(out, RESULT_BINARY_VERSION, 1);
+    put_le(out, result->halt, 1);
+    put_le(out, cpu->PC, 2);
+    put_le(out, cpu->regA, 1);
+    put_le(out, cpu->regX, 1);
+    put_le(out, cpu->regY, 1);
+    put_le(out, cpu->SP, 1);
+    put_le(out, cpu_get_flags(cpu), 1);
+    put_le(out, 0, 1);
+    put_le(out, cpu->cycles, 8);
+    put_le(out, result->output_size, 4);
+    if(result->output_size)
+        fwrite(result->output, 1, result->output_size, out);
+    put_le(out, result->range_count, 4);
+    for(int i = 0; i < result->range_count; i++)
+    {
+        const memory_range* range = &result->ranges[i];
+        put_le(out, range->start, 2);
+        put_le(out, range->end, 2);
+        for(uint32_t address = range->start; address <= range->end; address++)
+            fputc(peek_memory(cpu, address), out);
+    }
+}
@@ -0,0 +1,135 @@
+/**
+ * @file result.h
+ * @author Mason Daub
+ * @brief Why a run stopped, and the result of a headless run as JSON or binary.
+ * 
+ * Every way a run can end has a halt_reason, whose value is also the exit status
+ * of a headless run, so a job system can tell them apart without reading the
+ * result:
+ * 
+ *  0 halt    - the program sent the terminal's halt command
+ *  1 error   - the ROM or the options could not be used, nothing ran
+ *  2 limit   - the cycle or instruction budget ran out
+ *  3 illegal - the opcode at PC is not a 6502 instruction
+ *  4 jam     - the program jumped or branched to itself and no interrupt can come
+ *  5 stack   - a push overflowed or a pop underflowed the stack
+ * 
+ * The JSON result is a single line:
+ * 
+ *     {"halt":"halt","status":0,"cycles":N,"registers":{"pc":N,"a":N,"x":N,"y":N,"s":N,"p":N},
+ *      "output":"...","memory":[{"start":N,"data":"hexbytes"}]}
+ * 
+ * The binary result is little endian:
+ * 
+ *     "6502" magic, version (1 byte), halt_reason (1 byte), PC (2), A, X, Y, S, P
+ *     (1 each), a zero byte, cycles (8), output size (4) and the output bytes,
+ *     range count (4), then per range its first and last address (2 each) and
+ *     its bytes.
+ * 
+ * Memory is read with peek_memory, so device pages read as 0.
+ * 
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#ifndef RESULT_H
+#define RESULT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define RESULT_MAX_RANGES 16        // Memory ranges a result can include
+#define RESULT_BINARY_VERSION 1     // Version byte of the binary result
+
+/**
+ * @brief Why a run stopped. The values are exit statuses.
+ */
+typedef enum _halt_reason
+{
+    HALT_COMMAND = 0,       // The terminal's halt command
+    HALT_ERROR   = 1,       // Nothing ran
+    HALT_LIMIT   = 2,       // The budget ran out
+    HALT_ILLEGAL = 3,       // EVENT_ILLEGAL
+    HALT_JAM     = 4,       // EVENT_JAM
+    HALT_STACK   = 5,       // EVENT_STACK
+} halt_reason;
+
+/**
+ * @brief An inclusive range of addresses.
+ */
+typedef struct _memory_range
+{
+    uint16_t start;
+    uint16_t end;
+} memory_range;
+
+/**
+ * @brief What a result holds besides the machine's registers and cycle count.
+ */
+typedef struct _run_result
+{
+    halt_reason halt;
+    const char* output;                         // Everything the terminal printed
+    size_t output_size;
+    memory_range ranges[RESULT_MAX_RANGES];     // Memory to include
+    int range_count;
+} run_result;
+
+/**
+ * @brief Tells why cpu_run stopped. A halt command wins over a fault raised by the
+ * same instruction.
+ * 
+ * @param events The events cpu_run returned.
+ * @return The reason, HALT_LIMIT if no event is set.
+ */
+halt_reason halt_reason_of(uint32_t events);
+
+/**
+ * @brief Names a halt reason, as the results of headless and batch runs do.
+ * 
+ * @param reason The reason.
+ * @return "halt", "error", "limit", "illegal", "jam" or "stack".
+ */
+const char* halt_reason_name(halt_reason reason);
+
+/**
+ * @brief Parses a memory range written as "start-end" in hex, inclusive.
+ * 
+ * @param text The text to parse.
+ * @param range Set to the range.
+ * @return 0 on success, -1 if the text is not a range.
+ */
+int result_parse_range(const char* text, memory_range* range);
+
+/**
+ * @brief Writes a string as a JSON string, quoted and escaped.
+ * 
+ * @param out Where to write.
+ * @param str The string, which does not need a terminator.
+ * @param size Its length in bytes.
+ */
+void result_write_string(FILE* out, const char* str, size_t size);
+
+/**
+ * @brief Writes a result as one line of JSON.
+ * 
+ * @param out Where to write.
+ * @param cpu The machine after the run.
+ * @param result The rest of the result.
+ */
+void result_write_json(FILE* out, const machine* cpu, const run_result* result);
+
+/**
+ * @brief Writes a result in the binary format.
+ * 
+ * @param out Where to write. It should be opened in binary mode.
+ * @param cpu The machine after the run.
+ * @param result The rest of the result.
+ */
+void result_write_binary(FILE* out, const machine* cpu, const run_result* result);
+
+#endif // RESULT_H
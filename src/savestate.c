@@ -0,0 +1,387 @@
+/**
+ * @file savestate.c
+ * @author Mason Daub
+ * @brief Saved state writer and loader.
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "savestate.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SAVESTATE_MMAP
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define HEADER_SIZE 64                                  // Bytes before the page bytes
+#define MEMORY_SIZE (BUS_PAGE_COUNT * BUS_PAGE_SIZE)    // Bytes in the memory section, unpacked
+#define PACKED_MAX (MEMORY_SIZE + MEMORY_SIZE / 128)    // Most bytes PackBits can turn it into
+
+struct _savestate
+{
+    uint16_t PC;                                // Saved registers, events, interrupt lines and cycle counter
+    byte regA;
+    byte regX;
+    byte regY;
+    byte SP;
+    byte FLAGS;
+    uint32_t events;
+    uint32_t irq_lines;
+    uint32_t nmi_lines;
+    bool nmi_pending;
+    uint64_t cycles;
+
+    byte pages[BUS_PAGE_COUNT];                 // SAVESTATE_PAGE_DEVICE, or the access flags of a memory page
+
+    byte device_pages[BUS_PAGE_COUNT];          // First page of every saved device, in page order
+    uint32_t device_sizes[BUS_PAGE_COUNT];      // Bytes of state of every saved device
+    int device_count;
+    byte* devices;                              // Saved device states, in page order
+
+    byte* memory;                               // The address space, page n at n * BUS_PAGE_SIZE
+    bool mapped;                                // memory is mapped from the file rather than allocated
+};
+
+// Devices are told apart from unmapped pages by their access flags.
+static bool is_device(const bus_page* page)
+{
+    return page->memory == NULL && page->access;
+}
+
+// A device is saved once, at the first of the pages it is mapped on.
+static bool device_page(const machine* cpu, int n)
+{
+    const bus_page* page = &cpu->pages[n];
+    return page->state_size && (n == 0 || cpu->pages[n - 1].device != page->device);
+}
+
+/*   PackBits   */
+
+// A control byte n below 0x80 is followed by n + 1 bytes to copy, and one above
+// 0x80 by a byte to repeat 0x101 - n times. Returns the packed size.
+static size_t pack(const byte* in, size_t size, byte* out)
+{
+    size_t i = 0, o = 0;
+    while(i < size)
+    {
+        size_t run = 1;
+        while(i + run < size && run < 128 && in[i + run] == in[i])
+            run++;
+        if(run > 1)
+        {
+            out[o++] = 0x101 - run;
+            out[o++] = in[i];
+            i += run;
+            continue;
+        }
+        // copy up to the next run of three, which is worth a packet of its own
+        size_t start = i;
+        while(i < size && i - start < 128 && !(i + 2 < size && in[i] == in[i + 1] && in[i] == in[i + 2]))
+            i++;
+        out[o++] = i - start - 1;
+        memcpy(out + o, in + start, i - start);
+        o += i - start;
+    }
+    return o;
+}
+
+// Returns false unless the packed bytes unpack to exactly size bytes.
+static bool unpack(const byte* in, size_t packed, byte* out, size_t size)
+{
+    size_t i = 0, o = 0;
+    while(i < packed)
+    {
+        byte n = in[i++];
+        if(n < 0x80)
+        {
+            size_t count = n + 1;
+            if(count > packed - i || count > size - o)
+                return false;
+            memcpy(out + o, in + i, count);
+            i += count;
+            o += count;
+        }
+        else if(n > 0x80)
+        {
+            size_t count = 0x101 - n;
+            if(i == packed || count > size - o)
+                return false;
+            memset(out + o, in[i++], count);
+            o += count;
+        }
+    }
+    return o == size;
+}
+
+/*   Writing   */
+
+static void put_le(byte* out, uint64_t value, int bytes)
+{
+    for(int i = 0; i < bytes; i++)
+        out[i] = (value >> (8 * i)) & 0xff;
+}
+
+int savestate_write(const machine* cpu, const char* path, bool compress)
+{
+    // everything up to the memory section is built in one buffer
+    int device_count = 0;
+    size_t devices_size = 0;
+    for(int n = 0; n < BUS_PAGE_COUNT; n++)
+        if(device_page(cpu, n))
+        {
+            device_count++;
+            devices_size += cpu->pages[n].state_size;
+        }
+    size_t header_size = HEADER_SIZE + BUS_PAGE_COUNT + device_count * 5 + devices_size;
+    size_t offset = compress ? header_size : (header_size + SAVESTATE_ALIGN - 1) & ~(size_t)(SAVESTATE_ALIGN - 1);
+    byte* header = calloc(1, offset);
+    byte* memory = calloc(1, MEMORY_SIZE + PACKED_MAX);
+    if(header == NULL || memory == NULL)
+    {
+        free(header);
+        free(memory);
+        return -1;
+    }
+
+    byte* table = header + HEADER_SIZE + BUS_PAGE_COUNT;
+    byte* state = table + device_count * 5;
+    for(int n = 0; n < BUS_PAGE_COUNT; n++)
+    {
+        const bus_page* page = &cpu->pages[n];
+        if(page->memory)
+        {
+            header[HEADER_SIZE + n] = page->access;
+            memcpy(memory + n * BUS_PAGE_SIZE, page->memory, BUS_PAGE_SIZE);
+        }
+        else if(is_device(page))
+            header[HEADER_SIZE + n] = SAVESTATE_PAGE_DEVICE;
+        if(device_page(cpu, n))
+        {
+            table[0] = n;
+            put_le(table + 1, page->state_size, 4);
+            table += 5;
+            memcpy(state, page->device, page->state_size);
+            state += page->state_size;
+        }
+    }
+
+    byte* section = memory;
+    size_t size = MEMORY_SIZE;
+    if(compress)
+    {
+        section = memory + MEMORY_SIZE;
+        size = pack(memory, MEMORY_SIZE, section);
+    }
+
+    memcpy(header, SAVESTATE_MAGIC, 8);
+    put_le(header + 8, SAVESTATE_VERSION, 4);
+    put_le(header + 12, compress ? SAVESTATE_COMPRESSED : 0, 4);
+    put_le(header + 16, offset, 8);
+    put_le(header + 24, size, 8);
+    put_le(header + 32, cpu->PC, 2);
+    header[34] = cpu->regA;
+    header[35] = cpu->regX;
+    header[36] = cpu->regY;
+    header[37] = cpu->SP;
+    header[38] = cpu_get_flags(cpu);
+    header[39] = cpu->nmi_pending;
+    put_le(header + 40, cpu->events, 4);
+    put_le(header + 44, cpu->irq_lines, 4);
+    put_le(header + 48, cpu->nmi_lines, 4);
+    put_le(header + 52, device_count, 4);
+    put_le(header + 56, cpu->cycles, 8);
+
+    int status = -1;
+    FILE* file = fopen(path, "wb");
+    if(file)
+    {
+        if(fwrite(header, 1, offset, file) == offset && fwrite(section, 1, size, file) == size)
+            status = 0;
+        if(fclose(file) != 0)
+            status = -1;
+    }
+    free(header);
+    free(memory);
+    return status;
+}
+
+/*   Reading   */
+
+static uint64_t get_le(const byte* in, int bytes)
+{
+    uint64_t value = 0;
+    for(int i = 0; i < bytes; i++)
+        value |= (uint64_t)in[i] << (8 * i);
+    return value;
+}
+
+// Maps an uncompressed memory section copy on write. Returns false where it can
+// not be mapped, and the section is read instead.
+static bool map_section(savestate* state, FILE* file, uint64_t offset)
+{
+#ifdef SAVESTATE_MMAP
+    struct stat info;
+    long page_size = sysconf(_SC_PAGESIZE);
+    if(page_size <= 0 || offset % page_size != 0 || fstat(fileno(file), &info) != 0
+        || (uint64_t)info.st_size < offset + MEMORY_SIZE)
+        return false;
+    void* memory = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file), offset);
+    if(memory == MAP_FAILED)
+        return false;
+    state->memory = memory;
+    state->mapped = true;
+    return true;
+#else
+    (void)state;
+    (void)file;
+    (void)offset;
+    return false;
+#endif
+}
+
+// Reads or unpacks the memory section into a buffer of its own.
+static bool read_section(savestate* state, FILE* file, uint64_t offset, uint64_t size, bool compressed)
+{
+    if((!compressed && size != MEMORY_SIZE) || size > PACKED_MAX || fseek(file, offset, SEEK_SET) != 0)
+        return false;
+    state->memory = malloc(MEMORY_SIZE);
+    byte* packed = compressed ? malloc(size) : state->memory;
+    bool ok = state->memory && packed && fread(packed, 1, size, file) == size
+        && (!compressed || unpack(packed, size, state->memory, MEMORY_SIZE));
+    if(compressed)
+        free(packed);
+    return ok;
+}
+
+savestate* savestate_open(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if(file == NULL)
+        return NULL;
+    savestate* state = calloc(1, sizeof(savestate));
+    byte header[HEADER_SIZE];
+    bool ok = state && fread(header, 1, HEADER_SIZE, file) == HEADER_SIZE && memcmp(header, SAVESTATE_MAGIC, 8) == 0
+        && get_le(header + 8, 4) == SAVESTATE_VERSION && fread(state->pages, 1, BUS_PAGE_COUNT, file) == BUS_PAGE_COUNT;
+    uint32_t flags = 0;
+    uint64_t offset = 0, size = 0, device_count = 0;
+    if(ok)
+    {
+        flags = get_le(header + 12, 4);
+        offset = get_le(header + 16, 8);
+        size = get_le(header + 24, 8);
+        state->PC = get_le(header + 32, 2);
+        state->regA = header[34];
+        state->regX = header[35];
+        state->regY = header[36];
+        state->SP = header[37];
+        state->FLAGS = header[38];
+        state->nmi_pending = header[39] != 0;
+        state->events = get_le(header + 40, 4);
+        state->irq_lines = get_le(header + 44, 4);
+        state->nmi_lines = get_le(header + 48, 4);
+        device_count = get_le(header + 52, 4);
+        state->cycles = get_le(header + 56, 8);
+        ok = device_count <= BUS_PAGE_COUNT;
+        for(int n = 0; n < BUS_PAGE_COUNT; n++)
+            if(state->pages[n] != SAVESTATE_PAGE_DEVICE && (state->pages[n] & ~(BUS_READ | BUS_WRITE)))
+                ok = false;
+    }
+
+    // the device table, then their states
+    size_t devices_size = 0;
+    for(uint64_t i = 0; ok && i < device_count; i++)
+    {
+        byte entry[5];
+        ok = fread(entry, 1, 5, file) == 5 && get_le(entry + 1, 4) <= BUS_PAGE_SIZE * BUS_PAGE_COUNT;
+        state->device_pages[i] = entry[0];
+        state->device_sizes[i] = get_le(entry + 1, 4);
+        devices_size += state->device_sizes[i];
+    }
+    if(ok)
+    {
+        state->device_count = device_count;
+        state->devices = malloc(devices_size ? devices_size : 1);
+        ok = state->devices && fread(state->devices, 1, devices_size, file) == devices_size
+            && offset >= HEADER_SIZE + BUS_PAGE_COUNT + device_count * 5 + devices_size;
+    }
+
+    if(ok)
+    {
+        bool compressed = flags & SAVESTATE_COMPRESSED;
+        ok = (!compressed && size == MEMORY_SIZE && map_section(state, file, offset))
+            || read_section(state, file, offset, size, compressed);
+    }
+    fclose(file); // a mapping keeps the file open
+    if(!ok)
+    {
+        savestate_close(state);
+        return NULL;
+    }
+    return state;
+}
+
+void savestate_close(savestate* state)
+{
+    if(state == NULL)
+        return;
+#ifdef SAVESTATE_MMAP
+    if(state->mapped)
+        munmap(state->memory, MEMORY_SIZE);
+    else
+#endif
+        free(state->memory);
+    free(state->devices);
+    free(state);
+}
+
+int savestate_load(machine* cpu, const savestate* state)
+{
+    // the devices have to be where they were, with states of the same size
+    int device_count = 0;
+    for(int n = 0; n < BUS_PAGE_COUNT; n++)
+    {
+        if(is_device(&cpu->pages[n]) != (state->pages[n] == SAVESTATE_PAGE_DEVICE))
+            return -1;
+        device_count += device_page(cpu, n);
+    }
+    if(device_count != state->device_count)
+        return -1;
+    for(int i = 0; i < state->device_count; i++)
+        if(!device_page(cpu, state->device_pages[i]) || cpu->pages[state->device_pages[i]].state_size != state->device_sizes[i])
+            return -1;
+
+    // remapping throws away decoded and translated code, and lets a snapshot save the old pages
+    for(int n = 0; n < BUS_PAGE_COUNT; n++)
+        if(state->pages[n] != SAVESTATE_PAGE_DEVICE)
+            bus_map_memory(cpu, n << 8, BUS_PAGE_SIZE, state->pages[n] ? state->memory + n * BUS_PAGE_SIZE : NULL,
+                state->pages[n]);
+
+    const byte* saved = state->devices;
+    for(int i = 0; i < state->device_count; i++)
+    {
+        const bus_page* page = &cpu->pages[state->device_pages[i]];
+        memcpy(page->device, saved, page->state_size);
+        saved += page->state_size;
+    }
+
+    cpu->PC = state->PC;
+    cpu->regA = state->regA;
+    cpu->regX = state->regX;
+    cpu->regY = state->regY;
+    cpu->SP = state->SP;
+    cpu_set_flags(cpu, state->FLAGS);
+    cpu->events = state->events;
+    cpu->irq_lines = state->irq_lines;
+    cpu->nmi_lines = state->nmi_lines;
+    cpu->nmi_pending = state->nmi_pending;
+    cpu->cycles = state->cycles;
+    return 0;
+}
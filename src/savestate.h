@@ -0,0 +1,89 @@
+/**
+ * @file savestate.h
+ * @author Mason Daub
+ * @brief Saves the whole machine to a file, and resumes it from one.
+ * 
+ * A saved state holds the registers, pending events, interrupt lines and cycle
+ * counter, what is mapped on every page of the bus, the state of every device
+ * and the 64K of memory the pages show. Unlike a snapshot it outlives the
+ * process, so a library of warmed up machines can be resumed without running
+ * their boot code from RST_ADDRESS again.
+ * 
+ * The memory is stored as one section of the whole address space, starting at a
+ * multiple of SAVESTATE_ALIGN in the file. Loading maps that section copy on
+ * write and points the memory pages of the bus straight at it, so resuming
+ * copies nothing and the file is never written. The state has to stay open for
+ * as long as a machine uses its pages, like a rom_image. Compressed states,
+ * meant for archiving, store the section packed with PackBits and are unpacked
+ * into a buffer when they are opened.
+ * 
+ * The devices are not saved, only their state: a state is loaded into a machine
+ * that has the same devices on the same pages. Every other page is mapped as it
+ * was saved, as RAM, ROM or unmapped, so the ROM image is not needed.
+ * 
+ * The file is little endian:
+ * 
+ *     "D6502SAV" magic, version (4), flags (4), memory section offset (8) and
+ *     size in the file (8), PC (2), A, X, Y, S, P, NMI pending (1 each),
+ *     events, IRQ lines, NMI lines and device count (4 each), cycles (8),
+ *     256 page bytes (SAVESTATE_PAGE_DEVICE, or a memory page's BUS_READ and
+ *     BUS_WRITE flags, 0 if unmapped), per device its first page (1) and state
+ *     size (4), the device states in the same order, then the memory section.
+ * 
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include <stdbool.h>
+#include "cpu.h"
+
+#define SAVESTATE_MAGIC "D6502SAV"      // First 8 bytes of a saved state
+#define SAVESTATE_VERSION 1
+#define SAVESTATE_ALIGN 0x4000          // Alignment of an uncompressed memory section, a multiple of host pages
+#define SAVESTATE_COMPRESSED 0x01       // Flag: the memory section is packed with PackBits
+#define SAVESTATE_PAGE_DEVICE 0x80      // Page byte of a page a device is mapped on
+
+typedef struct _savestate savestate;
+
+/**
+ * @brief Saves the state of a machine to a file.
+ * 
+ * @param cpu The machine. It must not be running.
+ * @param path The file to create.
+ * @param compress Pack the memory, which makes the file smaller but a little slower to open.
+ * @return 0 on success, -1 if the file could not be written.
+ */
+int savestate_write(const machine* cpu, const char* path, bool compress);
+
+/**
+ * @brief Opens a saved state, mapping its memory or unpacking it.
+ * 
+ * @param path The file.
+ * @return The state, or NULL if the file could not be read or is not a saved state.
+ */
+savestate* savestate_open(const char* path);
+
+/**
+ * @brief Closes a saved state. No machine may still use its pages.
+ * 
+ * @param state The state to close, or NULL.
+ */
+void savestate_close(savestate* state);
+
+/**
+ * @brief Puts a machine into a saved state. Its memory pages are mapped from the
+ * state, and what the machine runs from there on writes to private copies.
+ * 
+ * @param cpu The machine, with the same devices mapped as the one saved. It must not be running.
+ * @param state The state.
+ * @return 0 on success, -1 if the devices do not match, in which case the machine is unchanged.
+ */
+int savestate_load(machine* cpu, const savestate* state);
+
+#endif // SAVESTATE_H
@@ -0,0 +1,276 @@
+/**
+ * @file snapshot.c
+ * @author Mason Daub
+ * @brief Copy on write machine snapshots.
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "snapshot.h"
+#include "jit.h"
+
+struct _snapshot
+{
+    machine* owner;                             // Machine sharing the pages that are not saved yet, or NULL
+    bool captured;                              // Set once the snapshot holds a state
+
+    uint16_t PC;                                // Saved registers, events, interrupt lines and cycle counter
+    byte regA;
+    byte regX;
+    byte regY;
+    byte SP;
+    byte FLAGS;
+    uint32_t events;
+    uint32_t irq_lines;
+    uint32_t nmi_lines;
+    bool nmi_pending;
+    uint64_t cycles;
+
+    bool mapped[BUS_PAGE_COUNT];                // Pages that were memory when captured
+    bool saved[BUS_PAGE_COUNT];                 // Pages copied into data
+    bool dirty[BUS_PAGE_COUNT];                 // Pages of the owner written since the capture or the last restore
+    byte dirty_pages[BUS_PAGE_COUNT];           // The dirty pages, in the order they were written
+    int dirty_count;
+
+    byte device_pages[BUS_PAGE_COUNT];          // First page of every saved device, in page order
+    int device_count;
+    byte* devices;                              // Saved device states, in page order
+    size_t devices_size;                        // Bytes used in devices
+    size_t devices_capacity;                    // Bytes allocated for devices
+
+    byte data[BUS_PAGE_COUNT][BUS_PAGE_SIZE];   // Saved page contents
+};
+
+// A device is saved once, at the first of the pages it is mapped on.
+static bool device_page(const machine* cpu, int n)
+{
+    const bus_page* page = &cpu->pages[n];
+    return page->state_size && (n == 0 || cpu->pages[n - 1].device != page->device);
+}
+
+static size_t device_state_size(const machine* cpu)
+{
+    size_t size = 0;
+    for(int n = 0; n < BUS_PAGE_COUNT; n++)
+        if(device_page(cpu, n))
+            size += cpu->pages[n].state_size;
+    return size;
+}
+
+// Checks that the devices saved in a snapshot are where they were. Restoring
+// does not look at the other pages, so it stays cheap for short runs.
+static bool devices_match(const snapshot* s, const machine* cpu)
+{
+    size_t size = 0;
+    for(int i = 0; i < s->device_count; i++)
+    {
+        int n = s->device_pages[i];
+        if(!device_page(cpu, n))
+            return false;
+        size += cpu->pages[n].state_size;
+    }
+    return size == s->devices_size;
+}
+
+// Stops sharing pages with the owner. With keep set, the pages that are still
+// shared are copied first so the snapshot stays complete.
+static void detach(snapshot* s, bool keep)
+{
+    machine* cpu = s->owner;
+    for(int n = 0; n < BUS_PAGE_COUNT; n++)
+    {
+        bus_page* page = &cpu->pages[n];
+        if(keep && s->mapped[n] && !s->saved[n] && page->memory)
+        {
+            memcpy(s->data[n], page->memory, BUS_PAGE_SIZE);
+            s->saved[n] = true;
+        }
+        if(page->traps & BUS_TRAP_SNAPSHOT)
+            bus_set_traps(cpu, n, 0, BUS_TRAP_SNAPSHOT);
+    }
+    memset(s->dirty, 0, sizeof(s->dirty));
+    s->dirty_count = 0;
+    cpu->snapshot = NULL;
+    s->owner = NULL;
+}
+
+// Copies a saved page back and shares it again. Returns true if translated code
+// may have come from the page, which has to be thrown away.
+static bool restore_page(snapshot* s, machine* cpu, int n)
+{
+    bus_page* page = &cpu->pages[n];
+    bool writable = page->access & BUS_WRITE;
+    // read-only pages are never trapped and only change through snapshot_touch.
+    // They can be mapped straight from a ROM image, which must not be written.
+    if(page->memory == NULL || (!writable && memcmp(page->memory, s->data[n], BUS_PAGE_SIZE) == 0))
+        return false;
+    memcpy(page->memory, s->data[n], BUS_PAGE_SIZE);
+    if((page->traps & BUS_TRAP_DECODE) || !writable)
+        cpu_invalidate_decoded(cpu, n << 8, BUS_PAGE_SIZE);
+    if(writable)
+        bus_set_traps(cpu, n, BUS_TRAP_SNAPSHOT, 0);
+    return (page->traps & BUS_TRAP_CODE) || !writable;
+}
+
+snapshot* snapshot_create(void)
+{
+    return calloc(1, sizeof(snapshot));
+}
+
+void snapshot_destroy(snapshot* s)
+{
+    if(s == NULL)
+        return;
+    if(s->owner)
+        detach(s, false);
+    free(s->devices);
+    free(s);
+}
+
+void snapshot_capture(snapshot* s, machine* cpu)
+{
+    if(s->owner)
+        detach(s, false);
+    if(cpu->snapshot)
+        snapshot_release(cpu);
+
+    s->PC = cpu->PC;
+    s->regA = cpu->regA;
+    s->regX = cpu->regX;
+    s->regY = cpu->regY;
+    s->SP = cpu->SP;
+    s->FLAGS = cpu_get_flags(cpu);
+    s->events = cpu->events;
+    s->irq_lines = cpu->irq_lines;
+    s->nmi_lines = cpu->nmi_lines;
+    s->nmi_pending = cpu->nmi_pending;
+    s->cycles = cpu->cycles;
+
+    size_t size = device_state_size(cpu);
+    if(size > s->devices_capacity)
+    {
+        byte* devices = realloc(s->devices, size);
+        if(devices == NULL)
+        {
+            s->captured = false;
+            return;
+        }
+        s->devices = devices;
+        s->devices_capacity = size;
+    }
+    s->devices_size = size;
+    byte* state = s->devices;
+    s->device_count = 0;
+    for(int n = 0; n < BUS_PAGE_COUNT; n++)
+    {
+        const bus_page* page = &cpu->pages[n];
+        if(device_page(cpu, n))
+        {
+            memcpy(state, page->device, page->state_size);
+            state += page->state_size;
+            s->device_pages[s->device_count++] = n;
+        }
+        // memory is left where it is until it is written
+        s->mapped[n] = page->memory != NULL;
+        s->saved[n] = false;
+        if(s->mapped[n] && (page->access & BUS_WRITE))
+            bus_set_traps(cpu, n, BUS_TRAP_SNAPSHOT, 0);
+    }
+    s->owner = cpu;
+    s->captured = true;
+    cpu->snapshot = s;
+}
+
+int snapshot_restore(snapshot* s, machine* cpu)
+{
+    if(!s->captured || !devices_match(s, cpu))
+        return -1;
+
+    bool flush = false;
+    if(s->owner == cpu)
+    {
+        // everything else still holds what was captured
+        for(int i = 0; i < s->dirty_count; i++)
+        {
+            int n = s->dirty_pages[i];
+            flush |= restore_page(s, cpu, n);
+            s->dirty[n] = false;
+        }
+        s->dirty_count = 0;
+    }
+    else
+    {
+        if(s->owner)
+            detach(s, true);
+        if(cpu->snapshot)
+            snapshot_release(cpu);
+        for(int n = 0; n < BUS_PAGE_COUNT; n++)
+            if(s->saved[n])
+                flush |= restore_page(s, cpu, n);
+        s->owner = cpu;
+        cpu->snapshot = s;
+    }
+    if(flush)
+        jit_flush(cpu);
+
+    const byte* state = s->devices;
+    for(int i = 0; i < s->device_count; i++)
+    {
+        const bus_page* page = &cpu->pages[s->device_pages[i]];
+        memcpy(page->device, state, page->state_size);
+        state += page->state_size;
+    }
+
+    cpu->PC = s->PC;
+    cpu->regA = s->regA;
+    cpu->regX = s->regX;
+    cpu->regY = s->regY;
+    cpu->SP = s->SP;
+    cpu_set_flags(cpu, s->FLAGS);
+    cpu->events = s->events;
+    cpu->irq_lines = s->irq_lines;
+    cpu->nmi_lines = s->nmi_lines;
+    cpu->nmi_pending = s->nmi_pending;
+    cpu->cycles = s->cycles;
+    return 0;
+}
+
+void snapshot_touch(machine* cpu, uint16_t address, size_t size)
+{
+    if(cpu->snapshot == NULL || size == 0)
+        return;
+    size_t last = (address + size - 1) >> 8;
+    for(size_t n = address >> 8; n <= last && n < BUS_PAGE_COUNT; n++)
+        if(cpu->pages[n].memory)
+            snapshot_page_written(cpu, n);
+}
+
+void snapshot_release(machine* cpu)
+{
+    if(cpu->snapshot)
+        detach(cpu->snapshot, true);
+}
+
+void snapshot_page_written(machine* cpu, int n)
+{
+    snapshot* s = cpu->snapshot;
+    if(s->mapped[n] && !s->dirty[n])
+    {
+        if(!s->saved[n])
+        {
+            memcpy(s->data[n], cpu->pages[n].memory, BUS_PAGE_SIZE);
+            s->saved[n] = true;
+        }
+        s->dirty[n] = true;
+        s->dirty_pages[s->dirty_count++] = n;
+    }
+    // later writes go straight to memory until the next restore
+    if(cpu->pages[n].traps & BUS_TRAP_SNAPSHOT)
+        bus_set_traps(cpu, n, 0, BUS_TRAP_SNAPSHOT);
+}
@@ -0,0 +1,92 @@
+/**
+ * @file snapshot.h
+ * @author Mason Daub
+ * @brief Saves and restores the complete state of a machine, copying memory page by page on demand.
+ * 
+ * A snapshot holds the CPU registers and cycle counter, the contents of every
+ * memory page in the address space and the state of the devices mapped on the
+ * bus. Capturing does not copy memory. The machine's writable pages are trapped
+ * on the bus instead, and the first write to one copies it into the snapshot
+ * before it changes. Restoring copies back only the pages written since the
+ * capture or the last restore, so going back to the same state over and over
+ * costs as much as the memory each run touched.
+ * 
+ * A machine shares its pages with at most one snapshot. Capturing another one,
+ * or restoring the snapshot into a different machine (a fork), first copies the
+ * rest of its pages so it no longer depends on the machine it came from.
+ * 
+ * The memory map itself is not saved: a snapshot is restored into the pages
+ * that are mapped when it is restored, so the machine must be set up with the
+ * same layout and devices. Memory that is changed directly instead of through
+ * the bus must be announced with snapshot_touch.
+ * 
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "cpu.h"
+
+/**
+ * @brief Allocates an empty snapshot.
+ * 
+ * @return The snapshot, or NULL if it could not be allocated.
+ */
+snapshot* snapshot_create(void);
+
+/**
+ * @brief Frees a snapshot, detaching it from the machine it shares pages with.
+ * 
+ * @param s The snapshot to free, or NULL.
+ */
+void snapshot_destroy(snapshot* s);
+
+/**
+ * @brief Saves the current state of a machine, replacing what the snapshot held.
+ * 
+ * @param s The snapshot.
+ * @param cpu The machine to save. It must not be running.
+ */
+void snapshot_capture(snapshot* s, machine* cpu);
+
+/**
+ * @brief Puts a machine back into the state saved in a snapshot.
+ * 
+ * @param s The snapshot.
+ * @param cpu The machine, either the one the snapshot was captured from or one
+ * with the same memory layout and devices. It must not be running.
+ * @return 0 on success, -1 if nothing was captured or the devices do not match.
+ */
+int snapshot_restore(snapshot* s, machine* cpu);
+
+/**
+ * @brief Lets the machine's snapshot save memory before it is changed directly.
+ * Writes through the bus do this automatically.
+ * 
+ * @param cpu The machine.
+ * @param address First address that will change.
+ * @param size Number of bytes that will change.
+ */
+void snapshot_touch(machine* cpu, uint16_t address, size_t size);
+
+/**
+ * @brief Gives the machine's snapshot its own copy of every page and detaches it.
+ * 
+ * @param cpu The machine.
+ */
+void snapshot_release(machine* cpu);
+
+/**
+ * @brief Called by the bus before a page shared with a snapshot is written or remapped.
+ * 
+ * @param cpu The machine.
+ * @param page The page number.
+ */
+void snapshot_page_written(machine* cpu, int page);
+
+#endif // SNAPSHOT_H
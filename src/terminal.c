@@ -0,0 +1,255 @@
+/**
+ * @file terminal.c
+ * @author Mason Daub
+ * @brief The terminal IO device.
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "terminal.h"
+
+struct _terminal_output
+{
+    FILE* file;
+    char ring[TERMINAL_RING_SIZE];
+    // head only moves on the emulator's thread and tail only on the writer's, so
+    // neither takes the lock unless the other side is asleep
+    _Atomic size_t head;                // Bytes queued, ever
+    _Atomic size_t tail;                // Bytes written, ever
+    _Atomic size_t flushed;             // Bytes written and flushed out of the file's buffer
+    atomic_bool writer_idle;            // The writer sleeps until more is queued
+    atomic_bool emulator_waiting;       // The emulator sleeps until the writer catches up
+
+    pthread_t thread;
+    pthread_mutex_t lock;               // Guards sleeping and waking up
+    pthread_cond_t queued;              // Signalled when bytes are queued or the output closes
+    pthread_cond_t written;             // Signalled when the writer catches up
+    bool closing;
+    bool failed;                        // A write failed
+};
+
+/*   Writer   */
+
+static void* writer_thread(void* arg)
+{
+    terminal_output* o = arg;
+    size_t tail = atomic_load(&o->tail);
+    while(true)
+    {
+        size_t head = atomic_load(&o->head);
+        if(head == tail)
+        {
+            // caught up: push the output out before sleeping, so it shows while the program runs
+            if(fflush(o->file) != 0)
+                o->failed = true;
+            atomic_store(&o->flushed, tail);
+            pthread_mutex_lock(&o->lock);
+            if(atomic_load(&o->emulator_waiting))
+                pthread_cond_signal(&o->written);
+            atomic_store(&o->writer_idle, true);
+            while(atomic_load(&o->head) == tail && !o->closing)
+                pthread_cond_wait(&o->queued, &o->lock);
+            atomic_store(&o->writer_idle, false);
+            bool done = o->closing && atomic_load(&o->head) == tail;
+            pthread_mutex_unlock(&o->lock);
+            if(done)
+                break;
+            continue;
+        }
+        // the queued bytes, up to the end of the ring
+        size_t start = tail & (TERMINAL_RING_SIZE - 1);
+        size_t size = head - tail;
+        if(size > TERMINAL_RING_SIZE - start)
+            size = TERMINAL_RING_SIZE - start;
+        if(fwrite(o->ring + start, 1, size, o->file) != size)
+            o->failed = true;
+        tail += size;
+        atomic_store(&o->tail, tail);
+        if(atomic_load(&o->emulator_waiting))
+        {
+            pthread_mutex_lock(&o->lock);
+            pthread_cond_signal(&o->written);
+            pthread_mutex_unlock(&o->lock);
+        }
+    }
+    return NULL;
+}
+
+// Sleeps until the writer has got as far as position in one of its counters.
+static void wait_for_writer(terminal_output* o, _Atomic size_t* counter, size_t position)
+{
+    if(atomic_load(counter) >= position)
+        return;
+    pthread_mutex_lock(&o->lock);
+    atomic_store(&o->emulator_waiting, true);
+    while(atomic_load(counter) < position)
+        pthread_cond_wait(&o->written, &o->lock);
+    atomic_store(&o->emulator_waiting, false);
+    pthread_mutex_unlock(&o->lock);
+}
+
+// Queues a line, waiting while the ring has no room for it.
+static void queue(terminal_output* o, const char* line, size_t size)
+{
+    size_t head = atomic_load_explicit(&o->head, memory_order_relaxed);
+    if(head + size > TERMINAL_RING_SIZE)
+        wait_for_writer(o, &o->tail, head + size - TERMINAL_RING_SIZE);
+    size_t start = head & (TERMINAL_RING_SIZE - 1);
+    size_t first = size < TERMINAL_RING_SIZE - start ? size : TERMINAL_RING_SIZE - start;
+    memcpy(o->ring + start, line, first);
+    memcpy(o->ring, line + first, size - first);
+    atomic_store(&o->head, head + size);
+    if(atomic_load(&o->writer_idle))
+    {
+        pthread_mutex_lock(&o->lock);
+        pthread_cond_signal(&o->queued);
+        pthread_mutex_unlock(&o->lock);
+    }
+}
+
+terminal_output* terminal_output_open(FILE* out)
+{
+    terminal_output* o = calloc(1, sizeof(terminal_output));
+    if(o == NULL)
+        return NULL;
+    o->file = out;
+    pthread_mutex_init(&o->lock, NULL);
+    pthread_cond_init(&o->queued, NULL);
+    pthread_cond_init(&o->written, NULL);
+    if(pthread_create(&o->thread, NULL, writer_thread, o) != 0)
+    {
+        pthread_mutex_destroy(&o->lock);
+        pthread_cond_destroy(&o->queued);
+        pthread_cond_destroy(&o->written);
+        free(o);
+        return NULL;
+    }
+    return o;
+}
+
+int terminal_output_close(terminal_output* output)
+{
+    if(output == NULL)
+        return 0;
+    pthread_mutex_lock(&output->lock);
+    output->closing = true;
+    pthread_cond_signal(&output->queued);
+    pthread_mutex_unlock(&output->lock);
+    pthread_join(output->thread, NULL);
+
+    int result = output->failed ? -1 : 0;
+    pthread_mutex_destroy(&output->lock);
+    pthread_cond_destroy(&output->queued);
+    pthread_cond_destroy(&output->written);
+    free(output);
+    return result;
+}
+
+void terminal_output_flush(terminal_output* output)
+{
+    wait_for_writer(output, &output->flushed, atomic_load_explicit(&output->head, memory_order_relaxed));
+}
+
+/*   Device   */
+
+static byte terminal_read(machine* cpu, uint16_t address, void* device)
+{
+    terminal* term = device;
+    return term->buffer[address & 0xff];
+}
+
+// Returns true for the halt command.
+static bool terminal_command(terminal* term, byte command)
+{
+    const byte* buffer = term->buffer;
+    char line[TERMINAL_LINE_MAX];
+    int size = 0;
+    // the lines are driven whether or not the output is discarded
+    if(command == TERM_SET_IRQ)
+        term->irq = buffer[0] != 0;
+    else if(command == TERM_SET_NMI)
+        term->nmi = buffer[0] != 0;
+    if(term->out == NULL && term->output == NULL)
+        return command == TERM_HALT;
+    switch(command)
+    {
+        // write contents of buffer, which can be at most 255 characters
+        case TERM_PRINT_STRING:
+            size = snprintf(line, sizeof(line), "%.*s\n", (int)strnlen((const char*)buffer, TERMINAL_COMMAND),
+                (const char*)buffer);
+            break;
+        // 6502 emulator stop command.
+        case TERM_HALT:
+            size = snprintf(line, sizeof(line), "Emulator recieved halt command...\n");
+            break;
+        // print number
+        case TERM_PRINT_BYTE:
+            size = snprintf(line, sizeof(line), "IO PRINT BYTE: %d\n", buffer[0]);
+            break;
+        // print unsigned word
+        case TERM_PRINT_WORD:
+            size = snprintf(line, sizeof(line), "IO PRINT WORD: %d\n", buffer[0] | (buffer[1] << 8));
+            break;
+        // signed word
+        case TERM_PRINT_SWORD:
+            size = snprintf(line, sizeof(line), "IO PRINT WORD: %d\n", (int16_t)(buffer[0] | (buffer[1] << 8)));
+            break;
+    }
+    if(size > 0 && term->output)
+    {
+        queue(term->output, line, size);
+        // the emulation stops, so what it printed has to be out by then
+        if(command == TERM_HALT)
+            terminal_output_flush(term->output);
+    }
+    else if(size > 0)
+        fwrite(line, 1, size, term->out);
+    return command == TERM_HALT;
+}
+
+bool terminal_store(terminal* term, byte offset, byte data)
+{
+    if(offset == TERMINAL_COMMAND)
+    {
+        // commands run on the write, and the register reads back as 0 once they are done
+        bool halt = terminal_command(term, data);
+        term->buffer[TERMINAL_COMMAND] = 0;
+        return halt;
+    }
+    term->buffer[offset] = data;
+    return false;
+}
+
+static void terminal_write(machine* cpu, uint16_t address, byte data, void* device)
+{
+    terminal* term = device;
+    byte offset = address & 0xff;
+    if(terminal_store(term, offset, data))
+        cpu_raise_event(cpu, EVENT_HALT);
+    else if(offset == TERMINAL_COMMAND && data == TERM_SET_IRQ)
+        cpu_set_irq(cpu, TERMINAL_SOURCE, term->irq);
+    else if(offset == TERMINAL_COMMAND && data == TERM_SET_NMI)
+        cpu_set_nmi(cpu, TERMINAL_SOURCE, term->nmi);
+}
+
+void terminal_init(terminal* term, FILE* out)
+{
+    memset(term->buffer, 0, sizeof(term->buffer));
+    term->out = out;
+    term->output = NULL;
+    term->irq = false;
+    term->nmi = false;
+}
+
+void terminal_attach(machine* cpu, terminal* term, uint16_t address)
+{
+    bus_map_device(cpu, address, TERMINAL_SIZE, terminal_read, terminal_write, term, sizeof(term->buffer));
+}
@@ -0,0 +1,128 @@
+/**
+ * @file terminal.h
+ * @author Mason Daub
+ * @brief The terminal IO device. Allows the CPU to print to the host, stop the emulation
+ * and interrupt itself.
+ * 
+ * The device occupies one page. The first 255 bytes are a buffer the CPU fills
+ * with a string or number, and the last byte is the command register. Commands
+ * run as soon as they are written:
+ * 
+ *  0xaa - print the buffer as a NUL terminated string
+ *  0xbb - halt the emulation (raises EVENT_HALT)
+ *  0xcc - print the byte at buffer[0]
+ *  0xcd - print the unsigned word at buffer[0..1]
+ *  0xce - print the signed word at buffer[0..1]
+ *  0xd0 - assert IRQ while buffer[0] is not 0, release it when it is 0
+ *  0xd1 - the same for NMI
+ * 
+ * The interrupt commands let a program test its handlers on every engine. The
+ * lines only change when the program writes the command, so a program waiting
+ * in a loop can not be interrupted by the terminal, and the terminal does not
+ * attach itself as a source of either (see cpu_attach_irq).
+ * 
+ * Every command prints at most one line of TERMINAL_LINE_MAX bytes. A terminal
+ * can print through a terminal_output, which queues the lines in a lock free
+ * ring and writes them from a thread of its own, so a program that prints a lot
+ * runs at the speed of the emulator rather than of the pipe or log it prints to.
+ * The ring only holds up the emulator while it is full, and the halt command
+ * waits until everything printed before it is written.
+ * 
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#ifndef TERMINAL_H
+#define TERMINAL_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "cpu.h"
+
+#define TERMINAL_ADDRESS 0x4000     // Default base address of the terminal
+#define TERMINAL_SIZE 0x100         // Size of the terminal, including the command register
+#define TERMINAL_COMMAND 0xff       // Offset of the command register
+#define TERMINAL_LINE_MAX 0x140     // Longest line a command prints, with its newline
+#define TERMINAL_RING_SIZE 0x10000  // Bytes a terminal_output queues, a power of two
+#define TERMINAL_SOURCE 0x01        // The terminal's bit in irq_lines and nmi_lines
+
+#define TERM_PRINT_STRING   0xaa
+#define TERM_HALT           0xbb
+#define TERM_PRINT_BYTE     0xcc
+#define TERM_PRINT_WORD     0xcd
+#define TERM_PRINT_SWORD    0xce
+#define TERM_SET_IRQ        0xd0
+#define TERM_SET_NMI        0xd1
+
+typedef struct _terminal_output terminal_output;   // Writer thread a terminal can print through
+
+/**
+ * @brief State of one terminal device.
+ */
+typedef struct _terminal
+{
+    byte buffer[TERMINAL_SIZE];     // Buffer and command register as seen by the CPU
+    FILE* out;                      // Where the terminal prints to, NULL to discard
+    terminal_output* output;        // Prints through this writer instead of out, or NULL
+    bool irq;                       // The terminal asserts IRQ
+    bool nmi;                       // The terminal asserts NMI
+} terminal;
+
+/**
+ * @brief Clears the terminal.
+ * 
+ * @param term The terminal to initialize.
+ * @param out Where the terminal prints to, or NULL to discard its output.
+ * Commands still run when the output is discarded.
+ */
+void terminal_init(terminal* term, FILE* out);
+
+/**
+ * @brief Writes a terminal register, running the command if it is the command register.
+ * This is the device without a bus, for engines that keep their own memory. The
+ * interrupt commands only set irq and nmi, the engine drives its lines from them.
+ * 
+ * @param term The terminal.
+ * @param offset The register, 0 to TERMINAL_COMMAND.
+ * @param data The byte written.
+ * @return true if the command asked for the emulation to halt.
+ */
+bool terminal_store(terminal* term, byte offset, byte data);
+
+/**
+ * @brief Starts a thread that writes what terminals print to a file.
+ * 
+ * @param out Where to write. Only the thread uses it until the output is closed.
+ * @return The output, or NULL if it could not be allocated.
+ */
+terminal_output* terminal_output_open(FILE* out);
+
+/**
+ * @brief Writes everything still queued, flushes the file and stops the thread.
+ * No terminal may still print through the output.
+ * 
+ * @param output The output to close, or NULL.
+ * @return 0 on success, -1 if a write failed.
+ */
+int terminal_output_close(terminal_output* output);
+
+/**
+ * @brief Waits until everything queued so far is written and flushed.
+ * 
+ * @param output The output.
+ */
+void terminal_output_flush(terminal_output* output);
+
+/**
+ * @brief Maps a terminal onto a machine's address bus.
+ * 
+ * @param cpu The machine to attach to.
+ * @param term The terminal to attach.
+ * @param address Page aligned base address, usually TERMINAL_ADDRESS.
+ */
+void terminal_attach(machine* cpu, terminal* term, uint16_t address);
+
+#endif // TERMINAL_H
@@ -0,0 +1,281 @@
+/**
+ * @file trace.c
+ * @author Mason Daub
+ * @brief Binary execution trace recorder and printer.
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "trace.h"
+#include "disasm.h"
+#include "cpu_utils.h"
+
+struct _tracer
+{
+    machine* cpu;                       // Machine the tracer is attached to, or NULL
+    trace_record* next;                 // Where the next record goes
+    trace_record* end;                  // End of the chunk being filled
+    int head;                           // Chunk being filled
+
+    trace_record* ring;                 // TRACE_CHUNKS chunks of TRACE_CHUNK_RECORDS records
+    size_t count[TRACE_CHUNKS];         // Records in every chunk handed to the writer
+
+    FILE* file;
+    pthread_t thread;
+    pthread_mutex_t lock;               // Guards the fields below
+    pthread_cond_t queued;              // Signalled when a chunk is handed over or the trace closes
+    pthread_cond_t written;             // Signalled when the writer frees a chunk
+    int tail;                           // Next chunk to write
+    int pending;                        // Chunks handed over and not yet written
+    bool closing;
+    bool failed;                        // A write failed, the rest of the trace is dropped
+};
+
+/*   Writer   */
+
+static void* writer_thread(void* arg)
+{
+    tracer* t = arg;
+    pthread_mutex_lock(&t->lock);
+    while(true)
+    {
+        while(t->pending == 0 && !t->closing)
+            pthread_cond_wait(&t->queued, &t->lock);
+        if(t->pending == 0)
+            break;
+        int chunk = t->tail;
+        bool failed = t->failed;
+        pthread_mutex_unlock(&t->lock);
+
+        // the chunk belongs to this thread until pending drops
+        size_t count = t->count[chunk];
+        if(!failed && fwrite(t->ring + (size_t)chunk * TRACE_CHUNK_RECORDS, sizeof(trace_record), count, t->file) != count)
+            failed = true;
+
+        pthread_mutex_lock(&t->lock);
+        t->failed = failed;
+        t->tail = (t->tail + 1) % TRACE_CHUNKS;
+        t->pending--;
+        pthread_cond_signal(&t->written);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+// Hands the chunk being filled to the writer and moves on to the next one.
+static void next_chunk(tracer* t)
+{
+    trace_record* start = t->ring + (size_t)t->head * TRACE_CHUNK_RECORDS;
+    pthread_mutex_lock(&t->lock);
+    t->count[t->head] = t->next - start;
+    t->pending++;
+    pthread_cond_signal(&t->queued);
+    // the next chunk may still be waiting for the disk
+    while(t->pending == TRACE_CHUNKS)
+        pthread_cond_wait(&t->written, &t->lock);
+    pthread_mutex_unlock(&t->lock);
+
+    t->head = (t->head + 1) % TRACE_CHUNKS;
+    t->next = t->ring + (size_t)t->head * TRACE_CHUNK_RECORDS;
+    t->end = t->next + TRACE_CHUNK_RECORDS;
+}
+
+tracer* trace_open(const char* path)
+{
+    tracer* t = calloc(1, sizeof(tracer));
+    if(t == NULL)
+        return NULL;
+    t->ring = calloc((size_t)TRACE_CHUNKS * TRACE_CHUNK_RECORDS, sizeof(trace_record));
+    t->file = fopen(path, "wb");
+    trace_header header = { TRACE_MAGIC, TRACE_VERSION, sizeof(trace_record) };
+    if(t->ring == NULL || t->file == NULL || fwrite(&header, sizeof(header), 1, t->file) != 1)
+    {
+        if(t->file)
+            fclose(t->file);
+        free(t->ring);
+        free(t);
+        return NULL;
+    }
+    setvbuf(t->file, NULL, _IONBF, 0); // chunks are already large writes
+    t->next = t->ring;
+    t->end = t->ring + TRACE_CHUNK_RECORDS;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->queued, NULL);
+    pthread_cond_init(&t->written, NULL);
+    pthread_create(&t->thread, NULL, writer_thread, t);
+    return t;
+}
+
+int trace_close(tracer* t)
+{
+    if(t == NULL)
+        return 0;
+    if(t->next != t->ring + (size_t)t->head * TRACE_CHUNK_RECORDS)
+        next_chunk(t);
+    pthread_mutex_lock(&t->lock);
+    t->closing = true;
+    pthread_cond_signal(&t->queued);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, NULL);
+
+    int result = t->failed ? -1 : 0;
+    if(fclose(t->file) != 0)
+        result = -1;
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->queued);
+    pthread_cond_destroy(&t->written);
+    free(t->ring);
+    free(t);
+    return result;
+}
+
+void trace_attach(machine* cpu, tracer* t)
+{
+    if(cpu->tracer)
+        cpu->tracer->cpu = NULL;
+    cpu->tracer = t;
+    if(t)
+    {
+        if(t->cpu)
+            trace_attach(t->cpu, NULL);
+        t->cpu = cpu;
+    }
+}
+
+/*   Recording   */
+
+// The address an instruction will operate on, worked out before it runs.
+static uint16_t operand_address(machine* cpu, address_mode mode, uint16_t operand)
+{
+    uint16_t pointer;
+    switch(mode)
+    {
+        case zpg:
+        case absolute:
+            return operand;
+        case ind_zpg_x:
+            return (operand + X) & 0xff;
+        case ind_zpg_y:
+            return (operand + Y) & 0xff;
+        case ind_abs_x:
+            return operand + X;
+        case ind_abs_y:
+            return operand + Y;
+        case ind_indir_x:
+            pointer = (operand + X) & 0xff;
+            return peek_memory(cpu, pointer) | (peek_memory(cpu, (pointer + 1) & 0xff) << 8);
+        case indir_ind_y:
+            return (peek_memory(cpu, operand) | (peek_memory(cpu, (operand + 1) & 0xff) << 8)) + Y;
+        case ind_abs:
+            return peek_memory(cpu, operand) | (peek_memory(cpu, (operand & 0xff00) | ((operand + 1) & 0xff)) << 8);
+        case rel:
+            return PC + 2 + (int8_t)operand;
+        default:
+            return 0x0000;
+    }
+}
+
+uint32_t trace_run(machine* cpu, uint64_t* remaining)
+{
+    tracer* t = cpu->tracer;
+    uint64_t left = *remaining;
+    do
+    {
+        trace_record* r = t->next;
+        const opcode_info* info = &opcode_table[r->opcode = peek_memory(cpu, PC)];
+        r->operand[0] = info->length > 0 ? peek_memory(cpu, PC + 1) : 0;
+        r->operand[1] = info->length > 1 ? peek_memory(cpu, PC + 2) : 0;
+        r->address = operand_address(cpu, info->mode, r->operand[0] | (r->operand[1] << 8));
+        r->pc = PC;
+        r->a = A;
+        r->x = X;
+        r->y = Y;
+        r->sp = S;
+        r->flags = cpu_get_flags(cpu);
+        r->cycles = cpu_do_next_op(cpu);
+        if(++t->next == t->end)
+            next_chunk(t);
+    }
+    while(--left != 0 && cpu->cycles < cpu->stop_cycle);
+    *remaining = left;
+    return cpu->events;
+}
+
+/*   Printing   */
+
+#define PRINT_BLOCK 4096    // Records read from the file at a time
+
+static void print_record(const trace_record* r, uint64_t cycle, FILE* out)
+{
+    const opcode_info* info = &opcode_table[r->opcode];
+    const byte code[3] = { r->opcode, r->operand[0], r->operand[1] };
+    char bytes[12], text[DISASM_TEXT_SIZE];
+    int length = disasm_format(code, r->pc, text, sizeof(text));
+    if(length == 1)
+        snprintf(bytes, sizeof(bytes), "%02x", r->opcode);
+    else if(length == 2)
+        snprintf(bytes, sizeof(bytes), "%02x %02x", r->opcode, r->operand[0]);
+    else
+        snprintf(bytes, sizeof(bytes), "%02x %02x %02x", r->opcode, r->operand[0], r->operand[1]);
+    fprintf(out, "%12llu  %04x  %-9s %-20s A:%02x X:%02x Y:%02x S:%02x P:%02x",
+        (unsigned long long)cycle, r->pc, bytes, text, r->a, r->x, r->y, r->sp, r->flags);
+    switch(info->name ? info->mode : impl)
+    {
+        // indexed and indirect modes show the address they resolved to
+        case ind_zpg_x:
+        case ind_zpg_y:
+        case ind_abs_x:
+        case ind_abs_y:
+        case ind_indir_x:
+        case indir_ind_y:
+        case ind_abs:
+            fprintf(out, "  @ $%04x\n", r->address);
+            break;
+        default:
+            fputc('\n', out);
+            break;
+    }
+}
+
+int64_t trace_print(const char* path, FILE* out)
+{
+    FILE* file = fopen(path, "rb");
+    if(file == NULL)
+        return -1;
+    trace_header header;
+    if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != TRACE_VERSION || header.record_size != sizeof(trace_record))
+    {
+        fclose(file);
+        return -1;
+    }
+
+    trace_record* block = malloc(PRINT_BLOCK * sizeof(trace_record));
+    if(block == NULL)
+    {
+        fclose(file);
+        return -1;
+    }
+    int64_t printed = 0;
+    uint64_t cycle = 0;     // cycles since the start of the trace
+    size_t count;
+    while((count = fread(block, sizeof(trace_record), PRINT_BLOCK, file)) > 0)
+    {
+        for(size_t i = 0; i < count; i++)
+        {
+            print_record(&block[i], cycle, out);
+            cycle += block[i].cycles;
+        }
+        printed += count;
+    }
+    free(block);
+    fclose(file);
+    return printed;
+}
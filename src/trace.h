@@ -0,0 +1,106 @@
+/**
+ * @file trace.h
+ * @author Mason Daub
+ * @brief Records every executed instruction to a binary trace file, and prints trace files as text.
+ * 
+ * While a tracer is attached, cpu_run steps through cpu_do_next_op and stores
+ * one fixed size trace_record per instruction in a ring of chunks. A background
+ * thread writes each chunk to the file as soon as it is full, so the emulator
+ * only pays for filling in the record. If the disk falls behind the emulator
+ * waits for it instead of dropping records, so a trace is always complete.
+ * 
+ * Operands and indirect pointers are read with peek_memory, without going through
+ * device handlers, so tracing never changes what a program sees. Bytes on device pages are
+ * recorded as 0.
+ * 
+ * A machine without a tracer runs exactly as before: cpu_run only checks for one
+ * once per call. Building with -DNO_TRACE removes even that check. The tracer
+ * replaces the JIT while it is attached, and a profiler takes precedence over it.
+ * 
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define TRACE_MAGIC "D6502TRC"          // First 8 bytes of a trace file
+#define TRACE_VERSION 1
+#define TRACE_CHUNK_RECORDS 65536       // Records written to the file at a time
+#define TRACE_CHUNKS 16                 // Chunks in the ring, the emulator can run this far ahead of the disk
+
+/**
+ * @brief One executed instruction. Records are stored in the file in host byte order.
+ */
+typedef struct _trace_record
+{
+    uint16_t pc;            // Address of the instruction
+    uint16_t address;       // Effective address of a memory operand, or the target of a branch
+    byte opcode;
+    byte operand[2];        // Operand bytes, as many as the opcode has
+    byte cycles;            // Clock cycles the instruction took
+    byte a, x, y, sp, flags;    // Registers before the instruction
+    byte reserved[3];
+} trace_record;
+
+/**
+ * @brief Header at the start of a trace file, followed by the records.
+ */
+typedef struct _trace_header
+{
+    char magic[8];          // TRACE_MAGIC
+    uint32_t version;       // TRACE_VERSION
+    uint32_t record_size;   // sizeof(trace_record)
+} trace_header;
+
+/**
+ * @brief Creates a trace file and starts the thread that writes it.
+ * 
+ * @param path The file to create.
+ * @return The tracer, or NULL if the file could not be created.
+ */
+tracer* trace_open(const char* path);
+
+/**
+ * @brief Writes the rest of the trace and closes the file. The tracer must not be attached.
+ * 
+ * @param t The tracer to close, or NULL.
+ * @return 0 if the whole trace was written, -1 if a write failed.
+ */
+int trace_close(tracer* t);
+
+/**
+ * @brief Attaches a tracer to a machine, so cpu_run records what it executes.
+ * 
+ * @param cpu The machine.
+ * @param t The tracer, or NULL to detach the current one.
+ */
+void trace_attach(machine* cpu, tracer* t);
+
+/**
+ * @brief The tracing version of cpu_run's loop.
+ * Called by cpu_run after it has set the machine's stop cycle.
+ * 
+ * @param cpu The machine to run. It must have a tracer attached.
+ * @param remaining Instruction budget, or CPU_UNLIMITED. Less the instructions run when it returns.
+ * @return The pending events.
+ */
+uint32_t trace_run(machine* cpu, uint64_t* remaining);
+
+/**
+ * @brief Prints a trace file as text, one disassembled instruction per line.
+ * 
+ * @param path The trace file.
+ * @param out Where to print.
+ * @return The number of records printed, or -1 if the file is not a trace.
+ */
+int64_t trace_print(const char* path, FILE* out);
+
+#endif // TRACE_H
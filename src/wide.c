@@ -0,0 +1,958 @@
+/**
+ * @file wide.c
+ * @author Mason Daub
+ * @brief The lockstep engine, with every instruction written once against vectors of lanes.
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wide.h"
+#include "cpu_utils.h"
+
+// The register shorthands name a single machine's registers
+#undef A
+#undef P
+#undef X
+#undef Y
+#undef S
+#undef PC
+#undef accum_flags
+
+// Vectors are only passed by value to functions that are always inlined, so the
+// calling convention for them never comes into play (the makefile builds this
+// file with -Wno-psabi for that reason).
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+_Static_assert(WIDE_LANES == 32, "lane masks are 32 bits wide");
+
+typedef int8_t wide_i8 __attribute__((vector_size(WIDE_LANES)));
+typedef int16_t wide_i16 __attribute__((vector_size(WIDE_LANES * 2)));
+typedef int64_t wide_i64 __attribute__((vector_size(WIDE_LANES * 8)));
+typedef uint64_t wide_packed __attribute__((vector_size(WIDE_LANES)));    // 8 lanes of bytes per element
+
+#define WIDE_SETTLE_STEPS 100   // Most instructions before per lane cycles are added up, so they fit in a byte
+
+// Picks value in the lanes set in mask and old in the others
+#define BLEND(mask, value, old) (((value) & (mask)) | ((old) & ~(mask)))
+
+// Vector compares wider than the host's registers are broken up into scalar code,
+// so masks are made with arithmetic instead. Masks are 0xff in the lanes where the
+// condition holds, and wide_bits only looks at the top bit of each lane.
+#define SIGN_MASK(v) ((wide_u8)((wide_i8)(v) >> 7))
+#define NONZERO(v) SIGN_MASK((v) | -(v))
+#define ZERO(v) (~NONZERO(v))
+#define WIDEN16(v) __builtin_convertvector((v), wide_u16)
+#define MASK16(m) ((wide_u16)__builtin_convertvector((wide_i8)(m), wide_i16))
+#define MASK64(m) ((wide_u64)__builtin_convertvector((wide_i8)(m), wide_i64))
+#define BROADCAST8(value) ((wide_u8){} + (byte)(value))
+#define BROADCAST16(value) ((wide_u16){} + (uint16_t)(value))
+
+// Sets a register in the lanes of the group only
+#define SET(reg, value) (w->reg = BLEND(g->mask, (value), w->reg))
+
+/**
+ * @brief The lanes running one instruction stream.
+ */
+typedef struct _wide_group
+{
+    lane_mask lanes;        // Lanes in the group
+    wide_u8 mask;           // 0xff in the lanes of the group
+    int first;              // Lowest lane of the group
+    uint16_t pc;            // The shared PC, written to the lanes when the group ends
+    uint32_t waiting;       // Lowest PC of the running lanes outside the group, 0x10000 if none
+    bool split;             // The lanes' PCs went different ways and are already written
+    lane_mask halted;       // Lanes that raised an event in this instruction
+    wide_u8 events;         // The events they raised
+    uint64_t cycles;        // Cycles of every lane in the group that are not added yet
+    wide_u8 extra;          // Per lane cycles that are not added yet
+    int steps;              // Instructions since the cycles were added
+} wide_group;
+
+/* Lane masks */
+
+// Packs the top bit of every lane into a lane mask.
+ALWAYS_INLINE lane_mask wide_bits(wide_u8 mask)
+{
+    // the multiply gathers the top bits of 8 bytes into the top byte
+    wide_packed q = ((wide_packed)mask & 0x8080808080808080ull) * 0x0002040810204081ull >> 56;
+    return q[0] | q[1] << 8 | q[2] << 16 | q[3] << 24;
+}
+
+// Unpacks a lane mask into 0xff or 0 in every lane.
+ALWAYS_INLINE wide_u8 wide_mask(lane_mask lanes)
+{
+    wide_packed q = { lanes & 0xff, (lanes >> 8) & 0xff, (lanes >> 16) & 0xff, lanes >> 24 };
+    q = q * 0x0101010101010101ull & 0x8040201008040201ull;
+    return NONZERO((wide_u8)q);
+}
+
+// Lanes of a vector that are not equal to a value.
+ALWAYS_INLINE lane_mask wide_differs8(wide_u8 v, byte value)
+{
+    wide_u8 difference = v ^ value;
+    return wide_bits(difference | -difference);
+}
+
+ALWAYS_INLINE lane_mask wide_differs16(const wide_u16* v, uint16_t value)
+{
+    wide_u16 difference = *v ^ value;
+    return wide_bits(__builtin_convertvector((difference | -difference) >> 8, wide_u8));
+}
+
+static void wide_set_lanes(wide_group* g, lane_mask lanes)
+{
+    g->lanes = lanes;
+    g->mask = wide_mask(lanes);
+    g->first = lanes ? __builtin_ctz(lanes) : 0;
+}
+
+// Stops lanes of the group with an event once the instruction completes.
+ALWAYS_INLINE void wide_stop(wide_group* g, lane_mask lanes, byte event)
+{
+    g->halted |= lanes;
+    g->events |= wide_mask(lanes) & event;
+}
+
+/* Memory */
+
+// One lane's view of the default memory map.
+static byte wide_peek(const wide_machine* w, int lane, uint16_t address)
+{
+    if(address >= ROM_START)
+        return w->rom[address - ROM_START];
+    if((address & 0xff00) == TERMINAL_ADDRESS)
+        return w->term[lane].buffer[address & 0xff];
+    return w->ram[address][lane];
+}
+
+// Writes the terminal of a lane of the group and follows the lines it drives. A lane
+// with an interrupt to take makes the group settle after the instruction, which
+// enters the handler.
+static void wide_store_terminal(wide_machine* w, wide_group* g, int lane, byte offset, byte data)
+{
+    terminal* term = &w->term[lane];
+    lane_mask bit = 1u << lane;
+    bool nmi = term->nmi;
+    if(terminal_store(term, offset, data))
+        wide_stop(g, bit, EVENT_HALT);
+    if(term->nmi && !nmi)
+        w->nmi_pending |= bit; // NMI is edge triggered
+    w->irq = term->irq ? w->irq | bit : w->irq & ~bit;
+    if((w->nmi_pending | w->irq) & bit)
+        g->steps = WIDE_SETTLE_STEPS;
+}
+
+// Writes one lane's memory.
+static void wide_store_lane(wide_machine* w, wide_group* g, int lane, uint16_t address, byte data)
+{
+    if(address >= ROM_START)
+        return; // ROM is write protected
+    if((address & 0xff00) == TERMINAL_ADDRESS)
+        wide_store_terminal(w, g, lane, address & 0xff, data);
+    else
+        w->ram[address][lane] = data;
+}
+
+// The slow paths take their vectors by pointer, so they do not depend on the vector ABI.
+static __attribute__((noinline)) void wide_gather(const wide_machine* w, lane_mask lanes, const wide_u16* address, wide_u8* data)
+{
+    for(; lanes; lanes &= lanes - 1)
+    {
+        int lane = __builtin_ctz(lanes);
+        (*data)[lane] = wide_peek(w, lane, (*address)[lane]);
+    }
+}
+
+static __attribute__((noinline)) void wide_scatter(wide_machine* w, wide_group* g, const wide_u16* address, const wide_u8* data)
+{
+    for(lane_mask lanes = g->lanes; lanes; lanes &= lanes - 1)
+    {
+        int lane = __builtin_ctz(lanes);
+        wide_store_lane(w, g, lane, (*address)[lane], (*data)[lane]);
+    }
+}
+
+// Reads the same address in every lane of the group. Other lanes read garbage.
+ALWAYS_INLINE wide_u8 wide_read(const wide_machine* w, const wide_group* g, uint16_t address)
+{
+    if(address >= ROM_START)
+        return BROADCAST8(w->rom[address - ROM_START]);
+    if((address & 0xff00) != TERMINAL_ADDRESS)
+        return w->ram[address];
+    wide_u16 addresses = BROADCAST16(address);
+    wide_u8 data = {0};
+    wide_gather(w, g->lanes, &addresses, &data);
+    return data;
+}
+
+// Writes the same address in every lane of the group.
+ALWAYS_INLINE void wide_write(wide_machine* w, wide_group* g, uint16_t address, wide_u8 data)
+{
+    if(address >= ROM_START)
+        return;
+    if((address & 0xff00) != TERMINAL_ADDRESS)
+    {
+        w->ram[address] = BLEND(g->mask, data, w->ram[address]);
+        return;
+    }
+    wide_u16 addresses = BROADCAST16(address);
+    wide_scatter(w, g, &addresses, &data);
+}
+
+// Reads an address per lane, with a single read if the lanes agree on it.
+static __attribute__((noinline)) void wide_load_lanes(const wide_machine* w, const wide_group* g, const wide_u16* address, wide_u8* data)
+{
+    uint16_t first = (*address)[g->first];
+    if(wide_differs16(address, first) & g->lanes)
+        wide_gather(w, g->lanes, address, data);
+    else
+        *data = wide_read(w, g, first);
+}
+
+static __attribute__((noinline)) void wide_store_lanes(wide_machine* w, wide_group* g, const wide_u16* address, const wide_u8* data)
+{
+    uint16_t first = (*address)[g->first];
+    if(wide_differs16(address, first) & g->lanes)
+        wide_scatter(w, g, address, data);
+    else
+        wide_write(w, g, first, *data);
+}
+
+/* Addressing */
+
+// Zero page pointers, which are always in RAM.
+ALWAYS_INLINE wide_u16 wide_pointer(const wide_machine* w, const wide_group* g, wide_u8 pointer)
+{
+    byte first = pointer[g->first];
+    if(!(wide_differs8(pointer, first) & g->lanes))
+        return WIDEN16(w->ram[first]) | WIDEN16(w->ram[(byte)(first + 1)]) << 8;
+    wide_u16 lo = WIDEN16(pointer);
+    wide_u16 hi = WIDEN16((wide_u8)(pointer + 1));
+    wide_u8 lo_data = {0}, hi_data = {0};
+    wide_gather(w, g->lanes, &lo, &lo_data);
+    wide_gather(w, g->lanes, &hi, &hi_data);
+    return WIDEN16(lo_data) | WIDEN16(hi_data) << 8;
+}
+
+// The effective address of a memory operand in every lane, as effective_address in cpu.c.
+// When page is set, lanes whose indexing crossed a page boundary take an extra cycle.
+// The mode is not a constant here, so the instructions share one copy of this.
+static __attribute__((noinline)) void wide_address(const wide_machine* w, wide_group* g, address_mode mode, uint16_t operand, int page, wide_u16* result)
+{
+    wide_u16 base, address;
+    switch(mode)
+    {
+        case ind_zpg_x:
+            *result = WIDEN16((wide_u8)(w->regX + (byte)operand));
+            return;
+        case ind_zpg_y:
+            *result = WIDEN16((wide_u8)(w->regY + (byte)operand));
+            return;
+        case ind_abs_x:
+            base = BROADCAST16(operand);
+            address = base + WIDEN16(w->regX);
+            break;
+        case ind_abs_y:
+            base = BROADCAST16(operand);
+            address = base + WIDEN16(w->regY);
+            break;
+        case ind_indir_x:
+            *result = wide_pointer(w, g, w->regX + (byte)operand);
+            return;
+        case indir_ind_y:
+            base = wide_pointer(w, g, BROADCAST8(operand));
+            address = base + WIDEN16(w->regY);
+            break;
+        case ind_abs:
+        {
+            // The NMOS 6502 does not carry into the high byte of the pointer.
+            wide_u8 lo = wide_read(w, g, operand);
+            wide_u8 hi = wide_read(w, g, (operand & 0xff00) | ((operand + 1) & 0xff));
+            *result = WIDEN16(lo) | WIDEN16(hi) << 8;
+            return;
+        }
+        default:
+            *result = BROADCAST16(operand);
+            return;
+    }
+    if(page)
+    {
+        wide_u16 high = (base ^ address) >> 8;
+        g->extra += __builtin_convertvector((high | -high) >> 15, wide_u8) & g->mask;
+    }
+    *result = address;
+}
+
+// Only these modes have the same address in every lane.
+#define UNIFORM(mode) ((mode) == zpg || (mode) == absolute)
+
+// Reads the value an instruction operates on. Supports immediate and accumulator modes.
+ALWAYS_INLINE wide_u8 wide_load(const wide_machine* w, wide_group* g, const address_mode mode, uint16_t operand, const int page)
+{
+    if(mode == imm)
+        return BROADCAST8(operand);
+    if(mode == reg_A)
+        return w->regA;
+    if(UNIFORM(mode))
+        return wide_read(w, g, operand);
+    wide_u16 address;
+    wide_u8 data = {0};
+    wide_address(w, g, mode, operand, page, &address);
+    wide_load_lanes(w, g, &address, &data);
+    return data;
+}
+
+ALWAYS_INLINE void wide_store(wide_machine* w, wide_group* g, const address_mode mode, uint16_t operand, wide_u8 data)
+{
+    if(UNIFORM(mode))
+    {
+        wide_write(w, g, operand, data);
+        return;
+    }
+    wide_u16 address;
+    wide_address(w, g, mode, operand, 0, &address);
+    wide_store_lanes(w, g, &address, &data);
+}
+
+/* Shared pieces */
+
+ALWAYS_INLINE void wide_nz(wide_machine* w, const wide_group* g, wide_u8 value)
+{
+    wide_u8 flags = (w->FLAGS & (byte)~(flag_N | flag_Z)) | (value & flag_N) | (ZERO(value) & flag_Z);
+    SET(FLAGS, flags);
+}
+
+ALWAYS_INLINE void wide_push(wide_machine* w, wide_group* g, wide_u8 data)
+{
+    lane_mask full = wide_bits(ZERO(w->SP)) & g->lanes;
+    if(__builtin_expect(full != 0, 0))
+        wide_stop(g, full, EVENT_STACK);
+    byte sp = w->SP[g->first];
+    if(wide_differs8(w->SP, sp) & g->lanes)
+    {
+        wide_u16 address = 0x0100 | WIDEN16(w->SP);
+        wide_store_lanes(w, g, &address, &data);
+    }
+    else
+        w->ram[0x0100 | sp] = BLEND(g->mask, data, w->ram[0x0100 | sp]);
+    SET(SP, w->SP - 1);
+}
+
+ALWAYS_INLINE wide_u8 wide_pop(wide_machine* w, wide_group* g)
+{
+    lane_mask empty = wide_bits(ZERO((wide_u8)~w->SP)) & g->lanes;
+    if(__builtin_expect(empty != 0, 0))
+        wide_stop(g, empty, EVENT_STACK);
+    SET(SP, w->SP + 1);
+    byte sp = w->SP[g->first];
+    if(!(wide_differs8(w->SP, sp) & g->lanes))
+        return w->ram[0x0100 | sp];
+    wide_u16 address = 0x0100 | WIDEN16(w->SP);
+    wide_u8 data = {0};
+    wide_load_lanes(w, g, &address, &data);
+    return data;
+}
+
+// Writes the shared PC to the lanes of the group.
+static void wide_sync_pc(wide_machine* w, const wide_group* g)
+{
+    if(!g->split)
+        w->PC = BLEND(MASK16(g->mask), BROADCAST16(g->pc), w->PC);
+}
+
+// Continues at a target per lane. The group ends if the lanes disagree.
+ALWAYS_INLINE void wide_jump(wide_machine* w, wide_group* g, wide_u16 target)
+{
+    uint16_t first = target[g->first];
+    if(!(wide_differs16(&target, first) & g->lanes))
+    {
+        g->pc = first;
+        return;
+    }
+    w->PC = BLEND(MASK16(g->mask), target, w->PC);
+    g->split = true;
+}
+
+ALWAYS_INLINE void wide_branch(wide_machine* w, wide_group* g, wide_u8 condition, uint16_t operand)
+{
+    lane_mask taken = wide_bits(condition) & g->lanes;
+    if(taken == 0)
+        return;
+    uint16_t target = g->pc + (int8_t)operand;
+    byte cycles = 1 + ((target ^ g->pc) > 0xff); // add 1 C for page change
+    if(__builtin_expect((int8_t)operand == -2, 0))
+        wide_stop(g, taken, EVENT_JAM); // no device can interrupt a lane to leave the loop
+    if(taken == g->lanes)
+    {
+        g->cycles += cycles;
+        g->pc = target;
+        return;
+    }
+    // the lanes that did not branch keep the shared PC
+    wide_u8 mask = condition & g->mask;
+    g->extra += mask & cycles;
+    wide_sync_pc(w, g);
+    w->PC = BLEND(MASK16(mask), BROADCAST16(target), w->PC);
+    g->split = true;
+}
+
+// After the I flag may have been cleared. Lanes with IRQ asserted settle after the
+// instruction to enter the handler, as irq_unmasked stops cpu_run.
+ALWAYS_INLINE void wide_unmasked(const wide_machine* w, wide_group* g)
+{
+    if(__builtin_expect(w->irq & g->lanes, 0))
+        g->steps = WIDE_SETTLE_STEPS;
+}
+
+ALWAYS_INLINE void wide_add(wide_machine* w, wide_group* g, wide_u8 data)
+{
+    wide_u8 a = w->regA;
+    wide_u8 carry = w->FLAGS & flag_C;
+    wide_u8 sum = a + data + carry;
+    // the carry out of bit 7, as a full adder makes it
+    wide_u8 carry_out = ((a & data) | ((a | data) & ~sum)) >> 7;
+    wide_u8 overflow = (~(a ^ data) & (a ^ sum) & 0x80) >> 1; // set V if sign of result is wrong
+    SET(FLAGS, (w->FLAGS & (byte)~(flag_C | flag_V)) | carry_out | overflow);
+    SET(regA, sum);
+    wide_nz(w, g, sum);
+}
+
+// Looks up the decimal mode results of the lanes in decimal mode one at a time,
+// from the accumulators and flags they had before the binary result was set.
+static __attribute__((noinline)) void wide_add_decimal(wide_machine* w, lane_mask lanes, const uint16_t* table,
+    const wide_u8* a, const wide_u8* flags, const wide_u8* data)
+{
+    while(lanes)
+    {
+        int lane = __builtin_ctz(lanes);
+        lanes &= lanes - 1;
+        uint16_t entry = table[DECIMAL_INDEX((*flags)[lane] & flag_C, (*a)[lane], (*data)[lane])];
+        w->regA[lane] = entry & 0xff;
+        w->FLAGS[lane] = ((*flags)[lane] & ~DECIMAL_FLAGS) | (entry >> 8);
+    }
+}
+
+// ADC, and SBC of the complement, in the lanes in binary mode and then those in decimal mode
+ALWAYS_INLINE void wide_add_with_mode(wide_machine* w, wide_group* g, const uint16_t* table, wide_u8 data, wide_u8 complement)
+{
+    lane_mask decimal = wide_bits(NONZERO(w->FLAGS & flag_D)) & g->lanes;
+    if(decimal == 0)
+    {
+        wide_add(w, g, complement);
+        return;
+    }
+    wide_u8 a = w->regA, flags = w->FLAGS;
+    wide_add(w, g, complement);
+    wide_add_decimal(w, decimal, table, &a, &flags, &data);
+}
+
+ALWAYS_INLINE void wide_compare(wide_machine* w, wide_group* g, wide_u8 reg, wide_u8 data)
+{
+    wide_u8 result = reg - data;
+    // set carry flag if reg >= data, which is when the subtraction does not borrow
+    wide_u8 carry = ~((~reg & data) | ((~reg | data) & result)) >> 7;
+    SET(FLAGS, (w->FLAGS & (byte)~flag_C) | carry);
+    wide_nz(w, g, result);
+}
+
+/* Instructions */
+
+// Every instruction is written once against a generic addressing mode, like the
+// ones in cpu.c, and runs for all lanes of the group at once.
+#define WIDE_INSTRUCTION(name) ALWAYS_INLINE void wide_exec_##name(wide_machine* w, wide_group* g, \
+    const address_mode mode, uint16_t operand, const int page)
+
+// Read-modify-write instructions work on either the accumulator or memory.
+#define WIDE_RMW_LOAD(data, address) \
+    wide_u16 address = BROADCAST16(operand); \
+    wide_u8 data = {0}; \
+    if(mode == reg_A) data = w->regA; \
+    else if(UNIFORM(mode)) data = wide_read(w, g, operand); \
+    else \
+    { \
+        wide_address(w, g, mode, operand, 0, &address); \
+        wide_load_lanes(w, g, &address, &data); \
+    }
+#define WIDE_RMW_STORE(data, address) \
+    if(mode == reg_A) SET(regA, data); \
+    else if(UNIFORM(mode)) wide_write(w, g, operand, data); \
+    else wide_store_lanes(w, g, &address, &data)
+
+#define WIDE_LOAD_REGISTER(name, reg) \
+    WIDE_INSTRUCTION(name) \
+    { \
+        wide_u8 data = wide_load(w, g, mode, operand, page); \
+        SET(reg, data); \
+        wide_nz(w, g, data); \
+    }
+
+#define WIDE_TRANSFER(name, from, to) \
+    WIDE_INSTRUCTION(name) \
+    { \
+        SET(to, w->from); \
+        wide_nz(w, g, w->from); \
+    }
+
+#define WIDE_STORE(name, reg) \
+    WIDE_INSTRUCTION(name) \
+    { \
+        wide_store(w, g, mode, operand, w->reg); \
+    }
+
+#define WIDE_LOGIC(name, op) \
+    WIDE_INSTRUCTION(name) \
+    { \
+        wide_u8 result = w->regA op wide_load(w, g, mode, operand, page); \
+        SET(regA, result); \
+        wide_nz(w, g, result); \
+    }
+
+#define WIDE_STEP(name, reg, delta) \
+    WIDE_INSTRUCTION(name) \
+    { \
+        wide_u8 result = w->reg + (byte)(delta); \
+        SET(reg, result); \
+        wide_nz(w, g, result); \
+    }
+
+#define WIDE_FLAG(name, op, flag) \
+    WIDE_INSTRUCTION(name) \
+    { \
+        SET(FLAGS, w->FLAGS op (byte)(flag)); \
+    }
+
+#define WIDE_BRANCH(name, flag, when_set) \
+    WIDE_INSTRUCTION(name) \
+    { \
+        wide_branch(w, g, NONZERO(w->FLAGS & flag) ^ (when_set ? 0 : 0xff), operand); \
+    }
+
+WIDE_INSTRUCTION(ADC)
+{
+    wide_u8 data = wide_load(w, g, mode, operand, page);
+    wide_add_with_mode(w, g, decimal_adc, data, data);
+}
+
+WIDE_INSTRUCTION(SBC)
+{
+    wide_u8 data = wide_load(w, g, mode, operand, page);
+    wide_add_with_mode(w, g, decimal_sbc, data, ~data);
+}
+
+WIDE_LOGIC(AND, &)
+WIDE_LOGIC(EOR, ^)
+WIDE_LOGIC(ORA, |)
+
+WIDE_INSTRUCTION(ASL)
+{
+    WIDE_RMW_LOAD(data, address);
+    SET(FLAGS, (w->FLAGS & (byte)~flag_C) | (data >> 7)); // set carry flag if bit 7 of data is set
+    data <<= 1;
+    wide_nz(w, g, data);
+    WIDE_RMW_STORE(data, address);
+}
+
+WIDE_INSTRUCTION(LSR)
+{
+    WIDE_RMW_LOAD(data, address);
+    SET(FLAGS, (w->FLAGS & (byte)~flag_C) | (data & flag_C)); // bit 0 goes into the carry
+    data >>= 1;
+    wide_nz(w, g, data);
+    WIDE_RMW_STORE(data, address);
+}
+
+WIDE_INSTRUCTION(ROL)
+{
+    WIDE_RMW_LOAD(data, address);
+    wide_u8 carry = data >> 7;
+    data = (data << 1) | (w->FLAGS & flag_C);
+    SET(FLAGS, (w->FLAGS & (byte)~flag_C) | carry); // set carry to bit 7 of original data
+    wide_nz(w, g, data);
+    WIDE_RMW_STORE(data, address);
+}
+
+WIDE_INSTRUCTION(ROR)
+{
+    WIDE_RMW_LOAD(data, address);
+    wide_u8 carry = data & flag_C;
+    data = (data >> 1) | (w->FLAGS << 7); // set bit 7 if carry bit is high
+    SET(FLAGS, (w->FLAGS & (byte)~flag_C) | carry); // set carry to bit 0 of original data
+    wide_nz(w, g, data);
+    WIDE_RMW_STORE(data, address);
+}
+
+WIDE_INSTRUCTION(DEC)
+{
+    WIDE_RMW_LOAD(data, address);
+    data -= 1;
+    wide_nz(w, g, data);
+    WIDE_RMW_STORE(data, address);
+}
+
+WIDE_INSTRUCTION(INC)
+{
+    WIDE_RMW_LOAD(data, address);
+    data += 1;
+    wide_nz(w, g, data);
+    WIDE_RMW_STORE(data, address);
+}
+
+WIDE_BRANCH(BCC, flag_C, false)
+WIDE_BRANCH(BCS, flag_C, true)
+WIDE_BRANCH(BEQ, flag_Z, true)
+WIDE_BRANCH(BMI, flag_N, true)
+WIDE_BRANCH(BNE, flag_Z, false)
+WIDE_BRANCH(BPL, flag_N, false)
+WIDE_BRANCH(BVC, flag_V, false)
+WIDE_BRANCH(BVS, flag_V, true)
+
+WIDE_INSTRUCTION(BIT)
+{
+    wide_u8 data = wide_load(w, g, mode, operand, page);
+    wide_u8 zero = ZERO(w->regA & data) & flag_Z;
+    SET(FLAGS, (w->FLAGS & (byte)~(flag_N | flag_V | flag_Z)) | (data & (flag_N | flag_V)) | zero);
+}
+
+WIDE_INSTRUCTION(BRK)
+{
+    uint16_t pc = g->pc + 1; // BRK skips a padding byte
+    wide_push(w, g, BROADCAST8(pc >> 8));
+    wide_push(w, g, BROADCAST8(pc & 0xff));
+    wide_push(w, g, w->FLAGS | flag_B | flag_U);
+    SET(FLAGS, w->FLAGS | flag_I);
+    g->pc = wide_peek(w, g->first, IRQ_ADDRESS) | (wide_peek(w, g->first, IRQ_ADDRESS + 1) << 8);
+}
+
+WIDE_FLAG(CLC, &, ~flag_C)
+WIDE_FLAG(CLD, &, ~flag_D)
+WIDE_FLAG(CLV, &, ~flag_V)
+WIDE_FLAG(SEC, |, flag_C)
+WIDE_FLAG(SED, |, flag_D)
+WIDE_FLAG(SEI, |, flag_I)
+
+WIDE_INSTRUCTION(CLI)
+{
+    SET(FLAGS, w->FLAGS & (byte)~flag_I);
+    wide_unmasked(w, g);
+}
+
+WIDE_INSTRUCTION(CMP) { wide_compare(w, g, w->regA, wide_load(w, g, mode, operand, page)); }
+WIDE_INSTRUCTION(CPX) { wide_compare(w, g, w->regX, wide_load(w, g, mode, operand, page)); }
+WIDE_INSTRUCTION(CPY) { wide_compare(w, g, w->regY, wide_load(w, g, mode, operand, page)); }
+
+WIDE_STEP(DEX, regX, -1)
+WIDE_STEP(DEY, regY, -1)
+WIDE_STEP(INX, regX, 1)
+WIDE_STEP(INY, regY, 1)
+
+WIDE_INSTRUCTION(JMP)
+{
+    if(mode == absolute)
+    {
+        if(__builtin_expect(operand == (uint16_t)(g->pc - 3), 0))
+            wide_stop(g, g->lanes, EVENT_JAM); // as in wide_branch
+        g->pc = operand;
+    }
+    else
+    {
+        wide_u16 target;
+        wide_address(w, g, mode, operand, 0, &target);
+        wide_jump(w, g, target);
+    }
+}
+
+WIDE_INSTRUCTION(JSR)
+{
+    uint16_t pc = g->pc - 1;
+    wide_push(w, g, BROADCAST8(pc >> 8));
+    wide_push(w, g, BROADCAST8(pc & 0xff));
+    g->pc = operand;
+}
+
+WIDE_LOAD_REGISTER(LDA, regA)
+WIDE_LOAD_REGISTER(LDX, regX)
+WIDE_LOAD_REGISTER(LDY, regY)
+
+WIDE_INSTRUCTION(NOP) { }
+
+WIDE_INSTRUCTION(PHA) { wide_push(w, g, w->regA); }
+WIDE_INSTRUCTION(PHP) { wide_push(w, g, w->FLAGS | flag_B | flag_U); }
+
+WIDE_INSTRUCTION(PLA)
+{
+    wide_u8 data = wide_pop(w, g);
+    SET(regA, data);
+    wide_nz(w, g, data);
+}
+
+WIDE_INSTRUCTION(PLP)
+{
+    SET(FLAGS, wide_pop(w, g) & (byte)~(flag_B | flag_U));
+    wide_unmasked(w, g);
+}
+
+WIDE_INSTRUCTION(RTI)
+{
+    SET(FLAGS, wide_pop(w, g) & (byte)~(flag_B | flag_U));
+    wide_unmasked(w, g);
+    wide_u16 lo = WIDEN16(wide_pop(w, g));
+    wide_u16 hi = WIDEN16(wide_pop(w, g));
+    wide_jump(w, g, lo | hi << 8);
+}
+
+WIDE_INSTRUCTION(RTS)
+{
+    wide_u16 lo = WIDEN16(wide_pop(w, g));
+    wide_u16 hi = WIDEN16(wide_pop(w, g));
+    wide_jump(w, g, (lo | hi << 8) + 1);
+}
+
+WIDE_STORE(STA, regA)
+WIDE_STORE(STX, regX)
+WIDE_STORE(STY, regY)
+
+WIDE_TRANSFER(TAX, regA, regX)
+WIDE_TRANSFER(TAY, regA, regY)
+WIDE_TRANSFER(TSX, SP, regX)
+WIDE_TRANSFER(TXA, regX, regA)
+WIDE_TRANSFER(TYA, regY, regA)
+
+WIDE_INSTRUCTION(TXS) { SET(SP, w->regX); }
+
+/* Scheduling */
+
+// Adds the cycles the group has run to its lanes.
+static void wide_commit(wide_machine* w, wide_group* g)
+{
+    w->cycles += MASK64(g->mask) & (g->cycles + __builtin_convertvector(g->extra, wide_u64));
+    g->cycles = 0;
+    g->extra = BROADCAST8(0);
+    g->steps = 0;
+}
+
+// Removes lanes from the group. They keep the PC the group had.
+static void wide_leave(wide_machine* w, wide_group* g, lane_mask lanes)
+{
+    wide_commit(w, g);
+    wide_sync_pc(w, g);
+    wide_set_lanes(g, g->lanes & ~lanes);
+}
+
+// Enters the handler of a pending interrupt in one lane, as cpu_interrupt does.
+static void wide_interrupt_lane(wide_machine* w, int lane)
+{
+    lane_mask bit = 1u << lane;
+    uint16_t vector = IRQ_ADDRESS;
+    if(w->nmi_pending & bit)
+    {
+        w->nmi_pending &= ~bit;
+        vector = NMI_ADDRESS;
+    }
+    uint16_t pc = w->PC[lane];
+    byte pushed[3] = { pc >> 8, pc & 0xff, w->FLAGS[lane] | flag_U }; // B is clear, unlike BRK
+    for(int i = 0; i < 3; i++)
+    {
+        if(w->SP[lane] == 0)
+            w->events[lane] |= EVENT_STACK;
+        w->ram[0x0100 | w->SP[lane]--][lane] = pushed[i];
+    }
+    w->FLAGS[lane] |= flag_I;
+    w->PC[lane] = wide_peek(w, lane, vector) | (wide_peek(w, lane, vector + 1) << 8);
+    w->cycles[lane] += INTERRUPT_CYCLES;
+}
+
+// Takes the lanes of the group that have an interrupt pending out of it and enters
+// their handlers. They run on in groups of their own, unless the handler stopped them.
+static __attribute__((noinline)) void wide_interrupt(wide_machine* w, wide_group* g, lane_mask lanes)
+{
+    wide_leave(w, g, lanes);
+    for(; lanes; lanes &= lanes - 1)
+    {
+        int lane = __builtin_ctz(lanes);
+        wide_interrupt_lane(w, lane);
+        if(w->events[lane] || w->cycles[lane] >= w->stop_cycle[lane])
+            w->running &= ~(1u << lane);
+        else if(w->PC[lane] < g->waiting)
+            g->waiting = w->PC[lane];
+    }
+}
+
+// Adds up the group's cycles and stops the lanes that raised events or ran out of cycles.
+// The lanes left with an interrupt to take leave the group to enter its handler.
+// Returns how many cycles the group can run before any of its lanes could stop.
+static int64_t wide_settle(wide_machine* w, wide_group* g)
+{
+    wide_commit(w, g);
+    lane_mask stopped = g->halted;
+    w->events |= g->events;
+    g->halted = 0;
+    g->events = BROADCAST8(0);
+    int64_t horizon = INT64_MAX;
+    for(lane_mask lanes = g->lanes & ~stopped; lanes; lanes &= lanes - 1)
+    {
+        int lane = __builtin_ctz(lanes);
+        if(w->cycles[lane] >= w->stop_cycle[lane])
+            stopped |= 1u << lane;
+        else if(w->stop_cycle[lane] - w->cycles[lane] < (uint64_t)horizon)
+            horizon = w->stop_cycle[lane] - w->cycles[lane];
+    }
+    if(stopped)
+    {
+        w->running &= ~stopped;
+        wide_leave(w, g, stopped);
+    }
+    if(__builtin_expect(w->nmi_pending | w->irq, 0))
+    {
+        lane_mask interrupted = (w->nmi_pending | (w->irq & wide_bits(ZERO(w->FLAGS & flag_I)))) & g->lanes;
+        if(interrupted)
+            wide_interrupt(w, g, interrupted);
+    }
+    return horizon;
+}
+
+// Forms the next group from the running lanes with the lowest PC. The group runs
+// until its PC passes one of the other lanes, which then gets to catch up, so lanes
+// that went different ways meet again where their paths join.
+static void wide_pick(const wide_machine* w, wide_group* g)
+{
+    uint32_t pc = 0x10000;
+    uint32_t waiting = 0x10000;
+    for(lane_mask lanes = w->running; lanes; lanes &= lanes - 1)
+    {
+        int lane = __builtin_ctz(lanes);
+        if(w->PC[lane] < pc)
+        {
+            waiting = pc;
+            pc = w->PC[lane];
+        }
+        else if(w->PC[lane] > pc && w->PC[lane] < waiting)
+            waiting = w->PC[lane];
+    }
+    memset(g, 0, sizeof(wide_group));
+    g->pc = pc;
+    g->waiting = waiting;
+    wide_set_lanes(g, w->running & ~wide_differs16(&w->PC, pc));
+}
+
+// Reads a byte of the instruction at the shared PC from RAM or the terminal, where
+// it can differ between lanes. Lanes that disagree with the first one leave the group.
+static __attribute__((noinline)) byte wide_fetch_slow(wide_machine* w, wide_group* g, uint16_t address)
+{
+    wide_u8 data = wide_read(w, g, address);
+    byte value = data[g->first];
+    lane_mask differ = wide_differs8(data, value) & g->lanes;
+    if(differ)
+    {
+        wide_leave(w, g, differ);
+        g->waiting = g->pc;
+    }
+    return value;
+}
+
+ALWAYS_INLINE byte wide_fetch(wide_machine* w, wide_group* g, uint16_t address)
+{
+    if(address >= ROM_START)
+        return w->rom[address - ROM_START];
+    return wide_fetch_slow(w, g, address);
+}
+
+wide_machine* wide_create(void)
+{
+    // the vectors are aligned to their size, more than malloc guarantees
+    wide_machine* w = aligned_alloc(__alignof__(wide_machine), sizeof(wide_machine));
+    if(w)
+        wide_init(w);
+    cpu_decimal_init();
+    return w;
+}
+
+void wide_destroy(wide_machine* w)
+{
+    free(w);
+}
+
+void wide_init(wide_machine* w)
+{
+    memset(w, 0, sizeof(wide_machine));
+    w->SP = BROADCAST8(0xff);
+    for(int lane = 0; lane < WIDE_LANES; lane++)
+        terminal_init(&w->term[lane], NULL);
+}
+
+int wide_poke(wide_machine* w, int lane, uint16_t address, const byte* data, size_t size)
+{
+    if(address + size > ROM_START)
+        return -1;
+    for(size_t i = 0; i < size; i++)
+        w->ram[address + i][lane] = data[i];
+    return 0;
+}
+
+void wide_start(wide_machine* w, int lane, FILE* out, uint64_t max_cycles)
+{
+    terminal_init(&w->term[lane], out);
+    w->PC[lane] = wide_peek(w, lane, RST_ADDRESS) | (wide_peek(w, lane, RST_ADDRESS + 1) << 8);
+    w->cycles[lane] = 0;
+    w->stop_cycle[lane] = max_cycles;
+    w->events[lane] = EVENT_NONE;
+    w->irq &= ~(1u << lane);
+    w->nmi_pending &= ~(1u << lane);
+    if(max_cycles > 0)
+        w->running |= 1u << lane;
+}
+
+// Built for AVX2 as well, and picked at load time on hosts that have it
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target_clones("avx2", "default")))
+#endif
+void wide_run(wide_machine* w)
+{
+    wide_group g;
+    while(w->running)
+    {
+        wide_pick(w, &g);
+        int64_t horizon = wide_settle(w, &g);
+        while(g.lanes && !g.split && g.pc < g.waiting)
+        {
+            uint16_t pc = g.pc;
+            byte opcode = wide_fetch(w, &g, pc);
+            uint16_t operand = 0;
+            int length = opcode_table[opcode].length;
+            if(length >= 1)
+                operand = wide_fetch(w, &g, pc + 1);
+            if(length == 2)
+                operand |= wide_fetch(w, &g, pc + 2) << 8;
+            g.pc = pc + 1 + length;
+
+            int cycles;
+            switch(opcode)
+            {
+                #define WIDE_CASE(code, name, mode, base_cycles, page) \
+                    case code: \
+                        wide_exec_##name(w, &g, mode, operand, page); \
+                        cycles = base_cycles; \
+                        break;
+                OPCODE_TABLE(WIDE_CASE)
+                default:
+                    // not run, so the lanes stop on the opcode
+                    g.pc = pc;
+                    wide_stop(&g, g.lanes, EVENT_ILLEGAL);
+                    cycles = 0;
+            }
+            g.cycles += cycles;
+
+            // at most 2 cycles are added to the base for branches and page crossings
+            horizon -= cycles + 2;
+            if(horizon <= 0 || g.halted || ++g.steps >= WIDE_SETTLE_STEPS)
+                horizon = wide_settle(w, &g);
+        }
+        wide_commit(w, &g);
+        wide_sync_pc(w, &g);
+    }
+}
@@ -0,0 +1,125 @@
+/**
+ * @file wide.h
+ * @author Mason Daub
+ * @brief Runs up to WIDE_LANES machines with the same ROM in lockstep.
+ * 
+ * The machines (lanes) are stored as structure of arrays: every register is a
+ * vector with one element per lane, and RAM is interleaved so the byte at one
+ * address in every lane is a single vector. Lanes that share a PC form a group,
+ * which fetches and decodes each instruction once and executes it for all of its
+ * lanes with vector operations, masked to the group. Memory accesses take a
+ * single vector load or store when every lane uses the same address, and fall
+ * back to a per-lane loop when the addresses differ.
+ * 
+ * A group keeps its PC as long as its lanes agree. When a branch or return sends
+ * them different ways the group splits, and the engine continues with the lanes
+ * at the lowest PC. A group runs until it gets ahead of another lane, so lanes
+ * that took different paths, or ran a loop a different number of times, join
+ * up again where the paths meet. Lanes never affect each other, so results are
+ * identical to running every lane alone with cpu_run.
+ * 
+ * Every lane has the default memory map: RAM at 0000-7fff, the ROM shared by all
+ * lanes at 8000-ffff and its own terminal at TERMINAL_ADDRESS. The terminal's
+ * interrupt commands interrupt only their own lane, which leaves its group to
+ * enter the handler as cpu_run would between instructions.
+ * 
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#ifndef WIDE_H
+#define WIDE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "loader.h"
+#include "terminal.h"
+
+#define WIDE_LANES 32   // Machines per wide machine, one bit of a lane_mask each
+
+typedef uint32_t lane_mask; // One bit per lane
+
+typedef byte wide_u8 __attribute__((vector_size(WIDE_LANES)));
+typedef uint16_t wide_u16 __attribute__((vector_size(WIDE_LANES * 2)));
+typedef uint64_t wide_u64 __attribute__((vector_size(WIDE_LANES * 8)));
+
+/**
+ * @brief The state of WIDE_LANES machines, one vector element per lane.
+ * It is over 1MB and its vectors need more alignment than malloc gives,
+ * so it is allocated with wide_create.
+ */
+typedef struct _wide_machine
+{
+    wide_u16 PC;                    // Program counters
+    wide_u8 regA;                   // Accumulators
+    wide_u8 regX;                   // X index registers
+    wide_u8 regY;                   // Y index registers
+    wide_u8 SP;                     // Stack pointers
+    wide_u8 FLAGS;                  // Status registers
+    wide_u64 cycles;                // Clock cycles executed since the lane started
+    wide_u64 stop_cycle;            // A lane stops once its cycles reach this
+    lane_mask running;              // Lanes that have not stopped
+    wide_u8 events;                 // Events that stopped each lane, as for cpu_run
+    lane_mask irq;                  // Lanes whose terminal asserts IRQ
+    lane_mask nmi_pending;          // Lanes with an NMI whose handler is not entered yet
+
+    terminal term[WIDE_LANES];      // Every lane's terminal
+    byte rom[ROM_SIZE];             // The ROM shared by all lanes
+    wide_u8 ram[ROM_START];         // RAM, ram[address][lane]
+} wide_machine;
+
+/**
+ * @brief Allocates a cleared wide machine.
+ * 
+ * @return The machine, or NULL if it could not be allocated.
+ */
+wide_machine* wide_create(void);
+
+/**
+ * @brief Frees a wide machine.
+ * 
+ * @param w The machine to free, or NULL.
+ */
+void wide_destroy(wide_machine* w);
+
+/**
+ * @brief Clears every lane and the ROM. No lane is running afterwards.
+ * 
+ * @param w The wide machine.
+ */
+void wide_init(wide_machine* w);
+
+/**
+ * @brief Writes bytes into one lane's RAM, like writing a machine's memory directly.
+ * 
+ * @param w The wide machine.
+ * @param lane The lane.
+ * @param address Address of the first byte.
+ * @param data The bytes.
+ * @param size Number of bytes.
+ * @return 0 on success, -1 if the bytes do not fit in RAM.
+ */
+int wide_poke(wide_machine* w, int lane, uint16_t address, const byte* data, size_t size);
+
+/**
+ * @brief Resets a lane and starts it, as cpu_reset followed by cpu_run would.
+ * 
+ * @param w The wide machine. The ROM must already be loaded.
+ * @param lane The lane to start.
+ * @param out Where the lane's terminal prints to, or NULL to discard it.
+ * @param max_cycles Cycle budget of the lane.
+ */
+void wide_start(wide_machine* w, int lane, FILE* out, uint64_t max_cycles);
+
+/**
+ * @brief Runs until every lane has raised an event or used up its cycle budget.
+ * 
+ * @param w The wide machine.
+ */
+void wide_run(wide_machine* w);
+
+#endif // WIDE_H
@@ -0,0 +1,111 @@
+/**
+ * @file decimal.c
+ * @author Mason Daub
+ * @brief Checks decimal mode ADC and SBC against a model of the NMOS 6502 for
+ * every accumulator, operand and carry.
+ * 
+ * The model is written out step by step from the published description of the
+ * NMOS chip's decimal mode, apart from the lookup tables the emulator builds.
+ * Every result is compared: the accumulator and the N, V, Z and C flags.
+ * 
+ * @version 0.1
+ * @date 2023-11-25
+ * 
+ * @copyright Copyright (c) 2023 Mason Daub
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../src/cpu.h"
+#include "../src/cpu_utils.h"
+
+#define OPERAND_ADDRESS 0x0010  // Zero page operand of the instruction under test
+#define CODE_ADDRESS 0x0200     // Where the instruction under test is placed
+
+// ADC: A and C from the adjusted sum. N and V from the sum of the signed high
+// digits and the adjusted low digit, before the high digit is adjusted. Z from
+// the binary sum.
+static void model_adc(int a, int b, int carry, byte* result, byte* flags)
+{
+    int low = (a & 0x0f) + (b & 0x0f) + carry;
+    if(low >= 0x0a)
+        low = ((low + 0x06) & 0x0f) + 0x10;
+    int sum = (a & 0xf0) + (b & 0xf0) + low;
+    int signed_sum = (int8_t)(a & 0xf0) + (int8_t)(b & 0xf0) + low;
+    if(sum >= 0xa0)
+        sum += 0x60;
+    *result = sum & 0xff;
+    *flags = (sum >= 0x100 ? flag_C : 0)
+        | (((a + b + carry) & 0xff) == 0 ? flag_Z : 0)
+        | (signed_sum < -128 || signed_sum > 127 ? flag_V : 0)
+        | (signed_sum & 0x80 ? flag_N : 0);
+}
+
+// SBC: A from the adjusted difference. Every flag as in binary mode.
+static void model_sbc(int a, int b, int carry, byte* result, byte* flags)
+{
+    int low = (a & 0x0f) - (b & 0x0f) + carry - 1;
+    if(low < 0)
+        low = ((low - 0x06) & 0x0f) - 0x10;
+    int difference = (a & 0xf0) - (b & 0xf0) + low;
+    if(difference < 0)
+        difference -= 0x60;
+    *result = difference & 0xff;
+    int binary = a - b + carry - 1;
+    int signed_binary = (int8_t)a - (int8_t)b + carry - 1;
+    *flags = (binary >= 0 ? flag_C : 0)
+        | ((binary & 0xff) == 0 ? flag_Z : 0)
+        | (signed_binary < -128 || signed_binary > 127 ? flag_V : 0)
+        | (binary & 0x80 ? flag_N : 0);
+}
+
+// Runs one instruction for every input and counts the results that differ from the model.
+static int check(machine* cpu, const char* name, byte opcode,
+    void (*model)(int a, int b, int carry, byte* result, byte* flags))
+{
+    int failed = 0;
+    cpu->memory[CODE_ADDRESS] = opcode;
+    cpu->memory[CODE_ADDRESS + 1] = OPERAND_ADDRESS;
+    cpu_invalidate_decoded(cpu, CODE_ADDRESS, 2);
+    for(int carry = 0; carry < 2; carry++)
+    for(int a = 0; a < 0x100; a++)
+    for(int b = 0; b < 0x100; b++)
+    {
+        PC = CODE_ADDRESS;
+        A = a;
+        cpu->memory[OPERAND_ADDRESS] = b;
+        cpu_set_flags(cpu, flag_D | flag_I | carry);
+        cpu_do_next_op(cpu);
+
+        byte result, flags;
+        model(a, b, carry, &result, &flags);
+        flags |= flag_D | flag_I;
+        if(A != result || cpu_get_flags(cpu) != flags)
+        {
+            if(failed++ < 10)
+                printf("FAIL %s of $%02x with A=$%02x C=%d: expected A=$%02x P=$%02x, got A=$%02x P=$%02x\n",
+                    name, b, a, carry, result, flags, A, cpu_get_flags(cpu));
+        }
+    }
+    if(failed == 0)
+        printf("ok   decimal %s, all %d inputs\n", name, 2 * 0x100 * 0x100);
+    return failed;
+}
+
+int main(void)
+{
+    machine* cpu = aligned_alloc(_Alignof(machine), sizeof(machine));
+    if(cpu == NULL)
+        return EXIT_FAILURE;
+    cpu->snapshot = NULL;
+    machine_init(cpu);
+    int failed = check(cpu, "ADC", 0x65, model_adc) + check(cpu, "SBC", 0xe5, model_sbc);
+    free(cpu);
+    if(failed != 0)
+    {
+        printf("%d decimal results differ\n", failed);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
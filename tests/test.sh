@@ -0,0 +1,109 @@
+#!/bin/sh
+# Runs the emulator on the ROMs in tests/roms and checks what it reports.
+# Usage: tests/test.sh [emulator], from the top of the repository.
+
+emulator=${1:-./daubmos}
+roms=$(dirname "$0")/roms
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+# check name expected actual
+check()
+{
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: expected '$2', got '$3'"
+        failed=$((failed + 1))
+    fi
+}
+
+# The halt reason of a JSON result
+halt()
+{
+    sed -n 's/^{"halt":"\([a-z]*\)".*/\1/p'
+}
+
+# The first line printed by the job on a line of batch results
+output()
+{
+    sed -n "$1"'s/.*"output":"\([^\\"]*\).*/\1/p'
+}
+
+# Replaying a log recorded under an instruction budget reproduces the run
+"$emulator" -f "$roms/readback.hex" -q json -i 1000000 -r "$tmp/inputs.log" > "$tmp/recorded.json"
+check "record under -i" halt "$(halt < "$tmp/recorded.json")"
+"$emulator" -f "$roms/readback.hex" -q json -i 1000000 -R "$tmp/inputs.log" > "$tmp/replayed.json"
+check "replay under -i" "$(cat "$tmp/recorded.json")" "$(cat "$tmp/replayed.json")"
+"$emulator" -f "$roms/readback.hex" -q json -i 1000000 -R "$tmp/inputs.log" -j > "$tmp/replayed.json"
+check "replay under -i on the JIT" "$(cat "$tmp/recorded.json")" "$(cat "$tmp/replayed.json")"
+"$emulator" -f "$roms/readback.hex" -q json -i 50 -r "$tmp/inputs.log" > "$tmp/recorded.json"
+"$emulator" -f "$roms/readback.hex" -q json -i 50 -R "$tmp/inputs.log" > "$tmp/replayed.json"
+check "replay stops at the same instruction" "$(cat "$tmp/recorded.json")" "$(cat "$tmp/replayed.json")"
+
+# Batch inputs at ROM addresses reach the program, and the next job of the ROM does not see them
+hello=$(dirname "$0")/../res/hello_world.bin
+printf '%s 8000:4a4a\n%s\n%s layout=ram:0000-ffff 8001:4a\n' "$hello" "$hello" "$hello" > "$tmp/manifest.txt"
+"$emulator" -b "$tmp/manifest.txt" -t 1 > "$tmp/results.jsonl"
+check "batch input to ROM" "JJllo World!" "$(output 1 < "$tmp/results.jsonl")"
+check "batch input to ROM is undone" "Hello World!" "$(output 2 < "$tmp/results.jsonl")"
+check "batch input to RAM" "HJllo World!" "$(output 3 < "$tmp/results.jsonl")"
+
+# A bad input only fails its own job
+printf '%s 0200:zz\n%s\n' "$hello" "$hello" > "$tmp/manifest.txt"
+"$emulator" -b "$tmp/manifest.txt" -t 1 > "$tmp/results.jsonl" 2> /dev/null
+check "bad input fails its job" error "$(sed -n '1s/.*"halt":"\([a-z]*\)".*/\1/p' "$tmp/results.jsonl")"
+check "bad input leaves the other jobs" "Hello World!" "$(output 2 < "$tmp/results.jsonl")"
+
+# A cycle limit of 0 means none, in the manifest as with -l
+printf '%s cycles=0\n' "$hello" > "$tmp/manifest.txt"
+"$emulator" -b "$tmp/manifest.txt" -t 1 > "$tmp/results.jsonl"
+check "cycles=0 runs without a limit" "Hello World!" "$(output 1 < "$tmp/results.jsonl")"
+"$emulator" -b "$tmp/manifest.txt" -t 1 -l 0 -W > "$tmp/results.jsonl"
+check "-l 0 runs without a limit" "Hello World!" "$(output 1 < "$tmp/results.jsonl")"
+
+# A loop to itself jams whatever the I flag, since no device here sends IRQ or NMI.
+# reset.hex is JMP * straight out of reset, without touching the flags.
+for engine in "" -j; do
+    for rom in jam:"SEI; JMP *" wait:"CLI; JMP *" reset:"JMP * out of reset"; do
+        "$emulator" -f "$roms/${rom%%:*}.hex" -q json -l 100000 $engine > "$tmp/result.json"
+        check "${rom#*:} jams${engine:+ with $engine}" jam "$(halt < "$tmp/result.json")"
+    done
+done
+printf '%s cycles=1000\n' "$roms/jam.hex" "$roms/wait.hex" "$roms/reset.hex" > "$tmp/manifest.txt"
+"$emulator" -b "$tmp/manifest.txt" -W > "$tmp/results.jsonl"
+check "SEI; JMP * jams on the wide engine" jam "$(sed -n '1s/.*"halt":"\([a-z]*\)".*/\1/p' "$tmp/results.jsonl")"
+check "CLI; JMP * jams on the wide engine" jam "$(sed -n '2s/.*"halt":"\([a-z]*\)".*/\1/p' "$tmp/results.jsonl")"
+check "JMP * out of reset jams on the wide engine" jam "$(sed -n '3s/.*"halt":"\([a-z]*\)".*/\1/p' "$tmp/results.jsonl")"
+
+# interrupts.hex drives the lines through the terminal: an IRQ asserted with I set is
+# taken after CLI and released by its handler, each NMI edge is taken once and RTI
+# returns to the program, which prints the handlers' counts and X
+expected='IO PRINT BYTE: 0\nIO PRINT BYTE: 1\nIO PRINT BYTE: 1\nIO PRINT BYTE: 2\nIO PRINT BYTE: 1\nIO PRINT BYTE: 66'
+"$emulator" -f "$roms/interrupts.hex" -q json -r "$tmp/inputs.log" > "$tmp/recorded.json"
+check "IRQ, NMI and RTI" "$expected" "$(sed -n 's/.*"output":"\(.*\)\\nEmulator.*/\1/p' "$tmp/recorded.json")"
+# the same cycles, registers and output on every engine and in a replay
+run()
+{
+    sed 's/.*\("cycles".*"output":"[^"]*"\).*/\1/'
+}
+"$emulator" -f "$roms/interrupts.hex" -q json -j | run > "$tmp/jit.txt"
+check "IRQ, NMI and RTI with -j" "$(run < "$tmp/recorded.json")" "$(cat "$tmp/jit.txt")"
+printf '%s\n' "$roms/interrupts.hex" > "$tmp/manifest.txt"
+"$emulator" -b "$tmp/manifest.txt" -W | run > "$tmp/wide.txt"
+check "IRQ, NMI and RTI on the wide engine" "$(run < "$tmp/recorded.json")" "$(cat "$tmp/wide.txt")"
+"$emulator" -f "$roms/interrupts.hex" -q json -R "$tmp/inputs.log" > "$tmp/replayed.json"
+check "IRQ, NMI and RTI replayed" "$(cat "$tmp/recorded.json")" "$(cat "$tmp/replayed.json")"
+
+# Arguments that are not options do not end up in the result
+"$emulator" -f "$roms/jam.hex" -q json stray > "$tmp/result.json" 2> /dev/null
+check "stray argument kept out of the JSON" 1 "$(wc -l < "$tmp/result.json" | tr -d ' ')"
+
+# A plain run prints only what the program did, statistics need -c or -j
+check "no statistics without -c or -j" "Emulator recieved halt command..." "$("$emulator" | tail -n 1)"
+
+if [ $failed -ne 0 ]; then
+    echo "$failed tests failed"
+    exit 1
+fi